@@ -41,6 +41,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "parse_bam.h"
 #include "adapters.h"
 #include "hash_table.h"
+#include "batch_shared.h"
+#include "libbambi.h"
+#include "qc.h"
 
 #define DEBUG 1
 
@@ -55,13 +58,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define TEMPLATES_PER_JOB 5000
 
+JOB_SIZE(adapters_templates_per_job, TEMPLATES_PER_JOB)
+TEST_RECORD(adapters_io_reserved)   // BAM files were read and written by the --io-threads pool
+
 #define SEEDLEN 12
 #define MAXSEEDDIFF 2
 
-uint8_t S[256];
-uint64_t SEEDMASK;
+static uint8_t S[256];
+static uint64_t SEEDMASK;
+static pthread_once_t seed_values_once = PTHREAD_ONCE_INIT;
 
-// Metrics are stored in a global hash table keyed on RG tag
+// Metrics are stored in a hash table keyed on RG tag
 typedef struct {
     int total_fwd;
     int total_rev;
@@ -77,9 +84,6 @@ typedef struct {
     int fwd, rev;
 } adapter_metrics_t;
 
-static HashTable *metrics = NULL;
-static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
-
 /*
  * structure to hold options
  */
@@ -94,9 +98,12 @@ typedef struct {
     char *output_fmt;
     char compression_level;
     int nthreads;
+    int io_threads;
     int minscore;
     double minfrac;
     double minpfrac;
+    HashTable *metrics;
+    pthread_mutex_t metrics_lock;
 } adapter_opts_t;
 
 static void freeAdapter(void *r)
@@ -263,6 +270,8 @@ static adapter_opts_t *adapter_init_opts(int argc, char **argv)
     opts->argv_list = stringify_argv(argc, argv);
     if (opts->argv_list[strlen(opts->argv_list)-1] == ' ') opts->argv_list[strlen(opts->argv_list)-1] = 0;
     opts->adapterArray = NULL;
+    opts->metrics = NULL;
+    pthread_mutex_init(&opts->metrics_lock, NULL);
 
     // set defaults
     opts->minscore = DEFAULT_MIN_SCORE;
@@ -282,24 +291,10 @@ static void adapter_free_opts(adapter_opts_t *opts)
     free(opts->output_fmt);
     free(opts->metrics_name);
     va_free(opts->adapterArray);
+    pthread_mutex_destroy(&opts->metrics_lock);
     free(opts);
 }
 
-// Data for thread pool jobs
-typedef struct adapter_thread_data_t {
-    va_t *record_set;                   // records to process
-    ia_t *template_counts;              // records in each template
-    va_t *adapter_array;                // job-local copy of adapters array
-    adapter_t *adapter;             // memory for job-local adapter
-    adapter_opts_t *opts;                       // pointer to shared opts
-    int nrec;                           // number of live records in record_set
-    int result;                         // job result, 0 = success
-    struct adapter_thread_data_t *next;  // for free list
-    BAMit_t *bam_out;
-} adapter_thread_data_t;
-
-static void freeRecord(void *r) { bam_destroy1((bam1_t *)r); }
-
 //
 // resize histogram arrays
 //
@@ -373,6 +368,8 @@ static void usage(FILE *write_to)
 "       --output-fmt                    format of output file [sam/bam/cram]\n"
 "       --compression-level             Compression level of output file [0..9]\n"
 "  -t   --threads                       number of threads to use [default: 1]\n"
+"       --io-threads                    number of extra threads to reserve for reading and writing BAM\n"
+"                                       files. If 0, they share the --threads pool. [default: 0]\n"
 );
 }
 
@@ -395,6 +392,7 @@ static adapter_opts_t* parse_args(int argc, char *argv[])
         { "output-fmt",                 1, 0, 0 },
         { "compression-level",          1, 0, 0 },
         { "threads",                    1, 0, 't' },
+        { "io-threads",                 1, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -419,6 +417,7 @@ static adapter_opts_t* parse_args(int argc, char *argv[])
                     else if (strcmp(arg, "input-fmt") == 0)                  opts->input_fmt = strdup(optarg);
                     else if (strcmp(arg, "output-fmt") == 0)                 opts->output_fmt = strdup(optarg);
                     else if (strcmp(arg, "compression-level") == 0)          opts->compression_level = *optarg;
+                    else if (strcmp(arg, "io-threads") == 0)                 opts->io_threads = atoi(optarg);
                     else {
                         printf("\nUnknown option: %s\n\n", arg); 
                         usage(stdout); adapter_free_opts(opts);
@@ -459,7 +458,7 @@ static adapter_opts_t* parse_args(int argc, char *argv[])
     }
 
     fragmentAdapters(opts->adapterArray, opts->minscore);
-    initSeedValues();
+    pthread_once(&seed_values_once, initSeedValues);
     calcAdapterSeed(opts->adapterArray);
 
     return opts;
@@ -589,31 +588,49 @@ static void matchAdapter(char *seq, adapter_t *adapter, adapter_opts_t *opts, bo
 /*
  * find the adapter with the best match.
  */
-static adapter_t *findBestMatch(bam1_t *rec, va_t *adapterArray, adapter_opts_t *opts)
+static adapter_t *findBestMatchSeq(char *seq, bool isReverse, va_t *adapterArray, adapter_opts_t *opts)
 {
     adapter_t *best_match = NULL;
-    uint8_t *seq = get_read(rec);
 
     for (int n=0; n < adapterArray->end; n++) {
         adapter_t *adapter = adapterArray->entries[n];
-        matchAdapter((char *)seq, adapter, opts, bam_is_rev(rec));
-//dumpAdapterResult(rec,adapter);
+        matchAdapter(seq, adapter, opts, isReverse);
         if (compareAdapters(adapter, best_match) > 0) {
             best_match = adapter;
         }
     }
 
+    return best_match;
+}
+
+static adapter_t *findBestMatch(bam1_t *rec, va_t *adapterArray, adapter_opts_t *opts)
+{
+    uint8_t *seq = get_read(rec);
+    adapter_t *best_match = findBestMatchSeq((char *)seq, bam_is_rev(rec), adapterArray, opts);
     free(seq);
     return best_match;
 }
 
+/*
+ * is the best match good enough?
+ */
+static bool isMatch(adapter_t *adapter, adapter_opts_t *opts)
+{
+    return adapter && adapter->score >= opts->minscore && adapter->frac >= opts->minfrac && adapter->pfrac >= opts->minpfrac;
+}
+
 static void updateRecord(bam1_t *rec, adapter_t *adapter)
 {
     uint32_t clip = rec->core.l_qseq - adapter->seqstart + adapter->offset;
     float randconf = kmerPoisson(rec, adapter);
+    float pfrac = adapter->pfrac;
+    BAMit_aux_t aux = BAMIT_AUX_INIT;
+    int af = BAMit_aux_add(&aux, "af");
+    int ar = BAMit_aux_add(&aux, "ar");
     bam_aux_append(rec, "aa", 'Z', strlen(adapter->name)+1, (uint8_t *) adapter->name);
-    bam_aux_update_float(rec, "af", adapter->pfrac);
-    bam_aux_update_float(rec, "ar", randconf);
+    if (BAMit_aux_index(&aux, rec) < 0) die("Corrupt aux data in record %s\n", bam_get_qname(rec));
+    if (BAMit_aux_update(&aux, rec, af, 'f', 4, (uint8_t *)&pfrac) < 0 ||
+        BAMit_aux_update(&aux, rec, ar, 'f', 4, (uint8_t *)&randconf) < 0) die("Out of memory");
     bam_aux_append(rec, "as", 'i', 4, (uint8_t *)&clip);
 #if DEBUG
     uint32_t score = adapter->score;
@@ -735,19 +752,19 @@ static int processTemplate(va_t *template, va_t *adapterArray, adapter_opts_t *o
     for (int n=0; n < template->end; n++) {
         bam1_t *rec = template->entries[n];
         adapter = findBestMatch(rec, adapterArray, opts);
-        if (adapter && adapter->score >= opts->minscore && adapter->frac >= opts->minfrac && adapter->pfrac >= opts->minpfrac) {
+        if (isMatch(adapter, opts)) {
             updateRecord(rec, adapter);
-            if (metrics) {
-                pthread_mutex_lock(&metrics_lock);
-                updateMetrics(metrics, rec, adapter);
-                pthread_mutex_unlock(&metrics_lock);
+            if (opts->metrics) {
+                pthread_mutex_lock(&opts->metrics_lock);
+                updateMetrics(opts->metrics, rec, adapter);
+                pthread_mutex_unlock(&opts->metrics_lock);
             }
             if (opts->verbose) dumpAdapterResult(rec, adapter);
         } else {
-            if (metrics) {
-                pthread_mutex_lock(&metrics_lock);
-                updateMetrics(metrics, rec, NULL);
-                pthread_mutex_unlock(&metrics_lock);
+            if (opts->metrics) {
+                pthread_mutex_lock(&opts->metrics_lock);
+                updateMetrics(opts->metrics, rec, NULL);
+                pthread_mutex_unlock(&opts->metrics_lock);
             }
         }
     }
@@ -757,245 +774,243 @@ static int processTemplate(va_t *template, va_t *adapterArray, adapter_opts_t *o
     return error_code;
 }
 
-/*
- * Read records from a given iterator until the qname changes
- */
-static va_t *loadTemplate(BAMit_t *bit, char *qname)
+static va_t *copy_adapter_array(va_t *adapter_array)
 {
-    va_t *recordSet = va_init(5,freeRecord);
+    va_t *dest = va_init(adapter_array->end, freeAdapter);
 
-    while (BAMit_hasnext(bit) && strcmp(bam_get_qname(BAMit_peek(bit)),qname) == 0) {
-        bam1_t *rec = bam_init1();
-        if (!bam_copy1(rec,BAMit_next(bit))) die("bam_copy1() failed in loadTemplate()");
-        va_push(recordSet,rec);
+    for (int n = 0; n < adapter_array->end; n++) {
+        adapter_t *src = adapter_array->entries[n];
+        adapter_t *d = smalloc(sizeof(adapter_t));
+        memset(d, 0, sizeof(adapter_t));
+        d->name = strdup(src->name);
+        d->fwd = strdup(src->fwd);
+        d->rev = strdup(src->rev);
+        d->offset = src->offset;
+        d->fwd_seed = src->fwd_seed;
+        d->rev_seed = src->rev_seed;
+        va_push(dest,d);
     }
-
-    return recordSet;
+    return dest;
 }
 
-static int processTemplatesNoThreads(BAMit_t *bam_in, BAMit_t *bam_out, va_t *adapterArray, adapter_opts_t* opts)
-{
-    char qname[257] = {0};
-    adapter_t *adapter = NULL;
+/*
+ * Adapter detection on records in memory. The adapters command and libbambi
+ * both use this.
+ */
+typedef struct adapter_lib_job_t {
+    bambi_adapters_t *ctx;
+    va_t *adapter_array;                // job-local copy of adapters array
+    bam1_t **recs;
+    int nrecs;
+    int max_recs;                       // records allocated, when the job owns them
+    int result;
+    struct adapter_lib_job_t *next;     // for free list
+} adapter_lib_job_t;
+
+struct bambi_adapters_t {
+    adapter_opts_t *opts;
+    hts_tpool *pool;
+    hts_tpool_process *queue;
+    int njobs;
+    adapter_lib_job_t *jobs;
+    bool own_opts;                      // the opts (and metrics) belong to the context
+};
 
-    while (BAMit_hasnext(bam_in)) {
-        bam1_t *rec = BAMit_peek(bam_in);
-        va_t *template;
-        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
-        template = loadTemplate(bam_in, qname);
-
-        // Look for adapters in the list
-        for (int n=0; n < template->end; n++) {
-            rec = template->entries[n];
-            adapter = findBestMatch(rec, adapterArray, opts);
-            if (adapter && adapter->score >= opts->minscore && adapter->frac >= opts->minfrac && adapter->pfrac >= opts->minpfrac) {
-                updateRecord(rec, adapter);
-                if (metrics) updateMetrics(metrics, rec, adapter);
-                if (opts->verbose) dumpAdapterResult(rec, adapter);
-            } else {
-                if (metrics) updateMetrics(metrics, rec, NULL);
-            }
-        }
-        // check for overlapping adapters
-        checkOverlap(template, opts->verbose);
-
-        // write records
-        for (int n=0; n < template->end; n++) {
-            rec = template->entries[n];
-            int r = sam_write1(bam_out->f, bam_out->h, rec);
-            if (r < 0) die("Could not write bam record\n");
-        }
-        va_free(template);
+/*
+ * Process a run of records, one template at a time
+ */
+static int adapter_lib_run(adapter_lib_job_t *job)
+{
+    va_t template = { 0, 0, NULL, NULL };
+    bam1_t **recs = job->recs;
+    int start = 0;
+
+    while (start < job->nrecs) {
+        int end = start + 1;
+        while (end < job->nrecs && strcmp(bam_get_qname(recs[end]), bam_get_qname(recs[start])) == 0) end++;
+        template.end = template.max = end - start;
+        template.entries = (void **)&recs[start];
+        if (processTemplate(&template, job->adapter_array, job->ctx->opts)) return -1;
+        start = end;
     }
-
     return 0;
 }
 
-static void *adapter_job(void *arg)
+static void *adapter_lib_job(void *arg)
 {
-    adapter_thread_data_t *job_data = (adapter_thread_data_t *) arg;
-    va_t template = { 0, 0, NULL, NULL };
-    size_t start_rec = 0;
-
-    job_data->result = -1;
-    for (int i = 0; i < job_data->template_counts->end; i++) {
-        template.end = template.max = job_data->template_counts->entries[i];
-        template.entries = &job_data->record_set->entries[start_rec];
-        start_rec += template.end;
-        if (processTemplate(&template, job_data->adapter_array, job_data->opts)) goto fail;
+    adapter_lib_job_t *job = (adapter_lib_job_t *)arg;
+    job->result = adapter_lib_run(job);
+    return job;
+}
+
+/*
+ * Set up a context to find adapters. If 'own' is set, the opts and metrics
+ * are freed with the context.
+ */
+static bambi_adapters_t *adapter_ctx_init(adapter_opts_t *opts, hts_tpool *pool, bool own)
+{
+    bambi_adapters_t *ctx = calloc(1, sizeof(bambi_adapters_t));
+    if (!ctx) die("Out of memory");
+    ctx->opts = opts;
+    ctx->own_opts = own;
+    ctx->pool = pool;
+    ctx->njobs = pool ? hts_tpool_size(pool) : 1;
+    if (pool) {
+        ctx->queue = hts_tpool_process_init(pool, 2 * ctx->njobs, 0);
+        if (!ctx->queue) die("Couldn't set up thread pool queue\n");
+    }
+    ctx->jobs = calloc(ctx->njobs, sizeof(adapter_lib_job_t));
+    if (!ctx->jobs) die("Out of memory");
+    for (int n = 0; n < ctx->njobs; n++) {
+        ctx->jobs[n].ctx = ctx;
+        ctx->jobs[n].adapter_array = copy_adapter_array(opts->adapterArray);
     }
-    assert(start_rec == job_data->nrec);
 
-    job_data->result = 0;
- fail:
-    return job_data;
+    return ctx;
 }
 
-static void output_job_results(BAMit_t *bam_out, adapter_thread_data_t *job_data)
+/*
+ * Split the records into runs of whole templates, one for each thread
+ */
+int bambi_adapters_records(bambi_adapters_t *ctx, bam1_t **recs, int nrecs)
 {
-    if (job_data->result != 0) {
-        die("Processing job failed to return a result\n");
+    int njobs = 0, start = 0, ret = 0;
+
+    if (!ctx->pool) {
+        ctx->jobs[0].recs = recs;
+        ctx->jobs[0].nrecs = nrecs;
+        return adapter_lib_run(&ctx->jobs[0]);
     }
 
-    // Write out result records
-    for (int i = 0; i < job_data->nrec; i++) {
-        bam1_t *rec = job_data->record_set->entries[i];
-        int r = sam_write1(bam_out->f, bam_out->h, rec);
-        if (r < 0) die("Could not write sequence\n");
+    int chunk = (nrecs + ctx->njobs - 1) / ctx->njobs;
+    while (start < nrecs) {
+        int end = start + chunk;
+        if (end > nrecs) end = nrecs;
+        while (end < nrecs && strcmp(bam_get_qname(recs[end]), bam_get_qname(recs[end-1])) == 0) end++;
+        adapter_lib_job_t *job = &ctx->jobs[njobs++];
+        job->recs = recs + start;
+        job->nrecs = end - start;
+        if (hts_tpool_dispatch(ctx->pool, ctx->queue, adapter_lib_job, job) < 0) die("Thread pool dispatch failed");
+        start = end;
     }
 
+    while (njobs--) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(ctx->queue);
+        if (!r) die("Failed to get processing job result");
+        adapter_lib_job_t *job = hts_tpool_result_data(r);
+        if (job->result) ret = -1;
+        hts_tpool_delete_result(r, 0);
+    }
+    return ret;
 }
 
-static va_t *copy_adapter_array(va_t *adapter_array)
+static void writeRecords(bam1_t **recs, int nrecs, BAMit_t *bam_out)
 {
-    va_t *dest = va_init(adapter_array->end, freeAdapter);
-
-    for (int n = 0; n < adapter_array->end; n++) {
-        adapter_t *src = adapter_array->entries[n];
-        adapter_t *d = smalloc(sizeof(adapter_t));
-        memset(d, 0, sizeof(adapter_t));
-        d->name = strdup(src->name);
-        d->fwd = strdup(src->fwd);
-        d->rev = strdup(src->rev);
-        d->offset = src->offset;
-        d->fwd_seed = src->fwd_seed;
-        d->rev_seed = src->rev_seed;
-        va_push(dest,d);
+    for (int n = 0; n < nrecs; n++) {
+        if (sam_write1(bam_out->f, bam_out->h, recs[n]) < 0) die("Could not write bam record\n");
     }
-    return dest;
 }
 
-static void job_free(adapter_thread_data_t *job_data)
+static void freeRecords(bam1_t **recs, int max_recs)
 {
-    va_free(job_data->record_set);
-    ia_free(job_data->template_counts);
-    va_free(job_data->adapter_array);
-    free(job_data);
+    for (int n = 0; n < max_recs; n++) if (recs[n]) bam_destroy1(recs[n]);
+    free(recs);
 }
 
-static adapter_thread_data_t *init_job(va_t *adapter_array, adapter_opts_t *opts)
+static int processTemplatesNoThreads(bambi_adapters_t *ctx, BAMit_t *bam_in, BAMit_t *bam_out)
 {
-    adapter_thread_data_t *job_data = calloc(1, sizeof(*job_data));
-    if (!job_data) die("Out of memory\n");
+    bam1_t **recs = NULL;
+    int max_recs = 0, nrecs, ret = 0;
 
-    job_data->adapter_array = copy_adapter_array(adapter_array);
-    job_data->adapter = job_data->adapter_array->entries[0];
-    job_data->opts = opts;
-    job_data->result = -1;
-    job_data->next = NULL;
+    while (ret == 0 && (nrecs = BAMit_next_templates(bam_in, &recs, &max_recs, adapters_templates_per_job)) > 0) {
+        ret = bambi_adapters_records(ctx, recs, nrecs);
+        if (ret == 0) writeRecords(recs, nrecs, bam_out);
+    }
 
-    return job_data;
+    freeRecords(recs, max_recs);
+    return ret;
 }
 
-static int processTemplatesThreads(hts_tpool *pool, BAMit_t *bam_in, BAMit_t *bam_out, va_t *adapterArray, adapter_opts_t* opts)
+/*
+ * Write out a finished job, and put it on the free list
+ */
+static int finishJob(hts_tpool_result *r, adapter_lib_job_t **freelist, BAMit_t *bam_out, int ret)
 {
-    hts_tpool_result *job_result = NULL;
-    hts_tpool_process *queue = hts_tpool_process_init(pool, 2 * opts->nthreads, 0);
-    adapter_thread_data_t *job_freelist = NULL;
-    adapter_thread_data_t *job_data = init_job(adapterArray, opts);
-    char qname[257] = { 0 };
-
-    if (!queue) {
-        perror("hts_tpool_process_init");
-        return -1;
-    }
+    adapter_lib_job_t *job = hts_tpool_result_data(r);
+    if (job->result) ret = -1;
+    if (ret == 0) writeRecords(job->recs, job->nrecs, bam_out);
+    job->next = *freelist;
+    *freelist = job;
+    hts_tpool_delete_result(r, 0);
+    return ret;
+}
 
-    job_data->record_set = va_init(TEMPLATES_PER_JOB * 2, freeRecord);
-    job_data->template_counts = ia_init(TEMPLATES_PER_JOB);
-    job_data->nrec = 0;
-    job_data->bam_out = bam_out;
-
-    while (BAMit_hasnext(bam_in)) {
-        bam1_t *rec = BAMit_peek(bam_in);
-        int rec_count = 0;
-        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
-        while (BAMit_hasnext(bam_in) && strcmp(bam_get_qname(BAMit_peek(bam_in)),qname) == 0) {
-            if (job_data->nrec < job_data->record_set->end) {
-                if (!bam_copy1(job_data->record_set->entries[job_data->nrec], BAMit_next(bam_in)))
-                    die("bam_copy1() failed in processTemplatesThreads()");
-            } else {
-                bam1_t *rec = bam_init1();
-                if (!rec) { die("Out of memory"); }
-                if (!bam_copy1(rec, BAMit_next(bam_in))) die("bam_copy1() failed in processTemplatesThreads() [2]");
-                va_push(job_data->record_set, rec);
-            }
-            job_data->nrec++;
-            rec_count++;
+/*
+ * Read the next job while the thread pool works on the ones before it, and
+ * write each job out (in order) as it finishes
+ */
+static int processTemplatesThreads(bambi_adapters_t *ctx, BAMit_t *bam_in, BAMit_t *bam_out)
+{
+    adapter_lib_job_t *freelist = NULL;
+    hts_tpool_result *r;
+    int ret = 0;
+
+    while (ret == 0) {
+        adapter_lib_job_t *job = freelist;
+        if (job) {
+            freelist = job->next;
+        } else {
+            job = calloc(1, sizeof(adapter_lib_job_t));
+            if (!job) die("Out of memory");
+            job->ctx = ctx;
+            job->adapter_array = copy_adapter_array(ctx->opts->adapterArray);
         }
-        ia_push(job_data->template_counts, rec_count);
-
-        if (job_data->template_counts->end == TEMPLATES_PER_JOB) {
-            while (job_data != NULL) {
-                int blk = hts_tpool_dispatch2(pool, queue, adapter_job, job_data, 1);
-                if (!blk) {
-                    job_data = NULL;
-                } else if (errno != EAGAIN) {
-                    die("Thread pool dispatch failed");
-                }
 
-                if (blk) {
-                    job_result = hts_tpool_next_result_wait(queue);
-                    if (!job_result) {
-                        die("Failed to get processing job result");
-                    }
-                } else {
-                    job_result = hts_tpool_next_result(queue);
-                }
+        job->nrecs = BAMit_next_templates(bam_in, &job->recs, &job->max_recs, adapters_templates_per_job);
+        if (job->nrecs == 0) {
+            job->next = freelist;
+            freelist = job;
+            break;
+        }
 
-                if (job_result != NULL) {
-                    adapter_thread_data_t *finished_job = hts_tpool_result_data(job_result);
-                    output_job_results(bam_out, finished_job);
-                    finished_job->next = job_freelist;
-                    job_freelist = finished_job;
-                    hts_tpool_delete_result(job_result, 0);
-                }
+        // if the queue is full, write out a finished job and try again
+        while (job) {
+            int blk = hts_tpool_dispatch2(ctx->pool, ctx->queue, adapter_lib_job, job, 1);
+            if (!blk) {
+                job = NULL;
+            } else if (errno != EAGAIN) {
+                die("Thread pool dispatch failed");
             }
 
-            if (job_freelist != NULL) {
-                job_data = job_freelist;
-                job_freelist = job_data->next;
-                job_data->template_counts->end = 0;
-            }  else {
-                job_data = init_job(adapterArray, opts);
-                job_data->record_set = va_init(TEMPLATES_PER_JOB * 2, freeRecord);
-                job_data->template_counts = ia_init(TEMPLATES_PER_JOB);
-            }
-            job_data->nrec = 0;
+            r = blk ? hts_tpool_next_result_wait(ctx->queue) : hts_tpool_next_result(ctx->queue);
+            if (blk && !r) die("Failed to get processing job result");
+            if (r) ret = finishJob(r, &freelist, bam_out, ret);
         }
     }
 
-    if (job_data->template_counts->end > 0) {
-        // Deal with left-over items
-        if (hts_tpool_dispatch(pool, queue, adapter_job, job_data) < 0) {
-            die("Thread pool dispatch failed");
-        }
-    } else {
-        // Not used, put back on free list
-        job_data->next = job_freelist;
-        job_freelist = job_data;
+    while (!hts_tpool_process_empty(ctx->queue)) {
+        r = hts_tpool_next_result_wait(ctx->queue);
+        if (!r) die("Failed to get processing job result");
+        ret = finishJob(r, &freelist, bam_out, ret);
     }
 
-    while (!hts_tpool_process_empty(queue)) {
-        job_result = hts_tpool_next_result_wait(queue);
-        if (!job_result) {
-            die("Failed to get processing job result");
-        }
-        adapter_thread_data_t *finished_job = hts_tpool_result_data(job_result);
-        output_job_results(bam_out, finished_job);
-        finished_job->next = job_freelist;
-        job_freelist = finished_job;
-        hts_tpool_delete_result(job_result, 0);
+    while (freelist) {
+        adapter_lib_job_t *job = freelist;
+        freelist = job->next;
+        va_free(job->adapter_array);
+        freeRecords(job->recs, job->max_recs);
+        free(job);
     }
+    return ret;
+}
 
-    while (job_freelist != NULL) {
-        adapter_thread_data_t *next = job_freelist->next;
-        job_free(job_freelist);
-        job_freelist = next;
-    }
-
-    hts_tpool_process_destroy(queue);
-
-    return 0;
+/*
+ * Find adapters in the input a set of templates at a time, and write the records out
+ */
+static int processTemplates(bambi_adapters_t *ctx, BAMit_t *bam_in, BAMit_t *bam_out)
+{
+    if (ctx->pool) return processTemplatesThreads(ctx, bam_in, bam_out);
+    return processTemplatesNoThreads(ctx, bam_in, bam_out);
 }
 
 static int writeMetrics(HashTable *m, adapter_opts_t *opts)
@@ -1040,28 +1055,40 @@ static int findAdapters(adapter_opts_t* opts)
     BAMit_t *bam_in = NULL;
     BAMit_t *bam_out = NULL;
     htsThreadPool hts_threads = { NULL, 0 };
+    htsThreadPool io_threads = { NULL, 0 };
+    htsThreadPool *io_pool = NULL;
+    bambi_adapters_t *ctx = NULL;
 
     while (1) {
         if (opts->nthreads > 1) {
-            hts_threads.pool = hts_tpool_init(opts->nthreads);
+            hts_threads.pool = batch_tpool_init(opts->nthreads);
             if (!hts_threads.pool) {
                 fprintf(stderr, "Couldn't set up thread pool\n");
                 break;
             }
         }
+        if (opts->io_threads > 0) {
+            io_threads.pool = hts_tpool_init(opts->io_threads);
+            if (!io_threads.pool) {
+                fprintf(stderr, "Couldn't set up I/O thread pool\n");
+                break;
+            }
+        }
+        io_pool = io_threads.pool ? &io_threads : hts_threads.pool ? &hts_threads : NULL;
+        TEST_SET(adapters_io_reserved, io_pool && io_pool->pool != hts_threads.pool);
 
         // create metrics hash
         if (opts->metrics_name) {
-            metrics = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
-            if (!metrics) { display("Could not create metrics hash"); break; }
+            opts->metrics = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+            if (!opts->metrics) { display("Could not create metrics hash"); break; }
         }
 
         /*
          * Open input and output BAM files
          */
-        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, hts_threads.pool ? &hts_threads : NULL);
+        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, io_pool, 0);
         if (!bam_in) break;
-        bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, opts->compression_level, hts_threads.pool ? &hts_threads : NULL);
+        bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, opts->compression_level, io_pool, 0);
         if (!bam_out) break;
         // copy input to output header
         bam_hdr_destroy(bam_out->h); bam_out->h = bam_hdr_dup(bam_in->h);
@@ -1074,32 +1101,158 @@ static int findAdapters(adapter_opts_t* opts)
         }
 
         // Read and process each template in the input BAM
-        if (opts->nthreads < 2) {
-            if (processTemplatesNoThreads(bam_in, bam_out, opts->adapterArray, opts) < 0) break;
-        } else {
-            if (processTemplatesThreads(hts_threads.pool, bam_in, bam_out, opts->adapterArray, opts) < 0) break;
-        }
+        ctx = adapter_ctx_init(opts, hts_threads.pool, false);
+        if (processTemplates(ctx, bam_in, bam_out) < 0) break;
 
         if (BAMit_hasnext(bam_in)) break;   // we must has exited the above loop early
 
         /*
          * And finally.....the metrics
          */
-        if (writeMetrics(metrics, opts) != 0) break;
+        if (bambi_adapters_finish(ctx) != 0) break;
         retcode = 0;
 
         break;
     }
 
     // tidy up after us
+    bambi_adapters_destroy(ctx);
     BAMit_free(bam_in);
     BAMit_free(bam_out);
-    if (hts_threads.pool) hts_tpool_destroy(hts_threads.pool);
-    if (metrics) HashTableDestroy(metrics, 1);
+    batch_tpool_destroy(hts_threads.pool);
+    if (io_threads.pool) hts_tpool_destroy(io_threads.pool);
+    if (opts->metrics) HashTableDestroy(opts->metrics, 1);
+    opts->metrics = NULL;
 
     return retcode;
 }
 
+bambi_adapters_t *bambi_adapters_init(int argc, char **argv, hts_tpool *pool)
+{
+    // parse_args() expects "bambi" before the command, and an input file (which isn't used)
+    char **args = smalloc((argc + 3) * sizeof(char *));
+    args[0] = "bambi";
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    args[argc + 1] = "-";
+    args[argc + 2] = NULL;
+    adapter_opts_t *opts = parse_args(argc + 1, args + 1);
+    free(args);
+    if (!opts) return NULL;
+
+    if (opts->metrics_name) {
+        opts->metrics = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+        if (!opts->metrics) die("Could not create metrics hash");
+    }
+
+    return adapter_ctx_init(opts, pool, true);
+}
+
+int bambi_adapters_header(bambi_adapters_t *ctx, sam_hdr_t *hdr)
+{
+    changeHeader(hdr, ctx->opts->argv_list);
+    return 0;
+}
+
+int bambi_adapters_metrics(bambi_adapters_t *ctx, bambi_adapter_metrics_fn fn, void *arg)
+{
+    bambi_adapter_metrics_t m;
+    HashItem *hi;
+    int ret = 0;
+
+    if (!ctx->opts->metrics) return 0;
+
+    HashIter *iter = HashTableIterCreate();
+    if (!iter) die("Out of memory");
+    while (ret == 0 && (hi = HashTableIterNext(ctx->opts->metrics, iter)) != NULL) {
+        rg_metrics_t *rgm = (rg_metrics_t *)hi->data.p;
+        m.read_group = hi->key;
+        m.total_fwd = rgm->total_fwd;
+        m.total_rev = rgm->total_rev;
+        m.contam_fwd = rgm->contam_fwd;
+        m.contam_rev = rgm->contam_rev;
+        m.hist_len = rgm->hist_len;
+        m.hist_fwd = rgm->hist_fwd;
+        m.hist_rev = rgm->hist_rev;
+        ret = fn(&m, arg);
+    }
+    HashTableIterDestroy(iter);
+
+    return ret ? -1 : 0;
+}
+
+int bambi_adapters_finish(bambi_adapters_t *ctx)
+{
+    return writeMetrics(ctx->opts->metrics, ctx->opts);
+}
+
+void bambi_adapters_destroy(bambi_adapters_t *ctx)
+{
+    if (!ctx) return;
+    if (ctx->queue) hts_tpool_process_destroy(ctx->queue);
+    for (int n = 0; n < ctx->njobs; n++) va_free(ctx->jobs[n].adapter_array);
+    free(ctx->jobs);
+    if (ctx->own_opts) {
+        if (ctx->opts->metrics) HashTableDestroy(ctx->opts->metrics, 1);
+        adapter_free_opts(ctx->opts);
+    }
+    free(ctx);
+}
+
+/*
+ * Adapter metrics as part of 'bambi qc'. Records are not changed.
+ */
+typedef struct {
+    adapter_opts_t *opts;
+    va_t *adapter_array;                // our own copy, as matching changes the adapters
+} qc_state_t;
+
+static void *qc_adapters_init(int argc, char **argv)
+{
+    adapter_opts_t *opts = parse_args(argc, argv);
+    if (!opts) return NULL;
+    if (!opts->metrics_name) {
+        fprintf(stderr, "No metrics file given\n");
+        adapter_free_opts(opts);
+        return NULL;
+    }
+    opts->metrics = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    if (!opts->metrics) die("Could not create metrics hash");
+
+    qc_state_t *st = calloc(1, sizeof(qc_state_t));
+    if (!st) die("Out of memory");
+    st->opts = opts;
+    st->adapter_array = copy_adapter_array(opts->adapterArray);
+    return st;
+}
+
+static int qc_adapters_records(void *state, qc_batch_t *batch)
+{
+    qc_state_t *st = (qc_state_t *)state;
+
+    for (int n=0; n < batch->nrecs; n++) {
+        qc_record_t *r = &batch->recs[n];
+        adapter_t *adapter = findBestMatchSeq(r->seq, bam_is_rev(r->rec), st->adapter_array, st->opts);
+        updateMetrics(st->opts->metrics, r->rec, isMatch(adapter, st->opts) ? adapter : NULL);
+    }
+    return 0;
+}
+
+static int qc_adapters_finish(void *state)
+{
+    qc_state_t *st = (qc_state_t *)state;
+    int ret = writeMetrics(st->opts->metrics, st->opts);
+    HashTableDestroy(st->opts->metrics, 1);
+    va_free(st->adapter_array);
+    adapter_free_opts(st->opts);
+    free(st);
+    return ret;
+}
+
+const qc_analyser_t qc_adapters = {
+    "adapters", QC_NEED_SEQ,
+    qc_adapters_init, qc_adapters_records, qc_adapters_finish
+};
+
 /*
  * called from bambi to perform adapter searching
  *
@@ -1112,6 +1265,8 @@ int main_adapters(int argc, char *argv[])
     int ret = 1;
 
     adapter_opts_t* opts = parse_args(argc, argv);
+
+    batch_args_parsed();
     if (opts) {
         ret = findAdapters(opts);
     }
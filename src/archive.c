@@ -0,0 +1,539 @@
+/*  archive.c -- read run folder files directly from a tar archive
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE     // for fopencookie()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bambi.h"
+#include "hash_table.h"
+#include "archive.h"
+
+#define TAR_BLOCK 512
+
+/*
+ * A member of the archive
+ */
+typedef struct {
+    off_t offset;       // start of data
+    off_t size;
+    bool is_dir;
+} member_t;
+
+typedef struct archive_t {
+    char *tarfile;      // real path of the tar file
+    int fd;
+    int refs;           // number of times this archive has been mounted
+    HashTable *members; // normalised name -> member_t
+    struct archive_t *next;
+} archive_t;
+
+/*
+ * Several archives can be mounted at once (eg by jobs in a batch). The
+ * list is only changed by mount and unmount; the member tables are never
+ * changed once an archive has been mounted, so they can be read without
+ * holding the lock.
+ */
+static archive_t *archives = NULL;
+static pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Tidy up a path so that it can be used as an archive key:
+ * remove leading '/' and './', repeated '/', '.' components, and
+ * resolve '..' components. Never returns NULL.
+ */
+char *archive_normalise(const char *path)
+{
+    char *tmp = strdup(path);
+    char *out = calloc(1, strlen(path) + 1);
+    char *saveptr = NULL;
+    size_t len = 0;
+
+    if (!tmp || !out) die("Out of memory");
+
+    for (char *s = strtok_r(tmp, "/", &saveptr); s; s = strtok_r(NULL, "/", &saveptr)) {
+        if (strcmp(s, ".") == 0) continue;
+        if (strcmp(s, "..") == 0) {
+            char *p = strrchr(out, '/');
+            len = p ? p - out : 0;
+            out[len] = 0;
+            continue;
+        }
+        if (len) out[len++] = '/';
+        strcpy(out + len, s);
+        len += strlen(s);
+    }
+
+    free(tmp);
+    return out;
+}
+
+/*
+ * Find the mounted archive that fname is in, and the name of the member
+ * within it. Returns NULL if fname is an ordinary file name.
+ */
+static archive_t *find_archive(const char *fname, const char **member)
+{
+    archive_t *a;
+    const char *sep = strstr(fname, ARCHIVE_SEPARATOR);
+    if (!sep) return NULL;
+
+    pthread_mutex_lock(&archive_lock);
+    for (a = archives; a; a = a->next) {
+        if (strlen(a->tarfile) == sep - fname && strncmp(a->tarfile, fname, sep - fname) == 0) break;
+    }
+    pthread_mutex_unlock(&archive_lock);
+
+    if (a && member) *member = sep + strlen(ARCHIVE_SEPARATOR);
+    return a;
+}
+
+static member_t *find_member(archive_t *a, const char *name)
+{
+    char *key = archive_normalise(name);
+    HashItem *hi = HashTableSearch(a->members, key, strlen(key));
+    free(key);
+    return hi ? (member_t *)hi->data.p : NULL;
+}
+
+static void add_member(archive_t *a, const char *name, off_t offset, off_t size, bool is_dir)
+{
+    char *key = archive_normalise(name);
+    HashItem *hi;
+
+    if (!*key) { free(key); return; }
+
+    // every parent of a member is a directory, even if it has no entry of its own
+    for (char *p = strchr(key, '/'); p; p = strchr(p + 1, '/')) {
+        *p = 0;
+        if (!HashTableSearch(a->members, key, strlen(key))) add_member(a, key, 0, 0, true);
+        *p = '/';
+    }
+
+    hi = HashTableSearch(a->members, key, strlen(key));
+    if (!hi) {
+        HashData hd;
+        hd.p = calloc(1, sizeof(member_t));
+        if (!hd.p) die("Out of memory");
+        hi = HashTableAdd(a->members, key, strlen(key), hd, NULL);
+        if (!hi) die("Out of memory");
+    }
+    member_t *m = (member_t *)hi->data.p;
+    m->offset = offset;
+    m->size = size;
+    m->is_dir = is_dir;
+    free(key);
+}
+
+/*
+ * tar numeric fields are octal, or base-256 for large values
+ */
+static off_t tar_number(const char *field, int len)
+{
+    off_t n = 0;
+    if (field[0] & 0x80) {
+        n = field[0] & 0x3f;
+        for (int i = 1; i < len; i++) n = (n << 8) | (unsigned char)field[i];
+    } else {
+        for (int i = 0; i < len && field[i]; i++) {
+            if (field[i] >= '0' && field[i] <= '7') n = (n << 3) | (field[i] - '0');
+        }
+    }
+    return n;
+}
+
+static char *read_data(archive_t *a, off_t offset, off_t size)
+{
+    char *buf = smalloc(size + 1);
+    if (pread(a->fd, buf, size, offset) != size) { free(buf); return NULL; }
+    buf[size] = 0;
+    return buf;
+}
+
+/*
+ * Find the 'path' record in a pax extended header
+ */
+static char *pax_path(const char *data, off_t size)
+{
+    const char *p = data;
+    while (p < data + size) {
+        char *key;
+        long len = strtol(p, &key, 10);
+        if (len <= 0 || *key != ' ') break;
+        key++;
+        if (strncmp(key, "path=", 5) == 0) {
+            const char *val = key + 5;
+            int vlen = (p + len - 1) - val;
+            if (vlen < 0) break;
+            return strndup(val, vlen);
+        }
+        p += len;
+    }
+    return NULL;
+}
+
+static void free_archive(archive_t *a)
+{
+    if (!a) return;
+    if (a->members) {
+        HashIter *iter = HashTableIterCreate();
+        HashItem *hi;
+        while ((hi = HashTableIterNext(a->members, iter)) != NULL) free(hi->data.p);
+        HashTableIterDestroy(iter);
+        HashTableDestroy(a->members, 0);
+    }
+    if (a->fd >= 0) close(a->fd);
+    free(a->tarfile);
+    free(a);
+}
+
+/*
+ * Read the index of a tar file
+ */
+static archive_t *index_archive(const char *tarfile, char *realname)
+{
+    char hdr[TAR_BLOCK];
+    char *longname = NULL;
+    off_t offset = 0;
+
+    archive_t *a = calloc(1, sizeof(archive_t));
+    if (!a) die("Out of memory");
+    a->tarfile = realname;
+    a->refs = 1;
+    a->fd = open(realname, O_RDONLY);
+    if (a->fd < 0) {
+        fprintf(stderr, "Can't open archive %s: %s\n", tarfile, strerror(errno));
+        free_archive(a);
+        return NULL;
+    }
+    a->members = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    if (!a->members) die("Out of memory");
+
+    while (pread(a->fd, hdr, TAR_BLOCK, offset) == TAR_BLOCK) {
+        int i;
+        for (i = 0; i < TAR_BLOCK && !hdr[i]; i++);
+        if (i == TAR_BLOCK) break;  // end of archive
+
+        off_t size = tar_number(hdr + 124, 12);
+        char type = hdr[156];
+        off_t data = offset + TAR_BLOCK;
+        char name[256+2];
+
+        if (type == 'L' || type == 'x') {
+            // GNU long name or pax header: applies to the next member
+            char *buf = read_data(a, data, size);
+            if (!buf) break;
+            free(longname);
+            longname = (type == 'L') ? strdup(buf) : pax_path(buf, size);
+            free(buf);
+        } else if (type == '0' || type == '\0' || type == '7' || type == '5') {
+            if (longname) {
+                add_member(a, longname, data, size, type == '5');
+                free(longname); longname = NULL;
+            } else {
+                name[0] = 0;
+                if (memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345]) {
+                    snprintf(name, sizeof(name), "%.155s/", hdr + 345);
+                }
+                strncat(name, hdr, 100);
+                add_member(a, name, data, size, type == '5');
+            }
+        } else {
+            // links, devices, global headers etc. are of no interest
+            free(longname); longname = NULL;
+        }
+
+        offset = data + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+    }
+    free(longname);
+
+    if (a->members->nused == 0) {
+        fprintf(stderr, "Archive %s is empty or is not an uncompressed tar file\n", tarfile);
+        free_archive(a);
+        return NULL;
+    }
+
+    return a;
+}
+
+/*
+ * Open and index a tar archive. Mounting an archive which is already
+ * mounted just adds a reference to it.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int archive_mount(const char *tarfile)
+{
+    archive_t *a;
+    char *realname = realpath(tarfile, NULL);
+    if (!realname) {
+        fprintf(stderr, "Can't open archive %s: %s\n", tarfile, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&archive_lock);
+    for (a = archives; a; a = a->next) {
+        if (strcmp(a->tarfile, realname) == 0) { a->refs++; break; }
+    }
+    pthread_mutex_unlock(&archive_lock);
+    if (a) { free(realname); return 0; }
+
+    archive_t *new = index_archive(tarfile, realname);
+    if (!new) return -1;
+
+    // someone else may have mounted it while we were reading it
+    pthread_mutex_lock(&archive_lock);
+    for (a = archives; a; a = a->next) {
+        if (strcmp(a->tarfile, new->tarfile) == 0) { a->refs++; break; }
+    }
+    if (!a) { new->next = archives; archives = new; new = NULL; }
+    pthread_mutex_unlock(&archive_lock);
+    free_archive(new);
+
+    return 0;
+}
+
+void archive_unmount(const char *tarfile)
+{
+    archive_t *a, **prev;
+    char *realname = realpath(tarfile, NULL);
+    if (!realname) return;
+
+    pthread_mutex_lock(&archive_lock);
+    for (prev = &archives; (a = *prev) != NULL; prev = &a->next) {
+        if (strcmp(a->tarfile, realname) == 0) {
+            if (--a->refs == 0) *prev = a->next;
+            else                a = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&archive_lock);
+
+    free_archive(a);
+    free(realname);
+}
+
+/*
+ * Return the name to use for path within a mounted archive.
+ * This is the real path of the tar file and the normalised path,
+ * joined by ARCHIVE_SEPARATOR.
+ */
+char *archive_path(const char *tarfile, const char *path)
+{
+    char *realname = realpath(tarfile, NULL);
+    if (!realname) return NULL;
+    char *key = archive_normalise(path);
+    char *name = smalloc(strlen(realname) + strlen(ARCHIVE_SEPARATOR) + strlen(key) + 1);
+    sprintf(name, "%s%s%s", realname, ARCHIVE_SEPARATOR, key);
+    free(realname);
+    free(key);
+    return name;
+}
+
+bool archive_is_member(const char *fname)
+{
+    return find_archive(fname, NULL) != NULL;
+}
+
+/*
+ * stdio access to a member, using pread() on the shared archive file
+ */
+typedef struct {
+    int fd;
+    off_t start;
+    off_t size;
+    off_t pos;
+} member_cookie_t;
+
+static ssize_t member_read(void *cookie, char *buf, size_t size)
+{
+    member_cookie_t *m = (member_cookie_t *)cookie;
+    if (m->pos >= m->size) return 0;
+    if (size > m->size - m->pos) size = m->size - m->pos;
+    ssize_t n = pread(m->fd, buf, size, m->start + m->pos);
+    if (n > 0) m->pos += n;
+    return n;
+}
+
+static int member_seek(void *cookie, off64_t *offset, int whence)
+{
+    member_cookie_t *m = (member_cookie_t *)cookie;
+    off_t pos;
+    switch (whence) {
+        case SEEK_SET: pos = *offset; break;
+        case SEEK_CUR: pos = m->pos + *offset; break;
+        case SEEK_END: pos = m->size + *offset; break;
+        default: errno = EINVAL; return -1;
+    }
+    if (pos < 0) { errno = EINVAL; return -1; }
+    m->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+static int member_close(void *cookie)
+{
+    free(cookie);
+    return 0;
+}
+
+/*
+ * Open a file for reading
+ */
+FILE *archive_fopen(const char *fname)
+{
+    const char *name;
+    archive_t *a = find_archive(fname, &name);
+    if (!a) return fopen(fname, "rb");
+
+    member_t *m = find_member(a, name);
+    if (!m || m->is_dir) { errno = ENOENT; return NULL; }
+
+    member_cookie_t *cookie = calloc(1, sizeof(member_cookie_t));
+    if (!cookie) die("Out of memory");
+    cookie->fd = a->fd;
+    cookie->start = m->offset;
+    cookie->size = m->size;
+
+    cookie_io_functions_t io = { member_read, NULL, member_seek, member_close };
+    FILE *f = fopencookie(cookie, "rb", io);
+    if (!f) free(cookie);
+    return f;
+}
+
+/*
+ * Return a file descriptor positioned at the start of the file.
+ *
+ * For an archive member, reading will continue past the end of the
+ * member, so this is only suitable for self-terminating formats such as
+ * gzip (zlib ignores trailing data after the compressed stream).
+ */
+int archive_open_fd(const char *fname)
+{
+    const char *name;
+    archive_t *a = find_archive(fname, &name);
+    if (!a) return open(fname, O_RDONLY);
+
+    member_t *m = find_member(a, name);
+    if (!m || m->is_dir) { errno = ENOENT; return -1; }
+
+    int fd = open(a->tarfile, O_RDONLY);
+    if (fd < 0) return -1;
+    if (lseek(fd, m->offset, SEEK_SET) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+/*
+ * Read a whole file into memory. The result is NUL terminated.
+ */
+char *archive_load(const char *fname, size_t *size)
+{
+    char *buf = NULL;
+    FILE *f = archive_fopen(fname);
+    if (!f) return NULL;
+
+    if (fseeko(f, 0, SEEK_END) == 0) {
+        off_t len = ftello(f);
+        rewind(f);
+        buf = smalloc(len + 1);
+        if (fread(buf, 1, len, f) != (size_t)len) {
+            free(buf); buf = NULL;
+        } else {
+            buf[len] = 0;
+            if (size) *size = len;
+        }
+    }
+    fclose(f);
+    return buf;
+}
+
+bool archive_is_dir(const char *path)
+{
+    const char *name;
+    archive_t *a = find_archive(path, &name);
+    if (!a) {
+        struct stat buf;
+        return stat(path, &buf) == 0 && S_ISDIR(buf.st_mode);
+    }
+
+    char *key = archive_normalise(name);
+    bool is_dir = (*key == 0);  // the root of the archive
+    free(key);
+    if (!is_dir) {
+        member_t *m = find_member(a, name);
+        is_dir = m && m->is_dir;
+    }
+    return is_dir;
+}
+
+/*
+ * Return the names of the entries in a directory, or NULL if it can't be read
+ */
+va_t *archive_list_dir(const char *path)
+{
+    va_t *names = NULL;
+    const char *name;
+    archive_t *a = find_archive(path, &name);
+
+    if (!a) {
+        struct dirent *dir;
+        DIR *d = opendir(path);
+        if (!d) return NULL;
+        names = va_init(100, free);
+        while ((dir = readdir(d)) != NULL) {
+            if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) continue;
+            va_push(names, strdup(dir->d_name));
+        }
+        closedir(d);
+        return names;
+    }
+
+    if (!archive_is_dir(path)) return NULL;
+
+    char *dirkey = archive_normalise(name);
+    size_t dirlen = strlen(dirkey);
+    HashIter *iter = HashTableIterCreate();
+    HashItem *hi;
+
+    names = va_init(100, free);
+    while ((hi = HashTableIterNext(a->members, iter)) != NULL) {
+        char *entry = hi->key;
+        if (dirlen) {
+            if (hi->key_len <= dirlen || strncmp(entry, dirkey, dirlen) || entry[dirlen] != '/') continue;
+            entry += dirlen + 1;
+        }
+        int len = hi->key_len - (entry - hi->key);
+        if (memchr(entry, '/', len)) continue;
+        va_push(names, strndup(entry, len));
+    }
+    HashTableIterDestroy(iter);
+    free(dirkey);
+    return names;
+}
@@ -0,0 +1,56 @@
+/*  archive.h -- read run folder files directly from a tar archive
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "array.h"
+
+/*
+ * An uncompressed tar file can be "mounted", after which the names
+ * returned by archive_path() are looked up in the archive instead of the
+ * filesystem. The archive is indexed once when it is mounted, and members
+ * are read in place. More than one archive can be mounted at a time.
+ *
+ * Names which are not in a mounted archive fall through to the normal
+ * filesystem calls, so readers can use these functions unconditionally.
+ */
+
+// separates the tar file from the member name; never found in a real path
+#define ARCHIVE_SEPARATOR "//"
+
+int archive_mount(const char *tarfile);
+void archive_unmount(const char *tarfile);
+// Returns NULL (with errno set) if the tar file can't be found
+char *archive_path(const char *tarfile, const char *path);
+bool archive_is_member(const char *fname);
+
+// Always returns a new string (it dies if out of memory)
+char *archive_normalise(const char *path);
+FILE *archive_fopen(const char *fname);
+int archive_open_fd(const char *fname);
+char *archive_load(const char *fname, size_t *size);
+bool archive_is_dir(const char *path);
+va_t *archive_list_dir(const char *path);
+
+#endif
+
@@ -29,6 +29,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "htslib/hts.h"
 #include "bambi.h"
 #include "bambi_utils.h"
+#include "shm.h"
 
 int main_decode(int argc, char *argv[]);
 int main_i2b(int argc, char *argv[]);
@@ -40,10 +41,37 @@ int main_seqchksum(int argc, char *argv[]);
 int main_adapters(int argc, char *argv[]);
 int main_update(int argc, char *argv[]);
 int main_substitution_analysis(int argc, char *argv[]);
+int main_batch(int argc, char *argv[]);
+int main_qc(int argc, char *argv[]);
 
-const char *bambi_version()
+static const struct {
+    const char *name;
+    bambi_command_t func;
+} commands[] = {
+    { "decode",                 main_decode },
+    { "i2b",                    main_i2b },
+    { "select",                 main_select },
+    { "chrsplit",               main_chrsplit },
+    { "read2tags",              main_read2tags },
+    { "spatial_filter",         main_spatial_filter },
+    { "seqchksum",              main_seqchksum },
+    { "adapters",               main_adapters },
+    { "update",                 main_update },
+    { "substitution_analysis",  main_substitution_analysis },
+    { "batch",                  main_batch },
+    { "qc",                     main_qc },
+    { NULL, NULL }
+};
+
+/*
+ * Find the main function for a command, or NULL if there isn't one
+ */
+bambi_command_t bambi_find_command(const char *name)
 {
-    return VERSION;
+    for (int n = 0; commands[n].name; n++) {
+        if (strcmp(commands[n].name, name) == 0) return commands[n].func;
+    }
+    return NULL;
 }
 
 static void usage(FILE *fp)
@@ -66,6 +94,8 @@ static void usage(FILE *fp)
 "     adapters       find and remove adapters\n"
 "     update         update an existing BAM/SAM/CRAM file\n"
 "     substitution_analysis   produce a substitution analysis table\n"
+"     batch          run a list of commands in one process\n"
+"     qc             run several QC analyses in one pass over a file\n"
 "\n"
 "bambi <command> for help on a particular command\n"
 "\n");
@@ -85,17 +115,12 @@ int main(int argc, char *argv[])
         argc = 2;
     }
 
+    // let any command read and write shm: rings
+    shm_register();
+
     int ret = 0;
-         if (strcmp(argv[1], "decode") == 0)    ret = main_decode(argc-1, argv+1);
-    else if (strcmp(argv[1], "i2b") == 0)       ret = main_i2b(argc-1, argv+1);
-    else if (strcmp(argv[1], "select") == 0)    ret = main_select(argc-1, argv+1);
-    else if (strcmp(argv[1], "chrsplit") == 0)  ret = main_chrsplit(argc-1, argv+1);
-    else if (strcmp(argv[1], "read2tags") == 0) ret = main_read2tags(argc-1, argv+1);
-    else if (strcmp(argv[1], "spatial_filter") == 0) ret = main_spatial_filter(argc-1, argv+1);
-    else if (strcmp(argv[1], "seqchksum") == 0) ret = main_seqchksum(argc-1, argv+1);
-    else if (strcmp(argv[1], "adapters") == 0) ret = main_adapters(argc-1, argv+1);
-    else if (strcmp(argv[1], "update") == 0) ret = main_update(argc-1, argv+1);
-    else if (strcmp(argv[1], "substitution_analysis") == 0) ret = main_substitution_analysis(argc-1, argv+1);
+    bambi_command_t cmd = bambi_find_command(argv[1]);
+         if (cmd) ret = cmd(argc-1, argv+1);
     else if (strcmp(argv[1], "--version") == 0) {
         printf( "bambi %s\n"
                 "Using htslib %s\n"
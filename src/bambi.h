@@ -38,5 +38,34 @@ typedef enum { MT_UNKNOWN,
 
 const char *bambi_version(void);
 
+/*
+ * The number of clusters or templates in each job of a threaded command.
+ * In a BAMBI_TESTING build, set_<name>() changes it (0 for the default),
+ * so the thread tests can split small inputs into many jobs.
+ */
+#ifdef BAMBI_TESTING
+#define JOB_SIZE(name, size) static int name = size; \
+                             void set_##name(int n) { name = n ? n : size; }
+#else
+#define JOB_SIZE(name, size) static const int name = size;
+#endif
+
+/*
+ * In a BAMBI_TESTING build, TEST_RECORD(name) is a flag which TEST_SET()
+ * sets during a run, so the thread tests can check how a command set up
+ * its thread pools. Otherwise they are nothing.
+ */
+#ifdef BAMBI_TESTING
+#define TEST_RECORD(name) bool name;
+#define TEST_SET(name, value) (name = (value))
+#else
+#define TEST_RECORD(name)
+#define TEST_SET(name, value)
+#endif
+
+// the main function for each command
+typedef int (*bambi_command_t)(int argc, char *argv[]);
+bambi_command_t bambi_find_command(const char *name);
+
 #endif
 
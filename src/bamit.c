@@ -17,34 +17,91 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "htslib/bgzf.h"
+#include "htslib/cram.h"
 
 #include "bambi_utils.h"
 #include "bamit.h"
+#include "shm.h"
 
-BAMit_t *BAMit_init(samFile *f, sam_hdr_t *h)
+/*
+ * Go to the start of a range: a BGZF virtual offset for BAM, or the
+ * offset of a container for CRAM
+ */
+static int BAMit_seek(BAMit_t *bit, int64_t offset)
+{
+    bit->range_read = 0;
+    if (bit->f->format.format == cram) return cram_seek(bit->f->fp.cram, offset, SEEK_SET);
+    return bgzf_seek(bit->f->fp.bgzf, offset, SEEK_SET);
+}
+
+/*
+ * Read the next record, moving on to the next range if there are ranges
+ */
+static int BAMit_read(BAMit_t *bit, bam1_t *rec)
+{
+    if (!bit->ranges) return sam_read1(bit->f, bit->h, rec);
+
+    while (bit->range < bit->nranges) {
+        int64_t *range = bit->ranges + 3 * bit->range;
+        if (bit->f->format.format == cram) {
+            // CRAM reads whole containers, so the file offset doesn't say
+            // where we are: count the records instead
+            if (bit->range_read < range[2]) {
+                bit->range_read++;
+                return sam_read1(bit->f, bit->h, rec);
+            }
+        } else {
+            // ranges end on block boundaries, so bgzf_peek() makes sure we look
+            // at the start of the next block and not the end of this one
+            BGZF *fp = bit->f->fp.bgzf;
+            if (bgzf_peek(fp) >= 0 && bgzf_tell(fp) < range[1]) {
+                return sam_read1(bit->f, bit->h, rec);
+            }
+        }
+        // this range is finished, so go to the start of the next one
+        if (++bit->range < bit->nranges && BAMit_seek(bit, bit->ranges[3 * bit->range]) < 0) {
+            fprintf(stderr, "Can't seek in input file\n");
+            return -2;
+        }
+    }
+    return -1;
+}
+
+static BAMit_t *BAMit_create(samFile *f, sam_hdr_t *h, int64_t *ranges, int nranges)
 {
-    int r;
     BAMit_t *bit = calloc(1,sizeof(BAMit_t));
     bit->f = f;
     bit->h = h;
     bit->rec = bam_init1();
     bit->nextRec = bam_init1();
+    bit->ranges = ranges;
+    bit->nranges = nranges;
+    if (ranges && nranges && BAMit_seek(bit, ranges[0]) < 0) die("Can't seek in input file");
     if (f->is_write == 0) {
-        r = sam_read1(bit->f, bit->h, bit->nextRec);
+        int r = BAMit_read(bit, bit->nextRec);
         if (r<0) { bam_destroy1(bit->nextRec); bit->nextRec = NULL; }
     }
     return bit;
 }
 
+BAMit_t *BAMit_init(samFile *f, sam_hdr_t *h)
+{
+    return BAMit_create(f, h, NULL, 0);
+}
+
 /*
  * Open a BAM file
- * arguments are: char *fname               filename to open
+ * arguments are: char *fname               filename to open, '-' or shm:NAME
  *                char mode                 'r' or 'w'
  *                char *fmt                 format [bam,sam,cram]
- *                char compression level    [0..9]
+ *                char compression level    [0..9], or 0 for the default (uncompressed for shm:)
+ *                int required_fields       mask of SAM_* fields needed when reading, or 0 for all
  */
 BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
-                    htsThreadPool *thread_pool)
+                    htsThreadPool *thread_pool, int required_fields)
 {
     samFile *f = NULL;
     sam_hdr_t *h = NULL;
@@ -61,6 +118,11 @@ BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
     sam_open_mode(m+1, fname, NULL);    // set type (sam/bam/cram) from filename
     m[0] = mode;
     m[2] = compression_level;
+    // BAM into a shared memory ring is read straight away, so don't compress it
+    if (mode == 'w' && !compression_level && shm_is_shm(fname)
+        && m[1] == 'b' && (!format || format->format == bam)) {
+        m[2] = '0';
+    }
     f = hts_open_format(fname, m, format);
     free(format);
     if (!f) {
@@ -73,12 +135,85 @@ BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
         exit(1);
     }
 
+    // Only CRAM can skip decoding fields; this is a no-op for BAM and SAM
+    if (mode == 'r' && required_fields && hts_set_opt(f, CRAM_OPT_REQUIRED_FIELDS, required_fields) < 0) {
+        fprintf(stderr, "Couldn't set required fields on %s\n", fname);
+        exit(1);
+    }
+
     if (mode == 'r') h = sam_hdr_read(f);
     else             h = bam_hdr_init();
 
     return BAMit_init(f,h);
 }
 
+static int compare_ranges(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Open a BAM or CRAM file, and read only the tiles given, using the tile index
+ */
+BAMit_t *BAMit_open_tiles(char *fname, char *tile_index, int *tiles, int ntiles,
+                          htsThreadPool *thread_pool)
+{
+    FILE *idx = fopen(tile_index, "r");
+    if (!idx) die("Could not open tile index (%s)", tile_index);
+
+    int nranges = 0, max_ranges = 16;
+    int64_t *ranges = smalloc(3 * max_ranges * sizeof(int64_t));
+    char line[1024];
+    while (fgets(line, sizeof(line), idx)) {
+        int lane, tile;
+        int64_t start, end;
+        uint64_t nrecords;
+        if (*line == '#') continue;
+        if (sscanf(line, "%d %d %"SCNd64" %"SCNd64" %"SCNu64, &lane, &tile, &start, &end, &nrecords) != 5) {
+            die("Can't understand tile index line: %s", line);
+        }
+        int n;
+        for (n = 0; n < ntiles; n++) if (tiles[n] == tile) break;
+        if (n == ntiles || start == end) continue;
+        if (nranges == max_ranges) {
+            max_ranges *= 2;
+            ranges = realloc(ranges, 3 * max_ranges * sizeof(int64_t));
+            if (!ranges) die("Out of memory");
+        }
+        ranges[3 * nranges] = start;
+        ranges[3 * nranges + 1] = end;
+        ranges[3 * nranges + 2] = nrecords;
+        nranges++;
+    }
+    fclose(idx);
+
+    // read the tiles in file order, joining tiles which follow each other
+    qsort(ranges, nranges, 3 * sizeof(int64_t), compare_ranges);
+    int n = 0;
+    for (int i = 0; i < nranges; i++) {
+        if (n && ranges[3*n-2] == ranges[3*i]) {
+            ranges[3*n-2] = ranges[3*i+1];
+            ranges[3*n-1] += ranges[3*i+2];
+        } else {
+            ranges[3*n] = ranges[3*i];
+            ranges[3*n+1] = ranges[3*i+1];
+            ranges[3*n+2] = ranges[3*i+2];
+            n++;
+        }
+    }
+    nranges = n;
+
+    samFile *f = hts_open(fname, "rb");
+    if (!f) die("Could not open file (%s)", fname);
+    if (hts_get_format(f)->format != bam && hts_get_format(f)->format != cram) die("%s is not a BAM or CRAM file", fname);
+    if (thread_pool && hts_set_thread_pool(f, thread_pool) < 0) die("Couldn't set thread pool on %s", fname);
+    sam_hdr_t *h = sam_hdr_read(f);
+    if (!h) die("Could not read header from %s", fname);
+
+    return BAMit_create(f, h, ranges, nranges);
+}
+
 void BAMit_free(void *ptr)
 {
     BAMit_t *bit = (BAMit_t *)ptr;
@@ -87,6 +222,7 @@ void BAMit_free(void *ptr)
     if (bit->h) bam_hdr_destroy(bit->h);
     if (bit->rec) bam_destroy1(bit->rec);
     if (bit->nextRec) bam_destroy1(bit->nextRec);
+    free(bit->ranges);
     free(bit);
 }
 
@@ -94,7 +230,7 @@ bam1_t *BAMit_next(BAMit_t *bit)
 {
     if (!bit->nextRec) return NULL;
     if (!bam_copy1(bit->rec,bit->nextRec)) die("bam_copy1() failed in BAMit_next()");
-    int r = sam_read1(bit->f, bit->h, bit->nextRec);
+    int r = BAMit_read(bit, bit->nextRec);
     if (r<0) { bam_destroy1(bit->nextRec); bit->nextRec = NULL; }
     return bit->rec;
 }
@@ -109,6 +245,130 @@ bool BAMit_hasnext(BAMit_t *bit)
     return (bit->nextRec != NULL);
 }
 
+int BAMit_next_templates(BAMit_t *bit, bam1_t ***recs, int *max_recs, int ntemplates)
+{
+    char qname[260];
+    int nrecs = 0;
+
+    for (int t = 0; t < ntemplates && BAMit_hasnext(bit); t++) {
+        bam1_t *rec = BAMit_peek(bit);
+        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
+        while (BAMit_hasnext(bit) && strcmp(bam_get_qname(BAMit_peek(bit)), qname) == 0) {
+            if (nrecs == *max_recs) {
+                int max = *max_recs ? *max_recs * 2 : 256;
+                *recs = realloc(*recs, max * sizeof(bam1_t *));
+                if (!*recs) die("Out of memory");
+                memset(*recs + *max_recs, 0, (max - *max_recs) * sizeof(bam1_t *));
+                *max_recs = max;
+            }
+            if (!(*recs)[nrecs] && !((*recs)[nrecs] = bam_init1())) die("Out of memory");
+            if (!bam_copy1((*recs)[nrecs], BAMit_next(bit))) die("bam_copy1() failed in BAMit_next_templates()");
+            nrecs++;
+        }
+    }
+    return nrecs;
+}
+
 
 
 
+
+int BAMit_aux_add(BAMit_aux_t *aux, const char *tag)
+{
+    for (int n=0; n < aux->ntags; n++) {
+        if (aux->tag[n][0] == tag[0] && aux->tag[n][1] == tag[1]) return n;
+    }
+    if (aux->ntags == BAMIT_AUX_MAX) die("Too many tags in BAMit_aux_add()");
+    memcpy(aux->tag[aux->ntags], tag, 2);
+    aux->offset[aux->ntags] = -1;
+    aux->len[aux->ntags] = 0;
+    return aux->ntags++;
+}
+
+/*
+ * Size of an aux value, given a pointer to its type
+ * Returns -1 if it runs past end
+ */
+static int aux_value_size(uint8_t *s, uint8_t *end)
+{
+    int size;
+    switch (*s) {
+    case 'A': case 'c': case 'C': return 1;
+    case 's': case 'S':           return 2;
+    case 'i': case 'I': case 'f': return 4;
+    case 'd':                     return 8;
+    case 'Z': case 'H': {
+        uint8_t *z = memchr(s+1, 0, end - (s+1));
+        return z ? z - s : -1;
+    }
+    case 'B': {
+        if (end - s < 6) return -1;
+        uint32_t count;
+        memcpy(&count, s+2, 4);
+        switch (s[1]) {
+        case 'c': case 'C': size = 1; break;
+        case 's': case 'S': size = 2; break;
+        case 'i': case 'I': case 'f': size = 4; break;
+        default: return -1;
+        }
+        if ((uint64_t)count * size > end - s - 6) return -1;
+        return 5 + count * size;
+    }
+    default:
+        return -1;
+    }
+}
+
+int BAMit_aux_index(BAMit_aux_t *aux, bam1_t *rec)
+{
+    uint8_t *start = bam_get_aux(rec);
+    uint8_t *end = rec->data + rec->l_data;
+    uint8_t *s = start;
+    int nfound = 0;
+
+    for (int n=0; n < aux->ntags; n++) aux->offset[n] = -1;
+
+    while (end - s >= 3 && nfound < aux->ntags) {
+        int size = aux_value_size(s+2, end);
+        if (size < 0 || size > end - s - 3) return -1;
+        for (int n=0; n < aux->ntags; n++) {
+            if (aux->offset[n] < 0 && aux->tag[n][0] == s[0] && aux->tag[n][1] == s[1]) {
+                aux->offset[n] = s - start;
+                aux->len[n] = size + 3;
+                nfound++;
+                break;
+            }
+        }
+        s += size + 3;
+    }
+    return 0;
+}
+
+int BAMit_aux_update(BAMit_aux_t *aux, bam1_t *rec, int n, char type, int len, const uint8_t *data)
+{
+    if (aux->offset[n] < 0) {
+        aux->offset[n] = bam_get_l_aux(rec);
+        aux->len[n] = len + 3;
+        return bam_aux_append(rec, aux->tag[n], type, len, data);
+    }
+
+    int diff = len + 3 - aux->len[n];
+    if (diff > 0 && rec->l_data + diff > rec->m_data) {
+        if (sam_realloc_bam_data(rec, rec->l_data + diff) < 0) return -1;
+    }
+
+    // move the following tags up or down to fit the new value
+    uint8_t *s = bam_get_aux(rec) + aux->offset[n];
+    if (diff) {
+        uint8_t *next = s + aux->len[n];
+        memmove(next + diff, next, rec->data + rec->l_data - next);
+        rec->l_data += diff;
+        for (int i=0; i < aux->ntags; i++) {
+            if (aux->offset[i] > aux->offset[n]) aux->offset[i] += diff;
+        }
+        aux->len[n] += diff;
+    }
+    s[2] = type;
+    memcpy(s+3, data, len);
+    return 0;
+}
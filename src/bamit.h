@@ -33,6 +33,10 @@ typedef struct {
     sam_hdr_t *h;
     bam1_t *rec;
     bam1_t *nextRec;
+    int64_t *ranges;        // start and end offsets and number of records to read, or NULL for all
+    int nranges;
+    int range;              // current range
+    int64_t range_read;     // records read from the current range
 } BAMit_t;
 
 /*
@@ -42,9 +46,29 @@ typedef struct {
  *                char *fmt                  format [bam,sam,cram] or NULL
  *                char compression level     [0..9] or NULL
  *                htsThreadPool *thread_pool thread pool to use, or NULL
+ *                int required_fields        SAM_QNAME|SAM_FLAG|... fields needed when reading,
+ *                                           or 0 for all fields. Fields not asked for may not
+ *                                           be decoded (CRAM only), so don't write the records
+ *                                           out if you ask for less than everything.
  */
 BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
-                    htsThreadPool *thread_pool);
+                    htsThreadPool *thread_pool, int required_fields);
+
+/*
+ * Open a BAM or CRAM file written by 'i2b --tile-index', and read only some tiles
+ * arguments are: char *fname                BAM or CRAM file to open
+ *                char *tile_index           tile index written by i2b
+ *                int *tiles, int ntiles     the tiles to read (from any lane)
+ *                htsThreadPool *thread_pool thread pool to use, or NULL
+ * The records are returned in file order, whatever the order of the tiles.
+ */
+BAMit_t *BAMit_open_tiles(char *fname, char *tile_index, int *tiles, int ntiles,
+                          htsThreadPool *thread_pool);
+
+/*
+ * Fields needed to parse alignments and read info (see parse_bam.h)
+ */
+#define BAMIT_ALIGNMENT_FIELDS (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_SEQ | SAM_QUAL | SAM_AUX)
 
 /*
  * initialise with open file pointer and header
@@ -68,10 +92,63 @@ bam1_t *BAMit_peek(BAMit_t *bit);
 
 bool BAMit_hasnext(BAMit_t *bit);
 
+/*
+ * Read up to 'ntemplates' whole templates (runs of records with the same name)
+ * into *recs, an array of *max_recs records which is grown as needed. The
+ * records already in the array are reused, so the array can be passed back
+ * in for the next set of templates. Returns the number of records read.
+ */
+int BAMit_next_templates(BAMit_t *bit, bam1_t ***recs, int *max_recs, int ntemplates);
+
 /*
  * free data and close file
  */
 void BAMit_free(void *bit);
 
+/*
+ * Find several aux tags in a record with a single pass over its aux data,
+ * instead of one bam_aux_get() (and one pass) per tag.
+ *
+ * Declare the tags once with BAMit_aux_add(), which returns the index to use
+ * for each tag, then call BAMit_aux_index() for each record.
+ */
+#define BAMIT_AUX_MAX 16
+
+typedef struct {
+    int ntags;
+    char tag[BAMIT_AUX_MAX][2];
+    int offset[BAMIT_AUX_MAX];      // offset of the tag in the aux data, or -1 if not found
+    int len[BAMIT_AUX_MAX];         // length of the tag, type and value
+} BAMit_aux_t;
+
+#define BAMIT_AUX_INIT { 0 }
+
+/*
+ * Add a tag to the set, returning its index
+ * Adding the same tag twice returns the same index
+ */
+int BAMit_aux_add(BAMit_aux_t *aux, const char *tag);
+
+/*
+ * Find all the tags in the record
+ * Returns 0 on success, -1 if the aux data is corrupt
+ */
+int BAMit_aux_index(BAMit_aux_t *aux, bam1_t *rec);
+
+/*
+ * Return tag n of the record in the same form as bam_aux_get(), or NULL if it isn't there
+ */
+static inline uint8_t *BAMit_aux_get(BAMit_aux_t *aux, bam1_t *rec, int n)
+{
+    return aux->offset[n] < 0 ? NULL : bam_get_aux(rec) + aux->offset[n] + 2;
+}
+
+/*
+ * Replace the value of tag n (or append the tag if it isn't there) and keep the
+ * index up to date. A value of the same type and size is overwritten in place.
+ * Returns 0 on success, -1 on failure
+ */
+int BAMit_aux_update(BAMit_aux_t *aux, bam1_t *rec, int n, char type, int len, const uint8_t *data);
+
 #endif
 
@@ -0,0 +1,342 @@
+/*  batch.c -- run a list of bambi commands in one process
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <bambi.h>
+#include <string.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "array.h"
+#include "batch_shared.h"
+
+#define MANIFEST_LINE_LEN 65536
+
+/*
+ * structure to hold options
+ */
+typedef struct {
+    char *manifest;
+    int nthreads;
+    int njobs;
+    bool verbose;
+} opts_t;
+
+/*
+ * One command from the manifest
+ */
+typedef struct {
+    int lineno;
+    char *cmdline;
+    int argc;
+    char **argv;            // argv[0] is "bambi", argv[1] is the command
+    bambi_command_t func;
+    int result;
+} batch_job_t;
+
+/*
+ * The queue of commands, shared by the worker threads
+ */
+typedef struct {
+    va_t *jobs;
+    int next;
+    bool verbose;
+    pthread_mutex_t lock;
+} batch_queue_t;
+
+static void free_opts(opts_t* opts)
+{
+    if (!opts) return;
+    free(opts->manifest);
+    free(opts);
+}
+
+static void free_job(void *ent)
+{
+    batch_job_t *job = (batch_job_t *)ent;
+    for (int n = 0; n < job->argc; n++) free(job->argv[n]);
+    free(job->argv);
+    free(job->cmdline);
+    free(job);
+}
+
+/*
+ * display usage information
+ */
+static void usage(FILE *write_to)
+{
+    fprintf(write_to,
+"Usage: bambi batch [options] <manifest>\n"
+"\n"
+"Run all the commands in a manifest file in one process, several at a time.\n"
+"Each line of the manifest is a bambi command and its arguments, without the\n"
+"leading 'bambi'. Arguments may be quoted with single or double quotes.\n"
+"Blank lines and lines starting with '#' are ignored.\n"
+"\n"
+"The commands share a single thread pool (which they use if given --threads),\n"
+"and barcode files used by several decode commands are only read once.\n"
+"Commands should write to named files rather than to stdout. A command which\n"
+"fails with a fatal error stops the whole batch.\n"
+"\n"
+"Options:\n"
+"  -t   --threads                       size of the shared thread pool\n"
+"                                       [default: number of processors]\n"
+"  -j   --jobs                          number of commands to run at once\n"
+"                                       [default: same as --threads]\n"
+"  -v   --verbose                       report each command as it starts and finishes\n"
+"\n"
+"<manifest> of '-' reads the commands from STDIN\n"
+);
+}
+
+/*
+ * Takes the command line options and turns them into something we can understand
+ */
+static opts_t* parse_args(int argc, char *argv[])
+{
+    if (argc == 1) { usage(stdout); return NULL; }
+
+    const char* optstring = "t:j:v";
+
+    static const struct option lopts[] = {
+        { "threads",                    1, 0, 't' },
+        { "jobs",                       1, 0, 'j' },
+        { "verbose",                    0, 0, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    opts_t* opts = calloc(sizeof(opts_t), 1);
+    if (!opts) { perror("cannot allocate option parsing memory"); return NULL; }
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, optstring, lopts, &option_index)) != -1) {
+        switch (opt) {
+        case 't':   opts->nthreads = atoi(optarg);
+                    break;
+        case 'j':   opts->njobs = atoi(optarg);
+                    break;
+        case 'v':   opts->verbose = true;
+                    break;
+        default:    printf("Unknown option: '%c'\n", opt);
+            /* else fall-through */
+        case '?':   usage(stdout); free_opts(opts); return NULL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 0) opts->manifest = strdup(argv[0]);
+    optind = 0;
+
+    // some validation and tidying
+    if (!opts->manifest) {
+        fprintf(stderr, "You must specify a manifest file\n");
+        usage(stderr); free_opts(opts);
+        return NULL;
+    }
+
+    if (opts->nthreads < 1) opts->nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts->nthreads < 1) opts->nthreads = 1;
+    if (opts->njobs < 1) opts->njobs = opts->nthreads;
+
+    return opts;
+}
+
+/*
+ * Split a manifest line into words, allowing for quotes.
+ * Returns an argv array, with "bambi" as the first entry.
+ */
+static char **split_line(char *line, int *argc, int lineno)
+{
+    int max = 16;
+    char **argv = calloc(max, sizeof(char *));
+    char *word = calloc(1, strlen(line) + 1);
+    if (!argv || !word) die("Out of memory");
+
+    argv[0] = strdup("bambi");
+    *argc = 1;
+
+    char *p = line;
+    while (1) {
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p) break;
+
+        int len = 0;
+        char quote = 0;
+        while (*p && (quote || !isspace((unsigned char)*p))) {
+            if (quote && *p == quote)               quote = 0;
+            else if (!quote && (*p == '"' || *p == '\'')) quote = *p;
+            else                                    word[len++] = *p;
+            p++;
+        }
+        if (quote) die("Unterminated quote in manifest at line %d\n", lineno);
+        word[len] = 0;
+
+        if (*argc + 1 >= max) {
+            max *= 2;
+            argv = realloc(argv, max * sizeof(char *));
+            if (!argv) die("Out of memory");
+        }
+        argv[(*argc)++] = strdup(word);
+    }
+
+    argv[*argc] = NULL;
+    free(word);
+    return argv;
+}
+
+/*
+ * Read the manifest into an array of jobs
+ */
+static va_t *loadManifest(char *fname)
+{
+    FILE *f = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open manifest file %s\n", fname);
+        return NULL;
+    }
+
+    va_t *jobs = va_init(100, free_job);
+    char *buf = smalloc(MANIFEST_LINE_LEN);
+    int lineno = 0;
+    bool ok = true;
+
+    while (fgets(buf, MANIFEST_LINE_LEN, f)) {
+        lineno++;
+        char *p = buf;
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p || *p == '#') continue;
+        if (p[strlen(p)-1] == '\n') p[strlen(p)-1] = 0;
+
+        batch_job_t *job = calloc(1, sizeof(batch_job_t));
+        if (!job) die("Out of memory");
+        job->lineno = lineno;
+        job->cmdline = strdup(p);
+        job->argv = split_line(p, &job->argc, lineno);
+        job->func = bambi_find_command(job->argv[1]);
+        va_push(jobs, job);
+
+        if (!job->func || strcmp(job->argv[1], "batch") == 0) {
+            fprintf(stderr, "Unknown command at line %d: %s\n", lineno, job->argv[1]);
+            ok = false;
+        }
+    }
+
+    free(buf);
+    if (f != stdin) fclose(f);
+    if (!ok) { va_free(jobs); return NULL; }
+    return jobs;
+}
+
+/*
+ * Worker thread: keep taking the next command from the queue and running it
+ */
+static void *batch_worker(void *arg)
+{
+    batch_queue_t *q = (batch_queue_t *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        batch_job_t *job = q->next < q->jobs->end ? q->jobs->entries[q->next++] : NULL;
+        pthread_mutex_unlock(&q->lock);
+        if (!job) break;
+
+        if (q->verbose) display("Starting line %d: %s\n", job->lineno, job->cmdline);
+
+        // the command releases the lock when it has parsed its arguments
+        batch_args_lock();
+        optind = 0;
+        job->result = job->func(job->argc - 1, job->argv + 1);
+        batch_args_parsed();
+
+        if (q->verbose) display("Finished line %d: %s (%s)\n", job->lineno, job->argv[1],
+                                job->result ? "failed" : "OK");
+    }
+
+    return NULL;
+}
+
+/*
+ * Main code
+ */
+static int batch(opts_t *opts)
+{
+    int retcode = 0;
+    batch_queue_t q;
+
+    va_t *jobs = loadManifest(opts->manifest);
+    if (!jobs) return 1;
+
+    if (opts->njobs > jobs->end) opts->njobs = jobs->end;
+    if (opts->verbose) display("Running %d commands, %d at a time, with %d threads\n",
+                               jobs->end, opts->njobs, opts->nthreads);
+
+    q.jobs = jobs;
+    q.next = 0;
+    q.verbose = opts->verbose;
+    pthread_mutex_init(&q.lock, NULL);
+
+    batch_start(opts->nthreads);
+
+    pthread_t *workers = calloc(opts->njobs, sizeof(pthread_t));
+    if (!workers && opts->njobs) die("Out of memory");
+    for (int n = 0; n < opts->njobs; n++) {
+        if (pthread_create(&workers[n], NULL, batch_worker, &q) != 0) die("Can't create batch thread\n");
+    }
+    for (int n = 0; n < opts->njobs; n++) pthread_join(workers[n], NULL);
+
+    batch_end();
+
+    for (int n = 0; n < jobs->end; n++) {
+        batch_job_t *job = jobs->entries[n];
+        if (job->result) {
+            fprintf(stderr, "Command at line %d failed: %s\n", job->lineno, job->cmdline);
+            retcode = 1;
+        }
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&q.lock);
+    va_free(jobs);
+    return retcode;
+}
+
+/*
+ * called from bambi to run a batch of commands
+ *
+ * Parse the command line arguments, then call the main batch function
+ *
+ * returns 0 if all the commands succeeded, 1 if there was a problem
+ */
+int main_batch(int argc, char *argv[])
+{
+    int ret = 1;
+    opts_t* opts = parse_args(argc, argv);
+    if (opts) ret = batch(opts);
+    free_opts(opts);
+    return ret;
+}
+
@@ -0,0 +1,135 @@
+/*  batch_shared.c -- state shared by commands run together in a batch
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "batch_shared.h"
+
+typedef struct cache_entry_t {
+    char *key;
+    void *data;
+    void (*free_fn)(void *);
+    struct cache_entry_t *next;
+} cache_entry_t;
+
+static bool running = false;
+static hts_tpool *shared_pool = NULL;
+
+static pthread_mutex_t args_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool have_args_lock = false;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t *cache = NULL;
+
+/*
+ * Start a batch, with a shared pool of nthreads threads (or no shared
+ * pool if nthreads < 1)
+ */
+void batch_start(int nthreads)
+{
+    if (nthreads > 0) {
+        shared_pool = hts_tpool_init(nthreads);
+        if (!shared_pool) {
+            fprintf(stderr, "Couldn't set up thread pool\n");
+            exit(1);
+        }
+    }
+    running = true;
+}
+
+void batch_end(void)
+{
+    while (cache) {
+        cache_entry_t *e = cache;
+        cache = e->next;
+        if (e->free_fn) e->free_fn(e->data);
+        free(e->key);
+        free(e);
+    }
+    if (shared_pool) hts_tpool_destroy(shared_pool);
+    shared_pool = NULL;
+    running = false;
+}
+
+bool batch_running(void)
+{
+    return running;
+}
+
+hts_tpool *batch_tpool_init(int nthreads)
+{
+    if (shared_pool) return shared_pool;
+    return hts_tpool_init(nthreads);
+}
+
+void batch_tpool_destroy(hts_tpool *p)
+{
+    if (p && p != shared_pool) hts_tpool_destroy(p);
+}
+
+void batch_args_lock(void)
+{
+    pthread_mutex_lock(&args_lock);
+    have_args_lock = true;
+}
+
+void batch_args_parsed(void)
+{
+    if (!have_args_lock) return;
+    have_args_lock = false;
+    pthread_mutex_unlock(&args_lock);
+}
+
+void *batch_cache_get(const char *key, void *(*load)(void *arg), void *arg, void (*free_fn)(void *))
+{
+    cache_entry_t *e;
+    void *data = NULL;
+
+    if (!running) return NULL;
+
+    // Objects are only loaded once, so we hold the lock while loading
+    pthread_mutex_lock(&cache_lock);
+    for (e = cache; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) break;
+    }
+    if (e) {
+        data = e->data;
+    } else {
+        data = load(arg);
+        if (data) {
+            e = calloc(1, sizeof(cache_entry_t));
+            if (!e || !(e->key = strdup(key))) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            e->data = data;
+            e->free_fn = free_fn;
+            e->next = cache;
+            cache = e;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return data;
+}
+
@@ -0,0 +1,62 @@
+/*  batch_shared.h -- state shared by commands run together in a batch
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __BATCH_SHARED_H__
+#define __BATCH_SHARED_H__
+
+#include <stdbool.h>
+#include "htslib/thread_pool.h"
+
+/*
+ * 'bambi batch' runs several commands at once in one process. These
+ * functions let the commands share a thread pool and loaded data while
+ * they do. Outside of a batch they behave as if each command was on its
+ * own, so commands can call them unconditionally.
+ */
+
+// set up and tear down the shared state (used by 'bambi batch')
+void batch_start(int nthreads);
+void batch_end(void);
+bool batch_running(void);
+
+// A thread pool for a command: the shared pool in a batch, otherwise a new one
+hts_tpool *batch_tpool_init(int nthreads);
+void batch_tpool_destroy(hts_tpool *p);
+
+/*
+ * getopt() is not thread safe, so commands in a batch parse their
+ * arguments one at a time. The batch takes the lock before starting a
+ * command, and the command calls batch_args_parsed() as soon as it has
+ * finished parsing its arguments.
+ */
+void batch_args_lock(void);
+void batch_args_parsed(void);
+
+/*
+ * Return the object cached under key, calling load(arg) to create it if
+ * this is the first time it is asked for. The object belongs to the
+ * cache and is freed with free_fn at the end of the batch, so it must
+ * not be changed by the caller. Returns NULL if load() fails, or if no
+ * batch is running.
+ */
+void *batch_cache_get(const char *key, void *(*load)(void *arg), void *arg, void (*free_fn)(void *));
+
+#endif
+
@@ -34,6 +34,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "bclfile.h"
 #include "bambi_utils.h"
+#include "archive.h"
 
 // posix_fadvise control for NovaSeq
 // bit 0 set => Tell the filesystem which tile we want next
@@ -115,7 +116,7 @@ static bclfile_t *_bclfile_open_miseq(char *fname)
     bclfile_t *bcl = bclfile_init();
     bcl->filename = strdup(fname);
 
-    bcl->fhandle = fopen(fname, "rb");
+    bcl->fhandle = archive_fopen(fname);
     if (bcl->fhandle == NULL) { store_msg(&bcl->errmsg, "Can't open BCL file %s\n", fname); return bcl; }
 
     r = fread(&bcl->total_clusters, 1, 4, bcl->fhandle);
@@ -147,7 +148,11 @@ static bclfile_t *_bclfile_open_hiseqx(char *fname)
     int r;
     bclfile_t *bcl = bclfile_init();
 
-    bcl->gzhandle = gzopen(fname, "r");
+    int fd = archive_open_fd(fname);
+    if (fd >= 0) {
+        bcl->gzhandle = gzdopen(fd, "r");
+        if (!bcl->gzhandle) close(fd);
+    }
     if (!bcl->gzhandle) { store_msg(&bcl->errmsg, "Can't open BCL file %s\n", fname); return bcl; }
 
     r = gzread(bcl->gzhandle, (void *)&bcl->total_clusters, 4);
@@ -206,7 +211,7 @@ static bclfile_t *_bclfile_open_novaseq(char *fname, int tile)
     const uint32_t tiles_in_buffer = sizeof(buffer) / (4 * 4);
     bclfile_t *bcl = bclfile_init();
 
-    bcl->fhandle = fopen(fname, "rb");
+    bcl->fhandle = archive_fopen(fname);
     if (bcl->fhandle == NULL) {
         store_msg(&bcl->errmsg,"Can't open BCL file %s\n", fname);
         return bcl;
@@ -32,14 +32,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <time.h>
 #include <fcntl.h>
 
+#include <htslib/khash.h>
+
 #include "array.h"
 #include "bamit.h"
 #include "parse.h"
+#include "batch_shared.h"
 
 char *strptime(const char *s, const char *format, struct tm *tm);
 
 static void freeRecord(void *r) { bam_destroy1((bam1_t *)r); }
 
+KHASH_SET_INIT_STR(qnames)
+
 /*
  * structure to hold options
  */
@@ -55,6 +60,7 @@ typedef struct {
     char *input_fmt;
     bool exclude_unaligned;
     bool invert;
+    bool use_index;
 } opts_t;
 
 /*
@@ -97,6 +103,14 @@ static void usage(FILE *write_to)
 "  -s   --subset                Reference sequences to target. [Default 'Y,MT']\n"
 "  -u   --exclude-unaligned     Exclude read groups where all reads are unaligned\n"
 "  -V   --invert                Treat the -s option as a list to exclude rather than target\n"
+"  -x   --use-index             Input is coordinate sorted and indexed. Only read the target\n"
+"                               reference sequences (and unplaced reads), deciding where a\n"
+"                               pair belongs from each read's mate fields and SA tag. The\n"
+"                               exclude file is optional, and needs a full pass of the input.\n"
+"                               Secondary alignments aren't listed in either, so the other\n"
+"                               reference sequences are also read, looking only for secondary\n"
+"                               alignments. The output is the same as without --use-index.\n"
+"                               Can't be used with --invert.\n"
 "  -v   --verbose               verbose output\n"
 "       --input-fmt             [sam/bam/cram] [default: bam]\n"
 "       --output-fmt            [sam/bam/cram] [default: bam]\n"
@@ -111,7 +125,7 @@ opts_t* chrsplit_parse_args(int argc, char *argv[])
 {
     if (argc == 1) { usage(stdout); return NULL; }
 
-    const char* optstring = "vi:o:n:e:s:Vu";
+    const char* optstring = "vi:o:n:e:s:Vux";
 
     static const struct option lopts[] = {
         { "verbose",            0, 0, 'v' },
@@ -121,6 +135,7 @@ opts_t* chrsplit_parse_args(int argc, char *argv[])
         { "subset",             1, 0, 's' },
         { "exclude-unaligned",  0, 0, 'u' },
         { "invert",             0, 0, 'V' },
+        { "use-index",          0, 0, 'x' },
         { "compression-level",  1, 0, 0 },
         { "input-fmt",          1, 0, 0 },
         { "output-fmt",         1, 0, 0 },
@@ -154,6 +169,8 @@ opts_t* chrsplit_parse_args(int argc, char *argv[])
                     break;
         case 'V':   opts->invert = true;
                     break;
+        case 'x':   opts->use_index = true;
+                    break;
         case 0:     arg = lopts[option_index].name;
                          if (strcmp(arg, "output-fmt") == 0)              opts->output_fmt = strdup(optarg);
                     else if (strcmp(arg, "input-fmt") == 0)               opts->input_fmt = strdup(optarg);
@@ -185,11 +202,16 @@ opts_t* chrsplit_parse_args(int argc, char *argv[])
         usage(stderr); return NULL;
     }
 
-    if (!opts->exclude_file) {
+    if (!opts->exclude_file && !opts->use_index) {
         fprintf(stderr,"You must specify an exclude file\n");
         usage(stderr); return NULL;
     }
 
+    if (opts->use_index && opts->invert) {
+        fprintf(stderr,"--use-index can't be used with --invert\n");
+        usage(stderr); return NULL;
+    }
+
     if (opts->compression_level && !isdigit(opts->compression_level)) {
         fprintf(stderr, "compression-level must be a digit in the range [0..9], not '%c'\n", opts->compression_level);
         usage(stderr); return NULL;
@@ -348,6 +370,208 @@ static int processFiles(BAMit_t *in_bam, BAMit_t *target_bam, BAMit_t *exclude_b
     return 0;
 }
 
+/*
+ * With --use-index, decide from one record whether any part of its template
+ * belongs in the exclude file. Only the record itself, its mate fields and
+ * its SA tag can be checked, as the rest of the template is not read.
+ * Secondary alignments aren't listed in either, so findSecondaries() looks
+ * for those.
+ */
+static bool excludedByRecord(bam1_t *rec, bam_hdr_t *h, bool *target_tid, opts_t *opts)
+{
+    if (rec->core.flag & BAM_FUNMAP) {
+        if (opts->exclude_unaligned) return true;
+    } else {
+        if (rec->core.tid < 0 || !target_tid[rec->core.tid]) return true;
+    }
+
+    if (rec->core.flag & BAM_FPAIRED) {
+        if (rec->core.flag & BAM_FMUNMAP) {
+            if (opts->exclude_unaligned) return true;
+        } else {
+            if (rec->core.mtid < 0 || !target_tid[rec->core.mtid]) return true;
+        }
+    }
+
+    // supplementary alignments are listed as "rname,pos,strand,CIGAR,mapQ,NM;"
+    uint8_t *sa = bam_aux_get(rec, "SA");
+    if (sa) {
+        char *p = bam_aux2Z(sa);
+        while (p && *p) {
+            char *comma = strchr(p, ',');
+            if (!comma) break;
+            *comma = 0;
+            int tid = sam_hdr_name2tid(h, p);
+            *comma = ',';
+            if (tid < 0 || !target_tid[tid]) return true;
+            p = strchr(comma, ';');
+            if (p) p++;
+        }
+    }
+
+    return false;
+}
+
+static void addQname(khash_t(qnames) *set, bam1_t *rec)
+{
+    int absent;
+    khint_t k = kh_get(qnames, set, bam_get_qname(rec));
+    if (k != kh_end(set)) return;
+    char *qname = strdup(bam_get_qname(rec));
+    if (!qname) die("Out of memory");
+    kh_put(qnames, set, qname, &absent);
+}
+
+static bool hasQname(khash_t(qnames) *set, bam1_t *rec)
+{
+    return kh_get(qnames, set, bam_get_qname(rec)) != kh_end(set);
+}
+
+static void freeQnames(khash_t(qnames) *set)
+{
+    for (khint_t k = kh_begin(set); k != kh_end(set); k++) {
+        if (kh_exist(set, k)) free((char *)kh_key(set, k));
+    }
+    kh_destroy(qnames, set);
+}
+
+/*
+ * Read the target reference sequences (in header order, so the output stays
+ * sorted) and then the unplaced reads, calling fn for each record
+ */
+static void fetchTargets(samFile *f, bam_hdr_t *h, hts_idx_t *idx, bool *target_tid, opts_t *opts,
+                         void (*fn)(bam1_t *rec, void *arg), void *arg)
+{
+    bam1_t *rec = bam_init1();
+    int r;
+
+    for (int tid = 0; tid <= h->n_targets; tid++) {
+        hts_itr_t *iter;
+        if (tid < h->n_targets) {
+            if (!target_tid[tid]) continue;
+            iter = sam_itr_queryi(idx, tid, 0, HTS_POS_MAX);
+        } else {
+            // unplaced reads can only go to the target file if both reads are unaligned
+            if (opts->exclude_unaligned) break;
+            iter = sam_itr_queryi(idx, HTS_IDX_NOCOOR, 0, 0);
+        }
+        if (!iter) die("Can't query index of %s\n", opts->in_file);
+
+        while ((r = sam_itr_next(f, iter, rec)) >= 0) fn(rec, arg);
+        if (r < -1) die("Problem reading %s\n", opts->in_file);
+        hts_itr_destroy(iter);
+    }
+
+    bam_destroy1(rec);
+}
+
+/*
+ * Add the templates with a secondary alignment on any other reference sequence
+ * to the excluded set. Their other records are placed by the mate fields and
+ * SA tags checked by excludedByRecord().
+ */
+static void findSecondaries(samFile *f, bam_hdr_t *h, hts_idx_t *idx, bool *target_tid, opts_t *opts,
+                            khash_t(qnames) *excluded)
+{
+    bam1_t *rec = bam_init1();
+    int r;
+
+    for (int tid = 0; tid < h->n_targets; tid++) {
+        if (target_tid[tid]) continue;
+        hts_itr_t *iter = sam_itr_queryi(idx, tid, 0, HTS_POS_MAX);
+        if (!iter) die("Can't query index of %s\n", opts->in_file);
+        while ((r = sam_itr_next(f, iter, rec)) >= 0) {
+            if (rec->core.flag & BAM_FSECONDARY) addQname(excluded, rec);
+        }
+        if (r < -1) die("Problem reading %s\n", opts->in_file);
+        hts_itr_destroy(iter);
+    }
+
+    bam_destroy1(rec);
+}
+
+typedef struct {
+    bam_hdr_t *h;
+    bool *target_tid;
+    opts_t *opts;
+    khash_t(qnames) *excluded;
+    BAMit_t *target_bam;
+} index_state_t;
+
+/*
+ * true if fetchTargets() reads this record
+ */
+static bool fetched(bam1_t *rec, bool *target_tid, opts_t *opts)
+{
+    if (rec->core.tid >= 0) return target_tid[rec->core.tid];
+    return !opts->exclude_unaligned;
+}
+
+static void findExcluded(bam1_t *rec, void *arg)
+{
+    index_state_t *s = (index_state_t *)arg;
+    if (excludedByRecord(rec, s->h, s->target_tid, s->opts)) addQname(s->excluded, rec);
+}
+
+static void writeTarget(bam1_t *rec, void *arg)
+{
+    index_state_t *s = (index_state_t *)arg;
+    if (hasQname(s->excluded, rec)) return;
+    if (sam_write1(s->target_bam->f, s->target_bam->h, rec) < 0) die("Problem writing target record\n");
+}
+
+/*
+ * Use the index to write only the target file, and then (if asked for)
+ * make a full pass to write everything else to the exclude file
+ */
+static int processIndexed(samFile *f, bam_hdr_t *h, hts_idx_t *idx, BAMit_t *target_bam, BAMit_t *exclude_bam, opts_t *opts)
+{
+    index_state_t s;
+    bool *target_tid = calloc(h->n_targets ? h->n_targets : 1, sizeof(bool));
+    if (!target_tid) die("Out of memory");
+
+    for (int n = 0; n < opts->subset->end; n++) {
+        int tid = sam_hdr_name2tid(h, opts->subset->entries[n]);
+        if (tid >= 0) target_tid[tid] = true;
+    }
+
+    s.h = h;
+    s.target_tid = target_tid;
+    s.opts = opts;
+    s.excluded = kh_init(qnames);
+    s.target_bam = target_bam;
+
+    addPGLine(target_bam,opts,"TARGET");
+    if (sam_hdr_write(target_bam->f, target_bam->h)) { fprintf(stderr,"Failed to write target header\n"); exit(1); }
+
+    // first find the templates with a record outside the targets, then write the others
+    fetchTargets(f, h, idx, target_tid, opts, findExcluded, &s);
+    findSecondaries(f, h, idx, target_tid, opts, s.excluded);
+    fetchTargets(f, h, idx, target_tid, opts, writeTarget, &s);
+
+    if (exclude_bam) {
+        addPGLine(exclude_bam,opts,"EXCLUDED");
+        if (sam_hdr_write(exclude_bam->f, exclude_bam->h)) { fprintf(stderr,"Failed to write exclude header\n"); exit(1); }
+
+        hts_itr_t *iter = sam_itr_queryi(idx, HTS_IDX_START, 0, 0);
+        if (!iter) die("Can't query index of %s\n", opts->in_file);
+        bam1_t *rec = bam_init1();
+        int r;
+        while ((r = sam_itr_next(f, iter, rec)) >= 0) {
+            // everything not written to the target file
+            if (fetched(rec, target_tid, opts) && !hasQname(s.excluded, rec)) continue;
+            if (sam_write1(exclude_bam->f, exclude_bam->h, rec) < 0) die("Problem writing exclude record\n");
+        }
+        if (r < -1) die("Problem reading %s\n", opts->in_file);
+        bam_destroy1(rec);
+        hts_itr_destroy(iter);
+    }
+
+    freeQnames(s.excluded);
+    free(target_tid);
+    return 0;
+}
+
 /*
  * Main code
  *
@@ -366,6 +590,33 @@ static int chrsplit(opts_t* opts)
 
     f = openSamFile(opts->in_file, opts->input_fmt, opts->compression_level, 'r');
     h = sam_hdr_read(f);
+
+    if (opts->use_index) {
+        hts_idx_t *idx = sam_index_load(f, opts->in_file);
+        if (!idx) {
+            fprintf(stderr,"Can't load index for %s\n", opts->in_file);
+            bam_hdr_destroy(h); hts_close(f);
+            return 1;
+        }
+
+        samFile *in = f;
+        f = openSamFile(opts->target_file, opts->output_fmt, opts->compression_level, 'w');
+        target_bam = BAMit_init(f,bam_hdr_dup(h));
+        if (opts->exclude_file) {
+            f = openSamFile(opts->exclude_file, opts->output_fmt, opts->compression_level, 'w');
+            exclude_bam = BAMit_init(f,bam_hdr_dup(h));
+        }
+
+        retcode = processIndexed(in, h, idx, target_bam, exclude_bam, opts);
+
+        hts_idx_destroy(idx);
+        bam_hdr_destroy(h);
+        hts_close(in);
+        BAMit_free(target_bam);
+        BAMit_free(exclude_bam);
+        return retcode;
+    }
+
     in_bam = BAMit_init(f,h);
 
     f = openSamFile(opts->target_file, opts->output_fmt, opts->compression_level, 'w');
@@ -397,6 +648,7 @@ int main_chrsplit(int argc, char *argv[])
 {
     int ret = 1;
     opts_t* opts = chrsplit_parse_args(argc, argv);
+    batch_args_parsed();
     if (opts) ret = chrsplit(opts);
     free_opts(opts);
     return ret;
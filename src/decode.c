@@ -42,6 +42,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bamit.h"
 #include "hash_table.h"
 #include "seqchksum.h"
+#include "batch_shared.h"
+#include "libbambi.h"
+#include "whitelist.h"
 
 #define xstr(s) str(s)
 #define str(s) #s
@@ -52,8 +55,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define DEFAULT_MIN_MISMATCH_DELTA 1
 #define DEFAULT_BARCODE_TAG "BC"
 #define DEFAULT_QUALITY_TAG "QT"
+#define DEFAULT_ASSIGN_TAG "CB"
 #define TEMPLATES_PER_JOB 5000
 
+JOB_SIZE(decode_templates_per_job, TEMPLATES_PER_JOB)
+TEST_RECORD(decode_io_reserved)     // BAM files were read and written by the --io-threads pool
+
 // Size of stack allocations to use for storing barcodes.  If too small, malloc will be used instead.
 // Ideally this should be bigger than the longest barcode expected.
 #ifndef STACK_BC_LEN
@@ -67,6 +74,13 @@ static inline void hputi(int n, hFILE *f)
     hputs(b,f);
 }
 
+/*
+ * Metrics counts for one barcode
+ */
+typedef struct {
+    uint64_t reads, pf_reads, perfect, pf_perfect, one_mismatch, pf_one_mismatch;
+} bc_counts_t;
+
 enum match {
     MATCHED_NONE,
     MATCHED_FIRST,
@@ -84,6 +98,10 @@ struct decode_opts_t {
     char *output_name;
     char *barcode_name;
     char *metrics_name;
+    char *partial_metrics_name;
+    bool merge_metrics;
+    va_t *partials;
+    bool metrics_only;
     char *chksum_name;
     HASH_TYPE hash;
     char *barcode_tag_name;
@@ -100,9 +118,14 @@ struct decode_opts_t {
     char *output_fmt;
     char compression_level;
     int nthreads;
+    int io_threads;
     int idx1_len, idx2_len;
     bool ignore_pf;
     unsigned short dual_tag;
+    char *whitelist_name;
+    char *assign_tag_name;
+    whitelist_t *whitelist;     // set up by decode()
+    bc_counts_t *wl_counts;     // one for each whitelist barcode
 };
 
 decode_opts_t *decode_init_opts(int argc, char **argv)
@@ -142,6 +165,11 @@ void decode_free_opts(decode_opts_t *opts)
     free(opts->input_fmt);
     free(opts->output_fmt);
     free(opts->metrics_name);
+    free(opts->partial_metrics_name);
+    free(opts->whitelist_name);
+    free(opts->assign_tag_name);
+    free(opts->wl_counts);
+    va_free(opts->partials);
     free(opts);
 }
 
@@ -158,19 +186,23 @@ typedef struct {
     uint64_t reads, pf_reads, perfect, pf_perfect, one_mismatch, pf_one_mismatch;
 } bc_details_t;
 
-// Data for thread pool jobs
-typedef struct decode_thread_data_t {
-    va_t *record_set;                   // records to process
-    ia_t *template_counts;              // records in each template
-    va_t *barcode_array;                // job-local copy of barcodes array
-    bc_details_t *barcodes;             // memory for job-local barcodes
-    HashTable *tagHopHash;              // job-local tag hops hash
-    HashTable *barcodeHash;             // pointer to shared barcodeHash
-    decode_opts_t *opts;                       // pointer to shared opts
-    int nrec;                           // number of live records in record_set
-    int result;                         // job result, 0 = success
-    struct decode_thread_data_t *next;  // for free list
-} decode_thread_data_t;
+/*
+ * Metrics counts for one job. Barcodes are counted in a flat array, indexed
+ * by their position in the barcode array, and tag hops by the pair of
+ * barcodes which matched the first and second index. Whitelist barcodes are
+ * counted by their position in the whitelist, only for those a job sees.
+ * The counts are added into the barcode array, tag hops hash and whitelist
+ * counts when the job is finished with.
+ */
+KHASH_MAP_INIT_INT64(taghop, bc_counts_t)
+KHASH_MAP_INIT_INT(wlcount, bc_counts_t)
+
+struct decode_metrics_t {
+    int nbarcodes;
+    bc_counts_t *counts;
+    khash_t(taghop) *hops;
+    khash_t(wlcount) *wl;
+};
 
 static bc_details_t *bcd_init(void)
 {
@@ -286,7 +318,6 @@ static void sortTagHops(va_t *tagHopArray) {
     qsort(tagHopArray->entries, tagHopArray->end, sizeof(bc_details_t*), compareTagHops);
 }
 
-static void freeRecord(void *r) { bam_destroy1((bam1_t *)r); }
 
 /*
  * display usage information
@@ -300,6 +331,12 @@ static void usage(FILE *write_to)
 "  -o   --output                        output file [default: stdout]\n"
 "  -v   --verbose                       verbose output\n"
 "  -b   --barcode-file                  file containing barcodes\n"
+"       --whitelist                     file containing a whitelist of barcodes, one a line, instead of\n"
+"                                       a barcode file. There can be millions of them. Reads are given\n"
+"                                       the matching barcode in the --assign-tag tag, with no new RG\n"
+"                                       lines, and the metrics only list the barcodes that were seen.\n"
+"                                       At most one mismatch is allowed.\n"
+"       --assign-tag                    tag to hold the whitelist barcode [default: " DEFAULT_ASSIGN_TAG "]\n"
 "       --convert-low-quality           Convert low quality bases in barcode read to 'N'\n"
 "       --max-low-quality-to-convert    Max low quality phred value to convert bases in barcode\n"
 "                                       read to 'N' [default: " xstr(DEFAULT_MAX_LOW_QUALITY_TO_CONVERT) "]\n"
@@ -312,14 +349,24 @@ static void usage(FILE *write_to)
 "                                       match [default: " xstr(DEFAULT_MIN_MISMATCH_DELTA) "]\n"
 "       --change-read-name              Change the read name by adding #<barcode> suffix\n"
 "       --metrics-file                  Per-barcode and per-lane metrics written to this file\n"
+"       --partial-metrics               Write the raw metrics counts to this file, to be combined\n"
+"                                       later with --merge-metrics\n"
+"       --merge-metrics                 Don't decode: add up the partial metrics files given instead\n"
+"                                       of an input file, and write the metrics to --metrics-file.\n"
+"                                       The result is the same as decoding all the input in one go.\n"
+"       --metrics-only                  Only match the barcodes and write the metrics: don't write an output\n"
+"                                       file. Only the read names, flags and tags are read from the input.\n"
 "       --seqchksum-file                Chksums for the output file will be written here\n"
-"       --hash                          Hashing algorithm to use for chksums [default: crc32prod]\n"
+"       --hash                          Hashing algorithm to use for chksums: crc32 or crc32prod\n"
+"                                       [default: crc32prod]\n"
 "       --barcode-tag-name              Barcode tag name [default: " DEFAULT_BARCODE_TAG "]\n"
 "       --quality-tag-name              Quality tag name [default: " DEFAULT_QUALITY_TAG "]\n"
 "       --input-fmt                     format of input file [sam/bam/cram]\n"
 "       --output-fmt                    format of output file [sam/bam/cram]\n"
 "       --compression-level             Compression level of output file [0..9]\n"
 "  -t   --threads                       number of threads to use [default: 1]\n"
+"       --io-threads                    number of extra threads to reserve for reading and writing BAM\n"
+"                                       files. If 0, they share the --threads pool. [default: 0]\n"
 "       --ignore-pf                     Doesn't output PF statistics\n"
 "       --dual-tag                      Dual tag position in the barcode string (between 2 and barcode length - 1)\n"
 );
@@ -414,6 +461,12 @@ static decode_opts_t* parse_args(int argc, char *argv[])
         { "ignore-pf",                  0, 0, 0 },
         { "dual-tag",                   1, 0, 0 },
         { "threads",                    1, 0, 't' },
+        { "io-threads",                 1, 0, 0 },
+        { "partial-metrics",            1, 0, 0 },
+        { "merge-metrics",              0, 0, 0 },
+        { "metrics-only",               0, 0, 0 },
+        { "whitelist",                  1, 0, 0 },
+        { "assign-tag",                 1, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -449,6 +502,12 @@ static decode_opts_t* parse_args(int argc, char *argv[])
                     else if (strcmp(arg, "output-fmt") == 0)                 opts->output_fmt = strdup(optarg);
                     else if (strcmp(arg, "compression-level") == 0)          opts->compression_level = *optarg;
                     else if (strcmp(arg, "ignore-pf") == 0)                  opts->ignore_pf = true;
+                    else if (strcmp(arg, "io-threads") == 0)                 opts->io_threads = atoi(optarg);
+                    else if (strcmp(arg, "partial-metrics") == 0)            opts->partial_metrics_name = strdup(optarg);
+                    else if (strcmp(arg, "merge-metrics") == 0)              opts->merge_metrics = true;
+                    else if (strcmp(arg, "metrics-only") == 0)               opts->metrics_only = true;
+                    else if (strcmp(arg, "whitelist") == 0)                  opts->whitelist_name = strdup(optarg);
+                    else if (strcmp(arg, "assign-tag") == 0)                 opts->assign_tag_name = strdup(optarg);
                     else if (strcmp(arg, "dual-tag") == 0)                  {opts->dual_tag = (short)atoi(optarg);
                                                                              opts->max_no_calls = 0;}  
                     else {
@@ -466,21 +525,78 @@ static decode_opts_t* parse_args(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (argc > 0) opts->input_name = strdup(argv[0]);
+    if (opts->merge_metrics) {
+        opts->partials = va_init(5, free);
+        for (int n=0; n < argc; n++) va_push(opts->partials, strdup(argv[n]));
+    } else {
+        if (argc > 0) opts->input_name = strdup(argv[0]);
+    }
     optind = 0;
 
     // some validation and tidying
+    if (opts->merge_metrics) {
+        if (!opts->partials->end || !opts->metrics_name) {
+            fprintf(stderr,"--merge-metrics needs a --metrics-file and at least one partial metrics file\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+        return opts;
+    }
     if (!opts->input_name) {
         fprintf(stderr,"You must specify an input file (-i or --input)\n");
         usage(stderr); decode_free_opts(opts);
         return NULL;
     }
-    if (!opts->barcode_name) {
+    if (!opts->barcode_name && !opts->whitelist_name) {
         fprintf(stderr,"You must specify a barcode (tags) file (-b or --barcode-file)\n");
         usage(stderr); decode_free_opts(opts);
         return NULL;
     }
 
+    if (opts->whitelist_name) {
+        const char *err = NULL;
+        if (opts->barcode_name) err = "--whitelist can't be used with --barcode-file";
+        else if (opts->max_mismatches > 1) err = "--whitelist allows at most one mismatch (--max-mismatches 0 or 1)";
+        else if (opts->min_mismatch_delta != 1) err = "--whitelist needs --min-mismatch-delta 1";
+        else if (opts->max_no_calls > WHITELIST_MAX_NO_CALLS) err = "--whitelist allows at most " xstr(WHITELIST_MAX_NO_CALLS) " no-calls (--max-no-calls)";
+        else if (opts->dual_tag) err = "--whitelist can't be used with --dual-tag";
+        else if (opts->partial_metrics_name) err = "--whitelist can't be used with --partial-metrics";
+        if (err) {
+            fprintf(stderr,"%s\n", err);
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+        if (!opts->assign_tag_name) opts->assign_tag_name = strdup(DEFAULT_ASSIGN_TAG);
+        if (strlen(opts->assign_tag_name) != 2) {
+            fprintf(stderr,"--assign-tag must be a two character tag name\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+    } else if (opts->assign_tag_name) {
+        fprintf(stderr,"--assign-tag needs a --whitelist\n");
+        usage(stderr); decode_free_opts(opts);
+        return NULL;
+    }
+
+    if (opts->metrics_only) {
+        if (!opts->metrics_name && !opts->partial_metrics_name) {
+            fprintf(stderr,"--metrics-only needs a --metrics-file or --partial-metrics file\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+        if (opts->chksum_name) {
+            fprintf(stderr,"--seqchksum-file can't be used with --metrics-only\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+    }
+
+    if (opts->hash == HASH_UNKNOWN) {
+        fprintf(stderr,"Unknown --hash type\n");
+        usage(stderr); decode_free_opts(opts);
+        return NULL;
+    }
+
     if (!opts->barcode_tag_name) opts->barcode_tag_name = strdup(DEFAULT_BARCODE_TAG);
     if (!opts->quality_tag_name) opts->quality_tag_name = strdup(DEFAULT_QUALITY_TAG);
 
@@ -557,6 +673,59 @@ void writeMetricsLine(hFILE *f, bc_details_t *bcd, decode_opts_t *opts, uint64_t
 }
 
 
+/*
+ * Write the metrics for a whitelist: only the barcodes which were seen,
+ * in whitelist order, followed by the unmatched reads
+ */
+static int writeWhitelistMetrics(va_t *barcodeArray, decode_opts_t *opts)
+{
+    whitelist_t *wl = opts->whitelist;
+    bc_details_t *bcd = barcodeArray->entries[0];
+    uint64_t total_reads = bcd->reads;
+    uint64_t total_pf_reads = bcd->pf_reads;
+    uint64_t total_pf_reads_assigned = 0;
+    uint64_t max_reads = 0;
+    uint64_t max_pf_reads = 0;
+    uint64_t nReads = wl->nbarcodes;
+    int n;
+
+    hFILE *f = hopen(opts->metrics_name, "w");
+    if (!f) {
+        fprintf(stderr,"Can't open metrics file %s\n", opts->metrics_name);
+        return 1;
+    }
+
+    for (n=0; n < wl->nbarcodes; n++) {
+        bc_counts_t *c = &opts->wl_counts[n];
+        total_reads += c->reads;
+        total_pf_reads += c->pf_reads;
+        total_pf_reads_assigned += c->pf_reads;
+        if (max_reads < c->reads) max_reads = c->reads;
+        if (max_pf_reads < c->pf_reads) max_pf_reads = c->pf_reads;
+    }
+
+    print_header(f, opts, true);
+
+    char seq[WHITELIST_MAX_LEN+1];
+    bc_details_t line = { .seq = seq, .idx1 = seq, .idx2 = "", .name = seq, .lib = "", .sample = "", .desc = "" };
+    for (n=0; n < wl->nbarcodes; n++) {
+        bc_counts_t *c = &opts->wl_counts[n];
+        if (!c->reads) continue;
+        whitelist_seq(wl, n, seq);
+        line.reads = c->reads; line.pf_reads = c->pf_reads;
+        line.perfect = c->perfect; line.pf_perfect = c->pf_perfect;
+        line.one_mismatch = c->one_mismatch; line.pf_one_mismatch = c->pf_one_mismatch;
+        writeMetricsLine(f, &line, opts, total_reads, max_reads, total_pf_reads, max_pf_reads, total_pf_reads_assigned, nReads, true);
+    }
+    bcd->perfect = 0;
+    bcd->pf_perfect = 0;
+    bcd->name[0] = 0;
+    writeMetricsLine(f, bcd, opts, total_reads, max_reads, total_pf_reads, max_pf_reads, 0, nReads, true);
+
+    if (hclose(f)) die("Can't close metrics file");
+    return 0;
+}
+
 /*
  *
  */
@@ -573,6 +742,8 @@ int writeMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
     uint64_t nReads = 0;
     int n;
 
+    if (opts->whitelist) return writeWhitelistMetrics(barcodeArray, opts);
+
     // Open the metrics file
     hFILE *f = hopen(opts->metrics_name, "w");
     if (!f) {
@@ -701,6 +872,19 @@ static void split_index(char *seq, size_t seq_len, int dual_tag, char **idx1_ptr
     memcpy(*idx2_ptr, seq + idx2_start, idx2_len); (*idx2_ptr)[idx2_len] = '\0';
 }
 
+/*
+ * Set the sequence of the dummy entry 0, for unmatched reads, to all 'N'
+ */
+static void setNullBarcode(bc_details_t *bcd, int idx1_len, int idx2_len)
+{
+    bcd->idx1 = calloc(1,idx1_len+1); memset(bcd->idx1, 'N', idx1_len);
+    bcd->idx2 = calloc(1,idx2_len+1); memset(bcd->idx2, 'N', idx2_len);
+    bcd->seq = calloc(1,idx1_len+idx2_len+2);
+    strcpy(bcd->seq,bcd->idx1);
+    if (idx2_len) strcat(bcd->seq,INDEX_SEPARATOR);
+    strcat(bcd->seq,bcd->idx2);
+}
+
 /*
  * Read the barcode file into an array
  */
@@ -734,16 +918,16 @@ va_t *loadBarcodeFile(decode_opts_t *opts)
 
     while (hgets(buf, n, fh) > 0) {
         lineno++;
-        char *s;
+        char *s, *saveptr = NULL;
         if (buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1]=0;   // remove trailing lf
         bc_details_t *bcd = bcd_init();
-        s = strtok(buf,"\t");  if (!s) die("Can't read sequence from tag file: Line %d\n", lineno);
+        s = strtok_r(buf,"\t",&saveptr);  if (!s) die("Can't read sequence from tag file: Line %d\n", lineno);
         bcd->seq     = strdup(s);
-        s = strtok(NULL,"\t"); if (!s) die("Can't read name from tag file: Line %d\n", lineno);
+        s = strtok_r(NULL,"\t",&saveptr); if (!s) die("Can't read name from tag file: Line %d\n", lineno);
         bcd->name    = strdup(s);
-        s = strtok(NULL,"\t"); bcd->lib     = s ? strdup(s) : strdup("");
-        s = strtok(NULL,"\t"); bcd->sample  = s ? strdup(s) : strdup("");
-        s = strtok(NULL,"\t"); bcd->desc    = s ? strdup(s) : strdup("");
+        s = strtok_r(NULL,"\t",&saveptr); bcd->lib     = s ? strdup(s) : strdup("");
+        s = strtok_r(NULL,"\t",&saveptr); bcd->sample  = s ? strdup(s) : strdup("");
+        s = strtok_r(NULL,"\t",&saveptr); bcd->desc    = s ? strdup(s) : strdup("");
 
         split_index(bcd->seq, strlen(bcd->seq), opts->dual_tag, &bcd->idx1, &bcd->idx2, 0, 0);
 
@@ -762,18 +946,31 @@ va_t *loadBarcodeFile(decode_opts_t *opts)
 
     opts->idx1_len = idx1_len;
     opts->idx2_len = idx2_len;
-    bcd = barcodeArray->entries[0];
-    bcd->idx1 = calloc(1,idx1_len+1); memset(bcd->idx1, 'N', idx1_len);
-    bcd->idx2 = calloc(1,idx2_len+1); memset(bcd->idx2, 'N', idx2_len);
-    bcd->seq = calloc(1,idx1_len+idx2_len+2);
-    strcpy(bcd->seq,bcd->idx1);
-    if (idx2_len) strcat(bcd->seq,INDEX_SEPARATOR);
-    strcat(bcd->seq,bcd->idx2);
+    setNullBarcode(barcodeArray->entries[0], idx1_len, idx2_len);
 
     if (hclose(fh)) die("Can't close barcode file");
     return barcodeArray;
 }
 
+/*
+ * With a whitelist, the barcode array only holds the dummy entry 0
+ */
+static va_t *makeWhitelistBarcodeArray(decode_opts_t *opts)
+{
+    va_t *barcodeArray = va_init(1,free_bcd);
+    bc_details_t *bcd = bcd_init();
+    bcd->name   = strdup("0");
+    bcd->lib    = strdup("");
+    bcd->sample = strdup("");
+    bcd->desc   = strdup("");
+    setNullBarcode(bcd, opts->whitelist->len, 0);
+    va_push(barcodeArray,bcd);
+
+    opts->idx1_len = opts->whitelist->len;
+    opts->idx2_len = 0;
+    return barcodeArray;
+}
+
 /*
  * return true if base is a noCall
  */
@@ -811,12 +1008,53 @@ static int countMismatches(char *tag, char *barcode, int maxval)
     return n;
 }
 
+/*
+ * Count a read with n mismatches
+ */
+static void countRead(bc_counts_t *c, int n, bool isPf)
+{
+    c->reads++;
+    if (isPf) c->pf_reads++;
+
+    if (n==0) {     // count perfect matches
+        c->perfect++;
+        if (isPf) c->pf_perfect++;
+    }
+
+    if (n==1) {     // count out-by-one matches
+        c->one_mismatch++;
+        if (isPf) c->pf_one_mismatch++;
+    }
+}
+
+/*
+ * Update the metrics counts
+ */
+static void updateMetrics(bc_counts_t *c, char *bcseq, char *seq, bool isPf)
+{
+    int n = 99;
+    if (seq) n = countMismatches(bcseq, seq, 999);
+    countRead(c, n, isPf);
+}
+
+/*
+ * Make the tag hop key (first index, separator, second index) for two barcodes
+ * key must be at least idx1_len + idx2_len + 2 long
+ */
+static void make_tag_hop_key(char *key, bc_details_t *bc1, bc_details_t *bc2, decode_opts_t *opts)
+{
+    memcpy(key, bc1->idx1, opts->idx1_len);
+    memcpy(key + opts->idx1_len, INDEX_SEPARATOR, 1);
+    memcpy(key + opts->idx1_len + 1, bc2->idx2, opts->idx2_len);
+    key[opts->idx1_len + opts->idx2_len + 1] = '\0';
+}
+
 /*
  * For a failed match, check is there is tag hopping to report
  */
-static bc_details_t *check_tag_hopping(char *barcode, va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
+static void check_tag_hopping(char *barcode, va_t *barcodeArray, decode_metrics_t *metrics, decode_opts_t *opts, bool isPf, bool isUpdateMetrics)
 {
-    bc_details_t *bcd = NULL, *best_match1 = NULL, *best_match2 = NULL;
+    int best_match1 = 0, best_match2 = 0;
     char stack_idx1[STACK_BC_LEN], stack_idx2[STACK_BC_LEN];
     char *idx1 = stack_idx1, *idx2 = stack_idx2;
     int nmBest1 = opts->idx1_len + opts->idx2_len + 1;
@@ -834,13 +1072,13 @@ static bc_details_t *check_tag_hopping(char *barcode, va_t *barcodeArray, HashTa
         // match the first tag
         if (nMismatches1 < nmBest1) {
             nmBest1 = nMismatches1;
-            best_match1 = bcd;
+            best_match1 = n;
         }
 
         // match the second tag
         if (nMismatches2 < nmBest2) {
             nmBest2 = nMismatches2;
-            best_match2 = bcd;
+            best_match2 = n;
         }
     }
 
@@ -851,50 +1089,342 @@ static bc_details_t *check_tag_hopping(char *barcode, va_t *barcodeArray, HashTa
     bool matched_second = (nmBest2 == 0 );
 
     if (matched_first && matched_second) {
-        HashData hd;
-        HashItem *hi;
-        char stack_key[STACK_BC_LEN];
-        char *key = stack_key;
-
-        assert(best_match1 != NULL && best_match2 != NULL);
-        if (opts->idx1_len + opts->idx2_len + 2 >= sizeof(stack_key)) {
-            key = malloc(opts->idx1_len + opts->idx2_len + 2);
-            if (!key) die("Out of memory");
+        int absent;
+        assert(best_match1 && best_match2);
+        khint_t k = kh_put(taghop, metrics->hops, (uint64_t)best_match1 << 32 | best_match2, &absent);
+        if (absent < 0) die("Out of memory");
+        if (absent) memset(&kh_val(metrics->hops, k), 0, sizeof(bc_counts_t));
+        if (isUpdateMetrics) {
+            char stack_key[STACK_BC_LEN];
+            char *key = stack_key;
+            if (opts->idx1_len + opts->idx2_len + 2 >= sizeof(stack_key)) {
+                key = malloc(opts->idx1_len + opts->idx2_len + 2);
+                if (!key) die("Out of memory");
+            }
+            make_tag_hop_key(key, barcodeArray->entries[best_match1], barcodeArray->entries[best_match2], opts);
+            updateMetrics(&kh_val(metrics->hops, k), key, barcode, isPf);
+            if (key != stack_key) free(key);
         }
-        memcpy(key, best_match1->idx1, opts->idx1_len);
-        memcpy(key + opts->idx1_len, INDEX_SEPARATOR, 1);
-        memcpy(key + opts->idx1_len + 1, best_match2->idx2, opts->idx2_len);
-        key[opts->idx1_len + opts->idx2_len + 1] = '\0';
-        hi = HashTableSearch(tagHopHash, key, 0);
+    }
+}
+
+decode_metrics_t *decode_metrics_init(va_t *barcodeArray)
+{
+    decode_metrics_t *metrics = calloc(1, sizeof(decode_metrics_t));
+    if (!metrics) die("Out of memory");
+    metrics->nbarcodes = barcodeArray->end;
+    metrics->counts = calloc(barcodeArray->end ? barcodeArray->end : 1, sizeof(bc_counts_t));
+    metrics->hops = kh_init(taghop);
+    metrics->wl = kh_init(wlcount);
+    if (!metrics->counts || !metrics->hops || !metrics->wl) die("Out of memory");
+    return metrics;
+}
+
+void decode_metrics_free(decode_metrics_t *metrics)
+{
+    if (!metrics) return;
+    kh_destroy(taghop, metrics->hops);
+    kh_destroy(wlcount, metrics->wl);
+    free(metrics->counts);
+    free(metrics);
+}
+
+static void add_counts(bc_details_t *bcd, bc_counts_t *c)
+{
+    bcd->reads           += c->reads;
+    bcd->pf_reads        += c->pf_reads;
+    bcd->perfect         += c->perfect;
+    bcd->pf_perfect      += c->pf_perfect;
+    bcd->one_mismatch    += c->one_mismatch;
+    bcd->pf_one_mismatch += c->pf_one_mismatch;
+}
+
+void decode_metrics_merge(decode_metrics_t *metrics, va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
+{
+    for (int n = 0; n < metrics->nbarcodes; n++) {
+        add_counts(barcodeArray->entries[n], &metrics->counts[n]);
+    }
+    memset(metrics->counts, 0, metrics->nbarcodes * sizeof(bc_counts_t));
+
+    for (khint_t k = kh_begin(metrics->wl); opts->wl_counts && k != kh_end(metrics->wl); k++) {
+        if (!kh_exist(metrics->wl, k)) continue;
+        bc_counts_t *to = &opts->wl_counts[kh_key(metrics->wl, k)];
+        bc_counts_t *c = &kh_val(metrics->wl, k);
+        to->reads           += c->reads;
+        to->pf_reads        += c->pf_reads;
+        to->perfect         += c->perfect;
+        to->pf_perfect      += c->pf_perfect;
+        to->one_mismatch    += c->one_mismatch;
+        to->pf_one_mismatch += c->pf_one_mismatch;
+    }
+    kh_clear(wlcount, metrics->wl);
+
+    char *key = smalloc(opts->idx1_len + opts->idx2_len + 2);
+    for (khint_t k = kh_begin(metrics->hops); k != kh_end(metrics->hops); k++) {
+        if (!kh_exist(metrics->hops, k)) continue;
+        uint64_t pair = kh_key(metrics->hops, k);
+        bc_details_t *bc1 = barcodeArray->entries[pair >> 32];
+        bc_details_t *bc2 = barcodeArray->entries[pair & 0xffffffff];
+        make_tag_hop_key(key, bc1, bc2, opts);
+
+        bc_details_t *bcd;
+        HashItem *hi = HashTableSearch(tagHopHash, key, 0);
         if (hi) {
             bcd = hi->data.p;
         } else {
+            HashData hd;
             bcd = calloc(1, sizeof(bc_details_t)); //create a new entry with the two tags
-            bcd->idx1 = best_match1->idx1;
-            bcd->idx2 = best_match2->idx2;
+            if (!bcd) die("Out of memory");
+            bcd->idx1 = bc1->idx1;
+            bcd->idx2 = bc2->idx2;
             bcd->seq = strdup(key);
             bcd->name = "0";
             bcd->lib = "DUMMY_LIB";
             bcd->sample = "DUMMY_SAMPLE";
             bcd->desc = NULL;
             hd.p = bcd;
-            HashTableAdd(tagHopHash, key, 0, hd, NULL);
+            if (!HashTableAdd(tagHopHash, bcd->seq, 0, hd, NULL)) die("Out of memory");
         }
-        if (key != stack_key) free(key);
+        add_counts(bcd, &kh_val(metrics->hops, k));
     }
+    kh_clear(taghop, metrics->hops);
+    free(key);
+}
 
-    return bcd;
+
+#define PARTIAL_METRICS_MAGIC "##BAMBI_DECODE_PARTIAL_METRICS\t1"
+
+static void writePartialCounts(hFILE *f, bc_details_t *bcd)
+{
+    char b[256];
+    snprintf(b, sizeof(b), "\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+             bcd->reads, bcd->pf_reads, bcd->perfect, bcd->pf_perfect, bcd->one_mismatch, bcd->pf_one_mismatch);
+    hputs(b, f);
+}
+
+/*
+ * Write the raw metrics counts, so that the metrics from several decodes
+ * of parts of a file can be added up later by mergeMetrics()
+ *
+ * The file is tab separated text. 'P' lines hold the options which affect
+ * the metrics, 'B' lines hold each barcode (in barcode file order) and 'H'
+ * lines hold each tag hop.
+ */
+static int writePartialMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
+{
+    hFILE *f = hopen(opts->partial_metrics_name, "w");
+    if (!f) {
+        fprintf(stderr,"Can't open partial metrics file %s\n", opts->partial_metrics_name);
+        return 1;
+    }
+
+    hputs(PARTIAL_METRICS_MAGIC "\n", f);
+    hputs("P\tBARCODE_TAG_NAME\t", f); hputs(opts->barcode_tag_name, f); hputc('\n', f);
+    hputs("P\tMAX_MISMATCHES\t", f); hputi(opts->max_mismatches, f); hputc('\n', f);
+    hputs("P\tMIN_MISMATCH_DELTA\t", f); hputi(opts->min_mismatch_delta, f); hputc('\n', f);
+    hputs("P\tMAX_NO_CALLS\t", f); hputi(opts->max_no_calls, f); hputc('\n', f);
+    hputs("P\tIGNORE_PF\t", f); hputi(opts->ignore_pf, f); hputc('\n', f);
+    hputs("P\tIDX1_LEN\t", f); hputi(opts->idx1_len, f); hputc('\n', f);
+    hputs("P\tIDX2_LEN\t", f); hputi(opts->idx2_len, f); hputc('\n', f);
+
+    for (int n=0; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        hputs("B\t", f);
+        hputs(bcd->seq, f); hputc('\t', f);
+        hputs(bcd->idx1, f); hputc('\t', f);
+        hputs(bcd->idx2, f); hputc('\t', f);
+        hputs(bcd->name, f); hputc('\t', f);
+        hputs(bcd->lib, f); hputc('\t', f);
+        hputs(bcd->sample, f); hputc('\t', f);
+        hputs(bcd->desc, f);
+        writePartialCounts(f, bcd);
+    }
+
+    if (tagHopHash) {
+        HashIter *iter = HashTableIterCreate();
+        HashItem *hi;
+        while ( (hi = HashTableIterNext(tagHopHash, iter)) != NULL) {
+            bc_details_t *bcd = hi->data.p;
+            hputs("H\t", f);
+            hputs(bcd->seq, f); hputc('\t', f);
+            hputs(bcd->idx1, f); hputc('\t', f);
+            hputs(bcd->idx2, f);
+            writePartialCounts(f, bcd);
+        }
+        HashTableIterDestroy(iter);
+    }
+
+    if (hclose(f)) die("Can't close partial metrics file");
+    return 0;
+}
+
+/*
+ * Split a line into tab separated fields, keeping empty fields
+ */
+static int splitFields(char *line, char **fields, int max)
+{
+    int n = 0;
+    fields[n++] = line;
+    for (char *p = line; *p && n < max; p++) {
+        if (*p == '\t') { *p = 0; fields[n++] = p + 1; }
+    }
+    return n;
+}
+
+static int readPartialCounts(char **fields, bc_details_t *bcd)
+{
+    uint64_t *counts[6] = { &bcd->reads, &bcd->pf_reads, &bcd->perfect, &bcd->pf_perfect,
+                            &bcd->one_mismatch, &bcd->pf_one_mismatch };
+    for (int n=0; n < 6; n++) {
+        char *end;
+        uint64_t v = strtoull(fields[n], &end, 10);
+        if (end == fields[n]) return -1;
+        *counts[n] += v;
+    }
+    return 0;
+}
+
+/*
+ * Check or set an option from a partial file
+ */
+static int mergeOption(decode_opts_t *opts, char *name, char *value, bool first)
+{
+    if (strcmp(name, "BARCODE_TAG_NAME") == 0) {
+        if (first) { free(opts->barcode_tag_name); opts->barcode_tag_name = strdup(value); return 0; }
+        return strcmp(opts->barcode_tag_name, value);
+    }
+
+    int *opt = NULL, v = atoi(value);
+    if (strcmp(name, "MAX_MISMATCHES") == 0)     opt = &opts->max_mismatches;
+    if (strcmp(name, "MIN_MISMATCH_DELTA") == 0) opt = &opts->min_mismatch_delta;
+    if (strcmp(name, "MAX_NO_CALLS") == 0)       opt = &opts->max_no_calls;
+    if (strcmp(name, "IDX1_LEN") == 0)           opt = &opts->idx1_len;
+    if (strcmp(name, "IDX2_LEN") == 0)           opt = &opts->idx2_len;
+    if (strcmp(name, "IGNORE_PF") == 0) {
+        if (first) opts->ignore_pf = v;
+        return opts->ignore_pf != (bool)v;
+    }
+    if (!opt) return -1;
+    if (first) *opt = v;
+    return *opt != v;
 }
 
+/*
+ * Add up a list of partial metrics files and write the metrics
+ */
+static int mergeMetrics(decode_opts_t *opts)
+{
+    int retcode = 1;
+    va_t *barcodeArray = va_init(100, free_bcd);
+    va_t *hop_strings = va_init(100, free);
+    HashTable *tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    if (!tagHopHash) die("Out of memory");
+    char buf[8192];
+    char *fields[16];
+
+    for (int n=0; n < opts->partials->end; n++) {
+        char *fname = opts->partials->entries[n];
+        bool first = (n == 0);
+        int nbarcodes = 0, lineno = 0;
+
+        hFILE *fh = hopen(fname, "r");
+        if (!fh) {
+            fprintf(stderr, "Can't open partial metrics file %s\n", fname);
+            goto fail;
+        }
+
+        while (hgets(buf, sizeof(buf), fh) > 0) {
+            lineno++;
+            if (buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1] = 0;
+            if (lineno == 1) {
+                if (strcmp(buf, PARTIAL_METRICS_MAGIC)) {
+                    fprintf(stderr, "%s is not a partial metrics file\n", fname);
+                    hclose(fh); goto fail;
+                }
+                continue;
+            }
+
+            int nf = splitFields(buf, fields, 16);
+            if (nf == 3 && strcmp(fields[0], "P") == 0) {
+                if (mergeOption(opts, fields[1], fields[2], first)) {
+                    fprintf(stderr, "%s: option %s differs from the first partial metrics file\n", fname, fields[1]);
+                    hclose(fh); goto fail;
+                }
+            } else if (nf == 14 && strcmp(fields[0], "B") == 0) {
+                bc_details_t *bcd;
+                if (first) {
+                    bcd = bcd_init();
+                    bcd->seq    = strdup(fields[1]);
+                    bcd->idx1   = strdup(fields[2]);
+                    bcd->idx2   = strdup(fields[3]);
+                    bcd->name   = strdup(fields[4]);
+                    bcd->lib    = strdup(fields[5]);
+                    bcd->sample = strdup(fields[6]);
+                    bcd->desc   = strdup(fields[7]);
+                    va_push(barcodeArray, bcd);
+                } else {
+                    bcd = nbarcodes < barcodeArray->end ? barcodeArray->entries[nbarcodes] : NULL;
+                    if (!bcd || strcmp(bcd->seq, fields[1]) || strcmp(bcd->name, fields[4])) {
+                        fprintf(stderr, "%s: the barcodes differ from the first partial metrics file\n", fname);
+                        hclose(fh); goto fail;
+                    }
+                }
+                nbarcodes++;
+                if (readPartialCounts(fields + 8, bcd)) goto bad_line;
+            } else if (nf == 10 && strcmp(fields[0], "H") == 0) {
+                bc_details_t *bcd;
+                HashItem *hi = HashTableSearch(tagHopHash, fields[1], 0);
+                if (hi) {
+                    bcd = hi->data.p;
+                } else {
+                    HashData hd;
+                    bcd = calloc(1, sizeof(bc_details_t));
+                    if (!bcd) die("Out of memory");
+                    bcd->seq = strdup(fields[1]);
+                    bcd->idx1 = strdup(fields[2]); va_push(hop_strings, bcd->idx1);
+                    bcd->idx2 = strdup(fields[3]); va_push(hop_strings, bcd->idx2);
+                    bcd->name = "0";
+                    bcd->lib = "DUMMY_LIB";
+                    bcd->sample = "DUMMY_SAMPLE";
+                    bcd->desc = NULL;
+                    hd.p = bcd;
+                    if (!HashTableAdd(tagHopHash, bcd->seq, 0, hd, NULL)) die("Out of memory");
+                }
+                if (readPartialCounts(fields + 4, bcd)) goto bad_line;
+            } else {
+                goto bad_line;
+            }
+            continue;
+
+        bad_line:
+            fprintf(stderr, "%s: can't understand line %d\n", fname, lineno);
+            hclose(fh); goto fail;
+        }
+
+        if (hclose(fh)) die("Can't close partial metrics file %s", fname);
+        if (nbarcodes != barcodeArray->end || nbarcodes == 0) {
+            fprintf(stderr, "%s: the barcodes differ from the first partial metrics file\n", fname);
+            goto fail;
+        }
+    }
+
+    retcode = writeMetrics(barcodeArray, tagHopHash, opts);
+
+ fail:
+    free_tagHopHash(tagHopHash);
+    va_free(barcodeArray);
+    va_free(hop_strings);
+    return retcode;
+}
 
 /*
  * find the best match in the barcode (tag) file for a given barcode
  * return the tag, if a match found, else return NULL
  */
-bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, decode_opts_t *opts)
+static int findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, decode_opts_t *opts)
 {
     int bcLen = opts->idx1_len + opts->idx2_len + 1;   // size of barcode sequence in barcode file
-    bc_details_t *best_match = NULL;
+    int best_match = 0;
     int nmBest = bcLen;             // number of mismatches (best)
     int nm2Best = bcLen;            // number of mismatches (second best)
 
@@ -906,7 +1436,7 @@ bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcod
         HashItem *hi;
         hi = HashTableSearch(barcodeHash, barcode, 0);
         if (hi) {
-            return barcodeArray->entries[hi->data.i];
+            return hi->data.i;
         }
     }
 
@@ -918,7 +1448,7 @@ bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcod
         if (nMismatches < nmBest) {
             nm2Best = nmBest;
             nmBest = nMismatches;
-            best_match = bcd;
+            best_match = n;
         } else {
             if (nMismatches < nm2Best) nm2Best = nMismatches;
         }
@@ -927,62 +1457,63 @@ bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcod
     matched = best_match && nmBest <= opts->max_mismatches && nm2Best - nmBest >= opts->min_mismatch_delta;
 
     if (!matched) {
-        best_match = barcodeArray->entries[0];
+        best_match = 0;
     }
 
     return best_match;
 }
 
-/*
- * Update the metrics information
- */
-static void updateMetrics(bc_details_t *bcd, char *seq, bool isPf)
-{
-    int n = 99;
-    if (seq) n = countMismatches(bcd->seq, seq, 999);
-
-    bcd->reads++;
-    if (isPf) bcd->pf_reads++;
-
-    if (n==0) {     // count perfect matches
-        bcd->perfect++;
-        if (isPf) bcd->pf_perfect++;
-    }
-
-    if (n==1) {     // count out-by-one matches
-        bcd->one_mismatch++;
-        if (isPf) bcd->pf_one_mismatch++;
-    }
-}
-
 /*
  * find the best match in the barcode (tag) file, and return the corresponding barcode name
  * If no match found, check for tag hopping, and return dummy entry 0
  */
-char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts, bool isPf, bool isUpdateMetrics)
+char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, decode_metrics_t *metrics, decode_opts_t *opts, bool isPf, bool isUpdateMetrics)
 {
     bc_details_t *bcd;
     if (noCalls(barcode) > opts->max_no_calls) {
         bcd = barcodeArray->entries[0];
-        if (isUpdateMetrics) updateMetrics(bcd, barcode, isPf);
+        if (isUpdateMetrics) updateMetrics(&metrics->counts[0], bcd->seq, barcode, isPf);
     } else {
-        bcd = findBestMatch(barcode, barcodeArray, barcodeHash, opts);
-        if (isUpdateMetrics) updateMetrics(bcd, barcode, isPf);
-        if ((bcd == barcodeArray->entries[0]) && opts->idx1_len && opts->idx2_len) {
-            bc_details_t *tag_hop = check_tag_hopping(barcode, barcodeArray, tagHopHash, opts);
-            if (isUpdateMetrics && tag_hop) updateMetrics(tag_hop, barcode, isPf);
+        int n = findBestMatch(barcode, barcodeArray, barcodeHash, opts);
+        bcd = barcodeArray->entries[n];
+        if (isUpdateMetrics) updateMetrics(&metrics->counts[n], bcd->seq, barcode, isPf);
+        if (n == 0 && opts->idx1_len && opts->idx2_len) {
+            check_tag_hopping(barcode, barcodeArray, metrics, opts, isPf, isUpdateMetrics);
         }
     }
     return bcd->name;
 }
 
 /*
- * make a new tag by appending #<name> to the old tag
+ * Match a barcode against the whitelist. If it matches, the whitelist
+ * sequence is written to seq and returned, otherwise the read is counted
+ * against dummy entry 0 and its name is returned.
+ */
+static char *findWhitelistBarcode(char *barcode, char *seq, va_t *barcodeArray, decode_metrics_t *metrics, decode_opts_t *opts, bool isPf)
+{
+    int nm;
+    int n = whitelist_match(opts->whitelist, barcode, opts->max_mismatches, opts->max_no_calls, &nm);
+    if (n < 0) {
+        bc_details_t *bcd = barcodeArray->entries[0];
+        updateMetrics(&metrics->counts[0], bcd->seq, barcode, isPf);
+        return bcd->name;
+    }
+
+    int absent;
+    khint_t k = kh_put(wlcount, metrics->wl, n, &absent);
+    if (absent < 0) die("Out of memory");
+    if (absent) memset(&kh_val(metrics->wl, k), 0, sizeof(bc_counts_t));
+    countRead(&kh_val(metrics->wl, k), nm, isPf);
+    whitelist_seq(opts->whitelist, n, seq);
+    return seq;
+}
+
+/*
+ * make a new tag by appending #<name> to the old tag p (which may be NULL)
  */
-static void makeNewTag(bam1_t *rec, char *tag, char *name, char **newtag, size_t newtag_sz)
+static void makeNewTag(uint8_t *p, char *name, char **newtag, size_t newtag_sz)
 {
     char *rg = "";
-    uint8_t *p = bam_aux_get(rec,tag);
     size_t name_len = strlen(name), rg_len;
     if (p) rg = bam_aux2Z(p);
     rg_len = strlen(rg);
@@ -1020,126 +1551,146 @@ static void add_suffix(bam1_t *rec, char *suffix)
 }
 
 /*
- * Add a new @RG line to the header
+ * An @RG line from the input header, split into its fields once
+ * so that it can be copied for every barcode
  */
-static void addNewRG(sam_hdr_t *hdr, char *entry, char *bcname, char *lib, char *sample, char *desc)
+typedef struct {
+    char *line;         // copy of the header line, split in place
+    char *id;           // first field after @RG (normally ID:x)
+    int ntags;
+    char **tags;
+    char **vals;
+} rg_template_t;
+
+static void parseRGTemplate(rg_template_t *rg, const char *line)
 {
-    assert(entry != NULL);
-    kstring_t newline;
     char *saveptr;
-    char *p = strtok_r(entry,"\t",&saveptr);
+    int max = 8;
+
+    rg->line = strdup(line);
+    rg->ntags = 0;
+    rg->tags = smalloc(max * sizeof(char *));
+    rg->vals = smalloc(max * sizeof(char *));
+
+    char *p = strtok_r(rg->line, "\t", &saveptr);
     if (p) p = strtok_r(NULL, "\t", &saveptr);
-    if (!p) die("addNewRG(): Can't parse entry: %s\n", entry);
-    char *newtag = malloc(strlen(p)+1+strlen(bcname)+1);
-    strcpy(newtag, p);
-    strcat(newtag,"#");
-    strcat(newtag, bcname);
+    if (!p) die("changeHeader(): Can't parse entry: %s\n", line);
+    rg->id = p;
+
+    while ((p = strtok_r(NULL, "\t", &saveptr)) != NULL) {
+        char *v = strchr(p, ':');
+        if (!v) continue;
+        *v++ = 0;
+        if (rg->ntags == max) {
+            max *= 2;
+            rg->tags = realloc(rg->tags, max * sizeof(char *));
+            rg->vals = realloc(rg->vals, max * sizeof(char *));
+            if (!rg->tags || !rg->vals) die("Out of memory");
+        }
+        rg->tags[rg->ntags] = p;
+        rg->vals[rg->ntags] = v;
+        rg->ntags++;
+    }
+}
 
-    ks_initialize(&newline);
-    kputs("@RG\t", &newline); kputs(newtag, &newline);
+static void freeRGTemplate(rg_template_t *rg)
+{
+    free(rg->line);
+    free(rg->tags);
+    free(rg->vals);
+}
 
-    while (1) {
-        char *pu = NULL;
-        char *t = strtok_r(NULL, ":", &saveptr);
-        if (!t) break;
-        char *v = strtok_r(NULL, "\t", &saveptr);
-        if (!v) break;
+/*
+ * Append a new @RG line for barcode bcname to the header text
+ */
+static void appendNewRG(kstring_t *text, rg_template_t *rg, char *bcname, char *lib, char *sample, char *desc)
+{
+    kputs("@RG\t", text); kputs(rg->id, text);
+    kputc('#', text); kputs(bcname, text);
+
+    for (int n = 0; n < rg->ntags; n++) {
+        char *t = rg->tags[n];
+        char *v = rg->vals[n];
 
         // handle special cases
+        if (strcmp(t,"LB") == 0 && lib) v = lib;            // use library name
+        if (strcmp(t,"DS") == 0 && desc) v = desc;          // use desc
+        if (strcmp(t,"SM") == 0 && sample) v = sample;      // use sample name
+
+        kputc('\t', text);
+        kputs(t, text);
+        kputc(':', text);
+        kputs(v, text);
         if (strcmp(t,"PU") == 0) {
             // add #bcname
-            pu = malloc(strlen(v) + 1 + strlen(bcname) + 1);
-            strcpy(pu, v); strcat(pu,"#"); strcat(pu,bcname);
-            v = pu;
+            kputc('#', text); kputs(bcname, text);
         }
-        if (strcmp(t,"LB") == 0) {
-            if (lib) v = lib;        // use library name
-        }
-        if (strcmp(t,"DS") == 0) {
-            if (desc) v = desc;       // use desc
-        }
-        if (strcmp(t,"SM") == 0) {
-            if (sample) v = sample;     // use sample name
-        }
-
-        kputs("\t", &newline);
-        kputs(t, &newline); 
-        kputs(":", &newline);
-        kputs(v, &newline);
-
-        if (pu) free(pu);
     }
-    free(newtag);
-
-    sam_hdr_add_lines(hdr, ks_str(&newline), 0);
-    ks_free(&newline);
+    kputc('\n', text);
 }
 
 /*
  * for each "@RG ID:x" in the header, replace with
  * "@RG IDx#barcode" for each barcode
  *
+ * The new lines are built up in one buffer and added to the header
+ * in one go, as there can be a great many of them.
+ *
  * And don't forget to add a @PG header
  */ 
 static void changeHeader(va_t *barcodeArray, sam_hdr_t *sh, char *argv_list)
 {
     int i, n;
-    // int nrg = sam_hdr_nref(sh);     // number of RG lines in header;
     int nrg = sam_hdr_count_lines(sh, "RG");
-    kstring_t **rgArray = malloc(sizeof(kstring_t *) * nrg);
+    rg_template_t *rgArray = smalloc(sizeof(rg_template_t) * (nrg ? nrg : 1));
+    kstring_t ks = { 0, 0, NULL };
+    kstring_t text = { 0, 0, NULL };
+    size_t text_len = 0;
 
     sam_hdr_add_pg(sh, "bambi", "VN", bambi_version(), "CL", argv_list, NULL);
 
     // store the RG records
     for (n=0; n < nrg; n++) {
-        kstring_t *ks = smalloc(sizeof(kstring_t));;
-        ks_initialize(ks);
-
-        if (sam_hdr_find_line_pos(sh, "RG", n, ks) < 0) {
+        if (sam_hdr_find_line_pos(sh, "RG", n, &ks) < 0) {
             die("Can't read RG header line %d\n", n);
         }
-
-        // store the names and tags as a string <name>:<tag>:<val>:<tag>:<val>...
-        // eg 1:PL:Illumina:PU:110608_HS19
-
-        rgArray[n] = ks;
-
+        parseRGTemplate(&rgArray[n], ks_str(&ks));
+        text_len += ks_len(&ks) + 64;
     }
+    ks_free(&ks);
 
     // Remove the existing RG lines
-//    if (sam_hdr_remove_except(sh, "RG", NULL, NULL)) die("sam_hdr_remove_except() failed in changeHeader()");
     if (sam_hdr_remove_except(sh, "RG", "ID", "fred")) die("sam_hdr_remove_except() failed in changeHeader()");
     for (n=0; n < nrg; n++) {
         sam_hdr_remove_line_pos(sh, "RG", n);
     }
 
-    // add the new RG lines
+    // build the new RG lines
+    if (ks_resize(&text, text_len * (barcodeArray->end ? barcodeArray->end : 1) + 1) < 0) die("Out of memory");
     for (n=0; n<nrg; n++) {
-        char *entry = strdup(ks_str(rgArray[n]));
-        addNewRG(sh, entry, "0", NULL, NULL, NULL);
-        free(entry);
+        appendNewRG(&text, &rgArray[n], "0", NULL, NULL, NULL);
 
         // for each tag in barcodeArray
         for (i=1; i < barcodeArray->end; i++) {
             bc_details_t *bcd = barcodeArray->entries[i];
-
-            char *entry = strdup(ks_str(rgArray[n]));
-            addNewRG(sh, entry, bcd->name, bcd->lib, bcd->sample, bcd->desc);
-            free(entry);
+            appendNewRG(&text, &rgArray[n], bcd->name, bcd->lib, bcd->sample, bcd->desc);
         }
     }
 
-    for (n=0; n<nrg; n++) {
-        ks_free(rgArray[n]); free(rgArray[n]);
+    // and add them to the header
+    if (text.l && sam_hdr_add_lines(sh, ks_str(&text), text.l) < 0) {
+        die("changeHeader(): failed to add new RG lines\n");
     }
-    free(rgArray);
 
+    for (n=0; n<nrg; n++) freeRGTemplate(&rgArray[n]);
+    free(rgArray);
+    ks_free(&text);
 }
 
 /*
  * Process one template
  */
-static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts)
+static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcodeHash, decode_metrics_t *metrics, decode_opts_t *opts)
 {
     char *name = NULL;
     char *bc_tag = NULL;
@@ -1150,11 +1701,15 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
     char stack_bc_tag[STACK_BC_LEN];
     char stack_qt_tag[STACK_BC_LEN];
     char stack_newtag[STACK_BC_LEN];
+    BAMit_aux_t aux = BAMIT_AUX_INIT;
+    int bc_idx = BAMit_aux_add(&aux, opts->barcode_tag_name);
+    int qt_idx = opts->quality_tag_name ? BAMit_aux_add(&aux, opts->quality_tag_name) : -1;
 
     // look for barcode tag
     for (int n=0; n < template->end; n++) {
         bam1_t *rec = template->entries[n];
-        uint8_t *p = bam_aux_get(rec,opts->barcode_tag_name);
+        if (BAMit_aux_index(&aux, rec) < 0) die("Corrupt aux data in record %s\n", bam_get_qname(rec));
+        uint8_t *p = BAMit_aux_get(&aux, rec, bc_idx);
         if (p) {
             if (bc_tag) { // have we already found a tag?
                 if (strcmp(bc_tag,bam_aux2Z(p)) != 0) {
@@ -1174,7 +1729,7 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
                     bc_tag = strdup(bc);
                     if (!bc_tag) die("Out of memory");
                 }
-                p = bam_aux_get(rec,opts->quality_tag_name);
+                p = qt_idx < 0 ? NULL : BAMit_aux_get(&aux, rec, qt_idx);
                 if (p) {
                     char *qt = bam_aux2Z(p);
                     size_t qt_len = strlen(qt);
@@ -1203,31 +1758,47 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
         } else {
             newtag = bc_tag;
         }
-        // truncate to barcode lengths if necessary
-        char stack_idx1[STACK_BC_LEN];
-        char stack_idx2[STACK_BC_LEN];
-        char *idx1 = stack_idx1, *idx2 = stack_idx2;
-        split_index(bc_tag, bc_len, opts->dual_tag, &idx1, &idx2, sizeof(stack_idx1), sizeof(stack_idx2));
-        if ( (strlen(idx1) > opts->idx1_len) || (strlen(idx2) > opts->idx2_len) ) {
-            if (strlen(idx1) > opts->idx1_len) idx1[opts->idx1_len]=0;
-            if (strlen(idx2) > opts->idx2_len) idx2[opts->idx2_len]=0;
-            strcpy(newtag,idx1); 
-            if (opts->idx2_len) strcat(newtag,INDEX_SEPARATOR);
-            strcat(newtag,idx2);
+        // truncate to barcode lengths if necessary (whitelist_match() does its own)
+        if (!opts->whitelist) {
+            char stack_idx1[STACK_BC_LEN];
+            char stack_idx2[STACK_BC_LEN];
+            char *idx1 = stack_idx1, *idx2 = stack_idx2;
+            split_index(bc_tag, bc_len, opts->dual_tag, &idx1, &idx2, sizeof(stack_idx1), sizeof(stack_idx2));
+            if ( (strlen(idx1) > opts->idx1_len) || (strlen(idx2) > opts->idx2_len) ) {
+                if (strlen(idx1) > opts->idx1_len) idx1[opts->idx1_len]=0;
+                if (strlen(idx2) > opts->idx2_len) idx2[opts->idx2_len]=0;
+                strcpy(newtag,idx1);
+                if (opts->idx2_len) strcat(newtag,INDEX_SEPARATOR);
+                strcat(newtag,idx2);
+            }
+            if (idx1 != stack_idx1) free(idx1);
+            if (idx2 != stack_idx2) free(idx2);
         }
-        if (idx1 != stack_idx1) free(idx1);
-        if (idx2 != stack_idx2) free(idx2);
     }
 
+    BAMit_aux_t rg_aux = BAMIT_AUX_INIT;
+    int rg_idx = BAMit_aux_add(&rg_aux, opts->whitelist ? opts->assign_tag_name : "RG");
+    char wlseq[WHITELIST_MAX_LEN+1];
     for (int n=0; n < template->end; n++) {
         bam1_t *rec = template->entries[n];
         if (newtag) {
             char stack_newrg[256];
             char *newrg = stack_newrg;
-            if (n==0) name = findBarcodeName(newtag,barcodeArray, barcodeHash, tagHopHash, opts,!(rec->core.flag & BAM_FQCFAIL), n==0);
-            makeNewTag(rec,"RG",name, &newrg, sizeof(stack_newrg));
-            bam_aux_update_str(rec,"RG",strlen(newrg)+1, newrg);
-            if (newrg != stack_newrg) free(newrg);
+            bool isPf = !(rec->core.flag & BAM_FQCFAIL);
+            if (n==0) {
+                if (opts->whitelist) name = findWhitelistBarcode(newtag, wlseq, barcodeArray, metrics, opts, isPf);
+                else name = findBarcodeName(newtag,barcodeArray, barcodeHash, metrics, opts, isPf, n==0);
+            }
+            if (opts->metrics_only) break;  // the records aren't written, so don't change them
+            if (BAMit_aux_index(&rg_aux, rec) < 0) die("Corrupt aux data in record %s\n", bam_get_qname(rec));
+            if (opts->whitelist) {
+                // the barcode goes in its own tag, and the read group is left alone
+                if (name == wlseq && BAMit_aux_update(&rg_aux, rec, rg_idx, 'Z', strlen(wlseq)+1, (uint8_t *)wlseq) < 0) die("Out of memory");
+            } else {
+                makeNewTag(BAMit_aux_get(&rg_aux, rec, rg_idx), name, &newrg, sizeof(stack_newrg));
+                if (BAMit_aux_update(&rg_aux, rec, rg_idx, 'Z', strlen(newrg)+1, (uint8_t *)newrg) < 0) die("Out of memory");
+                if (newrg != stack_newrg) free(newrg);
+            }
             if (opts->change_read_name) add_suffix(rec, name);
         }
     }
@@ -1238,136 +1809,6 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
     return error_code;
 }
 
-/*
- * Read records from a given iterator until the qname changes
- */
-static va_t *loadTemplate(BAMit_t *bit, char *qname)
-{
-    va_t *recordSet = va_init(5,freeRecord);
-
-    while (BAMit_hasnext(bit) && strcmp(bam_get_qname(BAMit_peek(bit)),qname) == 0) {
-        bam1_t *rec = bam_init1();
-        if (!bam_copy1(rec,BAMit_next(bit))) die("bam_copy1() failed in loadTemplate()");
-        va_push(recordSet,rec);
-    }
-
-    return recordSet;
-}
-
-static int processTemplatesNoThreads(BAMit_t *bam_in, BAMit_t *bam_out, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t* opts)
-{
-    char qname[257] = {0};
-    chksum_results_t *results = NULL;
-
-    if (opts->chksum_name) results = chksum_init_results(opts->hash);
-
-    while (BAMit_hasnext(bam_in)) {
-        bam1_t *rec = BAMit_peek(bam_in);
-        va_t *template;
-        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
-        template = loadTemplate(bam_in, qname);
-        if (processTemplate(template, barcodeArray, barcodeHash, tagHopHash, opts)) break;
-        for (int n = 0; n < template->end; n++) {
-            bam1_t *rec_n = template->entries[n];
-            if (opts->chksum_name) seqchksum_processRecord(rec_n, opts->hash, results);
-            int r = sam_write1(bam_out->f, bam_out->h, rec_n);
-            if (r < 0) {
-                fprintf(stderr, "Could not write sequence\n");
-                return -1;
-            }
-        }
-        va_free(template);
-    }
-
-    if (opts->chksum_name) {
-        hFILE *f = hopen(opts->chksum_name, "w");
-        if (f) {
-            chksum_print_results(f, results);
-            if (hclose(f)) die("Can't close chksum file");
-        } else {
-            fprintf(stderr, "WARNING: couldn't open chksum file '%s'\n", opts->chksum_name);
-        }
-        chksum_free_results(results);
-    }
-    return 0;
-}
-
-static void *decode_job(void *arg)
-{
-    decode_thread_data_t *job_data = (decode_thread_data_t *) arg;
-    va_t template = { 0, 0, NULL, NULL };
-    size_t start_rec = 0;
-
-    job_data->result = -1;
-    for (int i = 0; i < job_data->template_counts->end; i++) {
-        template.end = template.max = job_data->template_counts->entries[i];
-        template.entries = &job_data->record_set->entries[start_rec];
-        start_rec += template.end;
-        if (processTemplate(&template, job_data->barcode_array, job_data->barcodeHash, job_data->tagHopHash, job_data->opts)) goto fail;
-    }
-    assert(start_rec == job_data->nrec);
-
-    job_data->result = 0;
- fail:
-    return job_data;
-}
-
-static void output_job_results(BAMit_t *bam_out, decode_thread_data_t *job_data, chksum_results_t *chksum_results, HASH_TYPE hash)
-{
-    if (job_data->result != 0) {
-        die("Processing job failed to return a result\n");
-    }
-
-    // Write out result records
-    for (int i = 0; i < job_data->nrec; i++) {
-        bam1_t *rec = job_data->record_set->entries[i];
-        if (chksum_results) seqchksum_processRecord(rec, hash, chksum_results);
-        int r = sam_write1(bam_out->f, bam_out->h, rec);
-        if (r < 0) {
-            die("Could not write sequence\n");
-        }
-    }
-}
-
-void accumulate_job_metrics(va_t *job_barcodes, HashTable *job_tag_hops, va_t *barcodeArray, HashTable *tagHopHash)
-{
-    // Accumulate metrics
-    HashIter *iter = HashTableIterCreate();
-    if (!iter) die("Out of memory");
-    HashItem *hi;
-
-    for (int i = 0; i < barcodeArray->end; i++) {
-        bc_details_t *bc = barcodeArray->entries[i];
-        bc_details_t *job_bc = job_barcodes->entries[i];
-        bc->reads           += job_bc->reads;
-        bc->pf_reads        += job_bc->pf_reads;
-        bc->perfect         += job_bc->perfect;
-        bc->pf_perfect      += job_bc->pf_perfect;
-        bc->one_mismatch    += job_bc->one_mismatch;
-        bc->pf_one_mismatch += job_bc->pf_one_mismatch;
-    }
-
-    // Accumulate tag hops
-    while ((hi = HashTableIterNext(job_tag_hops, iter)) != NULL) {
-        int added = -1;
-        HashItem *hi2 = HashTableAdd(tagHopHash, hi->key, hi->key_len, hi->data, &added);
-        if (!hi2) die("Out of memory");
-        if (!added) {  // Already in there so accumulate results
-            bc_details_t *job_bc = hi->data.p;
-            bc_details_t *acc_bc = hi2->data.p;
-            acc_bc->reads           += job_bc->reads;
-            acc_bc->pf_reads        += job_bc->pf_reads;
-            acc_bc->perfect         += job_bc->perfect;
-            acc_bc->pf_perfect      += job_bc->pf_perfect;
-            acc_bc->one_mismatch    += job_bc->one_mismatch;
-            acc_bc->pf_one_mismatch += job_bc->pf_one_mismatch;
-            free_taghop_bcd(job_bc);
-        }
-    }
-
-    HashTableIterDestroy(iter);
-}
-
 va_t *copy_barcode_array(va_t *barcode_array)
 {
     va_t *copy = va_init(barcode_array->end, NULL);
@@ -1398,156 +1839,262 @@ void delete_barcode_array_copy(va_t *barcode_array)
     va_free(barcode_array);
 }
 
-static void job_free(decode_thread_data_t *job_data)
+/*
+ * Decoding records in memory. The decode command and libbambi both use this.
+ */
+typedef struct decode_lib_job_t {
+    bambi_decode_t *ctx;
+    bam1_t **recs;
+    int nrecs;
+    int max_recs;                       // records allocated, when the job owns them
+    decode_metrics_t *metrics;
+    int result;
+    struct decode_lib_job_t *next;      // for free list
+} decode_lib_job_t;
+
+struct bambi_decode_t {
+    decode_opts_t *opts;
+    va_t *barcodeArray;
+    HashTable *barcodeHash;
+    HashTable *tagHopHash;
+    hts_tpool *pool;
+    hts_tpool_process *queue;
+    int njobs;
+    decode_lib_job_t *jobs;
+    bool own_barcodes;                  // the barcodes and opts belong to the context
+};
+
+/*
+ * Decode a run of records, one template at a time
+ */
+static int decode_lib_run(bambi_decode_t *ctx, bam1_t **recs, int nrecs, decode_metrics_t *metrics)
 {
-    va_free(job_data->record_set);
-    ia_free(job_data->template_counts);
-    delete_barcode_array_copy(job_data->barcode_array);
-    HashTableDestroy(job_data->tagHopHash,0);
-    free(job_data);
+    va_t template = { 0, 0, NULL, NULL };
+    int start = 0;
+
+    while (start < nrecs) {
+        int end = start + 1;
+        while (end < nrecs && strcmp(bam_get_qname(recs[end]), bam_get_qname(recs[start])) == 0) end++;
+        template.end = template.max = end - start;
+        template.entries = (void **)&recs[start];
+        if (processTemplate(&template, ctx->barcodeArray, ctx->barcodeHash, metrics, ctx->opts)) return -1;
+        start = end;
+    }
+    return 0;
 }
 
-static decode_thread_data_t *init_job(va_t *barcode_array, HashTable *barcodeHash, decode_opts_t *opts)
+static void *decode_lib_job(void *arg)
 {
-    decode_thread_data_t *job_data = calloc(1, sizeof(*job_data));
-    if (!job_data) die("Out of memory\n");
+    decode_lib_job_t *job = (decode_lib_job_t *)arg;
+    job->result = decode_lib_run(job->ctx, job->recs, job->nrecs, job->metrics);
+    return job;
+}
 
-    job_data->barcode_array = copy_barcode_array(barcode_array);
-    job_data->barcodes = job_data->barcode_array->end > 0 ? job_data->barcode_array->entries[0] : NULL;
-    job_data->tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
-    if (!job_data->tagHopHash) die("Out of memory");
-    job_data->barcodeHash = barcodeHash;
-    job_data->opts = opts;
-    job_data->result = -1;
-    job_data->next = NULL;
+static void decode_lib_merge(bambi_decode_t *ctx)
+{
+    for (int n = 0; n < ctx->njobs; n++) {
+        decode_metrics_merge(ctx->jobs[n].metrics, ctx->barcodeArray, ctx->tagHopHash, ctx->opts);
+    }
+}
 
-    return job_data;
+/*
+ * Set up a context to decode with barcodes already loaded. If 'own' is set,
+ * the barcodes and opts are freed with the context.
+ */
+static bambi_decode_t *decode_ctx_init(decode_opts_t *opts, va_t *barcodeArray, HashTable *barcodeHash, hts_tpool *pool, bool own)
+{
+    bambi_decode_t *ctx = calloc(1, sizeof(bambi_decode_t));
+    if (!ctx) die("Out of memory");
+    ctx->opts = opts;
+    ctx->barcodeArray = barcodeArray;
+    ctx->barcodeHash = barcodeHash;
+    ctx->own_barcodes = own;
+    ctx->tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    if (!ctx->tagHopHash) die("Out of memory");
+
+    ctx->pool = pool;
+    ctx->njobs = pool ? hts_tpool_size(pool) : 1;
+    if (pool) {
+        ctx->queue = hts_tpool_process_init(pool, 2 * ctx->njobs, 0);
+        if (!ctx->queue) die("Couldn't set up thread pool queue\n");
+    }
+    ctx->jobs = calloc(ctx->njobs, sizeof(decode_lib_job_t));
+    if (!ctx->jobs) die("Out of memory");
+    for (int n = 0; n < ctx->njobs; n++) {
+        ctx->jobs[n].ctx = ctx;
+        ctx->jobs[n].metrics = decode_metrics_init(barcodeArray);
+    }
+
+    return ctx;
 }
 
-static int processTemplatesThreads(hts_tpool *pool, BAMit_t *bam_in, BAMit_t *bam_out, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t* opts)
+/*
+ * Split the records into runs of whole templates, one for each thread
+ */
+int bambi_decode_records(bambi_decode_t *ctx, bam1_t **recs, int nrecs)
 {
-    hts_tpool_result *job_result = NULL;
-    hts_tpool_process *queue = hts_tpool_process_init(pool, 2 * opts->nthreads, 0);
-    decode_thread_data_t *job_freelist = NULL;
-    decode_thread_data_t *job_data = init_job(barcodeArray, barcodeHash, opts);
-    char qname[257] = { 0 };
+    int njobs = 0, start = 0, ret = 0;
 
-    chksum_results_t *chksum_results = NULL;
+    if (!ctx->pool) return decode_lib_run(ctx, recs, nrecs, ctx->jobs[0].metrics);
 
-    if (opts->chksum_name) chksum_results = chksum_init_results(opts->hash);
+    int chunk = (nrecs + ctx->njobs - 1) / ctx->njobs;
+    while (start < nrecs) {
+        int end = start + chunk;
+        if (end > nrecs) end = nrecs;
+        while (end < nrecs && strcmp(bam_get_qname(recs[end]), bam_get_qname(recs[end-1])) == 0) end++;
+        decode_lib_job_t *job = &ctx->jobs[njobs++];
+        job->recs = recs + start;
+        job->nrecs = end - start;
+        if (hts_tpool_dispatch(ctx->pool, ctx->queue, decode_lib_job, job) < 0) die("Thread pool dispatch failed");
+        start = end;
+    }
+
+    while (njobs--) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(ctx->queue);
+        if (!r) die("Failed to get processing job result");
+        decode_lib_job_t *job = hts_tpool_result_data(r);
+        if (job->result) ret = -1;
+        hts_tpool_delete_result(r, 0);
+    }
+    return ret;
+}
 
-    if (!queue) {
-        perror("hts_tpool_process_init");
-        return -1;
+/*
+ * Checksum and write out decoded records
+ */
+static int writeRecords(bam1_t **recs, int nrecs, BAMit_t *bam_out, chksum_results_t *results, decode_opts_t *opts)
+{
+    for (int n = 0; n < nrecs; n++) {
+        if (results && seqchksum_processRecord(recs[n], opts->hash, results)) return -1;
+        if (bam_out && sam_write1(bam_out->f, bam_out->h, recs[n]) < 0) {
+            fprintf(stderr, "Could not write sequence\n");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    job_data->record_set = va_init(TEMPLATES_PER_JOB * 2, freeRecord);
-    job_data->template_counts = ia_init(TEMPLATES_PER_JOB);
-    job_data->nrec = 0;
+static void freeRecords(bam1_t **recs, int max_recs)
+{
+    for (int n = 0; n < max_recs; n++) if (recs[n]) bam_destroy1(recs[n]);
+    free(recs);
+}
 
-    while (BAMit_hasnext(bam_in)) {
-        bam1_t *rec = BAMit_peek(bam_in);
-        int rec_count = 0;
-        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
-        while (BAMit_hasnext(bam_in) && strcmp(bam_get_qname(BAMit_peek(bam_in)),qname) == 0) {
-            if (job_data->nrec < job_data->record_set->end) {
-                if (!bam_copy1(job_data->record_set->entries[job_data->nrec], BAMit_next(bam_in)))
-                    die("bam_copy1() failed in processTemplatesThreads()");
-            } else {
-                bam1_t *rec = bam_init1();
-                if (!rec) { die("Out of memory"); }
-                if (!bam_copy1(rec, BAMit_next(bam_in))) die("bam_copy1() failed in processTemplatesThreads() [2]");
-                va_push(job_data->record_set, rec);
-            }
-            job_data->nrec++;
-            rec_count++;
+static int processTemplatesNoThreads(bambi_decode_t *ctx, BAMit_t *bam_in, BAMit_t *bam_out, chksum_results_t *results)
+{
+    bam1_t **recs = NULL;
+    int max_recs = 0, nrecs, ret = 0;
+
+    while (ret == 0 && (nrecs = BAMit_next_templates(bam_in, &recs, &max_recs, decode_templates_per_job)) > 0) {
+        ret = bambi_decode_records(ctx, recs, nrecs);
+        if (ret == 0) ret = writeRecords(recs, nrecs, bam_out, results, ctx->opts);
+    }
+
+    freeRecords(recs, max_recs);
+    return ret;
+}
+
+/*
+ * Write out a finished job, and put it on the free list
+ */
+static int finishJob(hts_tpool_result *r, decode_lib_job_t **freelist, BAMit_t *bam_out, chksum_results_t *results, int ret)
+{
+    decode_lib_job_t *job = hts_tpool_result_data(r);
+    if (job->result) ret = -1;
+    if (ret == 0) ret = writeRecords(job->recs, job->nrecs, bam_out, results, job->ctx->opts);
+    job->next = *freelist;
+    *freelist = job;
+    hts_tpool_delete_result(r, 0);
+    return ret;
+}
+
+/*
+ * Read the next job while the thread pool decodes the ones before it, and
+ * write each job out (in order) as it finishes
+ */
+static int processTemplatesThreads(bambi_decode_t *ctx, BAMit_t *bam_in, BAMit_t *bam_out, chksum_results_t *results)
+{
+    decode_lib_job_t *freelist = NULL;
+    hts_tpool_result *r;
+    int ret = 0;
+
+    while (ret == 0) {
+        decode_lib_job_t *job = freelist;
+        if (job) {
+            freelist = job->next;
+        } else {
+            job = calloc(1, sizeof(decode_lib_job_t));
+            if (!job) die("Out of memory");
+            job->ctx = ctx;
+            job->metrics = decode_metrics_init(ctx->barcodeArray);
         }
-        ia_push(job_data->template_counts, rec_count);
-
-        if (job_data->template_counts->end == TEMPLATES_PER_JOB) {
-            while (job_data != NULL) {
-                int blk = hts_tpool_dispatch2(pool, queue, decode_job, job_data, 1);
-                if (!blk) {
-                    job_data = NULL;
-                } else if (errno != EAGAIN) {
-                    die("Thread pool dispatch failed");
-                }
 
-                if (blk) {
-                    job_result = hts_tpool_next_result_wait(queue);
-                    if (!job_result) {
-                        die("Failed to get processing job result");
-                    }
-                } else {
-                    job_result = hts_tpool_next_result(queue);
-                }
+        job->nrecs = BAMit_next_templates(bam_in, &job->recs, &job->max_recs, decode_templates_per_job);
+        if (job->nrecs == 0) {
+            job->next = freelist;
+            freelist = job;
+            break;
+        }
 
-                if (job_result != NULL) {
-                    decode_thread_data_t *finished_job = hts_tpool_result_data(job_result);
-                    output_job_results(bam_out, finished_job, chksum_results, opts->hash);
-                    finished_job->next = job_freelist;
-                    job_freelist = finished_job;
-                    hts_tpool_delete_result(job_result, 0);
-                }
+        // if the queue is full, write out a finished job and try again
+        while (job) {
+            int blk = hts_tpool_dispatch2(ctx->pool, ctx->queue, decode_lib_job, job, 1);
+            if (!blk) {
+                job = NULL;
+            } else if (errno != EAGAIN) {
+                die("Thread pool dispatch failed");
             }
 
-            if (job_freelist != NULL) {
-                job_data = job_freelist;
-                job_freelist = job_data->next;
-                job_data->template_counts->end = 0;
-            }  else {
-                job_data = init_job(barcodeArray, barcodeHash, opts);
-                job_data->record_set = va_init(TEMPLATES_PER_JOB * 2, freeRecord);
-                job_data->template_counts = ia_init(TEMPLATES_PER_JOB);
-            }
-            job_data->nrec = 0;
+            r = blk ? hts_tpool_next_result_wait(ctx->queue) : hts_tpool_next_result(ctx->queue);
+            if (blk && !r) die("Failed to get processing job result");
+            if (r) ret = finishJob(r, &freelist, bam_out, results, ret);
         }
     }
 
-    if (job_data->template_counts->end > 0) {
-        // Deal with left-over items
-        if (hts_tpool_dispatch(pool, queue, decode_job, job_data) < 0) {
-            die("Thread pool dispatch failed");
-        }
-    } else {
-        // Not used, put back on free list
-        job_data->next = job_freelist;
-        job_freelist = job_data;
+    while (!hts_tpool_process_empty(ctx->queue)) {
+        r = hts_tpool_next_result_wait(ctx->queue);
+        if (!r) die("Failed to get processing job result");
+        ret = finishJob(r, &freelist, bam_out, results, ret);
     }
 
-    while (!hts_tpool_process_empty(queue)) {
-        job_result = hts_tpool_next_result_wait(queue);
-        if (!job_result) {
-            die("Failed to get processing job result");
-        }
-        decode_thread_data_t *finished_job = hts_tpool_result_data(job_result);
-        output_job_results(bam_out, finished_job, chksum_results, opts->hash);
-        finished_job->next = job_freelist;
-        job_freelist = finished_job;
-        hts_tpool_delete_result(job_result, 0);
+    while (freelist) {
+        decode_lib_job_t *job = freelist;
+        freelist = job->next;
+        decode_metrics_merge(job->metrics, ctx->barcodeArray, ctx->tagHopHash, ctx->opts);
+        decode_metrics_free(job->metrics);
+        freeRecords(job->recs, job->max_recs);
+        free(job);
     }
+    return ret;
+}
 
-    while (job_freelist != NULL) {
-        decode_thread_data_t *next = job_freelist->next;
-        accumulate_job_metrics(job_freelist->barcode_array, job_freelist->tagHopHash, barcodeArray, tagHopHash);
-        job_free(job_freelist);
-        job_freelist = next;
-    }
+/*
+ * Decode the input a set of templates at a time, and write the records out
+ */
+static int processTemplates(bambi_decode_t *ctx, BAMit_t *bam_in, BAMit_t *bam_out)
+{
+    decode_opts_t *opts = ctx->opts;
+    chksum_results_t *results = NULL;
+    int ret;
 
-    hts_tpool_process_destroy(queue);
+    if (opts->chksum_name) results = chksum_init_results(opts->hash);
 
-    if (opts->chksum_name) {
-        hFILE *f = hopen(opts->chksum_name, "w");
-        if (f) {
-            chksum_print_results(f, chksum_results);
-            if (hclose(f)) die("Can't close chksum file");
-        } else {
-            fprintf(stderr, "WARNING: couldn't open chksum file '%s'\n", opts->chksum_name);
+    if (ctx->pool) ret = processTemplatesThreads(ctx, bam_in, bam_out, results);
+    else           ret = processTemplatesNoThreads(ctx, bam_in, bam_out, results);
+
+    if (results) {
+        if (ret == 0) {
+            hFILE *f = hopen(opts->chksum_name, "w");
+            if (f) {
+                chksum_print_results(f, results);
+                if (hclose(f)) die("Can't close chksum file");
+            } else {
+                fprintf(stderr, "WARNING: couldn't open chksum file '%s'\n", opts->chksum_name);
+            }
         }
-        chksum_free_results(chksum_results);
+        chksum_free_results(results);
     }
-
-    return 0;
+    return ret;
 }
 
 /*
@@ -1597,6 +2144,47 @@ int get_barcode_metadata(va_t *barcodeArray, int idx,
     return 0;
 }
 
+/*
+ * A barcode file and its hash, shared by decode commands in a batch.
+ * Each command counts into its own copy of the array.
+ */
+typedef struct {
+    va_t *barcodeArray;
+    HashTable *barcodeHash;
+    int idx1_len, idx2_len;
+} barcode_index_t;
+
+static void free_barcode_index(void *arg)
+{
+    barcode_index_t *idx = (barcode_index_t *)arg;
+    va_free(idx->barcodeArray);
+    HashTableDestroy(idx->barcodeHash, 0);
+    free(idx);
+}
+
+static void *load_barcode_index(void *arg)
+{
+    decode_opts_t *opts = (decode_opts_t *)arg;
+    barcode_index_t *idx = calloc(1, sizeof(barcode_index_t));
+    if (!idx) die("Out of memory");
+    idx->barcodeArray = loadBarcodeFile(opts);
+    if (!idx->barcodeArray) { free(idx); return NULL; }
+    idx->barcodeHash = make_barcode_hash(idx->barcodeArray);
+    idx->idx1_len = opts->idx1_len;
+    idx->idx2_len = opts->idx2_len;
+    return idx;
+}
+
+static void *load_whitelist(void *arg)
+{
+    return whitelist_load((char *)arg);
+}
+
+static void free_whitelist(void *arg)
+{
+    whitelist_free((whitelist_t *)arg);
+}
+
 /*
  * Main code
  */
@@ -1606,78 +2194,219 @@ static int decode(decode_opts_t* opts)
     BAMit_t *bam_in = NULL;
     BAMit_t *bam_out = NULL;
     va_t *barcodeArray = NULL;
-    HashTable *tagHopHash = NULL;
     HashTable *barcodeHash = NULL;
+    barcode_index_t *shared_index = NULL;
+    bambi_decode_t *ctx = NULL;
     htsThreadPool hts_threads = { NULL, 0 };
+    htsThreadPool io_threads = { NULL, 0 };
+    htsThreadPool *io_pool = NULL;
 
     while (1) {
         if (opts->nthreads > 1) {
-            hts_threads.pool = hts_tpool_init(opts->nthreads);
+            hts_threads.pool = batch_tpool_init(opts->nthreads);
             if (!hts_threads.pool) {
                 fprintf(stderr, "Couldn't set up thread pool\n");
                 break;
             }
         }
+        if (opts->io_threads > 0) {
+            io_threads.pool = hts_tpool_init(opts->io_threads);
+            if (!io_threads.pool) {
+                fprintf(stderr, "Couldn't set up I/O thread pool\n");
+                break;
+            }
+        }
+        io_pool = io_threads.pool ? &io_threads : hts_threads.pool ? &hts_threads : NULL;
+        TEST_SET(decode_io_reserved, io_pool && io_pool->pool != hts_threads.pool);
 
         /*
          * Read the barcode (tags) file 
          */
-        barcodeArray = loadBarcodeFile(opts);
-        if (!barcodeArray) break;
+        if (opts->whitelist_name) {
+            // in a batch, the whitelist is read once and shared
+            if (batch_running()) {
+                char key[8192];
+                snprintf(key, sizeof(key), "whitelist:%s", opts->whitelist_name);
+                opts->whitelist = batch_cache_get(key, load_whitelist, opts->whitelist_name, free_whitelist);
+            } else {
+                opts->whitelist = whitelist_load(opts->whitelist_name);
+            }
+            if (!opts->whitelist) break;
+            opts->wl_counts = calloc(opts->whitelist->nbarcodes, sizeof(bc_counts_t));
+            if (!opts->wl_counts) die("Out of memory");
+            barcodeArray = makeWhitelistBarcodeArray(opts);
+        } else if (batch_running()) {
+            // in a batch, the barcode file is read once and shared
+            char key[8192];
+            snprintf(key, sizeof(key), "decode:%d:%s", opts->dual_tag, opts->barcode_name);
+            shared_index = batch_cache_get(key, load_barcode_index, opts, free_barcode_index);
+            if (!shared_index) break;
+            barcodeArray = copy_barcode_array(shared_index->barcodeArray);
+            barcodeHash = shared_index->barcodeHash;
+            opts->idx1_len = shared_index->idx1_len;
+            opts->idx2_len = shared_index->idx2_len;
+        } else {
+            barcodeArray = loadBarcodeFile(opts);
+            if (!barcodeArray) break;
 
-        // create hash from barcodeArray
-        barcodeHash = make_barcode_hash(barcodeArray);
+            // create hash from barcodeArray
+            barcodeHash = make_barcode_hash(barcodeArray);
+        }
 
-        tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+        ctx = decode_ctx_init(opts, barcodeArray, barcodeHash, hts_threads.pool, false);
 
         /*
          * Open input fnd output BAM files
          */
-        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, hts_threads.pool ? &hts_threads : NULL);
+        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, io_pool,
+                            opts->metrics_only ? SAM_QNAME | SAM_FLAG | SAM_AUX : 0);
         if (!bam_in) break;
-        bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, opts->compression_level, hts_threads.pool ? &hts_threads : NULL);
-        if (!bam_out) break;
-        // copy input to output header
-        sam_hdr_destroy(bam_out->h); bam_out->h = sam_hdr_dup(bam_in->h);
-
-        // Change header by adding PG and RG lines
-        changeHeader(barcodeArray, bam_out->h, opts->argv_list);
-        if (sam_hdr_write(bam_out->f, bam_out->h) != 0) {
-            fprintf(stderr, "Could not write output file header\n");
-            break;
+        if (!opts->metrics_only) {
+            bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, opts->compression_level, io_pool, 0);
+            if (!bam_out) break;
+            // copy input to output header
+            sam_hdr_destroy(bam_out->h); bam_out->h = sam_hdr_dup(bam_in->h);
+
+            // Change header by adding PG and RG lines (just the PG line for a whitelist)
+            if (opts->whitelist) sam_hdr_add_pg(bam_out->h, "bambi", "VN", bambi_version(), "CL", opts->argv_list, NULL);
+            else                 changeHeader(barcodeArray, bam_out->h, opts->argv_list);
+            if (sam_hdr_write(bam_out->f, bam_out->h) != 0) {
+                fprintf(stderr, "Could not write output file header\n");
+                break;
+            }
         }
 
         // Read and process each template in the input BAM
-        if (opts->nthreads < 2) {
-            if (processTemplatesNoThreads(bam_in, bam_out, barcodeArray, barcodeHash, tagHopHash, opts) < 0) break;
-        } else {
-            if (processTemplatesThreads(hts_threads.pool, bam_in, bam_out, barcodeArray, barcodeHash, tagHopHash, opts) < 0) break;
-        }
+        if (processTemplates(ctx, bam_in, bam_out) < 0) break;
 
         if (BAMit_hasnext(bam_in)) break;   // we must has exited the above loop early
 
         /*
          * And finally.....the metrics
          */
-        if (opts->metrics_name) {
-            if (writeMetrics(barcodeArray, tagHopHash, opts) != 0) break;
-        }
-                
+        if (bambi_decode_finish(ctx) != 0) break;
+
         retcode = 0;
         break;
     }
 
     // tidy up after us
-    free_tagHopHash(tagHopHash);
-    va_free(barcodeArray);
-    HashTableDestroy(barcodeHash, 0);
+    bambi_decode_destroy(ctx);
+    if (shared_index) {
+        if (barcodeArray) delete_barcode_array_copy(barcodeArray);
+    } else {
+        va_free(barcodeArray);
+        HashTableDestroy(barcodeHash, 0);
+    }
+    if (!batch_running()) whitelist_free(opts->whitelist);
+    opts->whitelist = NULL;
     BAMit_free(bam_in);
     BAMit_free(bam_out);
-    if (hts_threads.pool) hts_tpool_destroy(hts_threads.pool);
+    batch_tpool_destroy(hts_threads.pool);
+    if (io_threads.pool) hts_tpool_destroy(io_threads.pool);
 
     return retcode;
 }
 
+bambi_decode_t *bambi_decode_init(int argc, char **argv, hts_tpool *pool)
+{
+    // parse_args() expects "bambi" before the command, and an input file (which isn't used)
+    char **args = smalloc((argc + 3) * sizeof(char *));
+    args[0] = "bambi";
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    args[argc + 1] = "-";
+    args[argc + 2] = NULL;
+    decode_opts_t *opts = parse_args(argc + 1, args + 1);
+    free(args);
+    if (!opts) return NULL;
+
+    if (opts->merge_metrics || opts->whitelist_name) {
+        fprintf(stderr, "--%s can't be used with libbambi\n", opts->merge_metrics ? "merge-metrics" : "whitelist");
+        decode_free_opts(opts);
+        return NULL;
+    }
+
+    va_t *barcodeArray = loadBarcodeFile(opts);
+    if (!barcodeArray) {
+        decode_free_opts(opts);
+        return NULL;
+    }
+    return decode_ctx_init(opts, barcodeArray, make_barcode_hash(barcodeArray), pool, true);
+}
+
+int bambi_decode_header(bambi_decode_t *ctx, sam_hdr_t *hdr)
+{
+    changeHeader(ctx->barcodeArray, hdr, ctx->opts->argv_list);
+    return 0;
+}
+
+static void fill_barcode_metrics(bambi_barcode_metrics_t *m, bc_details_t *bcd, bool tag_hop)
+{
+    m->barcode = bcd->seq;
+    m->name = bcd->name;
+    m->library = bcd->lib;
+    m->sample = bcd->sample;
+    m->description = bcd->desc;
+    m->tag_hop = tag_hop;
+    m->reads = bcd->reads;
+    m->pf_reads = bcd->pf_reads;
+    m->perfect = bcd->perfect;
+    m->pf_perfect = bcd->pf_perfect;
+    m->one_mismatch = bcd->one_mismatch;
+    m->pf_one_mismatch = bcd->pf_one_mismatch;
+}
+
+int bambi_decode_metrics(bambi_decode_t *ctx, bambi_barcode_metrics_fn fn, void *arg)
+{
+    bambi_barcode_metrics_t m;
+    int ret = 0;
+
+    decode_lib_merge(ctx);
+
+    for (int n = 0; n < ctx->barcodeArray->end && ret == 0; n++) {
+        fill_barcode_metrics(&m, ctx->barcodeArray->entries[n], false);
+        ret = fn(&m, arg);
+    }
+
+    HashIter *iter = HashTableIterCreate();
+    if (!iter) die("Out of memory");
+    HashItem *hi;
+    while (ret == 0 && (hi = HashTableIterNext(ctx->tagHopHash, iter)) != NULL) {
+        fill_barcode_metrics(&m, hi->data.p, true);
+        ret = fn(&m, arg);
+    }
+    HashTableIterDestroy(iter);
+
+    return ret ? -1 : 0;
+}
+
+int bambi_decode_finish(bambi_decode_t *ctx)
+{
+    decode_lib_merge(ctx);
+    if (ctx->opts->partial_metrics_name) {
+        if (writePartialMetrics(ctx->barcodeArray, ctx->tagHopHash, ctx->opts) != 0) return -1;
+    }
+    if (ctx->opts->metrics_name) {
+        if (writeMetrics(ctx->barcodeArray, ctx->tagHopHash, ctx->opts) != 0) return -1;
+    }
+    return 0;
+}
+
+void bambi_decode_destroy(bambi_decode_t *ctx)
+{
+    if (!ctx) return;
+    if (ctx->queue) hts_tpool_process_destroy(ctx->queue);
+    for (int n = 0; ctx->jobs && n < ctx->njobs; n++) decode_metrics_free(ctx->jobs[n].metrics);
+    free(ctx->jobs);
+    free_tagHopHash(ctx->tagHopHash);
+    if (ctx->own_barcodes) {
+        va_free(ctx->barcodeArray);
+        HashTableDestroy(ctx->barcodeHash, 0);
+        decode_free_opts(ctx->opts);
+    }
+    free(ctx);
+}
+
 /*
  * called from bambi to perform index decoding
  *
@@ -1690,8 +2419,10 @@ int main_decode(int argc, char *argv[])
     int ret = 1;
 
     decode_opts_t* opts = parse_args(argc, argv);
+
+    batch_args_parsed();
     if (opts) {
-        ret = decode(opts);
+        ret = opts->merge_metrics ? mergeMetrics(opts) : decode(opts);
     }
     decode_free_opts(opts);
     return ret;
@@ -60,11 +60,17 @@ va_t *copy_barcode_array(va_t *barcode_array);
 // Clean up a barcode array copy
 void delete_barcode_array_copy(va_t *barcode_array);
 
-// Barcode look-up.  Also updates metrics.
-char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts, bool isPf, bool isUpdateMetrics);
+// Metrics counts for one job or thread
+typedef struct decode_metrics_t decode_metrics_t;
+
+decode_metrics_t *decode_metrics_init(va_t *barcodeArray);
+void decode_metrics_free(decode_metrics_t *metrics);
 
-// Accumulate metrics in per-thread copies
-void accumulate_job_metrics(va_t *job_barcodes, HashTable *job_tag_hops, va_t *barcodeArray, HashTable *tagHopHash);
+// Add the counts into the barcode array and tag hops hash, and clear them
+void decode_metrics_merge(decode_metrics_t *metrics, va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts);
+
+// Barcode look-up.  Also updates metrics.
+char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, decode_metrics_t *metrics, decode_opts_t *opts, bool isPf, bool isUpdateMetrics);
 
 // Write out metrics
 int writeMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts);
@@ -32,19 +32,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "bambi.h"
 #include "filterfile.h"
+#include "archive.h"
 
 filter_t *filter_open(char *fname)
+{
+    return filter_open_as(fname, fname);
+}
+
+filter_t *filter_open_as(char *fname, const char *name)
 {
     filter_t *filter = calloc(1, sizeof(filter_t));
     if (!filter) {
         fprintf(stderr, "Out of memory");
         exit(1);
     }
+    filter->file_name = strdup(name);
+    if (!filter->file_name) {
+        fprintf(stderr, "Out of memory");
+        exit(1);
+    }
     filter->total_clusters = 0;
     filter->current_cluster = 0;
     filter->buffer = NULL;
     filter->buffer_size = 0;
-    filter->fhandle = fopen(fname, "rb");
+    filter->fhandle = archive_fopen(fname);
     if (filter->fhandle == NULL) {
         filter->errmsg = strdup(strerror(errno));
     } else {
@@ -53,7 +64,7 @@ filter_t *filter_open(char *fname)
         filter->errmsg=NULL;
         n = fread(x, 4, 3, filter->fhandle);
         if (n != 3) {
-            fprintf(stderr,"failed to read header from %s\n", fname);
+            fprintf(stderr,"failed to read header from %s\n", filter->file_name);
             exit(1);
         }
         // x[0] is ignored
@@ -67,11 +78,12 @@ void filter_close(filter_t *filter)
 {
     if (filter->fhandle!=NULL) {
         if (fclose(filter->fhandle)) {
-            fprintf(stderr, "Can't close filter file\n");
+            fprintf(stderr, "Can't close filter file %s\n", filter->file_name);
             exit(1);
         }
     }
     free(filter->errmsg);
+    free(filter->file_name);
     free(filter->buffer);
     free(filter);
 }
@@ -81,7 +93,7 @@ void filter_seek(filter_t *filter, int cluster)
     off_t pos = 12 + cluster;
     int n = fseeko(filter->fhandle, pos, SEEK_SET);
     if (n < 0) {
-        fprintf(stderr, "filter_seek(%d) failed: %s\n", cluster, strerror(errno));
+        fprintf(stderr, "filter_seek(%s, %d) failed: %s\n", filter->file_name, cluster, strerror(errno));
         exit(1);
     }
 }
@@ -96,7 +108,7 @@ void filter_load(filter_t *filter, size_t clusters)
     }
     size_t n = fread(filter->buffer, 1, clusters, filter->fhandle);
     if (n != clusters) {
-        fprintf(stderr, "filter_load(): Expected %ld clusters, read %zd\n", clusters, n);
+        fprintf(stderr, "filter_load(%s): Expected %ld clusters, read %zd\n", filter->file_name, clusters, n);
         exit(1);
     }
     filter->total_clusters = clusters;
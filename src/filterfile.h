@@ -25,6 +25,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 typedef struct {
     FILE *fhandle;
+    char *file_name;        // used in error messages
     char *errmsg;
     uint32_t version;
     uint32_t total_clusters;
@@ -34,6 +35,8 @@ typedef struct {
 } filter_t;
 
 filter_t *filter_open(char *fname);
+// Open fname, giving name in error messages (eg for a staged copy of a file)
+filter_t *filter_open_as(char *fname, const char *name);
 int filter_next(filter_t *filter);
 void filter_close(filter_t *filter);
 void filter_seek(filter_t *filter, int cluster);
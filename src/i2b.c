@@ -41,6 +41,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <htslib/thread_pool.h>
 #include <htslib/khash.h>
+#include <htslib/bgzf.h>
+#include <htslib/cram.h>
+#include <inttypes.h>
 
 #include "decode.h"
 #include "posfile.h"
@@ -48,6 +51,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bclfile.h"
 #include "array.h"
 #include "parse.h"
+#include "stage.h"
+#include "shm.h"
+#include "archive.h"
+#include "batch_shared.h"
+#include "libbambi.h"
+#include "spatial_filter.h"
 
 #define DEFAULT_BARCODE_TAG "BC"
 #define DEFAULT_QUALITY_TAG "QT"
@@ -56,6 +65,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define QUEUELEN "1000000"
 #define CLUSTERS_PER_THREAD 25000
 #define NOCALL_QUALITY_VALUE 2
+#define DEFAULT_STAGE_BUDGET "4G"
+#define CRAM_PROFILE_VERSION "3.1"
+#define CRAM_SEQS_PER_SLICE 100000
+
+JOB_SIZE(i2b_clusters_per_thread, CLUSTERS_PER_THREAD)
+TEST_RECORD(i2b_io_reserved)        // the output was compressed by the --io-threads pool
+TEST_RECORD(i2b_bcl_reserved)       // BCL files were read by the --bcl-threads pool
+
+// staging groups: one per tile, plus one (tile 0) for files shared by the whole lane
+#define STAGE_GROUP(lane,tile) ((lane) * 100000 + (tile))
 
 // BCL file cache
 KHASH_MAP_INIT_INT(bcl_cache, bclfile_t *);
@@ -66,8 +85,6 @@ typedef struct lockable_bcl_cache {
 
 char *strptime(const char *s, const char *format, struct tm *tm);
 
-static int machineType = MT_UNKNOWN;    // used to determine BCL file format in openBclFile()
-
 /*
  * Cycle range array
  */
@@ -130,8 +147,11 @@ typedef struct {
     char *intensity_dir;
     char *basecalls_dir;
     ia_t *lane;
+    MACHINE_TYPE machine_type;  // used to determine BCL file format in openBclFile()
     int nthreads;
     int pool_size;
+    int io_threads;             // reserved for compressing the output
+    int bcl_threads;            // reserved for reading BCL files
     char *output_file;
     char *output_fmt;
     char compression_level;
@@ -147,6 +167,9 @@ typedef struct {
     char *platform;
     int first_tile;
     int tile_limit;
+    ia_t *exclude_tiles;        // TILE_KEY()s of tiles not to process
+    float min_tile_pf_fraction;
+    kstring_t skipped_tiles;    // @CO lines for the tiles we skipped
     int qlen;
     va_t *barcode_tag;
     va_t *quality_tag;
@@ -170,8 +193,35 @@ typedef struct {
     int max_low_quality_to_convert;
     bool fix_blocks;
     bool nocall_quality;
+    char *stage_dir;
+    size_t stage_budget;
+    char *archive;
+    bool archive_mounted;
+    stage_t *stage;
+    char *tile_index_name;
+    hFILE *tile_index;
+    va_t *cram_tiles;           // tileRecords_t: the tile index for CRAM output is written at the end
+    char *cram_index_name;
+    char *qual_bins_name;
+    uint8_t qual_map[256];      // quality binning table (identity if not binning)
+    hts_tpool *thread_pool;     // set by libbambi: use this pool instead of our own
+    bambi_header_fn header_fn;  // set by libbambi: pass the header and records
+    bambi_records_fn records_fn;//   to these instead of writing them
+    void *fn_arg;
 } opts_t;
 
+// key for a tile in the --exclude-tiles list. Lane 0 matches any lane.
+#define TILE_KEY(lane,tile) ((lane) * 1000000 + (tile))
+
+/*
+ * Records written for a tile, for the CRAM tile index
+ */
+typedef struct {
+    int lane;
+    int tile;
+    uint64_t nrecords;
+} tileRecords_t;
+
 /*
  * Data to be passed / shared between tile threads
  */
@@ -194,10 +244,13 @@ typedef struct {
     lockable_bcl_cache *bcl_cache;
     hts_tpool *thread_p;
     hts_tpool_process *thread_q;
+    hts_tpool *bcl_p;
     HashTable *barcodes_hash;
     HashTable *tag_hops;
     size_t longest_barcode_name;
     int lane;
+    uint64_t nrecords;          // records written for this tile
+    bool failed;                // records_fn asked us to stop
 } job_data_t;
 
 
@@ -209,12 +262,17 @@ typedef struct {
 void i2b_free_opts(opts_t* opts)
 {
     if (!opts) return;
+    if (opts->archive_mounted) archive_unmount(opts->archive);
     free(opts->run_folder);
     free(opts->intensity_dir);
     free(opts->basecalls_dir);
     free(opts->argv_list);
     free(opts->output_file);
     free(opts->output_fmt);
+    free(opts->tile_index_name);
+    free(opts->cram_index_name);
+    va_free(opts->cram_tiles);
+    free(opts->qual_bins_name);
     free(opts->read_group_id);
     free(opts->sample_alias);
     free(opts->library_name);
@@ -223,11 +281,15 @@ void i2b_free_opts(opts_t* opts)
     free(opts->run_start_date);
     free(opts->sequencing_centre);
     free(opts->platform);
+    free(opts->stage_dir);
+    free(opts->archive);
     va_free(opts->barcode_tag);
     va_free(opts->quality_tag);
     va_free(opts->barcodeArray);
     ia_free(opts->bc_read);
     ia_free(opts->lane);
+    ia_free(opts->exclude_tiles);
+    ks_free(&opts->skipped_tiles);
     ia_free(opts->first_cycle);
     ia_free(opts->final_cycle);
     ia_free(opts->first_index_cycle);
@@ -242,16 +304,13 @@ void i2b_free_opts(opts_t* opts)
 
 static int isDirectory(char *dir, char *fname)
 {
-    struct stat buf;
     int is_directory = 0;
     char *path = malloc(strlen(dir) + strlen(fname) + 2);
     if (!path) die("Out of memory in isDirectory");
     strcpy(path, dir);
     strcat(path, "/");
     strcat(path, fname);
-    if (stat(path, &buf) == 0) {
-        is_directory = S_ISDIR(buf.st_mode);
-    }
+    is_directory = archive_is_dir(path);
     free(path);
     return is_directory;
 }
@@ -259,17 +318,17 @@ static int isDirectory(char *dir, char *fname)
 static ia_t *fillLaneList(char *basecalls_dir)
 {
     ia_t *lanes = ia_init(8);
-    struct dirent *dir;
-    DIR *d = opendir(basecalls_dir);
+    va_t *d = archive_list_dir(basecalls_dir);
     if (!d) die("Can't open basecalls directory: %s\n", basecalls_dir);
 
-    while ( (dir = readdir(d)) != NULL) {
+    for (int n=0; n < d->end; n++) {
+        char *name = d->entries[n];
         // Look for a lane directory
-        if (isDirectory(basecalls_dir, dir->d_name) && dir->d_name[0] == 'L') {
-            ia_push(lanes, atoi(dir->d_name+1));
+        if (isDirectory(basecalls_dir, name) && name[0] == 'L') {
+            ia_push(lanes, atoi(name+1));
         }
     }
-    closedir(d);
+    va_free(d);
     ia_sort(lanes);
     return lanes;
 }
@@ -307,6 +366,119 @@ ia_t *parseLaneList(char *arg)
     return lanes;
 }
 
+/*
+ * Parse a list of tiles to exclude, either
+ * --exclude-tiles 1101,1102,2_2104
+ * or
+ * --exclude-tiles bad_tiles.txt
+ * or
+ * --exclude-tiles lane_2.filter
+ *
+ * where the file holds the same list, separated by commas or white space,
+ * with '#' starting a comment. A tile may be qualified by its lane (as in
+ * RunInfo.xml), otherwise it is excluded from every lane.
+ *
+ * A spatial filter file excludes the tiles which spatial_filter would discard
+ * for having too few reads, in the lanes the filter is for.
+ *
+ * Anything other than digits, '_', ',' and spaces is taken to be a file name,
+ * so a file called 1101 must be given as ./1101
+ *
+ * Returns an integer array of TILE_KEY()s, or NULL if the list can't be parsed.
+ */
+ia_t *parseTileList(char *arg)
+{
+    kstring_t list = KS_INITIALIZE;
+
+    if (arg[strspn(arg, "0123456789_, ")]) {
+        char buf[8192];
+        ssize_t len;
+        hFILE *f = hopen(arg, "r");
+        if (!f) { fprintf(stderr, "Can't open tile list %s: %s\n", arg, strerror(errno)); return NULL; }
+        if (sf_isFilterFile(f)) {
+            ia_t *lanes = ia_init(8), *tiles = ia_init(8);
+            sf_badTiles(f, lanes, tiles);
+            if (hclose(f)) die("Can't close spatial filter file %s\n", arg);
+            for (int n = 0; n < tiles->end; n++) tiles->entries[n] = TILE_KEY(lanes->entries[n], tiles->entries[n]);
+            ia_free(lanes);
+            return tiles;
+        }
+        while ((len = hread(f, buf, sizeof(buf))) > 0) kputsn(buf, len, &list);
+        if (len < 0) die("Can't read tile list %s\n", arg);
+        if (hclose(f)) die("Can't close tile list %s\n", arg);
+        // blank out the comments
+        for (char *p = list.s ? strchr(list.s, '#') : NULL; p; p = strchr(p, '#')) {
+            while (*p && *p != '\n') *p++ = ' ';
+        }
+    } else {
+        kputs(arg, &list);
+    }
+
+    ia_t *tiles = ia_init(8);
+    char *saveptr;
+    char *s = strtok_r(list.s ? list.s : "", ", \t\r\n", &saveptr);
+    while (s) {
+        char *end;
+        long lane = 0, tile = strtol(s, &end, 10);
+        if (*end == '_') {
+            lane = tile;
+            tile = strtol(end+1, &end, 10);
+        }
+        if (*end || lane < 0 || tile <= 0) {
+            fprintf(stderr, "Invalid tile '%s' in %s\n", s, arg);
+            ia_free(tiles); tiles = NULL;
+            break;
+        }
+        ia_push(tiles, TILE_KEY(lane, tile));
+        s = strtok_r(NULL, ", \t\r\n", &saveptr);
+    }
+    free(list.s);
+    return tiles;
+}
+
+/*
+ * Parse a quality binning scheme:
+ *
+ * --qual-bins illumina8     Illumina 8 level binning (2-9:6,10-19:15,20-24:22,25-29:27,30-34:33,35-39:37,40-:40)
+ * or
+ * --qual-bins illumina4     4 level binning, as used by NovaSeq (3-14:12,15-30:23,31-:37)
+ * or
+ * --qual-bins 2-19:10,20-:30
+ *
+ * and fill in map, a 256 entry table from original to binned quality.
+ * Values outside all the ranges are left unchanged.
+ * Returns 0 on success, -1 if the scheme can't be parsed.
+ */
+int parseQualBins(char *arg, uint8_t *map)
+{
+    if (strcmp(arg, "illumina8") == 0) arg = "2-9:6,10-19:15,20-24:22,25-29:27,30-34:33,35-39:37,40-:40";
+    if (strcmp(arg, "illumina4") == 0) arg = "3-14:12,15-30:23,31-:37";
+
+    for (int q = 0; q < 256; q++) map[q] = q;
+
+    char *argstr = strdup(arg);
+    int retcode = 0;
+    char *s = strtok(argstr,",");
+    if (!s) retcode = -1;
+    while (s) {
+        char *p;
+        long lo = strtol(s, &p, 10), hi = lo, val;
+        if (p == s) { retcode = -1; break; }
+        if (*p == '-') {
+            char *q = p + 1;
+            hi = strtol(q, &p, 10);
+            if (p == q) hi = 93;
+        }
+        if (*p != ':') { retcode = -1; break; }
+        val = strtol(p + 1, &p, 10);
+        if (*p || lo < 0 || hi < lo || hi > 255 || val < 0 || val > 93) { retcode = -1; break; }
+        for (int q = lo; q <= hi; q++) map[q] = val;
+        s = strtok(NULL,",");
+    }
+    free(argstr);
+    return retcode;
+}
+
 /*
  * determineMachineType
  *
@@ -318,47 +490,49 @@ ia_t *parseLaneList(char *arg)
 MACHINE_TYPE determineMachineType(char *basecalls_dir)
 {
     MACHINE_TYPE mt = MT_UNKNOWN;
-    struct dirent *dir;
     char *lane_n = NULL;
     char *cycle_n = NULL;
 
-    DIR *d = opendir(basecalls_dir);
+    va_t *d = archive_list_dir(basecalls_dir);
     if (!d) die("Can't open basecalls directory: %s\n", basecalls_dir);
 
-    while ( (dir = readdir(d)) != NULL) {
+    for (int n=0; n < d->end; n++) {
+        char *name = d->entries[n];
         // Look for a lane directory
-        if (isDirectory(basecalls_dir, dir->d_name) && dir->d_name[0] == 'L') {
-            lane_n = malloc(strlen(basecalls_dir)+strlen(dir->d_name)+16);
-            sprintf(lane_n, "%s/%s", basecalls_dir, dir->d_name);
-            DIR *lane_d = opendir(lane_n);
-            if (!lane_d) die("Can't open lane directory: %s\n", dir->d_name);
-            while ( (dir = readdir(lane_d)) != NULL) {
+        if (isDirectory(basecalls_dir, name) && name[0] == 'L') {
+            lane_n = malloc(strlen(basecalls_dir)+strlen(name)+16);
+            sprintf(lane_n, "%s/%s", basecalls_dir, name);
+            va_t *lane_d = archive_list_dir(lane_n);
+            if (!lane_d) die("Can't open lane directory: %s\n", name);
+            for (int l=0; l < lane_d->end; l++) {
+                name = lane_d->entries[l];
                 // Look for either a Cycle directory, or a .bcl.bgzf file
-                if (isDirectory(lane_n, dir->d_name) && dir->d_name[0] == 'C') {
-                    cycle_n = malloc(strlen(lane_n)+strlen(dir->d_name)+16);
-                    sprintf(cycle_n, "%s/%s", lane_n, dir->d_name);
-                    DIR *cycle_d = opendir(cycle_n);
-                    if (!cycle_d) die("Can't open cycle directory: %s\n", dir->d_name);
-                    while ( (dir = readdir(cycle_d)) != NULL) {
+                if (isDirectory(lane_n, name) && name[0] == 'C') {
+                    cycle_n = malloc(strlen(lane_n)+strlen(name)+16);
+                    sprintf(cycle_n, "%s/%s", lane_n, name);
+                    va_t *cycle_d = archive_list_dir(cycle_n);
+                    if (!cycle_d) die("Can't open cycle directory: %s\n", name);
+                    for (int c=0; c < cycle_d->end; c++) {
+                        name = cycle_d->entries[c];
                         // Look for bcl, bcl.gz, or cbcl files
-                        if (strstr(dir->d_name, ".bcl.gz")) { mt = MT_HISEQX; break; }
-                        if (strstr(dir->d_name, ".bcl")) { mt = MT_MISEQ; break; }
-                        if (strstr(dir->d_name, ".cbcl")) { mt = MT_NOVASEQ; break; }
+                        if (strstr(name, ".bcl.gz")) { mt = MT_HISEQX; break; }
+                        if (strstr(name, ".bcl")) { mt = MT_MISEQ; break; }
+                        if (strstr(name, ".cbcl")) { mt = MT_NOVASEQ; break; }
                     }
-                    closedir(cycle_d);
+                    va_free(cycle_d);
                     break;
                 }
-                if (strstr(dir->d_name, ".bcl.bgzf")) {
+                if (strstr(name, ".bcl.bgzf")) {
                     mt = MT_NEXTSEQ;
                     break;
                 }
             }
-            closedir(lane_d);
+            va_free(lane_d);
             break;
         }
     }
     
-    closedir(d);
+    va_free(d);
     free(lane_n); free(cycle_n);
     return mt;
 }
@@ -454,7 +628,14 @@ static xmlDocPtr loadXML(char *dir, char *fname, int verbose)
     xmlDocPtr doc;
     char *tmp = calloc(1, strlen(dir) + strlen(fname) + 2);
     sprintf(tmp, "%s/%s", dir, fname);
-    doc = xmlReadFile(tmp, NULL, XML_PARSE_NOWARNING);
+    if (archive_is_member(tmp)) {
+        size_t size = 0;
+        char *buffer = archive_load(tmp, &size);
+        doc = buffer ? xmlReadMemory(buffer, size, tmp, NULL, XML_PARSE_NOWARNING) : NULL;
+        free(buffer);
+    } else {
+        doc = xmlReadFile(tmp, NULL, XML_PARSE_NOWARNING);
+    }
     if (doc && verbose) display("Opened XML file: %s/%s\n", dir, fname);
     free(tmp);
     return doc;
@@ -477,7 +658,8 @@ static void usage(FILE *write_to)
 "                                       bcl files under lane cycle directory\n"
 "                                       [default: BaseCalls directory under intensities]\n"
 "  -l   --lane                          Lane number(s). May be a comma separated list or range, or both (eg '1-4,6,8'). Required.\n"
-"  -o   --output-file                   Output file name. May be '-' for stdout. Required\n"
+"  -o   --output-file                   Output file name. May be '-' for stdout, or shm:NAME for a shared\n"
+"                                       memory ring read by another bambi process. Required\n"
 "       --no-filter                     Do not filter cluster [default: false]\n"
 "       --ignore-missing                Ignore missing BCL files and carry on [default: false]\n"
 "       --read-group-id                 ID used to link RG header record with RG tag in SAM record. [default: '1']\n"
@@ -492,6 +674,12 @@ static void usage(FILE *write_to)
 "                                       debugging. [default: null]\n"
 "       --tile-limit                    Number of tiles to process. Normally only used for testing and\n"
 "                                       debugging. [default: all tiles]\n"
+"       --exclude-tiles                 Tiles not to process, as a comma separated list, or the name of a file\n"
+"                                       containing a list, or of a spatial filter file, which excludes the\n"
+"                                       tiles spatial_filter discards for too few reads. Tiles may be given\n"
+"                                       as <lane>_<tile> to exclude them from one lane only. [default: none]\n"
+"       --min-tile-pf-fraction          Don't process tiles where less than this fraction of clusters pass\n"
+"                                       filter, according to the filter file. [default: 0]\n"
 "       --barcode-tag                   comma separated list of tag names for barcode sequences. [default: " DEFAULT_BARCODE_TAG "]\n"
 "       --quality-tag                   comma separated list of tag name for barcode qualities. [default: " DEFAULT_QUALITY_TAG "]\n"
 "       --sec-barcode-tag               DEPRECATED: Tag name for second barcode sequence. [default: null]\n"
@@ -509,9 +697,31 @@ static void usage(FILE *write_to)
 "  -S   --no-index-separator            Do NOT separate dual indexes with a '" INDEX_SEPARATOR "' character. Just concatenate instead.\n"
 "  -v   --verbose                       verbose output\n"
 "  -t   --threads                       maximum number of threads to use [default: " DEFAULT_MAX_THREADS "]\n"
+"       --io-threads                    number of threads to reserve for compressing the output. If 0, the\n"
+"                                       output shares the main thread pool. [default: 0]\n"
+"       --bcl-threads                   number of threads to reserve for reading BCL files. If 0, BCL files\n"
+"                                       are read by the main thread pool. [default: 0]\n"
 "       --fix-blocks                    fix corrupted cbcl blocks and continue instead of aborting.\n"
 "       --output-fmt                    [sam/bam/cram] [default: bam]\n"
+"                                       CRAM output is version " CRAM_PROFILE_VERSION ", with no reference, the name tokeniser\n"
+"                                       and fqzcomp quality codec, and each tile in its own containers.\n"
+"                                       A .crai index is written alongside. Options given with the format\n"
+"                                       (eg cram,version=3.0) override these.\n"
 "       --compression-level             [0..9]\n"
+"       --stage-dir                     Copy the filter, position and bcl files for each tile to this (local)\n"
+"                                       directory in the background before they are needed. [default: none]\n"
+"       --stage-budget                  Maximum space to use in the staging directory. K, M or G suffix allowed.\n"
+"                                       [default: " DEFAULT_STAGE_BUDGET "]\n"
+"       --archive                       Read the run folder from this uncompressed tar file. The directory\n"
+"                                       options are then paths within the archive.\n"
+"       --qual-bins                     Bin the quality values: 'illumina8' for Illumina 8 level binning,\n"
+"                                       'illumina4' for 4 level (NovaSeq style) binning, or a list of\n"
+"                                       ranges and values, eg '2-19:10,20-:30'. Barcode quality tags are\n"
+"                                       not binned. [default: no binning]\n"
+"       --tile-index                    Write the BGZF virtual offsets and number of records for each tile\n"
+"                                       of the (BAM) output to this file, so that tiles can be read\n"
+"                                       separately later. For CRAM output, the offsets are those of the\n"
+"                                       first container of the tile and of the next tile.\n"
 "Barcode decoding options:\n"
 "       --barcode-file                  file containing barcodes.\n"
 "       --barcode-tag-name              Barcode tag to use for decoding\n"
@@ -562,6 +772,8 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         { "platform",                   1, 0, 0 },
         { "first-tile",                 1, 0, 0 },
         { "tile-limit",                 1, 0, 0 },
+        { "exclude-tiles",              1, 0, 0 },
+        { "min-tile-pf-fraction",       1, 0, 0 },
         { "barcode-tag",                1, 0, 0 },
         { "quality-tag",                1, 0, 0 },
         { "sec-barcode-tag",            1, 0, 0 },
@@ -584,6 +796,13 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         { "change-read-name",           0, 0, 0 },
         { "ignore-pf",                  0, 0, 0 },
         { "fix-blocks",                 0, 0, 0 },
+        { "stage-dir",                  1, 0, 0 },
+        { "stage-budget",               1, 0, 0 },
+        { "archive",                    1, 0, 0 },
+        { "io-threads",                 1, 0, 0 },
+        { "bcl-threads",                1, 0, 0 },
+        { "tile-index",                 1, 0, 0 },
+        { "qual-bins",                  1, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -607,6 +826,7 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     opts->decode_tags = false;
     opts->decode_calls_tag = NULL;
     opts->nocall_quality = false;
+    opts->stage_budget = stage_parse_size(DEFAULT_STAGE_BUDGET);
 
     int opt;
     int option_index = 0;
@@ -648,6 +868,11 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                     else if (strcmp(arg, "platform") == 0)                     opts->platform = strdup(optarg);
                     else if (strcmp(arg, "first-tile") == 0)                   opts->first_tile = atoi(optarg);
                     else if (strcmp(arg, "tile-limit") == 0)                   opts->tile_limit = atoi(optarg);
+                    else if (strcmp(arg, "exclude-tiles") == 0) {
+                        ia_free(opts->exclude_tiles);
+                        opts->exclude_tiles = parseTileList(optarg);
+                        if (!opts->exclude_tiles) { usage(stderr); i2b_free_opts(opts); return NULL; }
+                    } else if (strcmp(arg, "min-tile-pf-fraction") == 0)       opts->min_tile_pf_fraction = atof(optarg);
                     else if (strcmp(arg, "barcode-tag") == 0)                  parse_tags(opts->barcode_tag,optarg);
                     else if (strcmp(arg, "quality-tag") == 0)                  parse_tags(opts->quality_tag,optarg);
                     else if (strcmp(arg, "sec-barcode-tag") == 0)              parse_tags(opts->barcode_tag,optarg);
@@ -669,6 +894,13 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                         opts->decode_calls_tag = optarg;
                     } else if (strcmp(arg, "convert-low-quality") == 0)          opts->convert_low_quality = true;
                     else if (strcmp(arg, "fix-blocks") == 0)                   opts->fix_blocks = true;
+                    else if (strcmp(arg, "stage-dir") == 0)                    opts->stage_dir = strdup(optarg);
+                    else if (strcmp(arg, "stage-budget") == 0)                 opts->stage_budget = stage_parse_size(optarg);
+                    else if (strcmp(arg, "archive") == 0)                      opts->archive = strdup(optarg);
+                    else if (strcmp(arg, "io-threads") == 0)                   opts->io_threads = atoi(optarg);
+                    else if (strcmp(arg, "bcl-threads") == 0)                  opts->bcl_threads = atoi(optarg);
+                    else if (strcmp(arg, "tile-index") == 0)                   opts->tile_index_name = strdup(optarg);
+                    else if (strcmp(arg, "qual-bins") == 0)                    opts->qual_bins_name = strdup(optarg);
                     else if (strcmp(arg, "max-low-quality-to-convert") == 0)   opts->max_low_quality_to_convert = atoi(optarg);
                     else if (strcmp(arg, "nocall-quality") == 0)          opts->nocall_quality = true;
                     else if (strcmp(arg, "max-no-calls") == 0)                 set_decode_opt_max_no_calls(opts->decode_opts, atoi(optarg));
@@ -712,9 +944,50 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         usage(stderr); return NULL;
     }
 
+    if (opts->qual_bins_name) {
+        if (parseQualBins(opts->qual_bins_name, opts->qual_map) < 0) {
+            fprintf(stderr, "Can't understand --qual-bins %s\n", opts->qual_bins_name);
+            usage(stderr); return NULL;
+        }
+    } else {
+        for (int q = 0; q < 256; q++) opts->qual_map[q] = q;
+    }
+
+    if (opts->min_tile_pf_fraction < 0 || opts->min_tile_pf_fraction > 1) {
+        fprintf(stderr, "min-tile-pf-fraction must be between 0 and 1\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->stage_dir && !opts->stage_budget) {
+        fprintf(stderr, "stage-budget must be a size, eg 500M or 20G\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->archive) {
+        if (opts->stage_dir) {
+            fprintf(stderr, "Files can't be staged from an archive: ignoring --stage-dir\n");
+            free(opts->stage_dir); opts->stage_dir = NULL;
+        }
+        if (archive_mount(opts->archive) < 0) {
+            fprintf(stderr, "Can't read archive %s\n", opts->archive);
+            return NULL;
+        }
+        opts->archive_mounted = true;
+    }
+
     if (opts->nthreads < 4) opts->nthreads = 4;
     opts->pool_size = opts->nthreads - 3;
 
+    // Reserved threads come out of the main pool, so that compression and
+    // BCL reading are never stuck in the queue behind record building
+    if (opts->io_threads < 0 || opts->bcl_threads < 0 ||
+        opts->pool_size - opts->io_threads - opts->bcl_threads < 1) {
+        fprintf(stderr, "--io-threads plus --bcl-threads must be less than %d for %d threads\n",
+                opts->pool_size, opts->nthreads);
+        return NULL;
+    }
+    opts->pool_size -= opts->io_threads + opts->bcl_threads;
+
     // Set defaults
     if (!opts->read_group_id) opts->read_group_id = strdup("1");
     if (!opts->library_name) opts->library_name = strdup("unknown");
@@ -748,19 +1021,10 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         usage(stderr); return NULL;
     }
 
-    if (strcmp(lane_arg,"all") != 0) opts->lane = parseLaneList(lane_arg);
-    else                             opts->lane = fillLaneList(opts->basecalls_dir);
-
-    if (opts->verbose) {
-        char *lanes = ia_join(opts->lane,",");
-        fprintf(stderr,"Lanes specified: %s\n", lanes);
-        free(lanes);
-    }
-
     // rationalise directories
     char *tmp;
     tmp = opts->intensity_dir; 
-    opts->intensity_dir = realpath(tmp, NULL); 
+    opts->intensity_dir = opts->archive ? archive_path(opts->archive, tmp) : realpath(tmp, NULL); 
     if (!opts->intensity_dir) { 
         fprintf(stderr,"Can't open directory: %s\n", tmp);
         perror("intensity-dir"); 
@@ -769,15 +1033,24 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     free(tmp);
 
     tmp = opts->basecalls_dir; 
-    opts->basecalls_dir = realpath(tmp, NULL); 
+    opts->basecalls_dir = opts->archive ? archive_path(opts->archive, tmp) : realpath(tmp, NULL); 
     if (!opts->basecalls_dir) { perror("basecalls-dir"); return NULL; }
     free(tmp);
 
     tmp = opts->run_folder; 
-    opts->run_folder = realpath(tmp, NULL); 
+    opts->run_folder = opts->archive ? archive_path(opts->archive, tmp) : realpath(tmp, NULL); 
     if (!opts->run_folder) { perror("run_folder"); return NULL; }
     free(tmp);
 
+    if (strcmp(lane_arg,"all") != 0) opts->lane = parseLaneList(lane_arg);
+    else                             opts->lane = fillLaneList(opts->basecalls_dir);
+
+    if (opts->verbose) {
+        char *lanes = ia_join(opts->lane,",");
+        fprintf(stderr,"Lanes specified: %s\n", lanes);
+        free(lanes);
+    }
+
     if (!opts->platform_unit) {
         // default is runfolder + lane
         char *rf = basename(opts->run_folder);
@@ -790,13 +1063,13 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     }
 
     // Once we have a basecalls directory, we can find the machine type
-    machineType = determineMachineType(opts->basecalls_dir);
-    if (machineType == MT_UNKNOWN) die("Unable to determine machine type\n");
+    opts->machine_type = determineMachineType(opts->basecalls_dir);
+    if (opts->machine_type == MT_UNKNOWN) die("Unable to determine machine type\n");
     if (opts->verbose) {
-        if (machineType == MT_MISEQ) display("Machine Type: MISEQ\n");
-        if (machineType == MT_HISEQX) display("Machine Type: HISEQX\n");
-        if (machineType == MT_NEXTSEQ) display("Machine Type: NEXTSEQ\n");
-        if (machineType == MT_NOVASEQ) display("Machine Type: NOVASEQ\n");
+        if (opts->machine_type == MT_MISEQ) display("Machine Type: MISEQ\n");
+        if (opts->machine_type == MT_HISEQX) display("Machine Type: HISEQX\n");
+        if (opts->machine_type == MT_NEXTSEQ) display("Machine Type: NEXTSEQ\n");
+        if (opts->machine_type == MT_NOVASEQ) display("Machine Type: NOVASEQ\n");
     }
 
     // read XML files
@@ -981,6 +1254,19 @@ static int addHeader(samFile *output_file, bam_hdr_t *output_header, opts_t *opt
                     "DS", "Convert Illumina BCL to BAM or SAM file",
                     NULL, NULL);
 
+    if (opts->qual_bins_name) {
+        kstring_t co = KS_INITIALIZE;
+        ksprintf(&co, "@CO\tQuality values binned by bambi i2b --qual-bins %s\n", opts->qual_bins_name);
+        if (sam_hdr_add_lines(output_header, co.s, co.l) < 0) die("Can't add header line");
+        free(co.s);
+    }
+
+    if (opts->skipped_tiles.l) {
+        if (sam_hdr_add_lines(output_header, opts->skipped_tiles.s, opts->skipped_tiles.l) < 0) die("Can't add header line");
+    }
+
+    if (opts->records_fn) return opts->header_fn ? opts->header_fn(output_header, opts->fn_arg) != 0 : 0;
+
     if (sam_hdr_write(output_file, output_header) != 0) {
         fprintf(stderr, "Could not write output file header\n");
         return 1;
@@ -1002,7 +1288,7 @@ static char *getId(opts_t *opts)
     char *flowcell = NULL;
     char *id = NULL;
 
-    if (machineType==MT_NOVASEQ) {
+    if (opts->machine_type==MT_NOVASEQ) {
         doc = opts->runinfoConfig;
         if (!doc) die("getId(): Can't find the RunInfo.xml config file");
         instrument = getXMLVal(doc, "//RunInfo/Run/Instrument");
@@ -1050,10 +1336,10 @@ static char *getId(opts_t *opts)
 static va_t *getTileIndex(opts_t *opts, int lane)
 {
     va_t *tileIndex = NULL;
-    if (machineType != MT_NEXTSEQ) return tileIndex;
+    if (opts->machine_type != MT_NEXTSEQ) return tileIndex;
     char *fname = calloc(1,strlen(opts->basecalls_dir)+64);
     sprintf(fname, "%s/L%03d/s_%d.bci", opts->basecalls_dir, lane, lane);
-    FILE *fhandle = fopen(fname, "rb");
+    FILE *fhandle = archive_fopen(fname);
     if (fhandle == NULL) die("Can't open BCI file %s\n", fname);
     tileIndex = va_init(100,free);
     int n;
@@ -1333,6 +1619,28 @@ static int findClusters(int tile, va_t *tileIndex)
     return -1;
 }
 
+/*
+ * Open position and filter files through the staging area (if any).
+ * The original file name is kept for error messages.
+ */
+static posfile_t *stagedPosfileOpen(opts_t *opts, char *fname)
+{
+    char *path = stage_path(opts->stage, fname);
+    posfile_t *posfile = posfile_open(path);
+    free(posfile->file_name);
+    posfile->file_name = strdup(fname);
+    free(path);
+    return posfile;
+}
+
+static filter_t *stagedFilterOpen(opts_t *opts, char *fname)
+{
+    char *path = stage_path(opts->stage, fname);
+    filter_t *filter = filter_open_as(path, fname);
+    free(path);
+    return filter;
+}
+
 /*
  * Open the position file
  *
@@ -1348,30 +1656,30 @@ static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts, int
     char *fname = calloc(1, strlen(opts->intensity_dir)+64);
 
     sprintf(fname, "%s/L%03d/s_%d_%04d.clocs", opts->intensity_dir, lane, lane, tile);
-    posfile = posfile_open(fname);
+    posfile = stagedPosfileOpen(opts, fname);
 
     if (posfile->errmsg) {
         posfile_close(posfile);
         sprintf(fname, "%s/L%03d/s_%d_%04d.locs", opts->intensity_dir, lane, lane, tile);
-        posfile = posfile_open(fname);
+        posfile = stagedPosfileOpen(opts, fname);
     }
 
     if (posfile->errmsg) {
         posfile_close(posfile);
         sprintf(fname, "%s/s.locs", opts->intensity_dir);
-        posfile = posfile_open(fname);
+        posfile = stagedPosfileOpen(opts, fname);
     }
 
     // if still not found, try NewSeq format files
     if (posfile->errmsg) {
         posfile_close(posfile);
         sprintf(fname, "%s/L%03d/s_%d.clocs", opts->intensity_dir, lane, lane);
-        posfile = posfile_open(fname);
+        posfile = stagedPosfileOpen(opts, fname);
 
         if (posfile->errmsg) {
             posfile_close(posfile);
             sprintf(fname, "%s/L%03d/s_%d.locs", opts->intensity_dir, lane, lane);
-            posfile = posfile_open(fname);
+            posfile = stagedPosfileOpen(opts, fname);
         }
 
         if (!posfile->errmsg) {
@@ -1402,22 +1710,24 @@ static filter_t *openFilterFile(int tile, va_t *tileIndex, opts_t *opts, int lan
     char *fname = calloc(1,strlen(opts->basecalls_dir)+128); // a bit arbitrary :-(
 
     sprintf(fname, "%s/L%03d/s_%d_%04d.filter", opts->basecalls_dir, lane, lane, tile);
-    filter = filter_open(fname);
+    filter = stagedFilterOpen(opts, fname);
     if (filter->errmsg) {
         filter_close(filter);
         sprintf(fname, "%s/s_%d_%04d.filter", opts->basecalls_dir, lane, tile);
-        filter = filter_open(fname);
+        filter = stagedFilterOpen(opts, fname);
     }
     if (filter->errmsg) {
         filter_close(filter);
         sprintf(fname, "%s/L%03d/s_%d.filter", opts->basecalls_dir, lane, lane);
-        filter = filter_open(fname);
+        filter = stagedFilterOpen(opts, fname);
     }
 
     if (opts->verbose && !filter->errmsg) fprintf(stderr,"Opened filter file %s\n", fname);
 
-    if (tileIndex) filter_seek(filter,findClusterNumber(tile,tileIndex));
-    filter_load(filter, tileIndex ? findClusters(tile, tileIndex) : filter->total_clusters);
+    if (!filter->errmsg) {
+        if (tileIndex) filter_seek(filter,findClusterNumber(tile,tileIndex));
+        filter_load(filter, tileIndex ? findClusters(tile, tileIndex) : filter->total_clusters);
+    }
 
     free(fname);
     return filter;
@@ -1474,33 +1784,45 @@ static void clear_bcl_cache(lockable_bcl_cache *bcl_cache) {
 }
 
 /*
- * Open a single bcl file
+ * Return the name of a single bcl file
  */
-static bclfile_t *openBclFile(char *basecalls, int lane, int tile, int cycle, int surface, va_t *tileIndex, filter_t *filter)
+static char *getBclFileName(MACHINE_TYPE machine_type, char *basecalls, int lane, int tile, int cycle, int surface)
 {
-    bclfile_t *bcl = NULL;
     char *fname = calloc(1, strlen(basecalls)+128);
     if (!fname) die("Out of memory");
 
-    if (machineType==MT_NEXTSEQ) {
+    if (machine_type==MT_NEXTSEQ) {
         sprintf(fname, "%s/L%03d/%04d.bcl.bgzf", basecalls, lane, cycle);
     }
 
-    if (machineType==MT_NOVASEQ) {
+    if (machine_type==MT_NOVASEQ) {
         sprintf(fname, "%s/L%03d/C%d.1/L%03d_%d.cbcl", basecalls, lane, cycle, lane, surface);
     }
 
-    if (machineType==MT_HISEQX) {
+    if (machine_type==MT_HISEQX) {
         sprintf(fname, "%s/L%03d/C%d.1/s_%d_%04d.bcl.gz", basecalls, lane, cycle, lane, tile);
     }
 
-    if (machineType==MT_MISEQ) {
+    if (machine_type==MT_MISEQ) {
         sprintf(fname, "%s/L%03d/C%d.1/s_%d_%04d.bcl", basecalls, lane, cycle, lane, tile);
     }
 
-    bcl = bclfile_open(fname, machineType, tile);
+    return fname;
+}
 
-    free(fname);
+/*
+ * Open a single bcl file
+ */
+static bclfile_t *openBclFile(MACHINE_TYPE machine_type, char *basecalls, int lane, int tile, int cycle, int surface, va_t *tileIndex, filter_t *filter, stage_t *stage)
+{
+    bclfile_t *bcl = NULL;
+    char *fname = getBclFileName(machine_type, basecalls, lane, tile, cycle, surface);
+    char *path = stage_path(stage, fname);
+
+    bcl = bclfile_open(path, machine_type, tile);
+    free(bcl->filename);
+    bcl->filename = fname;
+    free(path);
 
     bcl->surface = surface;
 
@@ -1537,14 +1859,14 @@ static void *bcl_thread(void *arg)
         bcl = get_cached_bclfile(o->bcl_cache, o->lane, o->cycle, o->surface);
     }
     if (!bcl) {
-        bcl = openBclFile(o->opts->basecalls_dir, o->lane, o->tile, o->cycle, o->surface, o->tileIndex, o->filter);
+        bcl = openBclFile(o->opts->machine_type, o->opts->basecalls_dir, o->lane, o->tile, o->cycle, o->surface, o->tileIndex, o->filter, o->opts->stage);
         if (bcl->errmsg) { display("%s", bcl->errmsg); /* JSL bcl = NULL; */ }
         if (o->bcl_cache) {
             if (bcl) insert_bclfile_to_cache(bcl, o->bcl_cache, o->lane, o->cycle, o->surface);
         }
     }
 
-    switch (machineType) {
+    switch (o->opts->machine_type) {
         case MT_NEXTSEQ:
             assert(o->tileIndex);
             if (bcl->is_open) bclfile_load_tile(bcl, findClusterNumber(o->tile, o->tileIndex), o->filter, -1, o->opts->fix_blocks);
@@ -1578,7 +1900,7 @@ static va_t *openBclFiles(va_t *cycleRange, opts_t *opts, int tile, int next_til
 {
     pthread_mutex_t bcl_array_lock = PTHREAD_MUTEX_INITIALIZER;
     va_t *bclReadArray = va_init(cycleRange->end * 2, freeBCLReadArray);
-    hts_tpool_process *q = hts_tpool_process_init(p, 2 * opts->pool_size, 1);
+    hts_tpool_process *q = hts_tpool_process_init(p, 2 * (opts->bcl_threads ? opts->bcl_threads : opts->pool_size), 1);
     if (!q) die("hts_tpool_process_init failed\n");
 
     for (int n=0; n < cycleRange->end; n++) {
@@ -1734,7 +2056,7 @@ struct processRecordJob_struct {
     size_t max_data_len[2];
     va_t *barcodeArray;
     HashTable *barcodes_hash;
-    HashTable *tag_hops;
+    decode_metrics_t *metrics;
     struct barcode_bcl_files *decode_calls;
     struct processRecordResult_struct results;
     struct processRecordJob_struct *next;
@@ -1753,7 +2075,7 @@ static void bam_fill_core(bam1_t *recs, unsigned char *data_block,
 
     for (int cluster = cluster_from, i = 0; cluster < cluster_to; cluster++, i+=nreads) {
         unsigned char *data[2];
-        bool filtered = (machineType == MT_NOVASEQ ? false    // NovaSeq is pre-filtered by this point
+        bool filtered = (job->opts->machine_type == MT_NOVASEQ ? false    // NovaSeq is pre-filtered by this point
                          : !filter_get(job->filter, cluster)); // actual flag is 'passed', but we want 'filtered out'
 
         data[0] = data_block + (cluster - job->start_cluster) * data_len;
@@ -1879,7 +2201,7 @@ static void bam_add_calls_quals(bam1_t *recs,
                     if (job->opts->nocall_quality && (bcl->bases[cluster] == 'N')) {
                         q = NOCALL_QUALITY_VALUE;
                     } else {
-                        q = bcl->quals[cluster];
+                        q = job->opts->qual_map[(unsigned char) bcl->quals[cluster]];
                     }
                 }
                     
@@ -2007,7 +2329,7 @@ static char **decode_tags(bam1_t *recs,
         if (is_pf || job->opts->no_filter) {
             barcode_names[c] = findBarcodeName(barcode_calls + c * bc_len,
                                                job->barcodeArray, job->barcodes_hash,
-                                               job->tag_hops, job->opts->decode_opts,
+                                               job->metrics, job->opts->decode_opts,
                                                is_pf, true);
         } else {
             barcode_names[c] = ""; // Won't be used, anyway.
@@ -2160,7 +2482,7 @@ static void processRecordGroup(struct processRecordJob_struct *job, int cluster_
 }
 
 /*
- * Create a set of 'CLUSTERS_PER_THREAD' records
+ * Create a set of 'i2b_clusters_per_thread' records
  */
 
 // Number of clusters to process at a time in processRecordGroup().
@@ -2252,6 +2574,111 @@ static struct barcode_bcl_files *find_tag_bcls(va_t *barcode_bcls[2], int nreads
     return NULL;
 }
 
+/*
+ * Ask the staging area to copy the files we will need for a tile.
+ * Files which are shared by all the tiles in a lane are staged by stageLaneFiles().
+ *
+ * We don't know which of the alternative filter and position file names
+ * exist, so request them all and let the stager skip the missing ones.
+ */
+static void stageTileFiles(opts_t *opts, int lane, int tile, va_t *cycleRange)
+{
+    if (!opts->stage) return;
+
+    char *fname = calloc(1, strlen(opts->basecalls_dir) + strlen(opts->intensity_dir) + 128);
+    int group = STAGE_GROUP(lane, tile);
+    if (!fname) die("Out of memory");
+
+    sprintf(fname, "%s/L%03d/s_%d_%04d.filter", opts->basecalls_dir, lane, lane, tile);
+    stage_request(opts->stage, fname, group);
+    sprintf(fname, "%s/s_%d_%04d.filter", opts->basecalls_dir, lane, tile);
+    stage_request(opts->stage, fname, group);
+    sprintf(fname, "%s/L%03d/s_%d_%04d.clocs", opts->intensity_dir, lane, lane, tile);
+    stage_request(opts->stage, fname, group);
+    sprintf(fname, "%s/L%03d/s_%d_%04d.locs", opts->intensity_dir, lane, lane, tile);
+    stage_request(opts->stage, fname, group);
+    free(fname);
+
+    // only MiSeq and HiSeqX have a bcl file per tile
+    if (opts->machine_type != MT_MISEQ && opts->machine_type != MT_HISEQX) return;
+
+    for (int n=0; n < cycleRange->end; n++) {
+        cycleRangeEntry_t *cr = cycleRange->entries[n];
+        for (int cycle = cr->first; cycle <= cr->last; cycle++) {
+            fname = getBclFileName(opts->machine_type, opts->basecalls_dir, lane, tile, cycle, bcl_tile2surface(tile));
+            stage_request(opts->stage, fname, group);
+            free(fname);
+        }
+    }
+}
+
+/*
+ * Stage the files which are re-opened for every tile in a lane.
+ *
+ * NovaSeq cbcl files are not staged: they are opened once per lane and
+ * held in the bcl cache, so they don't suffer from the cost of re-opening.
+ */
+static void stageLaneFiles(opts_t *opts, int lane, va_t *cycleRange)
+{
+    if (!opts->stage) return;
+
+    char *fname = calloc(1, strlen(opts->basecalls_dir) + strlen(opts->intensity_dir) + 128);
+    int group = STAGE_GROUP(lane, 0);
+    if (!fname) die("Out of memory");
+
+    sprintf(fname, "%s/L%03d/s_%d.filter", opts->basecalls_dir, lane, lane);
+    stage_request(opts->stage, fname, group);
+    sprintf(fname, "%s/s.locs", opts->intensity_dir);
+    stage_request(opts->stage, fname, group);
+    sprintf(fname, "%s/L%03d/s_%d.clocs", opts->intensity_dir, lane, lane);
+    stage_request(opts->stage, fname, group);
+    sprintf(fname, "%s/L%03d/s_%d.locs", opts->intensity_dir, lane, lane);
+    stage_request(opts->stage, fname, group);
+    free(fname);
+
+    if (opts->machine_type != MT_NEXTSEQ) return;
+
+    for (int n=0; n < cycleRange->end; n++) {
+        cycleRangeEntry_t *cr = cycleRange->entries[n];
+        for (int cycle = cr->first; cycle <= cr->last; cycle++) {
+            fname = getBclFileName(opts->machine_type, opts->basecalls_dir, lane, 0, cycle, 1);
+            stage_request(opts->stage, fname, group);
+            free(fname);
+        }
+    }
+}
+
+/*
+ * Write the records from one job, dropping filtered records unless
+ * --no-filter was given. With libbambi the records are passed to
+ * records_fn instead.
+ */
+static void outputRecords(job_data_t *job_data, struct processRecordResult_struct *res)
+{
+    opts_t *opts = job_data->opts;
+    int nrecs = 0;
+
+    for (int n=0; n < res->num_records; n++) {
+        if (!opts->no_filter && (res->records[n].core.flag & BAM_FQCFAIL)) continue;
+        if (opts->records_fn) {
+            // the record data is all in res->data, so records can be moved down the array
+            if (n != nrecs) res->records[nrecs] = res->records[n];
+            nrecs++;
+            continue;
+        }
+        int ret = sam_write1(job_data->output_file, job_data->output_header, &res->records[n]);
+        if (ret < 0) {
+            die("Problem writing record %s  : r=%d\n", bam_get_qname(&res->records[n]), ret);
+        }
+        job_data->nrecords++;
+    }
+
+    if (nrecs && !job_data->failed) {
+        if (opts->records_fn(res->records, nrecs, opts->fn_arg) != 0) job_data->failed = true;
+        job_data->nrecords += nrecs;
+    }
+}
+
 /*
  * Write all the BAM records for a given tile
  * Records are written to the global FIFO queue
@@ -2260,8 +2687,6 @@ static void processTile(job_data_t *job_data)
 {
     int tile = job_data->tile;
     int next_tile = job_data->next_tile;
-    samFile *output_file = job_data->output_file;
-    bam_hdr_t *output_header = job_data->output_header;
     va_t *cycleRange = job_data->cycleRange;
     va_t *tileIndex = job_data->tileIndex;
     opts_t *opts = job_data->opts;
@@ -2282,6 +2707,9 @@ static void processTile(job_data_t *job_data)
 
     if (opts->verbose) fprintf(stderr,"Processing Tile %d\n", tile);
 
+    // start copying the next tile's files while we work on this one
+    if (next_tile >= 0) stageTileFiles(opts, job_data->lane, next_tile, cycleRange);
+
     filter_t *filter = openFilterFile(tile,tileIndex,opts, job_data->lane);
     if (filter->errmsg) {
         die("Can't find filter file for tile %d\n%s\n", tile, filter->errmsg);
@@ -2294,10 +2722,10 @@ static void processTile(job_data_t *job_data)
     if (posfile->errmsg) {
         die("Can't find position file for Tile %d\n%s\n", tile, posfile->errmsg);
     }
-    posfile_load(posfile, max_cluster, (machineType == MT_NOVASEQ) ? filter : NULL);
+    posfile_load(posfile, max_cluster, (opts->machine_type == MT_NOVASEQ) ? filter : NULL);
     max_cluster = posfile->size;
 
-    bclReadArray = openBclFiles(cycleRange, opts, tile, next_tile, tileIndex, filter, p, job_data->bcl_cache, job_data->lane, surface);
+    bclReadArray = openBclFiles(cycleRange, opts, tile, next_tile, tileIndex, filter, job_data->bcl_p, job_data->bcl_cache, job_data->lane, surface);
     char *id = getId(opts);
 
     if (opts->verbose) fprintf(stderr,"Tile %d : opened all BCL files\n", tile);
@@ -2311,7 +2739,8 @@ static void processTile(job_data_t *job_data)
     int cluster;
     struct processRecordJob_struct *job_freelist = NULL;
 
-    for (cluster = 0; cluster < max_cluster; cluster += CLUSTERS_PER_THREAD) {
+    // stop reading clusters as soon as records_fn asks us to
+    for (cluster = 0; cluster < max_cluster && !job_data->failed; cluster += i2b_clusters_per_thread) {
         int blk = 0, nreads = 1;
         struct processRecordJob_struct *job_struct = job_freelist;
         if (job_struct) {
@@ -2322,7 +2751,7 @@ static void processTile(job_data_t *job_data)
             if (!job_struct) die("Out of memory");
             job_struct->next = NULL;
             job_struct->start_cluster = cluster;
-            job_struct->end_cluster = cluster+CLUSTERS_PER_THREAD-1;
+            job_struct->end_cluster = cluster+i2b_clusters_per_thread-1;
             if (job_struct->end_cluster >= max_cluster) job_struct->end_cluster = max_cluster - 1;
             job_struct->tile = tile;
             job_struct->filter = filter;
@@ -2357,15 +2786,14 @@ static void processTile(job_data_t *job_data)
 
             if (opts->decode_tags) {
                 job_struct->decode_calls = find_tag_bcls(job_struct->bc_calls_tags, nreads, opts->decode_calls_tag);
-                job_struct->barcodeArray = copy_barcode_array(opts->barcodeArray);
+                job_struct->barcodeArray = opts->barcodeArray;
                 job_struct->barcodes_hash = job_data->barcodes_hash;
-                job_struct->tag_hops = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
-                if (!job_struct->tag_hops) die("Out of memory");
+                job_struct->metrics = decode_metrics_init(opts->barcodeArray);
             } else {
                 job_struct->decode_calls = NULL;
                 job_struct->barcodeArray = NULL;
                 job_struct->barcodes_hash = NULL;
-                job_struct->tag_hops = NULL;
+                job_struct->metrics = NULL;
             }
 
             /*
@@ -2388,7 +2816,7 @@ static void processTile(job_data_t *job_data)
             }
         }
         job_struct->start_cluster = cluster;
-        job_struct->end_cluster = cluster+CLUSTERS_PER_THREAD-1;
+        job_struct->end_cluster = cluster+i2b_clusters_per_thread-1;
         if (job_struct->end_cluster >= max_cluster) job_struct->end_cluster = max_cluster - 1;
 
         while (job_struct != NULL) {
@@ -2408,13 +2836,7 @@ static void processTile(job_data_t *job_data)
             if (r != NULL) {
                 struct processRecordJob_struct *job = (struct processRecordJob_struct *) hts_tpool_result_data(r);
                 struct processRecordResult_struct *res = &job->results;
-                for (int n=0; n < res->num_records; n++) {
-                    if (!opts->no_filter && (res->records[n].core.flag & BAM_FQCFAIL)) continue;
-                    int ret = sam_write1(output_file, output_header, &res->records[n]);
-                    if (ret < 0) {
-                        die("Problem writing record %s  : r=%d\n", bam_get_qname(&res->records[n]), ret);
-                    }
-                }
+                outputRecords(job_data, res);
                 free(res->records);
                 free(res->data);
                 job->next = job_freelist;
@@ -2429,13 +2851,7 @@ static void processTile(job_data_t *job_data)
         r = hts_tpool_next_result_wait(q);
         struct processRecordJob_struct *job = (struct processRecordJob_struct *) hts_tpool_result_data(r);
         struct processRecordResult_struct *res = &job->results;
-        for (int n=0; n < res->num_records; n++) {
-            if (!opts->no_filter && (res->records[n].core.flag & BAM_FQCFAIL)) continue;
-            int ret = sam_write1(output_file, output_header, &res->records[n]);
-            if (ret < 0) {
-                die("Problem writing record %s  : r=%d\n", bam_get_qname(&res->records[n]), ret);
-            }
-        }
+        outputRecords(job_data, res);
         free(res->records);
         free(res->data);
         job->next = job_freelist;
@@ -2446,19 +2862,14 @@ static void processTile(job_data_t *job_data)
     while (job_freelist != NULL) {
         struct processRecordJob_struct *next = job_freelist->next;
         int is_paired = job_freelist->read_files[1] != NULL;
-        if (opts->barcodeArray) {
-            accumulate_job_metrics(job_freelist->barcodeArray, job_freelist->tag_hops, opts->barcodeArray, job_data->tag_hops);
+        if (job_freelist->metrics) {
+            decode_metrics_merge(job_freelist->metrics, opts->barcodeArray, job_data->tag_hops, opts->decode_opts);
+            decode_metrics_free(job_freelist->metrics);
         }
         for (int rd = 0; rd < (is_paired ? 2 : 1); rd++) {
             va_free(job_freelist->bc_calls_tags[rd]);
             va_free(job_freelist->bc_quals_tags[rd]);
         }
-        if (job_freelist->barcodeArray) {
-            delete_barcode_array_copy(job_freelist->barcodeArray);
-        }
-        if (job_freelist->tag_hops) {
-            HashTableDestroy(job_freelist->tag_hops,0);
-        }
         free(job_freelist);
         job_freelist = next;
     }
@@ -2467,10 +2878,104 @@ static void processTile(job_data_t *job_data)
     va_free(bclReadArray);
     filter_close(filter);
     posfile_close(posfile);
+    stage_release(opts->stage, STAGE_GROUP(job_data->lane, tile));
 
     if (opts->verbose) display("Finished processing Tile: %d\n", tile);
+}
+
+/*
+ * i2b output is unaligned, so CRAM needs no reference. The name tokeniser and
+ * fqzcomp do much better than the 3.0 codecs on Illumina read names and
+ * qualities, and tiles are flushed into their own containers, so slices can
+ * be larger than the default without mixing tiles.
+ * Any options given with --output-fmt are applied again afterwards, so they win.
+ */
+static int setCramProfile(samFile *output_file, htsFormat *out_fmt)
+{
+    if (hts_set_opt(output_file, CRAM_OPT_VERSION, CRAM_PROFILE_VERSION) < 0) return -1;
+    if (hts_set_opt(output_file, CRAM_OPT_NO_REF, 1) < 0) return -1;
+    if (hts_set_opt(output_file, CRAM_OPT_USE_TOK, 1) < 0) return -1;
+    if (hts_set_opt(output_file, CRAM_OPT_USE_FQZ, 1) < 0) return -1;
+    if (hts_set_opt(output_file, CRAM_OPT_SEQS_PER_SLICE, CRAM_SEQS_PER_SLICE) < 0) return -1;
+    if (out_fmt->specific && hts_opt_apply(output_file, out_fmt->specific) < 0) return -1;
+    return 0;
+}
+
+/*
+ * The offsets of CRAM containers aren't known until they have been compressed
+ * and written, which may be long after the tile was processed. Every tile is
+ * in its own containers, so read the container headers back from the output
+ * to find where each tile starts, and write the tile index.
+ */
+static int writeCramTileIndex(opts_t *opts)
+{
+    va_t *tiles = opts->cram_tiles;
+    int64_t *starts = calloc(tiles->end + 1, sizeof(int64_t));
+    if (!starts) die("Out of memory");
+
+    samFile *f = hts_open(opts->output_file, "rc");
+    if (!f) { fprintf(stderr, "Could not reopen %s\n", opts->output_file); free(starts); return -1; }
+    sam_hdr_t *h = sam_hdr_read(f);
+    if (!h) { fprintf(stderr, "Could not read header from %s\n", opts->output_file); sam_close(f); free(starts); return -1; }
+
+    hFILE *hf = cram_fd_get_fp(f->fp.cram);
+    int64_t offset = htell(hf);
+    uint64_t nrecords = 0;      // records before the container at offset
+    uint64_t tile_start = 0;    // first record of tile n
+    int retcode = 0;
+    int n = 0;
+
+    // starts[tiles->end] is the end of the last tile
+    while (retcode == 0) {
+        while (n <= tiles->end && tile_start == nrecords) {
+            starts[n] = offset;
+            if (n < tiles->end) tile_start += ((tileRecords_t *)tiles->entries[n])->nrecords;
+            n++;
+        }
+        if (n > tiles->end) break;
 
-    free(job_data);
+        cram_container *c = cram_read_container(f->fp.cram);
+        if (!c) {
+            fprintf(stderr, "%s ended before the last tile\n", opts->output_file);
+            retcode = -1;
+            break;
+        }
+        nrecords += cram_container_get_num_records(c);
+        offset = htell(hf) + cram_container_get_length(c);
+        cram_free_container(c);
+        if (tile_start < nrecords) {
+            fprintf(stderr, "A container in %s holds more than one tile\n", opts->output_file);
+            retcode = -1;
+        } else if (hseek(hf, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Can't seek in %s\n", opts->output_file);
+            retcode = -1;
+        }
+    }
+
+    for (int i=0; retcode == 0 && i < tiles->end; i++) {
+        tileRecords_t *t = tiles->entries[i];
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%d\t%d\t%"PRId64"\t%"PRId64"\t%"PRIu64"\n",
+                 t->lane, t->tile, starts[i], starts[i+1], t->nrecords);
+        if (hputs(buf, opts->tile_index) == EOF) die("Can't write to tile index %s", opts->tile_index_name);
+    }
+
+    sam_hdr_destroy(h);
+    sam_close(f);
+    free(starts);
+    return retcode;
+}
+
+/*
+ * Flush the output, and return the virtual offset of the next record.
+ * Every tile starts in a new BGZF block, so the offset is correct even
+ * if blocks are being compressed by other threads.
+ */
+static int64_t tileOffset(samFile *output_file)
+{
+    BGZF *fp = output_file->fp.bgzf;
+    if (bgzf_flush(fp) < 0) die("Can't flush output file");
+    return (int64_t)htell(fp->fp) << 16;
 }
 
 /*
@@ -2517,16 +3022,75 @@ void getBarcodeSpecs(va_t *specs[2], va_t *tags_array, ia_t *bc_read) {
     }
 }
 
+static bool isExcludedTile(ia_t *exclude_tiles, int lane, int tile)
+{
+    for (int n=0; exclude_tiles && n < exclude_tiles->end; n++) {
+        if (exclude_tiles->entries[n] == TILE_KEY(0, tile) ||
+            exclude_tiles->entries[n] == TILE_KEY(lane, tile)) return true;
+    }
+    return false;
+}
+
+static void skipTile(opts_t *opts, int lane, int tile, char *reason)
+{
+    fprintf(stderr, "Skipping lane %d tile %d: %s\n", lane, tile, reason);
+    ksprintf(&opts->skipped_tiles, "@CO\tbambi i2b skipped lane %d tile %d: %s\n", lane, tile, reason);
+}
+
+/*
+ * Get the list of tiles to process, leaving out any given by --exclude-tiles
+ * and any where too few clusters pass filter. That is decided from the filter
+ * file alone, so no BCL or position files are read for a skipped tile.
+ */
+static ia_t *selectTiles(opts_t *opts, int lane)
+{
+    ia_t *tiles = getTileList(opts, lane);
+    if (!opts->exclude_tiles && opts->min_tile_pf_fraction <= 0) return tiles;
+
+    va_t *tileIndex = opts->min_tile_pf_fraction > 0 ? getTileIndex(opts, lane) : NULL;
+    ia_t *selected = ia_init(100);
+    char reason[128];
+
+    for (int n=0; n < tiles->end; n++) {
+        int tile = tiles->entries[n];
+        if (isExcludedTile(opts->exclude_tiles, lane, tile)) {
+            skipTile(opts, lane, tile, "excluded by --exclude-tiles");
+            continue;
+        }
+        if (opts->min_tile_pf_fraction > 0) {
+            filter_t *filter = openFilterFile(tile, tileIndex, opts, lane);
+            if (filter->errmsg) {
+                die("Can't find filter file for tile %d\n%s\n", tile, filter->errmsg);
+            }
+            uint64_t pf = 0;
+            for (size_t c=0; c < filter->total_clusters; c++) pf += filter_get(filter, c);
+            float pf_fraction = filter->total_clusters ? (float)pf / filter->total_clusters : 1;
+            filter_close(filter);
+            if (pf_fraction < opts->min_tile_pf_fraction) {
+                snprintf(reason, sizeof(reason), "PF fraction %.3f is less than --min-tile-pf-fraction %.3f",
+                         pf_fraction, opts->min_tile_pf_fraction);
+                skipTile(opts, lane, tile, reason);
+                continue;
+            }
+        }
+        ia_push(selected, tile);
+    }
+
+    va_free(tileIndex);
+    ia_free(tiles);
+    return selected;
+}
+
 /*
  * process all the tiles and write all the BAM records
  */
-static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *thread_p, opts_t *opts, int lane)
+static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *thread_p, hts_tpool *bcl_p, opts_t *opts, ia_t *tiles, int lane)
 {
     int retcode = 0;
 
     hts_tpool_process *thread_q = hts_tpool_process_init(thread_p, 2 * opts->pool_size, 0);
+    bool is_cram = output_file && hts_get_format(output_file)->format == cram;
 
-    ia_t *tiles = getTileList(opts, lane);
     va_t *cycleRange = getCycleRange(opts);
     va_t *tileIndex = getTileIndex(opts, lane);
     va_t *barcode_calls[2];
@@ -2535,7 +3099,7 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
     HashTable *tag_hops = NULL;
     size_t longest_barcode_name = 0;
     lockable_bcl_cache bcl_cache = { PTHREAD_MUTEX_INITIALIZER, NULL };
-    if (machineType == MT_NOVASEQ) {
+    if (opts->machine_type == MT_NOVASEQ) {
         bcl_cache.cache = kh_init(bcl_cache);
         if (!bcl_cache.cache) die("Out of memory");
     }
@@ -2569,6 +3133,9 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
 
     if (tiles->end == 0) fprintf(stderr, "There are no tiles to process\n");
 
+    stageLaneFiles(opts, lane, cycleRange);
+    if (tiles->end > 0) stageTileFiles(opts, lane, tiles->entries[0], cycleRange);
+
     /*
      * Loop to create input threads - one for each tile
      */
@@ -2589,12 +3156,33 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
         job_data->bcl_cache = bcl_cache.cache ? &bcl_cache : NULL;
         job_data->thread_p = thread_p;
         job_data->thread_q = thread_q;
+        job_data->bcl_p = bcl_p;
         job_data->barcodes_hash = barcodeHash;
         job_data->tag_hops = tag_hops;
         job_data->longest_barcode_name = longest_barcode_name;
         job_data->lane = lane;
+        job_data->nrecords = 0;
+        job_data->failed = false;
 
+        int64_t start = opts->tile_index && !opts->cram_tiles ? tileOffset(output_file) : 0;
         processTile(job_data);
+        // end the CRAM container, so that the next tile starts a new one
+        if (is_cram && hts_flush(output_file) < 0) die("Can't flush output file");
+        if (opts->cram_tiles) {
+            tileRecords_t *t = smalloc(sizeof(tileRecords_t));
+            t->lane = lane;
+            t->tile = job_data->tile;
+            t->nrecords = job_data->nrecords;
+            va_push(opts->cram_tiles, t);
+        } else if (opts->tile_index) {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%d\t%d\t%"PRId64"\t%"PRId64"\t%"PRIu64"\n",
+                     lane, job_data->tile, start, tileOffset(output_file), job_data->nrecords);
+            if (hputs(buf, opts->tile_index) == EOF) die("Can't write to tile index %s", opts->tile_index_name);
+        }
+        if (job_data->failed) retcode = 1;
+        free(job_data);
+        if (retcode) break;
     }
 
     if (opts->write_decode_metrics) {
@@ -2604,6 +3192,8 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
     if (bcl_cache.cache)
         clear_bcl_cache(&bcl_cache);
 
+    stage_release(opts->stage, STAGE_GROUP(lane, 0));
+
     HashTableDestroy(barcodeHash, 0);
     free_tagHopHash(tag_hops);
     va_free(barcode_calls[0]);
@@ -2612,7 +3202,6 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
     va_free(barcode_quals[1]);
     va_free(cycleRange);
     va_free(tileIndex);
-    ia_free(tiles);
 
     hts_tpool_process_destroy(thread_q);
 
@@ -2629,16 +3218,49 @@ static int i2b(opts_t* opts)
     bam_hdr_t *output_header = NULL;
     htsFormat out_fmt = { 0 };
     htsThreadPool hts_threads = { NULL, 0 };
+    htsThreadPool io_threads = { NULL, 0 };
+    hts_tpool *bcl_pool = NULL;
+    ia_t **tiles = NULL;
     char mode[] = "wbC";
 
     while (1) {
 
-        /* Set up the thread pool */
-        hts_threads.pool = hts_tpool_init(opts->pool_size);
+        /* Set up the thread pools */
+        hts_threads.pool = opts->thread_pool ? opts->thread_pool : batch_tpool_init(opts->pool_size);
         if (!hts_threads.pool) {
             fprintf(stderr, "Couldn't set up thread pool\n");
             break;
         }
+        if (opts->io_threads) {
+            io_threads.pool = hts_tpool_init(opts->io_threads);
+            if (!io_threads.pool) {
+                fprintf(stderr, "Couldn't set up output thread pool\n");
+                break;
+            }
+        }
+        if (opts->bcl_threads) {
+            bcl_pool = hts_tpool_init(opts->bcl_threads);
+            if (!bcl_pool) {
+                fprintf(stderr, "Couldn't set up BCL thread pool\n");
+                break;
+            }
+        }
+        if (opts->verbose) display("Threads: %d processing, %d output, %d BCL reading\n",
+                                   opts->pool_size, opts->io_threads, opts->bcl_threads);
+
+        if (opts->stage_dir) {
+            opts->stage = stage_init(opts->stage_dir, opts->stage_budget, opts->verbose);
+            if (!opts->stage) break;
+        }
+
+        /*
+         * Decide which tiles to process, so that the header can record
+         * any we are skipping
+         */
+        opts->skipped_tiles.l = 0;
+        tiles = calloc(opts->lane->end, sizeof(ia_t *));
+        if (!tiles) die("Out of memory");
+        for (int n=0; n < opts->lane->end; n++) tiles[n] = selectTiles(opts, opts->lane->entries[n]);
 
         /*
          * Open output file and header
@@ -2650,15 +3272,28 @@ static int i2b(opts_t* opts)
             }
         }
         mode[2] = opts->compression_level ? opts->compression_level : '\0';
-        output_file = hts_open_format(opts->output_file, mode, &out_fmt);
-        if (!output_file) {
-            fprintf(stderr, "Could not open output file (%s)\n", opts->output_file);
-            break;
-        }
+        // BAM into a shared memory ring is read straight away, so don't compress it
+        if (!opts->compression_level && shm_is_shm(opts->output_file)
+            && (out_fmt.format == unknown_format || out_fmt.format == bam)) {
+            mode[2] = '0';
+        }
+        if (!opts->records_fn) {
+            output_file = hts_open_format(opts->output_file, mode, &out_fmt);
+            if (!output_file) {
+                fprintf(stderr, "Could not open output file (%s)\n", opts->output_file);
+                break;
+            }
 
-        if (hts_set_thread_pool(output_file, &hts_threads) < 0) {
-            fprintf(stderr, "Couldn't set thread pool on output file\n");
-            break;
+            TEST_SET(i2b_io_reserved, io_threads.pool != NULL);
+            if (hts_set_thread_pool(output_file, io_threads.pool ? &io_threads : &hts_threads) < 0) {
+                fprintf(stderr, "Couldn't set thread pool on output file\n");
+                break;
+            }
+
+            if (hts_get_format(output_file)->format == cram && setCramProfile(output_file, &out_fmt) < 0) {
+                fprintf(stderr, "Couldn't set CRAM options on output file\n");
+                break;
+            }
         }
 
         output_header = bam_hdr_init();
@@ -2673,17 +3308,68 @@ static int i2b(opts_t* opts)
             break;
         }
 
+        // CRAM output to a file (not a pipe or shared memory ring) gets a .crai index
+        const htsFormat *fmt = output_file ? hts_get_format(output_file) : NULL;
+        if (fmt && fmt->format == cram && strcmp(opts->output_file, "-") != 0 && !shm_is_shm(opts->output_file)) {
+            free(opts->cram_index_name);
+            opts->cram_index_name = smalloc(strlen(opts->output_file) + 6);
+            sprintf(opts->cram_index_name, "%s.crai", opts->output_file);
+            if (sam_idx_init(output_file, output_header, 0, opts->cram_index_name) < 0) {
+                fprintf(stderr, "Could not create index (%s)\n", opts->cram_index_name);
+                break;
+            }
+        }
+
+        if (opts->tile_index_name) {
+            if (fmt && fmt->format == cram && opts->cram_index_name) {
+                va_free(opts->cram_tiles);
+                opts->cram_tiles = va_init(100, free);
+            } else if (!fmt || fmt->format != bam || fmt->compression != bgzf) {
+                fprintf(stderr, "--tile-index can only be used with BAM output, or CRAM output to a file\n");
+                break;
+            }
+            opts->tile_index = hopen(opts->tile_index_name, "w");
+            if (!opts->tile_index) {
+                fprintf(stderr, "Could not open tile index (%s)\n", opts->tile_index_name);
+                break;
+            }
+            hputs("#lane\ttile\tstart\tend\trecords\n", opts->tile_index);
+        }
+
+        TEST_SET(i2b_bcl_reserved, bcl_pool != NULL);
         for (int n=0; n < opts->lane->end; n++) {
-            retcode = createBAM(output_file, output_header, hts_threads.pool, opts, opts->lane->entries[n]);
+            retcode = createBAM(output_file, output_header, hts_threads.pool,
+                                bcl_pool ? bcl_pool : hts_threads.pool, opts, tiles[n], opts->lane->entries[n]);
             if (retcode) break;
         }
         break;
     }
 
     // tidy up after us
+    for (int n=0; tiles && n < opts->lane->end; n++) ia_free(tiles[n]);
+    free(tiles);
     if (output_header) bam_hdr_destroy(output_header);
-    if (output_file) sam_close(output_file);
-    if (hts_threads.pool) hts_tpool_destroy(hts_threads.pool);
+    if (output_file && opts->cram_index_name && sam_idx_save(output_file) < 0) {
+        fprintf(stderr, "Could not write index (%s)\n", opts->cram_index_name);
+        retcode = 1;
+    }
+    if (output_file && sam_close(output_file) < 0) {
+        fprintf(stderr, "Could not close output file (%s)\n", opts->output_file);
+        retcode = 1;
+    }
+    if (retcode == 0 && opts->tile_index && opts->cram_tiles && writeCramTileIndex(opts) < 0) retcode = 1;
+    va_free(opts->cram_tiles);
+    opts->cram_tiles = NULL;
+    if (opts->tile_index && hclose(opts->tile_index)) {
+        fprintf(stderr, "Could not close tile index (%s)\n", opts->tile_index_name);
+        retcode = 1;
+    }
+    opts->tile_index = NULL;
+    if (hts_threads.pool != opts->thread_pool) batch_tpool_destroy(hts_threads.pool);
+    if (io_threads.pool) hts_tpool_destroy(io_threads.pool);
+    if (bcl_pool) hts_tpool_destroy(bcl_pool);
+    stage_free(opts->stage);
+    opts->stage = NULL;
 
     return retcode;
 }
@@ -2698,9 +3384,41 @@ static int i2b(opts_t* opts)
 int main_i2b(int argc, char *argv[])
 {
     int ret = 1;
-    machineType = -1;
     opts_t* opts = i2b_parse_args(argc, argv);
+    batch_args_parsed();
     if (opts) ret = i2b(opts);
     i2b_free_opts(opts);
     return ret;
 }
+
+/*
+ * called from libbambi to convert to records in memory
+ *
+ * returns 0 on success, 1 if there was a problem
+ */
+int bambi_i2b_run(int argc, char **argv, hts_tpool *pool,
+                  bambi_header_fn header_fn, bambi_records_fn records_fn, void *arg)
+{
+    int ret = 1;
+
+    // i2b_parse_args() expects "bambi" before the command, and an output file (which isn't used)
+    char **args = smalloc((argc + 4) * sizeof(char *));
+    args[0] = "bambi";
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    args[argc + 1] = "-o";
+    args[argc + 2] = "-";
+    args[argc + 3] = NULL;
+    opts_t* opts = i2b_parse_args(argc + 2, args + 1);
+    free(args);
+
+    if (opts) {
+        if (pool) opts->pool_size = hts_tpool_size(pool);
+        opts->thread_pool = pool;
+        opts->header_fn = header_fn;
+        opts->records_fn = records_fn;
+        opts->fn_arg = arg;
+        ret = i2b(opts);
+    }
+    i2b_free_opts(opts);
+    return ret;
+}
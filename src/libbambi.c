@@ -0,0 +1,34 @@
+/*  libbambi.c -- bambi library interface
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The library functions themselves are with each command, in decode.c,
+ * adapters.c and i2b.c. This file has what the commands need from the
+ * bambi front end, so that the library can be used without it.
+ */
+
+#include "bambi.h"
+#include "libbambi.h"
+
+const char *bambi_version()
+{
+    return VERSION;
+}
+
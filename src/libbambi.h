@@ -0,0 +1,145 @@
+/*  libbambi.h -- bambi library interface
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LIBBAMBI_H__
+#define __LIBBAMBI_H__
+
+#include <stdint.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libbambi lets a program run i2b, decode and adapter detection on records
+ * in memory, rather than through BAM files.
+ *
+ * Each command is set up from the same arguments as the bambi command line
+ * (argv[0] being the command name), but any input and output file options
+ * are not used. All the state for a command is held in its context, so
+ * several can be used at once. Setting up a context uses getopt(), which is
+ * not thread safe, so contexts should be created one at a time.
+ *
+ * If a thread pool is given, records are processed on the pool, which
+ * belongs to the caller and must outlive the context. Callbacks are always
+ * made from the calling thread.
+ *
+ * As with the command line tools, fatal errors (such as running out of
+ * memory) end the process.
+ */
+
+const char *bambi_version(void);
+
+/*
+ * Metrics for one barcode, passed to bambi_decode_metrics() callbacks.
+ * tag_hop is set for a pair of barcodes found as a tag hop, rather
+ * than a barcode from the barcode file.
+ */
+typedef struct {
+    const char *barcode;
+    const char *name;
+    const char *library;
+    const char *sample;
+    const char *description;
+    int tag_hop;
+    uint64_t reads, pf_reads, perfect, pf_perfect, one_mismatch, pf_one_mismatch;
+} bambi_barcode_metrics_t;
+
+typedef int (*bambi_barcode_metrics_fn)(const bambi_barcode_metrics_t *m, void *arg);
+
+/*
+ * Barcode decoding
+ *
+ * bambi_decode_header() adds the new @RG and @PG lines to a header.
+ * bambi_decode_records() decodes records in place. Records with the same
+ * name must be next to each other, and each call must contain whole
+ * templates.
+ * bambi_decode_metrics() calls fn for each barcode, then each tag hop.
+ * bambi_decode_finish() writes any --metrics-file or --partial-metrics.
+ *
+ * Functions returning int return 0 on success, or -1 on failure.
+ */
+typedef struct bambi_decode_t bambi_decode_t;
+
+bambi_decode_t *bambi_decode_init(int argc, char **argv, hts_tpool *pool);
+int bambi_decode_header(bambi_decode_t *ctx, sam_hdr_t *hdr);
+int bambi_decode_records(bambi_decode_t *ctx, bam1_t **recs, int nrecs);
+int bambi_decode_metrics(bambi_decode_t *ctx, bambi_barcode_metrics_fn fn, void *arg);
+int bambi_decode_finish(bambi_decode_t *ctx);
+void bambi_decode_destroy(bambi_decode_t *ctx);
+
+/*
+ * Metrics for one read group, passed to bambi_adapters_metrics() callbacks.
+ * hist_fwd and hist_rev count adapters by the position they start at.
+ */
+typedef struct {
+    const char *read_group;
+    int total_fwd, total_rev;
+    int contam_fwd, contam_rev;
+    int hist_len;
+    const int *hist_fwd;
+    const int *hist_rev;
+} bambi_adapter_metrics_t;
+
+typedef int (*bambi_adapter_metrics_fn)(const bambi_adapter_metrics_t *m, void *arg);
+
+/*
+ * Adapter detection
+ *
+ * These work in the same way as the decode functions above. Metrics are
+ * only collected if --metrics-file is given.
+ */
+typedef struct bambi_adapters_t bambi_adapters_t;
+
+bambi_adapters_t *bambi_adapters_init(int argc, char **argv, hts_tpool *pool);
+int bambi_adapters_header(bambi_adapters_t *ctx, sam_hdr_t *hdr);
+int bambi_adapters_records(bambi_adapters_t *ctx, bam1_t **recs, int nrecs);
+int bambi_adapters_metrics(bambi_adapters_t *ctx, bambi_adapter_metrics_fn fn, void *arg);
+int bambi_adapters_finish(bambi_adapters_t *ctx);
+void bambi_adapters_destroy(bambi_adapters_t *ctx);
+
+/*
+ * Illumina to BAM conversion
+ *
+ * Instead of writing a file, header_fn is called once with the new header,
+ * then records_fn is called with each batch of records, in output order.
+ * The records share memory, and only last until records_fn returns, so
+ * they must not be changed, and must be copied (with bam_copy1() or
+ * bam_dup1()) to be kept. A callback returning non-zero stops the
+ * conversion: no more clusters are read, and records_fn is not called
+ * again, although jobs already running on the thread pool are allowed to
+ * finish first.
+ *
+ * Returns 0 on success, 1 if there was a problem.
+ */
+typedef int (*bambi_header_fn)(sam_hdr_t *hdr, void *arg);
+typedef int (*bambi_records_fn)(bam1_t *recs, int nrecs, void *arg);
+
+int bambi_i2b_run(int argc, char **argv, hts_tpool *pool,
+                  bambi_header_fn header_fn, bambi_records_fn records_fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "parse_bam.h"
 #include "bambi.h"
@@ -30,6 +31,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define bam_nt16_rev_table "=ACMGRSVTWYHKDBN"
 
 static char *complement_table = NULL;
+static pthread_once_t complement_table_once = PTHREAD_ONCE_INIT;
 
 /**
  * Reverses the direction of the array of ints
@@ -79,6 +81,28 @@ char *reverse_seq(char *seq)
     return seq;
 }
 
+static void init_complement_table(void)
+{
+    int x;
+    complement_table = (char *) calloc(256, sizeof(char)) + 127;
+
+    for (x = -127; x < 128; x++) {
+             if (x == 'a') complement_table[x] = 't';
+        else if (x == 'c') complement_table[x] = 'g';
+        else if (x == 'g') complement_table[x] = 'c';
+        else if (x == 't') complement_table[x] = 'a';
+        else if (x == 'u') complement_table[x] = 'a';
+        else if (x == 'n') complement_table[x] = 'n';
+        else if (x == 'A') complement_table[x] = 'T';
+        else if (x == 'C') complement_table[x] = 'G';
+        else if (x == 'G') complement_table[x] = 'C';
+        else if (x == 'T') complement_table[x] = 'A';
+        else if (x == 'U') complement_table[x] = 'A';
+        else if (x == 'N') complement_table[x] = 'N';
+        else complement_table[x] = x;
+    }
+}
+
 /**
  * Return a character representing the complement-base of the supplied
  * parameter.  The mapping is as follows: a->t, c->g, g->c, t|u->a, [->],
@@ -95,26 +119,7 @@ char *reverse_seq(char *seq)
  */
 char complement_base(char c)
 {
-    if (!complement_table) {
-        int x;
-        complement_table = (char *) calloc(256, sizeof(char)) + 127;
-
-        for (x = -127; x < 128; x++) {
-                 if (x == 'a') complement_table[x] = 't';
-            else if (x == 'c') complement_table[x] = 'g';
-            else if (x == 'g') complement_table[x] = 'c';
-            else if (x == 't') complement_table[x] = 'a';
-            else if (x == 'u') complement_table[x] = 'a';
-            else if (x == 'n') complement_table[x] = 'n';
-            else if (x == 'A') complement_table[x] = 'T';
-            else if (x == 'C') complement_table[x] = 'G';
-            else if (x == 'G') complement_table[x] = 'C';
-            else if (x == 'T') complement_table[x] = 'A';
-            else if (x == 'U') complement_table[x] = 'A';
-            else if (x == 'N') complement_table[x] = 'N';
-            else complement_table[x] = x;
-        }
-    }
+    pthread_once(&complement_table_once, init_complement_table);
 
     return complement_table[(int) c];
 }
@@ -260,7 +265,7 @@ const char *parse_next_int(const char *str, int *val, const char *sep)
 /*
  * cns - parse bam file line
  *
- * returns 0 on success, 1 on expected failure.
+ * returns the next record, or NULL at the end of the file
  */
 bam1_t *parse_bam_readinfo( BAMit_t *fp,
                     int *bam_lane,
@@ -270,15 +275,28 @@ bam1_t *parse_bam_readinfo( BAMit_t *fp,
                     int *bam_read,
                     size_t *bam_offset) 
 {
+    bam1_t *bam = BAMit_next(fp);
+    if (bam) parse_bam_recinfo(bam, bam_lane, bam_tile, bam_x, bam_y, bam_read, bam_offset);
+    return bam;
+}
+
+/*
+ * get the lane, tile, position and read from a record's name and flags
+ */
+void parse_bam_recinfo( bam1_t *bam,
+                    int *bam_lane,
+                    int *bam_tile,
+                    int *bam_x,
+                    int *bam_y,
+                    int *bam_read,
+                    size_t *bam_offset) 
+{
 
     const char* const sep = ":#/";
     uint8_t *ci_ptr;
     int lane, tile, x, y, read;
 	int offset;
 
-    bam1_t *bam = BAMit_next(fp);
-    if (!bam) return bam;
-
     lane = -1;
     tile = -1;
     x = -1;
@@ -333,7 +351,6 @@ bam1_t *parse_bam_readinfo( BAMit_t *fp,
     if (bam_y) *bam_y = y;
     if (bam_read) *bam_read = read;
     if (bam_offset) *bam_offset = offset;
-    return bam;
 }
 
 /*
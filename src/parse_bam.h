@@ -43,6 +43,14 @@ bam1_t *parse_bam_readinfo(BAMit_t *fp,
                             int *bam_read, 
                          size_t *bam_offset);
 
+void parse_bam_recinfo(bam1_t *bam,
+                            int *bam_lane,
+                            int *bam_tile,
+                            int *bam_x,
+                            int *bam_y,
+                            int *bam_read,
+                         size_t *bam_offset);
+
 int parse_bam_alignments(BAMit_t *fp, 
                             bam1_t *bam, 
                               char *read_seq, 
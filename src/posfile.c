@@ -32,6 +32,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "bambi.h"
 #include "posfile.h"
+#include "archive.h"
 
 posfile_t *posfile_open(char *fname)
 {
@@ -67,7 +68,7 @@ posfile_t *posfile_open(char *fname)
         posfile->errmsg = strdup("posfile_open(): Unknown file type\n");
         return posfile;
     }
-    posfile->fhandle = fopen(fname, "rb");
+    posfile->fhandle = archive_fopen(fname);
 
     if (posfile->fhandle == NULL) {
         posfile->errmsg = strdup(strerror(errno));
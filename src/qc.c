@@ -0,0 +1,532 @@
+/*  qc.c -- several QC analyses in one pass over a BAM file
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Running seqchksum, substitution_analysis, spatial_filter -c and
+ * adapters --metrics-file one after another decodes the same BAM file
+ * four times, and works out the same read info and alignments several
+ * times over. 'bambi qc' reads the file once, in batches of records.
+ * The read info, sequence and alignments each analyser needs are worked
+ * out once per record (split over the thread pool), then each analyser
+ * is given the batch as a job of its own, while the next batch is read.
+ *
+ * Each analyser writes the same output as its own command would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include "bambi.h"
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include "bamit.h"
+#include "parse_bam.h"
+#include "bambi_utils.h"
+#include "batch_shared.h"
+#include "qc.h"
+
+#define QC_RECORDS_PER_BATCH 10000
+#define QC_MAX_ARGS 16
+
+#define QC_NANALYSERS 4     // seqchksum, substitution_analysis, spatial_filter and adapters
+
+/*
+ * An analyser, and the arguments to set it up with
+ */
+typedef struct {
+    const qc_analyser_t *analyser;
+    void *state;
+    int nargs;
+    char *args[QC_MAX_ARGS];
+    qc_batch_t *batch;          // the batch being analysed
+    int result;
+} qc_job_t;
+
+/*
+ * Working out the shared data for part of a batch
+ */
+typedef struct {
+    qc_batch_t *batch;
+    int start, end;
+    int needs;
+} qc_prep_t;
+
+/*
+ * structure to hold options
+ */
+typedef struct {
+    char *in_bam_file;
+    char *input_fmt;
+    int nthreads;
+    bool verbose;
+    qc_job_t jobs[QC_NANALYSERS];
+    int njobs;
+} opts_t;
+
+static void free_opts(opts_t *opts)
+{
+    if (!opts) return;
+    free(opts->in_bam_file);
+    free(opts->input_fmt);
+    for (int n=0; n < opts->njobs; n++) {
+        // args[0] and args[1] are "bambi" and the command name
+        for (int a=2; a < opts->jobs[n].nargs; a++) free(opts->jobs[n].args[a]);
+    }
+    free(opts);
+}
+
+/*
+ * Find the job for an analyser, adding it if need be
+ */
+static qc_job_t *findJob(opts_t *opts, const qc_analyser_t *analyser)
+{
+    for (int n=0; n < opts->njobs; n++) {
+        if (opts->jobs[n].analyser == analyser) return &opts->jobs[n];
+    }
+    qc_job_t *job = &opts->jobs[opts->njobs++];
+    job->analyser = analyser;
+    job->args[job->nargs++] = "bambi";
+    job->args[job->nargs++] = (char *)analyser->name;
+    return job;
+}
+
+static void addArg(opts_t *opts, const qc_analyser_t *analyser, const char *arg, const char *val)
+{
+    qc_job_t *job = findJob(opts, analyser);
+    // leave room for "-v", the input file and a NULL
+    if (job->nargs + 5 > QC_MAX_ARGS) die("Too many options for %s\n", analyser->name);
+    job->args[job->nargs++] = strdup(arg);
+    if (val) job->args[job->nargs++] = strdup(val);
+}
+
+/*
+ * display usage information
+ */
+static void usage(FILE *write_to)
+{
+    fprintf(write_to,
+"Usage: bambi qc [options] filename\n"
+"\n"
+"Reads a BAM file once, and runs each of the analyses asked for on it.\n"
+"Each analysis writes the same output as the bambi command would.\n"
+"\n"
+"Options:\n"
+"  -i   --input                         input file [default: stdin]\n"
+"       --input-fmt                     format of input file [sam/bam/cram]\n"
+"  -t   --threads                       number of threads to use [default: 1]\n"
+"  -v   --verbose                       verbose output\n"
+"\n"
+"       --seqchksum                     write checksums to this file (as 'bambi seqchksum -o')\n"
+"       --hash                          hash type for --seqchksum\n"
+"       --substitution-analysis         write a substitution analysis table to this file\n"
+"                                       (as 'bambi substitution_analysis -o')\n"
+"       --converge                      passed to substitution_analysis\n"
+"       --by-read-group                 passed to substitution_analysis\n"
+"       --by-tile                       passed to substitution_analysis\n"
+"       --spatial-filter                write a filter to this file (as 'bambi spatial_filter -c -F')\n"
+"       --snp-file                      passed to spatial_filter\n"
+"       --region-size                   passed to spatial_filter\n"
+"       --adapter-metrics               write adapter metrics to this file\n"
+"                                       (as 'bambi adapters --metrics-file')\n"
+"       --adapter-file                  passed to adapters\n"
+);
+}
+
+/*
+ * Takes the command line options and turns them into something we can understand
+ */
+static opts_t* parse_args(int argc, char *argv[])
+{
+    if (argc == 1) { usage(stdout); return NULL; }
+
+    const char* optstring = "i:t:vh?";
+
+    static const struct option lopts[] = {
+        { "input",                      1, 0, 'i' },
+        { "input-fmt",                  1, 0, 0 },
+        { "threads",                    1, 0, 't' },
+        { "verbose",                    0, 0, 'v' },
+        { "help",                       0, 0, 'h' },
+        { "seqchksum",                  1, 0, 0 },
+        { "hash",                       1, 0, 0 },
+        { "substitution-analysis",      1, 0, 0 },
+        { "converge",                   1, 0, 0 },
+        { "by-read-group",              0, 0, 0 },
+        { "by-tile",                    0, 0, 0 },
+        { "spatial-filter",             1, 0, 0 },
+        { "snp-file",                   1, 0, 0 },
+        { "region-size",                1, 0, 0 },
+        { "adapter-metrics",            1, 0, 0 },
+        { "adapter-file",               1, 0, 0 },
+        { NULL, 0, NULL, 0 }
+    };
+
+    opts_t* opts = calloc(sizeof(opts_t), 1);
+    if (!opts) { perror("cannot allocate option parsing memory"); return NULL; }
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, optstring, lopts, &option_index)) != -1) {
+        const char *arg;
+        switch (opt) {
+        case 'i':   opts->in_bam_file = strdup(optarg);
+                    break;
+        case 't':   opts->nthreads = atoi(optarg);
+                    break;
+        case 'v':   opts->verbose = true;
+                    break;
+        case 'h':   usage(stdout); free_opts(opts); return NULL;
+        case 0:     arg = lopts[option_index].name;
+                         if (strcmp(arg, "input-fmt") == 0)              opts->input_fmt = strdup(optarg);
+                    else if (strcmp(arg, "seqchksum") == 0)              addArg(opts, &qc_seqchksum, "-o", optarg);
+                    else if (strcmp(arg, "hash") == 0)                   addArg(opts, &qc_seqchksum, "--hash", optarg);
+                    else if (strcmp(arg, "substitution-analysis") == 0)  addArg(opts, &qc_substitution_analysis, "-o", optarg);
+                    else if (strcmp(arg, "converge") == 0)               addArg(opts, &qc_substitution_analysis, "--converge", optarg);
+                    else if (strcmp(arg, "by-read-group") == 0)          addArg(opts, &qc_substitution_analysis, "--by-read-group", NULL);
+                    else if (strcmp(arg, "by-tile") == 0)                addArg(opts, &qc_substitution_analysis, "--by-tile", NULL);
+                    else if (strcmp(arg, "spatial-filter") == 0)         addArg(opts, &qc_spatial_filter, "-F", optarg);
+                    else if (strcmp(arg, "snp-file") == 0)               addArg(opts, &qc_spatial_filter, "--snp-file", optarg);
+                    else if (strcmp(arg, "region-size") == 0)            addArg(opts, &qc_spatial_filter, "--region-size", optarg);
+                    else if (strcmp(arg, "adapter-metrics") == 0)        addArg(opts, &qc_adapters, "--metrics-file", optarg);
+                    else if (strcmp(arg, "adapter-file") == 0)           addArg(opts, &qc_adapters, "--adapter-file", optarg);
+                    else {
+                        printf("\nUnknown option: %s\n\n", arg);
+                        usage(stdout); free_opts(opts);
+                        return NULL;
+                    }
+                    break;
+        default:    printf("Unknown option: '%c'\n", opt);
+            /* else fall-through */
+        case '?':   usage(stdout); free_opts(opts); return NULL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 0) opts->in_bam_file = strdup(argv[0]);
+    optind = 0;
+
+    // input defaults to stdin
+    if (!opts->in_bam_file) opts->in_bam_file = strdup("-");
+
+    if (opts->njobs == 0) {
+        fprintf(stderr, "No analyses given\n");
+        usage(stderr); free_opts(opts);
+        return NULL;
+    }
+
+    // finish off each analyser's arguments
+    for (int n=0; n < opts->njobs; n++) {
+        qc_job_t *job = &opts->jobs[n];
+        if (job->analyser == &qc_spatial_filter) job->args[job->nargs++] = strdup("-c");
+        if (opts->verbose) job->args[job->nargs++] = strdup("-v");
+        // the input file isn't used, but the commands want one
+        job->args[job->nargs++] = strdup("-");
+        job->args[job->nargs] = NULL;
+    }
+
+    return opts;
+}
+
+/*
+ * Read the next batch of records. The records are copied, so that the
+ * batch can be analysed while the next one is read.
+ */
+static int readBatch(BAMit_t *bam_in, qc_batch_t *batch)
+{
+    batch->nrecs = 0;
+    while (batch->nrecs < QC_RECORDS_PER_BATCH && BAMit_hasnext(bam_in)) {
+        qc_record_t *r = &batch->recs[batch->nrecs++];
+        if (!bam_copy1(r->rec, BAMit_next(bam_in))) die("bam_copy1() failed in readBatch()");
+    }
+    return batch->nrecs;
+}
+
+/*
+ * Work out what the analysers need from a record
+ */
+static void prepareRecord(BAMit_t *bam_in, qc_record_t *r, int needs)
+{
+    bam1_t *rec = r->rec;
+
+    if (needs & QC_NEED_INFO) parse_bam_recinfo(rec, &r->lane, &r->tile, &r->x, &r->y, &r->read, NULL);
+
+    r->aligned = false;
+    if (!(needs & (QC_NEED_SEQ | QC_NEED_ALIGNMENT))) return;
+
+    if (rec->core.l_qseq >= r->buff_size) {
+        r->buff_size = rec->core.l_qseq + 1;
+        r->seq = realloc(r->seq, r->buff_size);
+        r->qual = realloc(r->qual, r->buff_size * sizeof(int));
+        r->ref = realloc(r->ref, r->buff_size);
+        r->mismatch = realloc(r->mismatch, r->buff_size * sizeof(int));
+        if (!r->seq || !r->qual || !r->ref || !r->mismatch) die("Out of memory");
+    }
+
+    if ((needs & QC_NEED_ALIGNMENT) && qc_use_alignment(rec)) {
+        // this gives the read in sequencing order too
+        parse_bam_alignments(bam_in, rec, r->seq, r->qual, r->ref, r->mismatch, r->buff_size, NULL);
+        r->aligned = true;
+    } else if (needs & QC_NEED_SEQ) {
+        // as get_read(), without the malloc
+        uint8_t *seq = bam_get_seq(rec);
+        int n;
+        for (n=0; n < rec->core.l_qseq; n++) r->seq[n] = seq_nt16_str[bam_seqi(seq,n)];
+        r->seq[n] = 0;
+        if (BAM_FREVERSE & rec->core.flag) rev_comp_seq(r->seq);
+    }
+}
+
+static void *prep_job(void *arg)
+{
+    qc_prep_t *prep = (qc_prep_t *)arg;
+    for (int n = prep->start; n < prep->end; n++) {
+        prepareRecord(prep->batch->bam_in, &prep->batch->recs[n], prep->needs);
+    }
+    return prep;
+}
+
+static void *analyser_job(void *arg)
+{
+    qc_job_t *job = (qc_job_t *)arg;
+    job->result = job->analyser->records(job->state, job->batch);
+    return job;
+}
+
+/*
+ * Wait for n jobs to finish
+ */
+static void waitJobs(hts_tpool_process *queue, int n)
+{
+    while (n-- > 0) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(queue);
+        if (!r) die("Failed to get qc job result");
+        hts_tpool_delete_result(r, 0);
+    }
+}
+
+/*
+ * Work out the shared data for a batch, a chunk per thread
+ */
+static void prepareBatch(hts_tpool *pool, hts_tpool_process *queue, qc_prep_t *preps, int npreps, qc_batch_t *batch, int needs)
+{
+    if (!pool) {
+        qc_prep_t prep = { batch, 0, batch->nrecs, needs };
+        prep_job(&prep);
+        return;
+    }
+
+    int chunk = (batch->nrecs + npreps - 1) / npreps;
+    int njobs = 0;
+    for (int start = 0; start < batch->nrecs; start += chunk) {
+        qc_prep_t *prep = &preps[njobs++];
+        prep->batch = batch;
+        prep->start = start;
+        prep->end = start + chunk < batch->nrecs ? start + chunk : batch->nrecs;
+        prep->needs = needs;
+        if (hts_tpool_dispatch(pool, queue, prep_job, prep) < 0) die("Thread pool dispatch failed");
+    }
+    waitJobs(queue, njobs);
+}
+
+/*
+ * Give a batch to each of the analysers
+ */
+static void runAnalysers(hts_tpool *pool, hts_tpool_process *queue, opts_t *opts, qc_batch_t *batch)
+{
+    for (int n=0; n < opts->njobs; n++) {
+        qc_job_t *job = &opts->jobs[n];
+        job->batch = batch;
+        if (pool) {
+            if (hts_tpool_dispatch(pool, queue, analyser_job, job) < 0) die("Thread pool dispatch failed");
+        } else {
+            analyser_job(job);
+        }
+    }
+}
+
+static int checkAnalysers(opts_t *opts)
+{
+    int ret = 0;
+    for (int n=0; n < opts->njobs; n++) {
+        if (opts->jobs[n].result) {
+            fprintf(stderr, "qc: %s failed\n", opts->jobs[n].analyser->name);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void initBatch(qc_batch_t *batch, BAMit_t *bam_in)
+{
+    batch->bam_in = bam_in;
+    batch->nrecs = 0;
+    batch->recs = calloc(QC_RECORDS_PER_BATCH, sizeof(qc_record_t));
+    if (!batch->recs) die("Out of memory");
+    for (int n=0; n < QC_RECORDS_PER_BATCH; n++) {
+        batch->recs[n].rec = bam_init1();
+        if (!batch->recs[n].rec) die("Out of memory");
+    }
+}
+
+static void freeBatch(qc_batch_t *batch)
+{
+    if (!batch->recs) return;
+    for (int n=0; n < QC_RECORDS_PER_BATCH; n++) {
+        qc_record_t *r = &batch->recs[n];
+        bam_destroy1(r->rec);
+        free(r->seq);
+        free(r->qual);
+        free(r->ref);
+        free(r->mismatch);
+    }
+    free(batch->recs);
+}
+
+/*
+ * Main code
+ */
+static int qc(opts_t *opts)
+{
+    int retcode = 1;
+    int needs = 0;
+    BAMit_t *bam_in = NULL;
+    htsThreadPool hts_threads = { NULL, 0 };
+    hts_tpool_process *prep_queue = NULL, *job_queue = NULL;
+    qc_prep_t *preps = NULL;
+    qc_batch_t batch[2] = { { NULL, NULL, 0 }, { NULL, NULL, 0 } };
+    int cur = 0;
+    bool running = false;       // the analysers have a batch
+
+    for (int n=0; n < opts->njobs; n++) needs |= opts->jobs[n].analyser->needs;
+
+    while (1) {
+        if (opts->nthreads > 1) {
+            hts_threads.pool = batch_tpool_init(opts->nthreads);
+            if (!hts_threads.pool) {
+                fprintf(stderr, "Couldn't set up thread pool\n");
+                break;
+            }
+            prep_queue = hts_tpool_process_init(hts_threads.pool, 2 * opts->nthreads, 0);
+            job_queue = hts_tpool_process_init(hts_threads.pool, 2 * QC_NANALYSERS, 0);
+            if (!prep_queue || !job_queue) {
+                fprintf(stderr, "Couldn't set up thread pool queue\n");
+                break;
+            }
+            preps = smalloc(opts->nthreads * sizeof(qc_prep_t));
+        }
+
+        bam_in = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, hts_threads.pool ? &hts_threads : NULL, 0);
+        if (!bam_in) {
+            fprintf(stderr, "Can't open %s: %s\n", opts->in_bam_file, strerror(errno));
+            break;
+        }
+        initBatch(&batch[0], bam_in);
+        initBatch(&batch[1], bam_in);
+
+        // read and prepare a batch while the analysers work on the last one
+        while (readBatch(bam_in, &batch[cur])) {
+            prepareBatch(hts_threads.pool, prep_queue, preps, opts->nthreads, &batch[cur], needs);
+            if (running) waitJobs(job_queue, opts->njobs);
+            running = false;
+            if (checkAnalysers(opts)) break;
+            runAnalysers(hts_threads.pool, job_queue, opts, &batch[cur]);
+            running = (hts_threads.pool != NULL);
+            cur ^= 1;
+        }
+        if (running) waitJobs(job_queue, opts->njobs);
+        running = false;
+        if (checkAnalysers(opts)) break;
+        if (BAMit_hasnext(bam_in)) break;
+
+        retcode = 0;
+        break;
+    }
+
+    // the analysers write their output and tidy up after themselves
+    for (int n=0; n < opts->njobs; n++) {
+        qc_job_t *job = &opts->jobs[n];
+        if (job->state && job->analyser->finish(job->state)) retcode = 1;
+        job->state = NULL;
+    }
+
+    // tidy up after us
+    freeBatch(&batch[0]);
+    freeBatch(&batch[1]);
+    BAMit_free(bam_in);
+    if (prep_queue) hts_tpool_process_destroy(prep_queue);
+    if (job_queue) hts_tpool_process_destroy(job_queue);
+    free(preps);
+    batch_tpool_destroy(hts_threads.pool);
+
+    return retcode;
+}
+
+/*
+ * Set up each analyser from its arguments
+ */
+static int initAnalysers(opts_t *opts)
+{
+    for (int n=0; n < opts->njobs; n++) {
+        qc_job_t *job = &opts->jobs[n];
+        optind = 0;
+        job->state = job->analyser->init(job->nargs - 1, job->args + 1);
+        if (!job->state) {
+            fprintf(stderr, "qc: can't set up %s\n", job->analyser->name);
+            // finish() is the only way to free the analysers already set up
+            while (n-- > 0) {
+                opts->jobs[n].analyser->finish(opts->jobs[n].state);
+                opts->jobs[n].state = NULL;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * called from bambi to run several QC analyses in one pass
+ *
+ * Parse the command line arguments, then call the main qc function
+ *
+ * returns 0 on success, 1 if there was a problem
+ */
+int main_qc(int argc, char *argv[])
+{
+    int ret = 1;
+
+    opts_t* opts = parse_args(argc, argv);
+    if (opts && initAnalysers(opts)) {
+        free_opts(opts);
+        opts = NULL;
+    }
+
+    batch_args_parsed();
+    if (opts) {
+        ret = qc(opts);
+    }
+    free_opts(opts);
+    return ret;
+}
@@ -0,0 +1,87 @@
+/*  qc.h -- several QC analyses in one pass over a BAM file
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __QC_H__
+#define __QC_H__
+
+#include <stdbool.h>
+#include "htslib/sam.h"
+#include "bamit.h"
+
+/*
+ * 'bambi qc' reads a BAM file once and gives each record to several
+ * analysers. What the analysers need from a record beyond the record
+ * itself is worked out once, and shared by all of them.
+ */
+
+#define QC_NEED_INFO        (1<<0)  // lane, tile, x, y and read, from the read name and flags
+#define QC_NEED_SEQ         (1<<1)  // the read in sequencing order, as from get_read()
+#define QC_NEED_ALIGNMENT   (1<<2)  // parse_bam_alignments() for aligned records
+
+typedef struct {
+    bam1_t *rec;
+    int lane, tile, x, y, read;     // set if QC_NEED_INFO
+    bool aligned;                   // seq, qual, ref and mismatch are from parse_bam_alignments()
+    char *seq;                      // set if QC_NEED_SEQ or aligned
+    int *qual;
+    char *ref;
+    int *mismatch;
+    int buff_size;                  // size of the arrays above
+} qc_record_t;
+
+/*
+ * The records in a batch. Analysers must not change them.
+ */
+typedef struct {
+    BAMit_t *bam_in;
+    qc_record_t *recs;
+    int nrecs;
+} qc_batch_t;
+
+/*
+ * An analyser is set up from the same arguments as its command (argv[0]
+ * being the command name, without an input file). records() is called
+ * for each batch, in order, from one thread at a time. finish() writes
+ * the command's usual output and frees the analyser.
+ * records() and finish() return 0 on success, or -1 on failure.
+ */
+typedef struct {
+    const char *name;
+    int needs;                      // QC_NEED_* flags
+    void *(*init)(int argc, char **argv);
+    int (*records)(void *state, qc_batch_t *batch);
+    int (*finish)(void *state);
+} qc_analyser_t;
+
+// Records which parse_bam_alignments() is run on for QC_NEED_ALIGNMENT
+static inline bool qc_use_alignment(bam1_t *rec)
+{
+    if (rec->core.flag & (BAM_FUNMAP | BAM_FQCFAIL | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) return false;
+    if ((rec->core.flag & BAM_FPAIRED) && !(rec->core.flag & BAM_FPROPER_PAIR)) return false;
+    return true;
+}
+
+extern const qc_analyser_t qc_seqchksum;
+extern const qc_analyser_t qc_substitution_analysis;
+extern const qc_analyser_t qc_spatial_filter;
+extern const qc_analyser_t qc_adapters;
+
+#endif
+
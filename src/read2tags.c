@@ -36,6 +36,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "array.h"
 #include "bamit.h"
 #include "parse.h"
+#include "batch_shared.h"
 
 #define DEFAULT_KEEP_TAGS "BC,QT,RG"
 #define DEFAULT_DISCARD_TAGS "as,af,aa,a3,ah"
@@ -834,8 +835,8 @@ int process(opts_t* opts)
     bam1_t *rec = NULL;
     bam1_t *rec2 = NULL;
 
-    BAMit_t *bam_in = BAMit_open(opts->in_file, 'r', opts->input_fmt, 0, NULL);
-    BAMit_t *bam_out = BAMit_open(opts->out_file, 'w', opts->output_fmt, opts->compression_level, NULL);
+    BAMit_t *bam_in = BAMit_open(opts->in_file, 'r', opts->input_fmt, 0, NULL, 0);
+    BAMit_t *bam_out = BAMit_open(opts->out_file, 'w', opts->output_fmt, opts->compression_level, NULL, 0);
 
     // copy input to output header
     bam_hdr_destroy(bam_out->h); bam_out->h = bam_hdr_dup(bam_in->h);
@@ -898,6 +899,7 @@ int main_read2tags(int argc, char *argv[])
 {
     int ret = 1;
     opts_t* opts = read2tags_parse_args(argc, argv);
+    batch_args_parsed();
     if (opts) ret = process(opts);
     free_opts(opts);
     return ret;
@@ -37,6 +37,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "array.h"
 #include "bamit.h"
 #include "parse.h"
+#include "batch_shared.h"
 
 char *strptime(const char *s, const char *format, struct tm *tm);
 
@@ -658,6 +659,7 @@ int main_select(int argc, char *argv[])
 {
     int ret = 1;
     opts_t* opts = select_parse_args(argc, argv);
+    batch_args_parsed();
     if (opts) ret = aln_select(opts);
     free_opts(opts);
     return ret;
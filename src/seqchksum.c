@@ -32,6 +32,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <regex.h>
 #include <htslib/khash.h>
 #include <inttypes.h>
+#include <htslib/bgzf.h>
+#include <htslib/hts_endian.h>
 
 #include "seqchksum.h"
 #include "bamit.h"
@@ -39,11 +41,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "parse_bam.h"
 #include "crc.h"
 #include "hash_table.h"
+#include "batch_shared.h"
+#include "qc.h"
 
 #define xstr(s) str(s)
 #define str(s) #s
 
-//static char *hash_names[] = {"crc32", "crc32prod"};
+#define PARTIAL_MAGIC "##BAMBI_SEQCHKSUM_PARTIAL\t2"
+#define SYNC_BUFFER (4*BGZF_MAX_BLOCK_SIZE)
 
 HASH_TYPE decode_hash_name(char *name)
 {
@@ -53,23 +58,47 @@ HASH_TYPE decode_hash_name(char *name)
     return hash;
 }
 
+static const char *hash_name(HASH_TYPE hash)
+{
+    switch (hash) {
+        case HASH_CRC32:        return "crc32";
+        case HASH_CRC32PROD:    return "crc32prod";
+        case HASH_UNKNOWN:      break;
+    }
+    return "unknown";
+}
+
 /*
  * structure to hold options
  */
 typedef struct {
     char *input_name;
+    char *output_name;
     bool verbose;
     char *argv_list;
     char *input_fmt;
     HASH_TYPE hash;
+    bool range;
+    int64_t range_start, range_end;
+    bool merge;
+    va_t *partials;
 } opts_t;
 
+/*
+ * Virtual offsets of the records a --range starts and stops at
+ */
+typedef struct {
+    int64_t data_start, first, next;
+} range_t;
+
 static void free_opts(opts_t* opts)
 {
     if (!opts) return;
     free(opts->input_name);
+    free(opts->output_name);
     free(opts->argv_list);
     free(opts->input_fmt);
+    va_free(opts->partials);
     free(opts);
 }
 
@@ -81,11 +110,21 @@ static void usage(FILE *write_to)
 {
     fprintf(write_to,
 "Usage: bambi seqchksum [options] <filename>\n"
+"       bambi seqchksum --merge [options] <partial> [<partial>...]\n"
 "\n"
 "Options:\n"
 "  -v   --verbose                       verbose output\n"
+"  -o   --output                        file to write the checksums to [default: stdout]\n"
 "       --input-fmt                     format of input file [sam/bam/cram]\n"
-"       --hash                          Hash type [default: crcprod]\n"
+"       --hash                          Hash type: crc32 or crc32prod [default: crc32prod]\n"
+"       --range                         start-end: only checksum the records which start in the\n"
+"                                       BGZF blocks between these compressed byte offsets of a\n"
+"                                       BAM file, and write a partial checksum file. The end may\n"
+"                                       be left out to mean the end of the file.\n"
+"       --merge                         combine partial checksum files from --range into the\n"
+"                                       normal output. The ranges must cover the whole file,\n"
+"                                       without overlapping, and then give the same checksums as\n"
+"                                       the whole file.\n"
 );
 }
 
@@ -96,13 +135,16 @@ static opts_t* parse_args(int argc, char *argv[])
 {
     if (argc == 1) { usage(stdout); return NULL; }
 
-    const char* optstring = "i:vb:";
+    const char* optstring = "i:o:vb:";
 
     static const struct option lopts[] = {
         { "hash",                       1, 0, 0 },
         { "input",                      1, 0, 'i' },
+        { "output",                     1, 0, 'o' },
         { "verbose",                    0, 0, 'v' },
         { "input-fmt",                  1, 0, 0 },
+        { "range",                      1, 0, 0 },
+        { "merge",                      0, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -123,11 +165,28 @@ static opts_t* parse_args(int argc, char *argv[])
         switch (opt) {
         case 'i':   opts->input_name = strdup(optarg);
                     break;
+        case 'o':   opts->output_name = strdup(optarg);
+                    break;
         case 'v':   opts->verbose = true;
                     break;
         case 0:     arg = lopts[option_index].name;
                          if (strcmp(arg, "hash") == 0)               opts->hash = decode_hash_name(optarg);
                     else if (strcmp(arg, "input-fmt") == 0)                  opts->input_fmt = strdup(optarg);
+                    else if (strcmp(arg, "range") == 0) {
+                        char *end;
+                        opts->range = true;
+                        opts->range_start = strtoll(optarg, &end, 10);
+                        opts->range_end = INT64_MAX;
+                        if (*end != '-') opts->range_start = -1;
+                        else if (end[1]) opts->range_end = strtoll(end+1, &end, 10);
+                        if (*end && *end != '-') opts->range_start = -1;
+                        if (opts->range_start < 0 || opts->range_end < opts->range_start) {
+                            fprintf(stderr, "Invalid range: %s\n", optarg);
+                            free_opts(opts);
+                            return NULL;
+                        }
+                    }
+                    else if (strcmp(arg, "merge") == 0)                      opts->merge = true;
                     else {
                         printf("\nUnknown option: %s\n\n", arg); 
                         usage(stdout); free_opts(opts);
@@ -143,17 +202,26 @@ static opts_t* parse_args(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (argc > 0) opts->input_name = strdup(argv[0]);
+    if (opts->merge) {
+        opts->partials = va_init(5, free);
+        for (int n=0; n < argc; n++) va_push(opts->partials, strdup(argv[n]));
+    } else {
+        if (argc > 0) opts->input_name = strdup(argv[0]);
+    }
     optind = 0;
 
     // some validation and tidying
+    if (opts->merge && (opts->range || !opts->partials->end)) {
+        fprintf(stderr, "--merge needs one or more partial checksum files, and can't be used with --range\n");
+        usage(stderr); free_opts(opts);
+        return NULL;
+    }
 
     // input defaults to stdin
     if (!opts->input_name) opts->input_name = strdup("-");
 
-    // TODO: list valid hash types here
     if (opts->hash == HASH_UNKNOWN) {
-        fprintf(stderr, "Unknown has type\n");
+        fprintf(stderr, "Unknown hash type: must be crc32 or crc32prod\n");
         return NULL;
     }
 
@@ -179,48 +247,116 @@ uint64_t update_digest_crc32(uint64_t digest, uint32_t val)
     return digest + val;
 }
 
-uint64_t update_digest(HASH_TYPE hash, uint64_t digest, uint32_t val)
+/*
+ * One record's data, packed into buf:
+ *
+ *   name \0 | flags seq | qual | tags
+ *
+ * The first three checksum columns are contiguous pieces of buf.
+ */
+typedef struct {
+    kstring_t *buf;
+    size_t col_start[3];
+    size_t col_len[3];
+    size_t tags_start, tags_len;
+} record_data_t;
+
+/*
+ * A checksum family. The record function works out the four column digests
+ * for a record, combine adds one digest into a running checksum, and merge
+ * combines two running checksums.
+ */
+typedef struct {
+    uint32_t identity;      // starting value of a checksum
+    void (*record)(record_data_t *rd, uint32_t v[4]);
+    void (*combine)(uint32_t *d, uint32_t v);
+    void (*merge)(uint32_t *d, uint32_t v);
+} hash_family_t;
+
+/*
+ * The crc is continued from one column into the next
+ */
+static void record_crc32(record_data_t *rd, uint32_t v[4])
 {
-    switch (hash) {
-        case HASH_CRC32:        digest = update_digest_crc32(digest,val);
-                                break;
-        case HASH_CRC32PROD:    digest = update_digest_crc32prod(digest,val);
-                                break;
-        case HASH_UNKNOWN:      break;
-    }
-    return digest;
+    uint8_t *b = (uint8_t *)rd->buf->s;
+    uint32_t crc = 0;
+
+    // flags + sequence chksum
+    update_crc(&crc, b + rd->col_start[0], rd->col_len[0]);
+    v[0] = crc;
+
+    // flags + sequence + quality chksum (don't reset crc, just add quality)
+    update_crc(&crc, b + rd->col_start[0] + rd->col_len[0], rd->col_len[2] - rd->col_len[0]);
+    v[2] = crc;
+
+    // name + flags + sequence chksum
+    crc = 0;
+    update_crc(&crc, b + rd->col_start[1], rd->col_len[1]);
+    v[1] = crc;
+
+    // flags + sequence + tags chksum
+    crc = v[0];
+    update_crc(&crc, b + rd->tags_start, rd->tags_len);
+    v[3] = crc;
 }
 
-static void init_digest_line(HASH_TYPE hash, digest_line_t *d)
+static void combine_crc32(uint32_t *d, uint32_t v)
 {
-    int v = 0;
-    if (hash == HASH_CRC32) v=0;
-    if (hash == HASH_CRC32PROD) v=1;
+    *d = update_digest_crc32(*d, v);
+}
 
-    d->count[0] = 0;    d->count[1] = 0;
+static void combine_crc32prod(uint32_t *d, uint32_t v)
+{
+    *d = update_digest_crc32prod(*d, v);
+}
+
+static void merge_crc32prod(uint32_t *d, uint32_t v)
+{
+    static uint64_t const MERSENNE31 = 0x7FFFFFFFull;
+    *d = ((uint64_t)*d * v) % MERSENNE31;
+}
+
+static const hash_family_t hash_families[] = {
+    [HASH_CRC32]        = { 0, record_crc32, combine_crc32,     combine_crc32 },
+    [HASH_CRC32PROD]    = { 1, record_crc32, combine_crc32prod, merge_crc32prod },
+};
+
+static void init_digest_line(HASH_TYPE hash, digest_line_t *d)
+{
+    memset(d, 0, sizeof(digest_line_t));
     for (int c=0; c<4; c++) {
         for (int p=0; p<2; p++) {
-            d->chksum[c][p] = v;
+            d->chksum[c][p] = hash_families[hash].identity;
         }
     }
 }
 
-static void update_digest_line(HASH_TYPE hash, bool pass, digest_line_t *dline, uint32_t crc, int c)
+static void update_digest_line(const hash_family_t *hf, bool pass, digest_line_t *dline, uint32_t v[4])
 {
-    if (!c) dline->count[0]++;
-    dline->chksum[c][0] = update_digest(hash, dline->chksum[c][0], crc);
-    if (pass) {
-        if (!c) dline->count[1]++;
-        dline->chksum[c][1] = update_digest(hash, dline->chksum[c][1], crc);
+    dline->count[0]++;
+    if (pass) dline->count[1]++;
+    for (int c=0; c<4; c++) {
+        hf->combine(&dline->chksum[c][0], v[c]);
+        if (pass) hf->combine(&dline->chksum[c][1], v[c]);
     }
 }
 
+/*
+ * The aux tags we look at: the read group, and the tags which are part of the checksum
+ */
+enum { TAG_RG, TAG_BC, TAG_FI, TAG_QT, TAG_RT, TAG_TC, NTAGS };
+static const char *chksum_tags[NTAGS] = { "RG", "BC", "FI", "QT", "RT", "TC" };
+
 /*
  * process one BAM record, and store accumulated results in 'results'
+ * Returns 0, or -1 if the record can't be read
  */
 int seqchksum_processRecord(bam1_t *rec, HASH_TYPE hash, chksum_results_t *results)
 {
-    uint32_t crc = 0;
+    const hash_family_t *hf = &hash_families[hash];
+    uint32_t v[4];
+    record_data_t rd;
+    kstring_t *b = &results->buf;
 
     uint16_t aflags = rec->core.flag;
     uint8_t *seq = get_read(rec);
@@ -229,17 +365,27 @@ int seqchksum_processRecord(bam1_t *rec, HASH_TYPE hash, chksum_results_t *resul
     uint8_t flags = (aflags & flag_mask) & 0xFF;
     bool pass = !(aflags & BAM_FQCFAIL);;
     char *qname = bam_get_qname(rec);
+    size_t name_len = strlen(qname) + 1;
+    size_t seq_len = strlen((char *)seq);
+    size_t qual_len = strlen((char *)qual);
     uint8_t *tag;
     char *rgid;
     HashItem *hi;
     HashData hd;
     int newitem;
-    digest_line_t *dline_all;
     digest_line_t *dline;
+    BAMit_aux_t aux = BAMIT_AUX_INIT;
+
+    // find all the tags we need in one pass
+    for (int n=0; n < NTAGS; n++) BAMit_aux_add(&aux, chksum_tags[n]);
+    if (BAMit_aux_index(&aux, rec) < 0) {
+        fprintf(stderr, "Corrupt aux data in record %s\n", qname);
+        free(seq); free(qual);
+        return -1;
+    }
 
     // look up the RG tag
-    tag = bam_aux_get(rec, "RG");
-    //hd.p = malloc(sizeof(digest_line_t));
+    tag = BAMit_aux_get(&aux, rec, TAG_RG);
     if (tag) rgid = bam_aux2Z(tag);
     else     rgid = "";
 
@@ -253,39 +399,28 @@ int seqchksum_processRecord(bam1_t *rec, HASH_TYPE hash, chksum_results_t *resul
         dline = hi->data.p;
     }
 
-    dline_all = &(results->all);
-
-    // flags + sequence chksum
-    update_crc(&crc,&flags,1);
-    update_crc(&crc,seq,strlen((char*)seq));
-
-    update_digest_line(hash, pass, dline, crc, 0);
-    update_digest_line(hash, pass, dline_all, crc, 0);
-
-    // flags + sequence + quality chksum (don't reset crc, just add quality)
-    update_crc(&crc,qual,strlen((char*)qual));
-    update_digest_line(hash, pass, dline, crc, 2);
-    update_digest_line(hash, pass, dline_all, crc, 2);
+    // name + flags + sequence, then quality
+    b->l = 0;
+    kputsn(qname, name_len, b);
+    kputc(flags, b);
+    kputsn((char *)seq, seq_len, b);
+    kputsn((char *)qual, qual_len, b);
+    rd.col_start[1] = 0;                rd.col_len[1] = name_len + 1 + seq_len;
+    rd.col_start[0] = name_len;         rd.col_len[0] = 1 + seq_len;
+    rd.col_start[2] = name_len;         rd.col_len[2] = 1 + seq_len + qual_len;
 
-    // name + flags + sequence chksum
-    crc = 0;
-    update_crc(&crc, (uint8_t *)qname, strlen(qname)+1);
-    update_crc(&crc, &flags, 1);
-    update_crc(&crc,seq,strlen((char*)seq));
-    update_digest_line(hash, pass, dline, crc, 1);
-    update_digest_line(hash, pass, dline_all, crc, 1);
+    // tags, which follow flags + sequence in the last column
+    rd.tags_start = b->l;
+    for (int n=TAG_BC; n < NTAGS; n++) {
+        tag = BAMit_aux_get(&aux, rec, n);
+        if (tag) kputsn((char *)tag-2, aux.len[n], b);
+    }
+    rd.tags_len = b->l - rd.tags_start;
+    rd.buf = b;
 
-    // flags + sequence + tags chksum
-    crc = 0;
-    update_crc(&crc, &flags, 1);
-    update_crc(&crc,seq,strlen((char*)seq));
-    tag = bam_aux_get(rec,"BC"); if (tag) update_crc(&crc,tag-2,aux_type2size(tag)+3);
-    tag = bam_aux_get(rec,"FI"); if (tag) update_crc(&crc,tag-2,aux_type2size(tag)+3);
-    tag = bam_aux_get(rec,"QT"); if (tag) update_crc(&crc,tag-2,aux_type2size(tag)+3);
-    tag = bam_aux_get(rec,"RT"); if (tag) update_crc(&crc,tag-2,aux_type2size(tag)+3);
-    tag = bam_aux_get(rec,"TC"); if (tag) update_crc(&crc,tag-2,aux_type2size(tag)+3);
-    update_digest_line(hash, pass, dline, crc, 3);
-    update_digest_line(hash, pass, dline_all, crc, 3);
+    hf->record(&rd, v);
+    update_digest_line(hf, pass, dline, v);
+    update_digest_line(hf, pass, &results->all, v);
 
     free(seq); free(qual);
     return 0;
@@ -293,9 +428,9 @@ int seqchksum_processRecord(bam1_t *rec, HASH_TYPE hash, chksum_results_t *resul
 
 static char *dformat(uint32_t v)
 {
-    static char buffer[64];
-    sprintf(buffer, "0x%" PRIx32 , v);
-    return buffer+2;
+    static __thread char buffer[16];
+    sprintf(buffer, "%" PRIx32 , v);
+    return buffer;
 }
 
 static void hputi(int n, hFILE *f)
@@ -340,7 +475,8 @@ void chksum_print_results(hFILE *f, chksum_results_t *results)
  */
 chksum_results_t *chksum_init_results(HASH_TYPE hash)
 {
-    chksum_results_t *results = malloc(sizeof(chksum_results_t));
+    chksum_results_t *results = calloc(1, sizeof(chksum_results_t));
+    if (!results) die("Out of memory");
     init_digest_line(hash, &(results->all));
     results->rgHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
     return results;
@@ -352,9 +488,431 @@ chksum_results_t *chksum_init_results(HASH_TYPE hash)
 void chksum_free_results(chksum_results_t *results)
 {
     HashTableDestroy(results->rgHash, 1);
+    free(results->buf.s);
     free(results);
 }
  
+/*
+ * Combine the digests in s into d
+ */
+static void merge_digest_line(HASH_TYPE hash, digest_line_t *d, digest_line_t *s)
+{
+    for (int p=0; p<2; p++) {
+        d->count[p] += s->count[p];
+        for (int c=0; c<4; c++) {
+            hash_families[hash].merge(&d->chksum[c][p], s->chksum[c][p]);
+        }
+    }
+}
+
+static void write_partial_line(hFILE *f, HASH_TYPE hash, char *type, char *key, digest_line_t *dline)
+{
+    char b[32];
+    hputs(type, f);
+    if (key) { hputc('\t', f); hputs(key, f); }
+    for (int p=0; p<2; p++) {
+        snprintf(b, sizeof(b), "\t%"PRIu32, dline->count[p]); hputs(b, f);
+    }
+    for (int c=0; c<4; c++) {
+        for (int p=0; p<2; p++) {
+            snprintf(b, sizeof(b), "\t%"PRIu32, dline->chksum[c][p]); hputs(b, f);
+        }
+    }
+    hputc('\n', f);
+}
+
+/*
+ * Write the results as a partial checksum file, to be combined by --merge
+ */
+static void write_partial(hFILE *f, HASH_TYPE hash, chksum_results_t *results, range_t *range)
+{
+    char b[80];
+    hputs(PARTIAL_MAGIC "\n", f);
+    hputs("HASH\t", f); hputs(hash_name(hash), f); hputc('\n', f);
+    snprintf(b, sizeof(b), "RANGE\t%"PRId64"\t%"PRId64"\t%"PRId64"\n", range->data_start, range->first, range->next);
+    hputs(b, f);
+    write_partial_line(f, hash, "A", NULL, &results->all);
+
+    HashIter *iter = HashTableIterCreate();
+    HashItem *hi;
+    while ( (hi = HashTableIterNext(results->rgHash, iter)) != NULL) {
+        write_partial_line(f, hash, "G", hi->key, hi->data.p);
+    }
+    HashTableIterDestroy(iter);
+}
+
+/*
+ * Parse the ten numbers at the end of a partial file line
+ */
+static int read_partial_line(HASH_TYPE hash, char *p, digest_line_t *dline)
+{
+    memset(dline, 0, sizeof(digest_line_t));
+    for (int n=0; n<10; n++) {
+        char *end;
+        if (*p++ != '\t') return -1;
+        if (n < 2) {
+            dline->count[n] = strtoul(p, &end, 10);
+        } else {
+            dline->chksum[(n-2)/2][n%2] = strtoul(p, &end, 10);
+        }
+        if (end == p) return -1;
+        p = end;
+    }
+    return *p ? -1 : 0;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    // the end of the file (-1) sorts last
+    uint64_t a1 = ((const range_t *)a)->first, b1 = ((const range_t *)b)->first;
+    uint64_t a2 = ((const range_t *)a)->next, b2 = ((const range_t *)b)->next;
+    if (a1 != b1) return a1 < b1 ? -1 : 1;
+    return a2 < b2 ? -1 : a2 > b2 ? 1 : 0;
+}
+
+/*
+ * Check that the ranges follow on from each other, from the first record to
+ * the end of the file. A range which started at the wrong place won't follow
+ * on from the one before it.
+ */
+static int check_ranges(range_t *ranges, int nranges)
+{
+    qsort(ranges, nranges, sizeof(range_t), compare_ranges);
+    int64_t expect = ranges[0].data_start;
+    for (int n = 0; n < nranges; n++) {
+        if (ranges[n].data_start != ranges[0].data_start || ranges[n].first != expect) {
+            fprintf(stderr, "The partial checksum files don't cover the file exactly: expected a range to start at %"PRId64" but found %"PRId64".\n"
+                            "Either the ranges overlap or leave gaps, or a --range couldn't tell where its first record starts:\n"
+                            "try different ranges, or checksum the whole file.\n", expect, ranges[n].first);
+            return -1;
+        }
+        expect = ranges[n].next;
+    }
+    if (expect != -1) {
+        fprintf(stderr, "The partial checksum files stop at %"PRId64", before the end of the file\n", expect);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the partial checksum files and add them up
+ */
+static chksum_results_t *merge_partials(opts_t *opts)
+{
+    chksum_results_t *results = NULL;
+    char buf[8192];
+    range_t *ranges = smalloc(opts->partials->end * sizeof(range_t));
+
+    for (int n=0; n < opts->partials->end; n++) {
+        char *fname = opts->partials->entries[n];
+        int lineno = 0;
+        bool got_range = false;
+        hFILE *f = hopen(fname, "r");
+        if (!f) {
+            fprintf(stderr, "Can't open partial checksum file %s\n", fname);
+            goto fail;
+        }
+
+        while (hgets(buf, sizeof(buf), f) > 0) {
+            digest_line_t dline;
+            lineno++;
+            if (buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1] = 0;
+
+            if (lineno == 1) {
+                if (strcmp(buf, PARTIAL_MAGIC) == 0) continue;
+                fprintf(stderr, "%s is not a partial checksum file\n", fname);
+                hclose(f); goto fail;
+            }
+
+            if (strncmp(buf, "HASH\t", 5) == 0) {
+                HASH_TYPE hash = decode_hash_name(buf+5);
+                if (!results) {
+                    opts->hash = hash;
+                    results = chksum_init_results(hash);
+                }
+                if (hash == HASH_UNKNOWN || hash != opts->hash) {
+                    fprintf(stderr, "%s: hash type %s is unknown or differs from the first partial file\n", fname, buf+5);
+                    hclose(f); goto fail;
+                }
+            } else if (strncmp(buf, "RANGE\t", 6) == 0) {
+                range_t *r = ranges + n;
+                if (sscanf(buf+6, "%"SCNd64"\t%"SCNd64"\t%"SCNd64, &r->data_start, &r->first, &r->next) != 3) goto bad_line;
+                got_range = true;
+            } else if (results && strncmp(buf, "A\t", 2) == 0) {
+                if (read_partial_line(opts->hash, buf+1, &dline)) goto bad_line;
+                merge_digest_line(opts->hash, &results->all, &dline);
+            } else if (results && strncmp(buf, "G\t", 2) == 0) {
+                char *p = strchr(buf+2, '\t');
+                if (!p || read_partial_line(opts->hash, p, &dline)) goto bad_line;
+                *p = 0;
+
+                HashData hd;
+                int newitem;
+                hd.p = NULL;
+                HashItem *hi = HashTableAdd(results->rgHash, buf+2, 0, hd, &newitem);
+                if (newitem) {
+                    hi->data.p = malloc(sizeof(digest_line_t));
+                    init_digest_line(opts->hash, hi->data.p);
+                }
+                merge_digest_line(opts->hash, hi->data.p, &dline);
+            } else {
+                goto bad_line;
+            }
+            continue;
+
+        bad_line:
+            fprintf(stderr, "%s: can't understand line %d\n", fname, lineno);
+            hclose(f); goto fail;
+        }
+
+        if (hclose(f)) die("Can't close %s", fname);
+        if (!got_range) {
+            fprintf(stderr, "%s doesn't say which records it covers\n", fname);
+            goto fail;
+        }
+    }
+
+    if (check_ranges(ranges, opts->partials->end)) goto fail;
+    free(ranges);
+    return results;
+
+ fail:
+    free(ranges);
+    if (results) chksum_free_results(results);
+    return NULL;
+}
+
+/*
+ * Is there a BGZF block header at buf?
+ */
+static bool is_bgzf_header(uint8_t *buf)
+{
+    static const uint8_t magic[] = "\37\213\10\4\0\0\0\0\0\377\6\0\102\103\2\0";
+    // ignore the mtime, xfl and os bytes
+    return memcmp(buf, magic, 4) == 0 && memcmp(buf+10, magic+10, 6) == 0;
+}
+
+/*
+ * Find the first BGZF block which starts at or after offset 'from'.
+ * Returns INT64_MAX if there isn't one.
+ *
+ * Compressed data can look like a block header, so a candidate is only
+ * accepted if its size leads to another block header, or to the end of the file.
+ */
+static int64_t find_block(hFILE *f, int64_t from)
+{
+    uint8_t buf[BGZF_MAX_BLOCK_SIZE + 18];
+
+    if (from == INT64_MAX) return from;
+    while (1) {
+        if (hseek(f, from, SEEK_SET) < 0) return INT64_MAX;
+        ssize_t len = hread(f, buf, sizeof(buf));
+        if (len < 18) return INT64_MAX;
+
+        for (ssize_t n = 0; n + 18 <= len; n++) {
+            if (!is_bgzf_header(buf+n)) continue;
+            int64_t next = from + n + le_to_u16(buf+n+16) + 1;
+            uint8_t next_hdr[18];
+            if (hseek(f, next, SEEK_SET) < 0) continue;
+            ssize_t l = hread(f, next_hdr, sizeof(next_hdr));
+            if (l == 0 || (l == 18 && is_bgzf_header(next_hdr))) return from + n;
+        }
+        from += len - 17;
+    }
+}
+
+/*
+ * Could there be a BAM record at buf? Returns the length of the record,
+ * 0 if it isn't a record, or -1 if we ran out of data before we could tell.
+ */
+static int64_t check_record(uint8_t *buf, int64_t len, int nref)
+{
+    if (len < 36) return -1;
+    int64_t block_size = le_to_u32(buf);
+    int32_t ref = le_to_i32(buf+4), pos = le_to_i32(buf+8);
+    int l_read_name = buf[12];
+    int n_cigar = le_to_u16(buf+16);
+    int64_t l_seq = le_to_i32(buf+20);
+    int32_t next_ref = le_to_i32(buf+24), next_pos = le_to_i32(buf+28);
+
+    if (ref < -1 || ref >= nref || next_ref < -1 || next_ref >= nref) return 0;
+    if (pos < -1 || next_pos < -1 || l_read_name < 1 || l_seq < 0) return 0;
+    if (32 + l_read_name + 4*n_cigar + (l_seq+1)/2 + l_seq > block_size) return 0;
+
+    if (len < 36 + l_read_name) return -1;
+    uint8_t *name = buf + 36;
+    if (name[l_read_name-1]) return 0;
+    for (int n = 0; n < l_read_name-1; n++) {
+        if (name[n] < '!' || name[n] > '~' || name[n] == '@') return 0;
+    }
+    return block_size + 4;
+}
+
+/*
+ * Size of an aux value of the given type, or 0 if it isn't a fixed size type
+ */
+static int aux_size(uint8_t type)
+{
+    switch (type) {
+        case 'A': case 'c': case 'C': return 1;
+        case 's': case 'S':           return 2;
+        case 'i': case 'I': case 'f': return 4;
+        case 'd':                     return 8;
+    }
+    return 0;
+}
+
+/*
+ * Check the whole of a record which check_record() has accepted, all 'len'
+ * bytes of which are at buf: the CIGAR operations, and that the aux fields
+ * are well formed and finish exactly at the end of the record.
+ */
+static bool valid_record(uint8_t *buf, int64_t len)
+{
+    int l_read_name = buf[12];
+    int n_cigar = le_to_u16(buf+16);
+    int64_t l_seq = le_to_i32(buf+20);
+    uint8_t *p = buf + 36 + l_read_name, *end = buf + len;
+
+    for (int n = 0; n < n_cigar; n++, p += 4) {
+        if ((le_to_u32(p) & BAM_CIGAR_MASK) > BAM_CBACK) return false;
+    }
+    p += (l_seq+1)/2 + l_seq;
+
+    while (p < end) {
+        if (end - p < 4 || !isalpha(p[0]) || !isalnum(p[1])) return false;
+        uint8_t type = p[2];
+        p += 3;
+        if (type == 'Z' || type == 'H') {
+            uint8_t *z = memchr(p, 0, end - p);
+            if (!z) return false;
+            p = z + 1;
+        } else if (type == 'B') {
+            if (end - p < 5) return false;
+            int size = aux_size(p[0]);
+            int64_t count = le_to_u32(p+1);
+            if (!size || size == 8 || p[0] == 'A') return false;
+            if (count * size > end - p - 5) return false;
+            p += 5 + count * size;
+        } else {
+            int size = aux_size(type);
+            if (!size || size > end - p) return false;
+            p += size;
+        }
+    }
+    return p == end;
+}
+
+/*
+ * Find the first BAM record which starts in the BGZF block at 'block'.
+ * Returns its virtual offset, or -1 if no record starts in the block.
+ *
+ * A start is accepted if every record chained from it is well formed, as far
+ * as we have read. That can still be fooled by data inside a record which
+ * looks like whole records, so --merge checks that the ranges join up.
+ */
+static int64_t find_record(BGZF *fp, int64_t block, int nref)
+{
+    uint8_t *buf = smalloc(SYNC_BUFFER);
+    int64_t voffset = -1;
+
+    if (bgzf_seek(fp, block << 16, SEEK_SET) < 0) die("Can't seek to block %"PRId64, block);
+    ssize_t len = bgzf_read(fp, buf, 1);
+    int block_length = fp->block_length;
+    if (len == 1) len += bgzf_read(fp, buf+1, SYNC_BUFFER-1);
+    bool eof = len < SYNC_BUFFER;
+
+    for (int u = 0; u < block_length && voffset < 0; u++) {
+        int64_t p = u, l = 0;
+        while (p < len) {
+            l = check_record(buf+p, len-p, nref);
+            if (l <= 0 || p + l > len || !valid_record(buf+p, l)) break;
+            p += l;
+        }
+        // the chain must reach the end of the file, or run out of buffer
+        if (p == len || (!eof && (l < 0 || (l > 0 && p + l > len)))) voffset = (block << 16) | u;
+    }
+
+    free(buf);
+    return voffset;
+}
+
+/*
+ * checksum the records which start in the BGZF blocks in the range
+ *
+ * 'range' is set to where the records start: the first record after the
+ * header, the first record in the range, and the first record after the
+ * range (-1 for the end of the file).
+ */
+static int seqchksum_range(opts_t *opts, chksum_results_t *results, range_t *range)
+{
+    int retcode = 0;
+    samFile *in = hts_open(opts->input_name, "r");
+    if (!in) die("Can't open %s", opts->input_name);
+    if (hts_get_format(in)->format != bam) {
+        fprintf(stderr, "--range can only be used with BAM files\n");
+        hts_close(in);
+        return 1;
+    }
+    sam_hdr_t *hdr = sam_hdr_read(in);
+    if (!hdr) die("Can't read header from %s", opts->input_name);
+    BGZF *fp = in->fp.bgzf;
+
+    hFILE *raw = hopen(opts->input_name, "r");
+    if (!raw) die("Can't open %s", opts->input_name);
+    int64_t start = opts->range_start ? find_block(raw, opts->range_start) : 0;
+    int64_t end = find_block(raw, opts->range_end);
+
+    // the first record may be in the range, if the header isn't all before it
+    int64_t voffset = bgzf_peek(fp) >= 0 ? bgzf_tell(fp) : -1;
+    range->data_start = voffset;
+    if (voffset >= 0 && (voffset >> 16) < start) {
+        // look on past the end of the range, so we know where the next range should start
+        voffset = -1;
+        for (int64_t block = start; block != INT64_MAX && voffset < 0; block = find_block(raw, block+1)) {
+            voffset = find_record(fp, block, sam_hdr_nref(hdr));
+        }
+    }
+    hclose(raw);
+
+    range->first = range->next = voffset;
+    if (voffset >= 0 && (voffset >> 16) < end) {
+        bam1_t *rec = bam_init1();
+        if (bgzf_seek(fp, voffset, SEEK_SET) < 0) die("Can't seek in %s", opts->input_name);
+        range->next = -1;
+        while (bgzf_peek(fp) >= 0) {
+            if ((bgzf_tell(fp) >> 16) >= end) { range->next = bgzf_tell(fp); break; }
+            int r = bam_read1(fp, rec);
+            if (r < 0) {
+                if (r < -1) { fprintf(stderr, "Can't read record from %s\n", opts->input_name); retcode = 1; }
+                break;
+            }
+            // ignore secondary and supplementary records
+            if (!(rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) {
+                if (seqchksum_processRecord(rec, opts->hash, results)) { retcode = 1; break; }
+            }
+        }
+        bam_destroy1(rec);
+    }
+
+    sam_hdr_destroy(hdr);
+    hts_close(in);
+    return retcode;
+}
+
+/*
+ * Write the results to the output file, or stdout
+ */
+static void write_results(opts_t *opts, chksum_results_t *results, range_t *range)
+{
+    hFILE *f = opts->output_name ? hopen(opts->output_name,"w") : hdopen(fileno(stdout),"w");
+    if (!f) die("Can't open %s", opts->output_name ? opts->output_name : "stdout");
+    if (opts->range) write_partial(f, opts->hash, results, range);
+    else             chksum_print_results(f, results);
+    if (hclose(f)) die("Can't close %s", opts->output_name ? opts->output_name : "stdout");
+}
+
 /*
  * Main code
  */
@@ -363,28 +921,36 @@ static int seqchksum(opts_t* opts)
     int retcode = 0;
     BAMit_t *bam_in = NULL;
     bam1_t *rec = NULL;
+    chksum_results_t *results = NULL;
+    range_t range = { -1, -1, -1 };
 
-    /*
-     * Open input BAM file
-     */
-    bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, NULL);
-    if (!bam_in) return 1;
+    if (opts->merge) {
+        results = merge_partials(opts);
+        if (!results) return 1;
+    } else if (opts->range) {
+        results = chksum_init_results(opts->hash);
+        retcode = seqchksum_range(opts, results, &range);
+    } else {
+        /*
+         * Open input BAM file
+         */
+        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, NULL,
+                            SAM_QNAME | SAM_FLAG | SAM_SEQ | SAM_QUAL | SAM_AUX);
+        if (!bam_in) return 1;
 
-    // Initialise results structure
-    chksum_results_t *results = chksum_init_results(opts->hash);
+        // Initialise results structure
+        results = chksum_init_results(opts->hash);
 
-    // Read and process each record in the input BAM
-    while ( (rec = BAMit_next(bam_in)) ) {
-        // ignore secondary and supplementary records
-        if (!(rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) {
-            if (seqchksum_processRecord(rec, opts->hash, results)) { retcode = 1; break; }
+        // Read and process each record in the input BAM
+        while ( (rec = BAMit_next(bam_in)) ) {
+            // ignore secondary and supplementary records
+            if (!(rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) {
+                if (seqchksum_processRecord(rec, opts->hash, results)) { retcode = 1; break; }
+            }
         }
     }
 
-    hFILE *f = hdopen(fileno(stdout),"w");
-    if (!f) die("Can't open stdout");
-    chksum_print_results(f, results);
-    if (hclose(f)) die("Can't close stdout");
+    if (retcode == 0) write_results(opts, results, &range);
 
     // tidy up after us
     BAMit_free(bam_in);
@@ -393,6 +959,59 @@ static int seqchksum(opts_t* opts)
     return retcode;
 }
 
+/*
+ * Checksums as part of 'bambi qc'
+ */
+typedef struct {
+    opts_t *opts;
+    chksum_results_t *results;
+} qc_state_t;
+
+static void *qc_seqchksum_init(int argc, char **argv)
+{
+    opts_t *opts = parse_args(argc, argv);
+    if (!opts) return NULL;
+    if (opts->merge || opts->range) {
+        fprintf(stderr, "--merge and --range can't be used with qc\n");
+        free_opts(opts);
+        return NULL;
+    }
+
+    qc_state_t *st = calloc(1, sizeof(qc_state_t));
+    if (!st) die("Out of memory");
+    st->opts = opts;
+    st->results = chksum_init_results(opts->hash);
+    return st;
+}
+
+static int qc_seqchksum_records(void *state, qc_batch_t *batch)
+{
+    qc_state_t *st = (qc_state_t *)state;
+
+    for (int n=0; n < batch->nrecs; n++) {
+        bam1_t *rec = batch->recs[n].rec;
+        // ignore secondary and supplementary records
+        if (rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
+        if (seqchksum_processRecord(rec, st->opts->hash, st->results)) return -1;
+    }
+    return 0;
+}
+
+static int qc_seqchksum_finish(void *state)
+{
+    qc_state_t *st = (qc_state_t *)state;
+    write_results(st->opts, st->results, NULL);
+    chksum_free_results(st->results);
+    free_opts(st->opts);
+    free(st);
+    return 0;
+}
+
+const qc_analyser_t qc_seqchksum = {
+    "seqchksum", 0,
+    qc_seqchksum_init, qc_seqchksum_records, qc_seqchksum_finish
+};
+
 /*
  * called from bambi to perform index decoding
  *
@@ -405,6 +1024,8 @@ int main_seqchksum(int argc, char *argv[])
     int ret = 1;
 
     opts_t* opts = parse_args(argc, argv);
+
+    batch_args_parsed();
     if (opts) {
         ret = seqchksum(opts);
     }
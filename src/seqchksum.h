@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "hash_table.h"
 #include "htslib/hfile.h"
+#include "htslib/kstring.h"
 
 typedef enum {
     HASH_UNKNOWN,
@@ -43,6 +44,7 @@ typedef struct {
 typedef struct {
     digest_line_t all;
     HashTable *rgHash;
+    kstring_t buf;          // one record's data, see seqchksum_processRecord()
 } chksum_results_t;
 
 /*
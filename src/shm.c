@@ -0,0 +1,386 @@
+/*  shm.c -- shared memory ring buffer transport between bambi processes
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <htslib/hfile.h>
+
+#include "bambi.h"
+#include "stage.h"
+#include "shm.h"
+
+/*
+ * The hFILE backend interface lives in htslib's hfile_internal.h, which
+ * is not installed, but it is the stable interface used by htslib's own
+ * plugins (libcurl, S3, GCS), so we declare the parts we need here.
+ */
+struct hFILE_backend {
+    ssize_t (*read)(hFILE *fp, void *buffer, size_t nbytes);
+    ssize_t (*write)(hFILE *fp, const void *buffer, size_t nbytes);
+    off_t (*seek)(hFILE *fp, off_t offset, int whence);
+    int (*flush)(hFILE *fp);
+    int (*close)(hFILE *fp);
+};
+
+struct hFILE_scheme_handler {
+    hFILE *(*open)(const char *filename, const char *mode);
+    int (*isremote)(const char *filename);
+    const char *provider;
+    int priority;
+    hFILE *(*vopen)(const char *filename, const char *mode, va_list args);
+};
+
+hFILE *hfile_init(size_t struct_size, const char *mode, size_t capacity);
+void hfile_destroy(hFILE *fp);
+void hfile_add_scheme_handler(const char *scheme, const struct hFILE_scheme_handler *handler);
+
+#define SHM_MAGIC 0x494d4253        // "SBMI"
+#define SHM_VERSION 1
+#define SHM_MIN_SIZE 4096
+#define SHM_HFILE_BUFSIZE (256*1024)
+#define SHM_SPINS 1000              // busy waits before we start sleeping
+#define SHM_MAX_SLEEP 1000000       // longest sleep, in nanoseconds
+#define SHM_CACHELINE 64
+
+/*
+ * The ring header, at the start of the shared memory object.
+ * head and tail count every byte ever written and read, so the ring is
+ * empty when they are equal and full when they differ by the size.
+ * Only the writer updates head and only the reader updates tail, so no
+ * locks are needed; they are on separate cache lines so that the two
+ * processes don't fight over them.
+ */
+typedef struct {
+    uint32_t magic;             // set last by the writer, once the ring is ready
+    uint32_t version;
+    uint64_t size;              // bytes of data in the ring
+    pid_t writer_pid;
+    pid_t reader_pid;
+    uint32_t reader_attached;
+    uint32_t writer_closed;
+    uint32_t reader_closed;
+    uint64_t head __attribute__((aligned(SHM_CACHELINE)));
+    uint64_t tail __attribute__((aligned(SHM_CACHELINE)));
+} shm_ring_t;
+
+#define SHM_HEADER_SIZE ((sizeof(shm_ring_t) + SHM_CACHELINE - 1) & ~(size_t)(SHM_CACHELINE - 1))
+
+typedef struct {
+    hFILE base;
+    shm_ring_t *ring;
+    char *data;
+    size_t map_size;
+    bool writer;
+} hFILE_shm;
+
+/*
+ * Is the process still running?
+ */
+static bool alive(pid_t pid)
+{
+    return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Wait a little before looking at the ring again.
+ * Spin for a while, as the other end is usually close behind, then sleep
+ * for longer each time so that an idle process doesn't burn a CPU.
+ * Returns false if the process at the other end has gone away.
+ */
+static bool backoff(int *n, pid_t peer)
+{
+    if (*n < SHM_SPINS) {
+        (*n)++;
+        return true;
+    }
+    long ns = 1000L << (*n - SHM_SPINS < 10 ? *n - SHM_SPINS : 10);
+    struct timespec ts = { 0, ns < SHM_MAX_SLEEP ? ns : SHM_MAX_SLEEP };
+    nanosleep(&ts, NULL);
+    (*n)++;
+    return alive(peer);
+}
+
+static ssize_t shm_read(hFILE *fpv, void *buffer, size_t nbytes)
+{
+    hFILE_shm *fp = (hFILE_shm *)fpv;
+    shm_ring_t *r = fp->ring;
+    uint64_t tail = r->tail;
+    uint64_t head;
+    int n = 0;
+
+    while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail) {
+        if (__atomic_load_n(&r->writer_closed, __ATOMIC_ACQUIRE)) {
+            // the writer may have written more just before closing
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) return 0;
+            continue;
+        }
+        if (!backoff(&n, r->writer_pid)) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+
+    size_t len = head - tail;
+    if (len > nbytes) len = nbytes;
+    size_t pos = tail % r->size;
+    size_t first = r->size - pos;
+    if (first > len) first = len;
+    memcpy(buffer, fp->data + pos, first);
+    memcpy((char *)buffer + first, fp->data, len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+static ssize_t shm_write(hFILE *fpv, const void *buffer, size_t nbytes)
+{
+    hFILE_shm *fp = (hFILE_shm *)fpv;
+    shm_ring_t *r = fp->ring;
+    uint64_t head = r->head;
+    uint64_t tail;
+    int n = 0;
+
+    for (;;) {
+        if (__atomic_load_n(&r->reader_closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - tail < r->size) break;
+        if (!backoff(&n, __atomic_load_n(&r->reader_pid, __ATOMIC_ACQUIRE))) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+
+    size_t len = r->size - (head - tail);
+    if (len > nbytes) len = nbytes;
+    size_t pos = head % r->size;
+    size_t first = r->size - pos;
+    if (first > len) first = len;
+    memcpy(fp->data + pos, buffer, first);
+    memcpy(fp->data, (const char *)buffer + first, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+static off_t shm_seek(hFILE *fpv, off_t offset, int whence)
+{
+    errno = ESPIPE;
+    return -1;
+}
+
+static int shm_flush(hFILE *fpv)
+{
+    // every write is visible to the reader as soon as it is made
+    return 0;
+}
+
+static int shm_close(hFILE *fpv)
+{
+    hFILE_shm *fp = (hFILE_shm *)fpv;
+    if (fp->writer) __atomic_store_n(&fp->ring->writer_closed, 1, __ATOMIC_RELEASE);
+    else            __atomic_store_n(&fp->ring->reader_closed, 1, __ATOMIC_RELEASE);
+    return munmap(fp->ring, fp->map_size);
+}
+
+static const struct hFILE_backend shm_backend = {
+    shm_read, shm_write, shm_seek, shm_flush, shm_close
+};
+
+/*
+ * Map a shared memory object, returning NULL if it isn't ready yet
+ */
+static shm_ring_t *map_ring(int fd, size_t *map_size)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SHM_HEADER_SIZE) return NULL;
+    shm_ring_t *r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r == MAP_FAILED) return NULL;
+    if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+        || r->version != SHM_VERSION
+        || r->size + SHM_HEADER_SIZE != st.st_size) {
+        munmap(r, st.st_size);
+        return NULL;
+    }
+    *map_size = st.st_size;
+    return r;
+}
+
+/*
+ * A ring left behind by a writer which has finished or died
+ */
+static bool is_stale(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return errno == ENOENT;
+    size_t map_size;
+    shm_ring_t *r = map_ring(fd, &map_size);
+    close(fd);
+    if (!r) return true;
+    bool stale = __atomic_load_n(&r->writer_closed, __ATOMIC_ACQUIRE) || !alive(r->writer_pid);
+    munmap(r, map_size);
+    return stale;
+}
+
+/*
+ * Create the ring for writing
+ */
+static shm_ring_t *create_ring(const char *name, size_t *map_size)
+{
+    const char *env = getenv("BAMBI_SHM_SIZE");
+    size_t size = stage_parse_size(env ? env : SHM_DEFAULT_SIZE);
+    if (size < SHM_MIN_SIZE) {
+        fprintf(stderr, "Invalid shared memory ring size: %s\n", env);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd;
+    while ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        if (errno != EEXIST) return NULL;
+        if (!is_stale(name)) {
+            fprintf(stderr, "Shared memory ring %s is already in use\n", name);
+            errno = EBUSY;
+            return NULL;
+        }
+        shm_unlink(name);
+    }
+
+    *map_size = SHM_HEADER_SIZE + size;
+    shm_ring_t *r = MAP_FAILED;
+    if (ftruncate(fd, *map_size) == 0) {
+        r = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int save_errno = errno;
+    close(fd);
+    if (r == MAP_FAILED) {
+        shm_unlink(name);
+        errno = save_errno;
+        return NULL;
+    }
+
+    r->version = SHM_VERSION;
+    r->size = size;
+    r->writer_pid = getpid();
+    __atomic_store_n(&r->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return r;
+}
+
+/*
+ * Wait for the writer to create the ring, then attach to it for reading.
+ * Once attached, the name is removed so that it can be used again.
+ */
+static shm_ring_t *attach_ring(const char *name, size_t *map_size)
+{
+    int n = 0;
+    for (;;) {
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0 && errno != ENOENT) return NULL;
+        if (fd >= 0) {
+            shm_ring_t *r = map_ring(fd, map_size);
+            close(fd);
+            if (r) {
+                uint32_t expected = 0;
+                if (!__atomic_compare_exchange_n(&r->reader_attached, &expected, 1, false,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    munmap(r, *map_size);
+                    fprintf(stderr, "Shared memory ring %s already has a reader\n", name);
+                    errno = EBUSY;
+                    return NULL;
+                }
+                __atomic_store_n(&r->reader_pid, getpid(), __ATOMIC_RELEASE);
+                shm_unlink(name);
+                return r;
+            }
+        }
+        backoff(&n, 0);
+    }
+}
+
+static hFILE *shm_hopen(const char *filename, const char *mode)
+{
+    bool writer;
+    if (strchr(mode, 'r'))      writer = false;
+    else if (strchr(mode, 'w')) writer = true;
+    else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const char *p = filename + strlen(SHM_PREFIX);
+    if (*p == '\0' || strchr(p, '/')) {
+        errno = EINVAL;
+        return NULL;
+    }
+    char *name = smalloc(strlen(p) + 8);
+    sprintf(name, "/bambi.%s", p);
+
+    hFILE_shm *fp = (hFILE_shm *)hfile_init(sizeof(hFILE_shm), mode, SHM_HFILE_BUFSIZE);
+    if (!fp) {
+        free(name);
+        return NULL;
+    }
+
+    fp->writer = writer;
+    fp->ring = writer ? create_ring(name, &fp->map_size) : attach_ring(name, &fp->map_size);
+    free(name);
+    if (!fp->ring) {
+        hfile_destroy((hFILE *)fp);
+        return NULL;
+    }
+    fp->data = (char *)fp->ring + SHM_HEADER_SIZE;
+    fp->base.backend = &shm_backend;
+    return &fp->base;
+}
+
+static int shm_isremote(const char *filename)
+{
+    return 0;
+}
+
+static const struct hFILE_scheme_handler shm_handler = {
+    shm_hopen, shm_isremote, "bambi", 50, NULL
+};
+
+static void shm_register_once(void)
+{
+    hfile_add_scheme_handler("shm", &shm_handler);
+}
+
+void shm_register(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, shm_register_once);
+}
+
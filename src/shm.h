@@ -0,0 +1,59 @@
+/*  shm.h -- shared memory ring buffer transport between bambi processes
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Files named "shm:<name>" are a ring buffer in POSIX shared memory, with
+ * one process writing and another reading, like a named pipe but without
+ * the system calls and small pipe buffer.
+ *
+ * The writer creates the ring, and the reader waits for it to appear, so
+ * they can be started in either order. The writer waits when the ring is
+ * full, and the reader when it is empty. Either side gives up if the other
+ * goes away.
+ *
+ * The ring is SHM_DEFAULT_SIZE bytes, or the size given by the environment
+ * variable BAMBI_SHM_SIZE (K, M or G suffix allowed).
+ */
+
+#define SHM_PREFIX "shm:"
+#define SHM_DEFAULT_SIZE "64M"
+
+/*
+ * Register the shm: scheme with htslib, so that hopen() and hts_open()
+ * understand it. It is safe to call this more than once.
+ */
+void shm_register(void);
+
+/*
+ * true if fname is a shared memory ring
+ */
+static inline bool shm_is_shm(const char *fname)
+{
+    return fname && strncmp(fname, SHM_PREFIX, strlen(SHM_PREFIX)) == 0;
+}
+
+#endif
+
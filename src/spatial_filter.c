@@ -47,6 +47,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "parse_bam.h"
 #include "array.h"
 #include "parse.h"
+#include "batch_shared.h"
+#include "qc.h"
+#include "spatial_filter.h"
 
 #define SF_MAX_LANES 17
 
@@ -56,6 +59,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define COORD_FACTOR  10
 
 #define REGION_MAGIC                "RGF3"
+#define REGION_PARTIAL_MAGIC        "RGP1"
 #define REGION_MAGIC_LEN            5
 #define SF_CMDLINE_LEN              1024
 
@@ -127,9 +131,6 @@ typedef struct {
     RegionTable_t rts;
 } Header;
 
-static Header *LaneArray[SF_MAX_LANES];
-static filter_header_t Fheader;
-
 enum images { IMAGE_COVERAGE,
               IMAGE_DELETION,
               IMAGE_INSERTION,
@@ -168,7 +169,7 @@ enum colours { COLOUR_LEVEL_0,
                N_COLOURS };
 
 #ifdef HAVE_LIBGD
-static int *colour_table = NULL;
+static int colour_table[N_COLOURS];     // the same for every image
 #endif
 
 typedef struct {
@@ -180,6 +181,9 @@ typedef struct {
 	char *output;
 	char *apply_stats_out;
 	int calculate;
+    bool partial;
+    bool merge;
+    va_t *partials;
     bool dumpFilter;
 	char *tileviz;
 	int apply;
@@ -194,6 +198,8 @@ typedef struct {
     char *argv_list;
     char *input_fmt;
     char *output_fmt;
+    Header *lane_array[SF_MAX_LANES];   // filter header for each lane
+    filter_header_t fheader;            // filter file header
 } opts_t;
 
 #define min(a, b) ( (a<=b) ? a : b )
@@ -283,16 +289,16 @@ static char *getFilterData(Header *hdr, int itile, int read, int cycle, int regi
 /*
  * Read the filter header from a filter file
  */
-static void readFheader(hFILE *fp)
+static void readFheader(hFILE *fp, filter_header_t *fheader)
 {
-    if (hread(fp, &Fheader, sizeof(Fheader)) < 0) die("readFheader() failed\n");
-    if (strncmp(Fheader.region_magic,REGION_MAGIC, strlen(REGION_MAGIC)-1)) die("Not a valid filter file\n");
+    if (hread(fp, fheader, sizeof(*fheader)) < 0) die("readFheader() failed\n");
+    if (strncmp(fheader->region_magic,REGION_MAGIC, strlen(REGION_MAGIC)-1)) die("Not a valid filter file\n");
 }
 
 /*
  * Read a Lane header from a filter file
  */
-static Header *readHeader(hFILE *fp)
+static Header *readHeader(hFILE *fp, filter_header_t *fheader)
 {
     Header *hdr = sf_initHdr();
     hdr->ngood_tiles = 0;
@@ -323,7 +329,7 @@ static Header *readHeader(hFILE *fp)
     if (hread(fp, &hdr->region_size, sizeof(hdr->region_size)) < 0) goto fail;
     if (hread(fp, &hdr->nregions_x, sizeof(hdr->nregions_x)) < 0) goto fail;
     if (hread(fp, &hdr->nregions_y, sizeof(hdr->nregions_y)) < 0) goto fail;
-    if (Fheader.region_magic[3] == '2') {
+    if (fheader->region_magic[3] == '2') {
         // old filter file
         int n=0;
         if (hread(fp, &n, sizeof(int)) < 0) goto fail;
@@ -373,17 +379,17 @@ fail:
 /*
  * Open and load a list of filter files
  */
-static void openFilters(va_t *fnames)
+static void openFilters(opts_t *opts, va_t *fnames)
 {
     for (int n = 0; n < fnames->end; n++) {
         char *fname = fnames->entries[n];
         hFILE *fp = hopen(fname, "r");
         if (!fp) die("Can't open file %s\n", fname);
-        readFheader(fp);
+        readFheader(fp, &opts->fheader);
         while (1) {
-            Header *hdr = readHeader(fp);
+            Header *hdr = readHeader(fp, &opts->fheader);
             if (!hdr) break;
-            LaneArray[hdr->lane] = hdr;
+            opts->lane_array[hdr->lane] = hdr;
             hdr->stats_nreads = 0;
             hdr->stats_nfiltered = 0;
         }
@@ -482,6 +488,7 @@ static void free_opts(opts_t *opts)
 {
     if (!opts) return;
     va_free(opts->filters);
+    va_free(opts->partials);
     free(opts->snp_file);
     free(opts->in_bam_file);
     free(opts->working_dir);
@@ -502,10 +509,6 @@ static gdImagePtr initImage(int width, int height, char *base, int type, int rea
 {
     gdImagePtr im = gdImageCreate(width, height);
 
-    if( NULL == colour_table ){
-        colour_table = smalloc(N_COLOURS * sizeof(int));
-    }
-
     gdImageColorAllocate(im, 0, 0, 0); // black - the background colour
 
     // white + graduated shades of blue from light to dark
@@ -1143,6 +1146,38 @@ static void removeBadTiles(Header *hdr)
     hdr->ngood_tiles = ngood_tiles;
 }
 
+/*
+ * RGF and a version number (not the RGFL of a filter dumped as text)
+ */
+bool sf_isFilterFile(hFILE *fp)
+{
+    char magic[REGION_MAGIC_LEN-1];
+    return hpeek(fp, magic, sizeof(magic)) == sizeof(magic)
+        && memcmp(magic, REGION_MAGIC, sizeof(magic)-1) == 0
+        && isdigit(magic[sizeof(magic)-1]);
+}
+
+void sf_badTiles(hFILE *fp, ia_t *lanes, ia_t *tiles)
+{
+    filter_header_t fheader;
+    Header *hdr;
+
+    readFheader(fp, &fheader);
+    while ((hdr = readHeader(fp, &fheader)) != NULL) {
+        // removeBadTiles() sets the tile number of a bad tile to -1
+        int *tile = smalloc((hdr->ntiles ? hdr->ntiles : 1) * sizeof(int));
+        memcpy(tile, hdr->tileArray, hdr->ntiles * sizeof(int));
+        removeBadTiles(hdr);
+        for (int itile=0; itile < hdr->ntiles; itile++) {
+            if (hdr->tileArray[itile] >= 0) continue;
+            ia_push(lanes, hdr->lane);
+            ia_push(tiles, tile[itile]);
+        }
+        free(tile);
+        sf_freeHdr(hdr);
+    }
+}
+
 /*
  * Write the filter file to disk
  */
@@ -1156,12 +1191,12 @@ static void writeFilter(opts_t *s, RegionTable_t *rtsArray)
     fp = hopen(s->filters->entries[0], "w");
 	if (!fp) die("Can't open filter file %s: %s\n", s->filters->entries[0], strerror(errno));
 
-	strncpy(Fheader.region_magic, REGION_MAGIC, sizeof(Fheader.region_magic));
-	strncpy(Fheader.cmdLine, s->argv_list, sizeof(Fheader.cmdLine)-1);
-    if (hwrite(fp, &Fheader, sizeof(Fheader)) < 0) die("writeFheader() failed\n");;
+	strncpy(s->fheader.region_magic, REGION_MAGIC, sizeof(s->fheader.region_magic));
+	strncpy(s->fheader.cmdLine, s->argv_list, sizeof(s->fheader.cmdLine)-1);
+    if (hwrite(fp, &s->fheader, sizeof(s->fheader)) < 0) die("writeFheader() failed\n");;
 
     for (int lane=1; lane < SF_MAX_LANES; lane++) {
-        hdr = LaneArray[lane];
+        hdr = s->lane_array[lane];
         if (!hdr) continue;
         rts = rtsArray[lane];
         writeHeader(fp,hdr);
@@ -1191,11 +1226,12 @@ static void writeFilter(opts_t *s, RegionTable_t *rtsArray)
 	if (hclose(fp)) die("Failed to close \n", s->filters->entries[0]);
 }
 
-static int findRegion(opts_t *opts, RegionTable_t rts, Header *hdr, int x, int y)
+/*
+ * Find the index of region (ix,iy) in the region table, adding it if it's new
+ */
+static int findRegionKey(RegionTable_t rts, Header *hdr, uint32_t ix, uint32_t iy)
 {
     int iregion = -1;
-    uint32_t ix = x2region(hdr, x);
-    uint32_t iy = x2region(hdr, y);
     region_key_t key;
     HashItem *hi;
 
@@ -1238,6 +1274,48 @@ static int findRegion(opts_t *opts, RegionTable_t rts, Header *hdr, int x, int y
      return iregion;
 }
 
+static int findRegion(opts_t *opts, RegionTable_t rts, Header *hdr, int x, int y)
+{
+    return findRegionKey(rts, hdr, x2region(hdr, x), x2region(hdr, y));
+}
+
+/*
+ * Find a tile in the lane header, adding it (and space for it in the region table) if it's new
+ */
+static int findTile(opts_t *opts, Header *hdr, RegionTable_t *prts, int tile)
+{
+    int itile = tile2index(hdr,tile);
+    if (itile < 0) {
+        itile = hdr->ntiles;
+        hdr->ntiles++;
+        hdr->tileArray = srealloc(hdr->tileArray, hdr->ntiles * sizeof(int));
+        hdr->tileReadCountArray = srealloc(hdr->tileReadCountArray, hdr->ntiles * sizeof(size_t));
+        hdr->tileArray[itile] = tile;
+        hdr->tileReadCountArray[itile] = 0;
+        *prts = srealloc(*prts, hdr->ntiles * N_READS * sizeof(RegionTableEntry_t **));
+        for (int read=0;read<N_READS;read++)
+            (*prts)[itile*N_READS+read] = NULL;
+        if (opts->verbose) fprintf(stderr, "Processing lane %d tile %i (%" PRIu64 ")\n", hdr->lane, tile, hdr->nreads);
+    }
+    return itile;
+}
+
+/*
+ * Allocate the region table for one read of one tile
+ */
+static void initReadTable(Header *hdr, RegionTable_t rts, int itile, int read, int read_length)
+{
+    int cycle, iregion;
+    rts[itile*N_READS+read] = smalloc(read_length * sizeof(RegionTableEntry_t *));
+    for(cycle=0;cycle<read_length;cycle++) {
+        rts[itile*N_READS+read][cycle] = smalloc(hdr->nregions * sizeof(RegionTableEntry_t));
+        for(iregion=0;iregion<hdr->nregions;iregion++) {
+            RegionTableEntry_t *rt = rts[itile*N_READS+read][cycle] + iregion;
+            initialiseRegionTableEntry(rt);
+        }
+    }
+}
+
 static void updateRegionTable(Header *hdr, RegionTable_t rts, int read, int iregion, int *read_qual, int *read_mismatch)
 {
     /* update region table */
@@ -1294,6 +1372,102 @@ static RegionTable_t orderRegionTableByTile(opts_t *s, Header *hdr, RegionTable_
     return new_rts;
 }
 
+/*
+ * Sort the region table by tile and map the observed regions
+ */
+static void finishRegionTable(opts_t *opts, RegionTable_t *rtsArray)
+{
+    /* re-order the RegionTable by tile */
+    for (int lane=1; lane < SF_MAX_LANES; lane++) {
+        Header *hdr = opts->lane_array[lane];
+        if (!hdr) continue;
+	    rtsArray[lane] = orderRegionTableByTile(opts, hdr, rtsArray[lane]);
+    }
+
+    /* setup a mapping between each potential region and the observed regions */
+    for (int lane=1; lane < SF_MAX_LANES; lane++) {
+        if (opts->lane_array[lane]) regionMapping(opts->lane_array[lane]);
+    }
+}
+
+/*
+ * Find the filter header for a lane, creating it if need be
+ */
+static Header *laneHeader(opts_t *opts, int lane)
+{
+    if (lane > SF_MAX_LANES) die("Lane %d found: max should be %d", lane, SF_MAX_LANES);
+
+    Header *hdr = opts->lane_array[lane];
+    if (!hdr) {
+        hdr = sf_initHdr();
+        hdr->region_size = opts->region_size;
+        hdr->lane = lane;
+        opts->lane_array[lane] = hdr;
+    }
+    return hdr;
+}
+
+/*
+ * Should this record be added to the region table?
+ */
+static bool useRecord(bam1_t *bam)
+{
+	if (BAM_FUNMAP & bam->core.flag) return false;
+	if (BAM_FQCFAIL & bam->core.flag) return false;
+	if (BAM_FSECONDARY & bam->core.flag) return false;
+	if (BAM_FSUPPLEMENTARY & bam->core.flag) return false;
+	if (BAM_FPAIRED & bam->core.flag) {
+		if (0 == (BAM_FPROPER_PAIR & bam->core.flag)) return false;
+	}
+    return true;
+}
+
+/*
+ * Check the read length is the same as for previous reads
+ */
+static void checkReadLength(Header *hdr, int bam_read, int read_length)
+{
+    if (0 == hdr->readLength[bam_read]) {
+        hdr->readLength[bam_read] = read_length;
+    }
+
+    if (hdr->readLength[bam_read] != read_length) {
+        fprintf(stderr,
+                "Error: inconsistent read lengths "
+                "within bam file for read %d.\n"
+                "have length %ld, previously it was %d.\n",
+                bam_read, (long) read_length, hdr->readLength[bam_read]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Add a record, with the arrays from parse_bam_alignments(), to the region table
+ */
+static void addRecord(opts_t *opts, RegionTable_t *rtsArray, Header *hdr,
+                      int bam_lane, int bam_tile, int bam_x, int bam_y, int bam_read, int read_length,
+                      int *read_qual, int *read_mismatch)
+{
+    // lookup tile in tile array
+    int itile = findTile(opts, hdr, &rtsArray[bam_lane], bam_tile);
+    RegionTable_t rts = rtsArray[bam_lane];
+    hdr->tileReadCountArray[itile]++;
+
+    if (NULL == rts[itile*N_READS+bam_read]) initReadTable(hdr, rts, itile, bam_read, read_length);
+
+    int iregion = findRegion(opts, rts, hdr, bam_x, bam_y);
+    updateRegionTable(hdr, &rts[itile*N_READS], bam_read, iregion, read_qual, read_mismatch);
+
+    hdr->nreads++;
+}
+
+static RegionTable_t *newRegionTableArray(void)
+{
+    RegionTable_t *rtsArray = smalloc(SF_MAX_LANES * sizeof(RegionTable_t));
+    for (int lane=0; lane < SF_MAX_LANES; lane++) rtsArray[lane] = NULL;
+    return rtsArray;
+}
+
 /*
  * Takes the bam file as input and updates the region table
  *
@@ -1305,8 +1479,7 @@ static RegionTable_t orderRegionTableByTile(opts_t *s, Header *hdr, RegionTable_
  */
 static RegionTable_t *makeRegionTable(opts_t *opts, BAMit_t *fp_bam)
 {
-    RegionTable_t rts = NULL;
-    RegionTable_t *rtsArray = smalloc(SF_MAX_LANES * sizeof(rts));
+    RegionTable_t *rtsArray = newRegionTableArray();
     Header *hdr;
 
 	static const int bam_read_buff_size = 1024;
@@ -1316,8 +1489,6 @@ static RegionTable_t *makeRegionTable(opts_t *opts, BAMit_t *fp_bam)
 
 	bam1_t *bam;
 
-    for (int lane=0; lane < SF_MAX_LANES; lane++) rtsArray[lane] = NULL;
-
 	/* loop over reads in the bam file */
 	while (1) {
 		int bam_lane = -1, bam_tile = -1, bam_read = -1, bam_x = -1, bam_y = -1, read_length;
@@ -1327,93 +1498,210 @@ static RegionTable_t *makeRegionTable(opts_t *opts, BAMit_t *fp_bam)
 			break;	/* break on end of BAM file */
 		}
 
-        if (bam_lane > SF_MAX_LANES) die("Lane %d found: max should be %d", bam_lane, SF_MAX_LANES);
+        hdr = laneHeader(opts, bam_lane);
 
-        rts = rtsArray[bam_lane];
-        hdr = LaneArray[bam_lane];
-        if (!hdr) {
-            hdr = sf_initHdr();
-            hdr->region_size = opts->region_size;
-            hdr->lane = bam_lane;
-            LaneArray[bam_lane] = hdr;
-        }
+        if (!useRecord(bam)) continue;
 
-		if (BAM_FUNMAP & bam->core.flag) continue;
-		if (BAM_FQCFAIL & bam->core.flag) continue;
-		if (BAM_FSECONDARY & bam->core.flag) continue;
-		if (BAM_FSUPPLEMENTARY & bam->core.flag) continue;
-		if (BAM_FPAIRED & bam->core.flag) {
-			if (0 == (BAM_FPROPER_PAIR & bam->core.flag)) {
-				continue;
-			}
-		}
-        
         read_length = bam->core.l_qseq;
-        if (0 == hdr->readLength[bam_read]) {
-            hdr->readLength[bam_read] = read_length;
-        }
-
-        if (hdr->readLength[bam_read] != read_length) {
-            fprintf(stderr,
-                    "Error: inconsistent read lengths "
-                    "within bam file for read %d.\n"
-                    "have length %ld, previously it was %d.\n",
-                    bam_read, (long) read_length, hdr->readLength[bam_read]);
-            exit(EXIT_FAILURE);
-        }
+        checkReadLength(hdr, bam_read, read_length);
 
 		parse_bam_alignments(fp_bam, bam, bam_read_seq, bam_read_qual, NULL, bam_read_mismatch,
                                                   bam_read_buff_size, opts->snp_hash);
 
-        // lookup tile in tile array
-        int itile = tile2index(hdr,bam_tile);
-	    if (itile < 0) {
-            itile = hdr->ntiles;
-            hdr->ntiles++;
-            hdr->tileArray = srealloc(hdr->tileArray, hdr->ntiles * sizeof(int));
-            hdr->tileReadCountArray = srealloc(hdr->tileReadCountArray, hdr->ntiles * sizeof(size_t));
-            hdr->tileArray[itile] = bam_tile;
-            hdr->tileReadCountArray[itile] = 0;
-            rts = srealloc(rts, hdr->ntiles * N_READS * sizeof(RegionTableEntry_t **));
-            rtsArray[bam_lane] = rts;
-            for (int read=0;read<N_READS;read++)
-                rts[itile*N_READS+read] = NULL;
-            if (opts->verbose) fprintf(stderr, "Processing lane %d tile %i (%" PRIu64 ")\n", bam_lane, bam_tile, hdr->nreads);
+        addRecord(opts, rtsArray, hdr, bam_lane, bam_tile, bam_x, bam_y, bam_read, read_length,
+                  bam_read_qual, bam_read_mismatch);
+	}
+
+	bam_destroy1(bam);
+
+    finishRegionTable(opts, rtsArray);
+    return rtsArray;
+}
+
+/*
+ * Write the raw region table counts to a partial file, to be merged later
+ *
+ * For each lane, the observed regions are written in the order they were
+ * first seen, so that merging partials in the order of the input shards
+ * numbers the regions just as a single pass over all the shards would.
+ */
+static void writePartial(opts_t *s, RegionTable_t *rtsArray)
+{
+    hFILE *fp = hopen(s->filters->entries[0], "w");
+	if (!fp) die("Can't open partial file %s: %s\n", s->filters->entries[0], strerror(errno));
+
+	strncpy(s->fheader.region_magic, REGION_PARTIAL_MAGIC, sizeof(s->fheader.region_magic));
+	strncpy(s->fheader.cmdLine, s->argv_list, sizeof(s->fheader.cmdLine)-1);
+    if (hwrite(fp, &s->fheader, sizeof(s->fheader)) < 0) goto fail;
+
+    for (int lane=1; lane < SF_MAX_LANES; lane++) {
+        Header *hdr = s->lane_array[lane];
+        if (!hdr) continue;
+        RegionTable_t rts = rtsArray[lane];
+        int nobserved = hdr->region_hash->nused;
+
+        // the (x,y) key of each observed region
+        region_key_t *keys = smalloc((nobserved ? nobserved : 1) * sizeof(region_key_t));
+        for (int n=0; n < hdr->nregions; n++) {
+            if (hdr->regions[n] >= 0) makeRegionKey(&keys[hdr->regions[n]], n / hdr->nregions_y, n % hdr->nregions_y);
         }
-        hdr->tileReadCountArray[itile]++;
-
-        if (NULL == rts[itile*N_READS+bam_read]) {
-            int cycle, iregion;
-            rts[itile*N_READS+bam_read] = smalloc(read_length * sizeof(RegionTableEntry_t *));
-            for(cycle=0;cycle<read_length;cycle++) {
-                rts[itile*N_READS+bam_read][cycle] = smalloc(hdr->nregions * sizeof(RegionTableEntry_t));
-                for(iregion=0;iregion<hdr->nregions;iregion++) {
-                    RegionTableEntry_t *rt = rts[itile*N_READS+bam_read][cycle] + iregion;
-                    initialiseRegionTableEntry(rt);
+
+        if (hwrite(fp, &hdr->lane, sizeof(hdr->lane)) < 0) goto fail;
+        if (hwrite(fp, &hdr->region_size, sizeof(hdr->region_size)) < 0) goto fail;
+        if (hwrite(fp, &hdr->nreads, sizeof(hdr->nreads)) < 0) goto fail;
+        if (hwrite(fp, &hdr->readLength, N_READS * sizeof(*hdr->readLength)) < 0) goto fail;
+        if (hwrite(fp, &nobserved, sizeof(nobserved)) < 0) goto fail;
+        for (int n=0; n < nobserved; n++) {
+            if (hwrite(fp, &keys[n].x, sizeof(keys[n].x)) < 0) goto fail;
+            if (hwrite(fp, &keys[n].y, sizeof(keys[n].y)) < 0) goto fail;
+        }
+        free(keys);
+
+        if (hwrite(fp, &hdr->ntiles, sizeof(hdr->ntiles)) < 0) goto fail;
+        for (int itile=0; itile < hdr->ntiles; itile++) {
+            if (hwrite(fp, &hdr->tileArray[itile], sizeof(hdr->tileArray[itile])) < 0) goto fail;
+            if (hwrite(fp, &hdr->tileReadCountArray[itile], sizeof(hdr->tileReadCountArray[itile])) < 0) goto fail;
+            for (int read=0; read < N_READS; read++) {
+                char present = rts[itile*N_READS+read] != NULL;
+                if (hwrite(fp, &present, sizeof(present)) < 0) goto fail;
+                if (!present) continue;
+                for (int cycle=0; cycle < hdr->readLength[read]; cycle++) {
+                    for (int iregion=0; iregion < nobserved; iregion++) {
+                        RegionTableEntry_t *rt = rts[itile*N_READS+read][cycle] + iregion;
+                        if (hwrite(fp, &rt->align, sizeof(rt->align)) < 0) goto fail;
+                        if (hwrite(fp, &rt->mismatch, sizeof(rt->mismatch)) < 0) goto fail;
+                        if (hwrite(fp, &rt->insertion, sizeof(rt->insertion)) < 0) goto fail;
+                        if (hwrite(fp, &rt->deletion, sizeof(rt->deletion)) < 0) goto fail;
+                        if (hwrite(fp, &rt->soft_clip, sizeof(rt->soft_clip)) < 0) goto fail;
+                        if (hwrite(fp, &rt->known_snp, sizeof(rt->known_snp)) < 0) goto fail;
+                        if (hwrite(fp, &rt->quality, sizeof(rt->quality)) < 0) goto fail;
+                    }
                 }
             }
         }
+    }
 
-        int iregion = findRegion(opts, rts, hdr, bam_x, bam_y);
-        updateRegionTable(hdr, &rts[itile*N_READS], bam_read, iregion, bam_read_qual, bam_read_mismatch);
+	if (hclose(fp)) die("Failed to close %s\n", s->filters->entries[0]);
+    return;
 
-        hdr->nreads++;
-	}
+fail:
+    die("writePartial() failed\n");
+}
 
-	bam_destroy1(bam);
+/*
+ * Add the counts from a partial file to the region table
+ */
+static void readPartial(opts_t *opts, char *fname, RegionTable_t *rtsArray)
+{
+    filter_header_t fheader;
+    hFILE *fp = hopen(fname, "r");
+    if (!fp) die("Can't open partial file %s\n", fname);
+    if (hread(fp, &fheader, sizeof(fheader)) != sizeof(fheader)) goto fail;
+    if (strncmp(fheader.region_magic, REGION_PARTIAL_MAGIC, strlen(REGION_PARTIAL_MAGIC))) die("%s is not a partial filter file\n", fname);
+
+    while (1) {
+        int lane, region_size, nobserved;
+        uint64_t nreads;
+        int readLength[N_READS];
+        size_t ntiles;
+
+        ssize_t r = hread(fp, &lane, sizeof(lane));
+        if (r == 0) break;      // end of file, no more lanes left
+        if (r != sizeof(lane)) goto fail;
+        if (lane < 0 || lane >= SF_MAX_LANES) die("Invalid lane %d in partial file %s\n", lane, fname);
+        if (hread(fp, &region_size, sizeof(region_size)) != sizeof(region_size)) goto fail;
+        if (hread(fp, &nreads, sizeof(nreads)) != sizeof(nreads)) goto fail;
+        if (hread(fp, readLength, sizeof(readLength)) != sizeof(readLength)) goto fail;
+
+        Header *hdr = opts->lane_array[lane];
+        if (!hdr) {
+            hdr = sf_initHdr();
+            hdr->region_size = region_size;
+            hdr->lane = lane;
+            opts->lane_array[lane] = hdr;
+        }
+        if (hdr->region_size != region_size) die("Partial file %s has a different region size\n", fname);
+        for (int read=0; read < N_READS; read++) {
+            if (0 == readLength[read]) continue;
+            if (0 == hdr->readLength[read]) hdr->readLength[read] = readLength[read];
+            if (hdr->readLength[read] != readLength[read]) {
+                die("Error: inconsistent read lengths for read %d.\n"
+                    "have length %d in %s, previously it was %d.\n",
+                    read, readLength[read], fname, hdr->readLength[read]);
+            }
+        }
 
-    /* re-order the RegionTable by tile */
-    for (int lane=1; lane < SF_MAX_LANES; lane++) {
-        Header *hdr = LaneArray[lane];
-        if (!hdr) continue;
-	    rtsArray[lane] = orderRegionTableByTile(opts, hdr, rtsArray[lane]);
+        // map the regions in this partial onto the merged table
+        if (hread(fp, &nobserved, sizeof(nobserved)) != sizeof(nobserved)) goto fail;
+        int *region_map = smalloc((nobserved ? nobserved : 1) * sizeof(int));
+        for (int n=0; n < nobserved; n++) {
+            uint32_t ix, iy;
+            if (hread(fp, &ix, sizeof(ix)) != sizeof(ix)) goto fail;
+            if (hread(fp, &iy, sizeof(iy)) != sizeof(iy)) goto fail;
+            region_map[n] = findRegionKey(rtsArray[lane], hdr, ix, iy);
+        }
+
+        if (hread(fp, &ntiles, sizeof(ntiles)) != sizeof(ntiles)) goto fail;
+        for (int n=0; n < ntiles; n++) {
+            int tile;
+            size_t count;
+            if (hread(fp, &tile, sizeof(tile)) != sizeof(tile)) goto fail;
+            if (hread(fp, &count, sizeof(count)) != sizeof(count)) goto fail;
+            int itile = findTile(opts, hdr, &rtsArray[lane], tile);
+            RegionTable_t rts = rtsArray[lane];
+            hdr->tileReadCountArray[itile] += count;
+
+            for (int read=0; read < N_READS; read++) {
+                char present;
+                if (hread(fp, &present, sizeof(present)) != sizeof(present)) goto fail;
+                if (!present) continue;
+                if (NULL == rts[itile*N_READS+read]) initReadTable(hdr, rts, itile, read, readLength[read]);
+                for (int cycle=0; cycle < readLength[read]; cycle++) {
+                    for (int iregion=0; iregion < nobserved; iregion++) {
+                        RegionTableEntry_t e;
+                        if (hread(fp, &e.align, sizeof(e.align)) != sizeof(e.align)) goto fail;
+                        if (hread(fp, &e.mismatch, sizeof(e.mismatch)) != sizeof(e.mismatch)) goto fail;
+                        if (hread(fp, &e.insertion, sizeof(e.insertion)) != sizeof(e.insertion)) goto fail;
+                        if (hread(fp, &e.deletion, sizeof(e.deletion)) != sizeof(e.deletion)) goto fail;
+                        if (hread(fp, &e.soft_clip, sizeof(e.soft_clip)) != sizeof(e.soft_clip)) goto fail;
+                        if (hread(fp, &e.known_snp, sizeof(e.known_snp)) != sizeof(e.known_snp)) goto fail;
+                        if (hread(fp, &e.quality, sizeof(e.quality)) != sizeof(e.quality)) goto fail;
+                        RegionTableEntry_t *rt = rts[itile*N_READS+read][cycle] + region_map[iregion];
+                        rt->align     += e.align;
+                        rt->mismatch  += e.mismatch;
+                        rt->insertion += e.insertion;
+                        rt->deletion  += e.deletion;
+                        rt->soft_clip += e.soft_clip;
+                        rt->known_snp += e.known_snp;
+                        rt->quality   += e.quality;
+                    }
+                }
+            }
+        }
+        hdr->nreads += nreads;
+        free(region_map);
     }
 
-    /* setup a mapping between each potential region and the observed regions */
-    for (int lane=1; lane < SF_MAX_LANES; lane++) {
-        if (LaneArray[lane]) regionMapping(LaneArray[lane]);
+    if (hclose(fp)) die("Failed to close partial file %s\n", fname);
+    return;
+
+fail:
+    die("Failed to read partial file %s\n", fname);
+}
+
+/*
+ * Merge a list of partial files into one region table
+ */
+static RegionTable_t *mergePartials(opts_t *opts)
+{
+    RegionTable_t *rtsArray = newRegionTableArray();
+
+    for (int n=0; n < opts->partials->end; n++) {
+        if (opts->verbose) display("Merging %s\n", (char *)opts->partials->entries[n]);
+        readPartial(opts, opts->partials->entries[n], rtsArray);
     }
 
+    finishRegionTable(opts, rtsArray);
     return rtsArray;
 }
 
@@ -1440,7 +1728,7 @@ static int filter_bam(opts_t *opts, BAMit_t *fp_in_bam, BAMit_t *fp_out_bam)
             break;	/* break on end of BAM file */
         }
 
-        Header *hdr = LaneArray[bam_lane];
+        Header *hdr = opts->lane_array[bam_lane];
         if (hdr) {
             if (hdr->ngood_tiles) {
                 int iregion = xy2region(hdr, bam_x, bam_y);
@@ -1487,6 +1775,8 @@ static void usage(FILE *usagefp)
 	fprintf(usagefp, " -D               Dump filter file in ascii text format to stdout\n");
 	fprintf(usagefp, " -c               Create filter file from BAM file\n");
 	fprintf(usagefp, " -a               Apply filter file to a BAM file\n");
+	fprintf(usagefp, " -M --merge       Create filter file by merging partial files made with -c --partial\n");
+	fprintf(usagefp, "                  The partial files are given instead of a BAM file\n");
 	fprintf(usagefp, "\n");
 	fprintf(usagefp, "Options:\n");
 	fprintf(usagefp, " -v --verbose     display progress messages to stderr\n");
@@ -1521,6 +1811,11 @@ static void usage(FILE *usagefp)
 	fprintf(usagefp, "                 default %-6.4f\n", REGION_DELETION_THRESHOLD);
 	fprintf(usagefp, "      -t prefix\n");
 	fprintf(usagefp, "                 generate tileviz files in this directory\n");
+	fprintf(usagefp, "      --partial\n");
+	fprintf(usagefp, "                 write the region counts to the filter file, to be merged with -M.\n");
+	fprintf(usagefp, "                 Merging the partials for several BAM files gives the same filter as\n");
+	fprintf(usagefp, "                 creating it from all the BAM files concatenated in the same order.\n");
+	fprintf(usagefp, "                 The region thresholds and tileviz options are used by the merge.\n");
 	fprintf(usagefp, "\n");
 	fprintf(usagefp, "    apply filter:\n");
 	fprintf(usagefp, "      -o         output\n");
@@ -1535,29 +1830,13 @@ static void usage(FILE *usagefp)
 }
 
 /*
- * Create filter command
+ * Write the filter (or partial file) and tileviz images, then free the region table
  */
-static void calculateFilter(opts_t *opts)
+static void writeRegionTable(opts_t *opts, RegionTable_t *rtsArray)
 {
-	BAMit_t *fp_input_bam;
-	RegionTable_t *rtsArray;
-    
-	fp_input_bam = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, NULL);
-	if (NULL == fp_input_bam) {
-		die("ERROR: can't open bam file %s: %s\n", opts->in_bam_file, strerror(errno));
-	}
-
-    /* read the snp_file */
-    opts->snp_hash = readSnpFile(opts);
-
-	rtsArray = makeRegionTable(opts, fp_input_bam);
-
-	/* close the bam file */
-	BAMit_free(fp_input_bam);
-
 	if (opts->verbose) {
         uint64_t traces = 0;
-        for (int n=1; n < SF_MAX_LANES; n++) if (LaneArray[n]) traces += LaneArray[n]->nreads;
+        for (int n=1; n < SF_MAX_LANES; n++) if (opts->lane_array[n]) traces += opts->lane_array[n]->nreads;
 		display("Processed %" PRIu64 " traces\n", traces);
 		if (opts->snp_hash) {
 			size_t nsnps = 0;
@@ -1571,30 +1850,64 @@ static void calculateFilter(opts_t *opts)
 		}
 	}
 
-    for (int lane=1; lane < SF_MAX_LANES; lane++) {
-        if (LaneArray[lane]) setRegionState(opts, LaneArray[lane], rtsArray[lane]);
-    }
-
     if (!opts->filters) {
         display("Writing filter to stdout\n");
-        va_push(opts->filters,"/dev/stdout");
+        opts->filters = va_init(1, free);
+        va_push(opts->filters, strdup("/dev/stdout"));
+    }
+
+    if (opts->partial) {
+        // the region state is set when the partials are merged
+        writePartial(opts, rtsArray);
+    } else {
+        for (int lane=1; lane < SF_MAX_LANES; lane++) {
+            if (opts->lane_array[lane]) setRegionState(opts, opts->lane_array[lane], rtsArray[lane]);
+        }
+        writeFilter(opts, rtsArray);
     }
-    writeFilter(opts, rtsArray);
 
 #ifdef HAVE_LIBGD
-    if (opts->tileviz) {
+    if (opts->tileviz && !opts->partial) {
         for (int n=1; n < SF_MAX_LANES; n++) {
-            if (LaneArray[n]) tileviz(opts, LaneArray[n], rtsArray[n]);
+            if (opts->lane_array[n]) tileviz(opts, opts->lane_array[n], rtsArray[n]);
         }
     }
 #endif
 
     for (int lane=1; lane < SF_MAX_LANES; lane++) {
-	    if (LaneArray[lane]) freeRTS(opts, LaneArray[lane], rtsArray[lane]);
+	    if (opts->lane_array[lane]) freeRTS(opts, opts->lane_array[lane], rtsArray[lane]);
     }
     free(rtsArray);
 }
 
+/*
+ * Create filter command
+ */
+static void calculateFilter(opts_t *opts)
+{
+	BAMit_t *fp_input_bam;
+	RegionTable_t *rtsArray;
+
+    if (opts->merge) {
+        rtsArray = mergePartials(opts);
+    } else {
+        fp_input_bam = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, NULL, BAMIT_ALIGNMENT_FIELDS);
+        if (NULL == fp_input_bam) {
+            die("ERROR: can't open bam file %s: %s\n", opts->in_bam_file, strerror(errno));
+        }
+
+        /* read the snp_file */
+        opts->snp_hash = readSnpFile(opts);
+
+        rtsArray = makeRegionTable(opts, fp_input_bam);
+
+        /* close the bam file */
+        BAMit_free(fp_input_bam);
+    }
+
+    writeRegionTable(opts, rtsArray);
+}
+
 /*
  * Apply filter command
  */
@@ -1606,11 +1919,11 @@ static void applyFilter(opts_t *s)
 	char *out_bam_file = NULL;
 	char *apply_stats_file = NULL;
 
-    openFilters(s->filters);
+    openFilters(s, s->filters);
 
     /* remove bad tiles from region table */
     for (int lane=1; lane < SF_MAX_LANES; lane++) {
-        Header *hdr = LaneArray[lane];
+        Header *hdr = s->lane_array[lane];
         if (hdr) removeBadTiles(hdr);
     }
 
@@ -1632,13 +1945,13 @@ static void applyFilter(opts_t *s)
     }
     strcat(apply_stats_file, s->apply_stats_out);
 
-	fp_input_bam = BAMit_open(s->in_bam_file, 'r', s->input_fmt, 0, NULL);
+	fp_input_bam = BAMit_open(s->in_bam_file, 'r', s->input_fmt, 0, NULL, 0);
 	if (NULL == fp_input_bam) {
 		die("ERROR: can't open bam file %s: %s\n", s->in_bam_file, strerror(errno));
 	}
 
 
-	fp_output_bam = BAMit_open(out_bam_file, 'w', s->output_fmt, s->compression_level, NULL);
+	fp_output_bam = BAMit_open(out_bam_file, 'w', s->output_fmt, s->compression_level, NULL, 0);
 	if (NULL == fp_output_bam) {
 		die("ERROR: can't open bam file %s: %s\n", out_bam_file, strerror(errno));
 	}
@@ -1665,7 +1978,7 @@ static void applyFilter(opts_t *s)
 	}
 
     for (int n=0; n < SF_MAX_LANES; n++) {
-        Header *hdr = LaneArray[n];
+        Header *hdr = s->lane_array[n];
         if (!hdr) continue;
         char buffer[64];
         sprintf(buffer, "Lane %d\t", hdr->lane);
@@ -1686,13 +1999,13 @@ static void applyFilter(opts_t *s)
  */
 static void dumpFilterFile(opts_t *opts)
 {
-    openFilters(opts->filters);
+    openFilters(opts, opts->filters);
 
-	printf("Magic:          %s\n", Fheader.region_magic);
-	printf("Command Line:   %s\n", Fheader.cmdLine);
+	printf("Magic:          %s\n", opts->fheader.region_magic);
+	printf("Command Line:   %s\n", opts->fheader.cmdLine);
 
     for (int laneNo=1; laneNo < SF_MAX_LANES; laneNo++) {
-        Header *hdr = LaneArray[laneNo];;
+        Header *hdr = opts->lane_array[laneNo];;
         if (!hdr) continue;
 
         printf("\n");
@@ -1748,7 +2061,7 @@ opts_t* spatial_filter_parse_args(int argc, char *argv[])
 {
     if (argc == 1) { usage(stdout); return NULL; }
 
-    const char *optstring = "vdcafuDF:b:e:o:l:i:p:s:r:R:x:y:t:z:qh?";
+    const char *optstring = "vdcafuDMF:b:e:o:l:i:p:s:r:R:x:y:t:z:qh?";
 
 	static const struct option lopts[] = {
         {"snp_file", 1, 0, 's'},
@@ -1765,6 +2078,8 @@ opts_t* spatial_filter_parse_args(int argc, char *argv[])
         {"input-fmt", 1, 0, 0},
         {"compression-level", 1, 0, 0},
         {"tileviz", 1, 0, 't'},
+        {"partial", 0, 0, 0},
+        {"merge", 0, 0, 'M'},
         {0, 0, 0, 0}
     };
 
@@ -1790,6 +2105,7 @@ opts_t* spatial_filter_parse_args(int argc, char *argv[])
             case 'R': break;
 			case 'D': opts->dumpFilter = 1; ncmd++;       break;
 			case 'c': opts->calculate = 1; ncmd++;        break;
+			case 'M': opts->calculate = 1; opts->merge = 1; ncmd++; break;
             case 't': opts->tileviz = strdup(optarg);     break;
 			case 'a': opts->apply = 1; ncmd++;            break;
 			case 'f': opts->qcfail = 1;		              break;
@@ -1807,6 +2123,7 @@ opts_t* spatial_filter_parse_args(int argc, char *argv[])
                           if (strcmp(arg, "output-fmt") == 0)              opts->output_fmt = strdup(optarg);
                      else if (strcmp(arg, "input-fmt") == 0)               opts->input_fmt = strdup(optarg);
                      else if (strcmp(arg, "compression-level") == 0)       opts->compression_level = *optarg;
+                     else if (strcmp(arg, "partial") == 0)                 opts->partial = true;
                      else {
                          fprintf(stderr,"\nUnknown option: %s\n\n", arg);
                          usage(stderr); free_opts(opts);
@@ -1830,9 +2147,16 @@ opts_t* spatial_filter_parse_args(int argc, char *argv[])
         usage(stderr); free_opts(opts); return NULL; 
     }
 
-	if (optind < argc) opts->in_bam_file = strdup(argv[optind]);
+    if (opts->merge) {
+        opts->partials = va_init(5, free);
+        while (optind < argc) va_push(opts->partials, strdup(argv[optind++]));
+        if (!opts->partials->end) die("Error: no partial files specified\n");
+    } else {
+        if (optind < argc) opts->in_bam_file = strdup(argv[optind]);
+        if (!opts->in_bam_file && !opts->dumpFilter) die("Error: no BAM file specified\n");
+    }
 
-	if (!opts->in_bam_file && !opts->dumpFilter) die("Error: no BAM file specified\n");
+    if (opts->partial && (!opts->calculate || opts->merge)) die("Error: --partial can only be used with -c\n");
 
     if (!opts->filters && (opts->dumpFilter || opts->apply)) die("Error: no filter file specified\n");
 
@@ -1863,7 +2187,7 @@ static int spatial_filter(opts_t *opts)
 	}
 
     // Initialise Lane array
-    for (int n=0; n < SF_MAX_LANES; n++) LaneArray[n] = NULL;
+    for (int n=0; n < SF_MAX_LANES; n++) opts->lane_array[n] = NULL;
 
 	/* Dump the filter file */
 	if (opts->dumpFilter) dumpFilterFile(opts);
@@ -1875,12 +2199,103 @@ static int spatial_filter(opts_t *opts)
 	if (opts->apply) applyFilter(opts);
 
     // Free Lane array
-    for (int n=0; n < SF_MAX_LANES; n++) sf_freeHdr(LaneArray[n]);
+    for (int n=0; n < SF_MAX_LANES; n++) sf_freeHdr(opts->lane_array[n]);
 
 	return EXIT_SUCCESS;
 
 }
 
+/*
+ * Calculating a filter as part of 'bambi qc'
+ */
+typedef struct {
+    opts_t *opts;
+    RegionTable_t *rtsArray;
+    int buff_size;              // for parse_bam_alignments() with a snp file
+    char *seq;
+    int *qual;
+    int *mismatch;
+} qc_state_t;
+
+static void *qc_sf_init(int argc, char **argv)
+{
+    opts_t *opts = spatial_filter_parse_args(argc, argv);
+    if (!opts) return NULL;
+    if (!opts->calculate || opts->merge || opts->partial) {
+        fprintf(stderr, "ERROR: only a filter can be calculated by qc\n");
+        free_opts(opts);
+        return NULL;
+    }
+
+    for (int n=0; n < SF_MAX_LANES; n++) opts->lane_array[n] = NULL;
+    opts->snp_hash = readSnpFile(opts);
+
+    qc_state_t *st = calloc(1, sizeof(qc_state_t));
+    if (!st) die("Out of memory");
+    st->opts = opts;
+    st->rtsArray = newRegionTableArray();
+    return st;
+}
+
+static int qc_sf_records(void *state, qc_batch_t *batch)
+{
+    qc_state_t *st = (qc_state_t *)state;
+    opts_t *opts = st->opts;
+
+    for (int n=0; n < batch->nrecs; n++) {
+        qc_record_t *r = &batch->recs[n];
+        Header *hdr = laneHeader(opts, r->lane);
+
+        if (!useRecord(r->rec)) continue;
+        if (!r->aligned) die("ERROR: no alignment for read: \"%s\"\n", bam_get_qname(r->rec));
+
+        int read_length = r->rec->core.l_qseq;
+        checkReadLength(hdr, r->read, read_length);
+
+        int *qual = r->qual, *mismatch = r->mismatch;
+        if (opts->snp_hash) {
+            // the shared mismatches don't know about our snps
+            if (read_length >= st->buff_size) {
+                st->buff_size = read_length + 1;
+                st->seq = realloc(st->seq, st->buff_size);
+                st->qual = realloc(st->qual, st->buff_size * sizeof(int));
+                st->mismatch = realloc(st->mismatch, st->buff_size * sizeof(int));
+                if (!st->seq || !st->qual || !st->mismatch) die("Out of memory");
+            }
+            parse_bam_alignments(batch->bam_in, r->rec, st->seq, st->qual, NULL, st->mismatch,
+                                 st->buff_size, opts->snp_hash);
+            qual = st->qual; mismatch = st->mismatch;
+        }
+
+        addRecord(opts, st->rtsArray, hdr, r->lane, r->tile, r->x, r->y, r->read, read_length,
+                  qual, mismatch);
+    }
+    return 0;
+}
+
+static int qc_sf_finish(void *state)
+{
+    qc_state_t *st = (qc_state_t *)state;
+    opts_t *opts = st->opts;
+
+    finishRegionTable(opts, st->rtsArray);
+    writeRegionTable(opts, st->rtsArray);
+
+    for (int n=0; n < SF_MAX_LANES; n++) sf_freeHdr(opts->lane_array[n]);
+    HashTableDestroy(opts->snp_hash, 0);
+    free_opts(opts);
+    free(st->seq);
+    free(st->qual);
+    free(st->mismatch);
+    free(st);
+    return 0;
+}
+
+const qc_analyser_t qc_spatial_filter = {
+    "spatial_filter", QC_NEED_INFO | QC_NEED_ALIGNMENT,
+    qc_sf_init, qc_sf_records, qc_sf_finish
+};
+
 /*
  * Called from bambi to perform spatial filtering
  *
@@ -1892,6 +2307,7 @@ int main_spatial_filter(int argc, char *argv[])
 {
     int ret = 1;
     opts_t *opts = spatial_filter_parse_args(argc, argv);
+    batch_args_parsed();
     if (opts) ret = spatial_filter(opts);
     free_opts(opts);
     return ret;
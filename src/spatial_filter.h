@@ -0,0 +1,39 @@
+/*  spatial_filter.h -- what other commands need from spatial filter files
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SPATIAL_FILTER_H__
+#define __SPATIAL_FILTER_H__
+
+#include <stdbool.h>
+#include "htslib/hfile.h"
+#include "array.h"
+
+/*
+ * true if fp is at the start of a spatial filter file
+ */
+bool sf_isFilterFile(hFILE *fp);
+
+/*
+ * Read a spatial filter file, and add the lane and tile number of each tile
+ * that removeBadTiles() discards to 'lanes' and 'tiles'
+ */
+void sf_badTiles(hFILE *fp, ia_t *lanes, ia_t *tiles);
+
+#endif
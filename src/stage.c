@@ -0,0 +1,385 @@
+/*  stage.c -- local disk staging cache for run folder files
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bambi.h"
+#include "hash_table.h"
+#include "stage.h"
+
+#define STAGE_COPY_BUFSIZE (1024*1024)
+
+/*
+ * Lifecycle of a staged file:
+ *
+ * QUEUED  -> waiting for the copier thread
+ * COPYING -> copier thread is reading it; readers must wait
+ * WAITING -> copier is waiting for space in the budget
+ * READY   -> local copy is complete
+ * REMOTE  -> not staged (missing, too big, or needed before it was copied)
+ *
+ * A reader that finds a file QUEUED or WAITING doesn't wait for it, but
+ * marks it REMOTE and reads the original. This means a reader can never
+ * block on space that only it can free.
+ */
+typedef enum { STAGE_QUEUED, STAGE_COPYING, STAGE_WAITING, STAGE_READY, STAGE_REMOTE } STAGE_STATE;
+
+typedef struct stage_entry_t {
+    char *src;
+    char *dst;
+    int group;
+    STAGE_STATE state;
+    size_t size;
+    bool in_queue;          // on the copier queue
+    bool in_flight;         // being handled by the copier thread
+    bool evict;             // released while queued or in flight
+    struct stage_entry_t *next;
+} stage_entry_t;
+
+struct stage_t {
+    char *dir;
+    size_t budget;
+    size_t used;
+    int verbose;
+    bool shutdown;
+    unsigned int seq;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    HashTable *files;       // src filename -> stage_entry_t
+    stage_entry_t *head;    // copier queue
+    stage_entry_t *tail;
+    size_t nstaged, nlocal, nremote;
+};
+
+static void stage_free_entry(stage_t *s, stage_entry_t *e)
+{
+    if (e->state == STAGE_READY) {
+        unlink(e->dst);
+        s->used -= e->size;
+    }
+    free(e->src);
+    free(e->dst);
+    free(e);
+}
+
+/*
+ * Copy an open file to the local staging file
+ * returns 0 on success, -1 on failure
+ */
+static int stage_copy(int in, const char *dst)
+{
+    char *buf = smalloc(STAGE_COPY_BUFSIZE);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ssize_t n = 0;
+    int ret = 0;
+
+    if (out < 0) { free(buf); return -1; }
+
+    while ((n = read(in, buf, STAGE_COPY_BUFSIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ret = -1; break;
+        }
+        char *p = buf;
+        while (n > 0) {
+            ssize_t w = write(out, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                ret = -1; break;
+            }
+            p += w; n -= w;
+        }
+        if (ret) break;
+    }
+
+    if (close(out) < 0) ret = -1;
+    if (ret) unlink(dst);
+    free(buf);
+    return ret;
+}
+
+/*
+ * The background copier
+ */
+static void *stage_thread(void *arg)
+{
+    stage_t *s = (stage_t *)arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->shutdown && !s->head) pthread_cond_wait(&s->cond, &s->lock);
+        if (s->shutdown) break;
+
+        stage_entry_t *e = s->head;
+        s->head = e->next;
+        if (!s->head) s->tail = NULL;
+        e->next = NULL;
+        e->in_queue = false;
+
+        if (e->evict) { stage_free_entry(s, e); continue; }
+        if (e->state != STAGE_QUEUED) continue;     // already given up on
+
+        e->state = STAGE_COPYING;
+        e->in_flight = true;
+        pthread_mutex_unlock(&s->lock);
+
+        struct stat st;
+        int fd = open(e->src, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) < 0) { close(fd); fd = -1; }
+
+        pthread_mutex_lock(&s->lock);
+        if (fd >= 0) {
+            e->size = st.st_size;
+            if (e->size > s->budget) {
+                close(fd); fd = -1;
+            } else if (s->used + e->size > s->budget) {
+                e->state = STAGE_WAITING;
+                pthread_cond_broadcast(&s->cond);
+                while (e->state == STAGE_WAITING && !e->evict && !s->shutdown && s->used + e->size > s->budget) {
+                    pthread_cond_wait(&s->cond, &s->lock);
+                }
+                if (e->state != STAGE_WAITING || e->evict || s->shutdown) { close(fd); fd = -1; }
+            }
+        }
+
+        if (fd < 0) {
+            e->state = STAGE_REMOTE;
+        } else {
+            e->state = STAGE_COPYING;
+            s->used += e->size;
+            pthread_mutex_unlock(&s->lock);
+            int ret = stage_copy(fd, e->dst);
+            close(fd);
+            pthread_mutex_lock(&s->lock);
+            if (ret == 0) {
+                e->state = STAGE_READY;
+                s->nstaged++;
+            } else {
+                s->used -= e->size;
+                e->state = STAGE_REMOTE;
+                if (s->verbose) display("Failed to stage %s\n", e->src);
+            }
+        }
+
+        e->in_flight = false;
+        if (e->evict) stage_free_entry(s, e);
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/*
+ * Create a staging cache in a new directory under dir
+ *
+ * Returns NULL if the directory can't be created
+ */
+stage_t *stage_init(const char *dir, size_t budget, int verbose)
+{
+    stage_t *s = calloc(1, sizeof(stage_t));
+    if (!s) die("Out of memory");
+
+    s->dir = smalloc(strlen(dir) + 32);
+    sprintf(s->dir, "%s/bambi_stage.XXXXXX", dir);
+    if (!mkdtemp(s->dir)) {
+        fprintf(stderr, "Can't create staging directory in %s: %s\n", dir, strerror(errno));
+        free(s->dir); free(s);
+        return NULL;
+    }
+
+    s->budget = budget;
+    s->verbose = verbose;
+    s->files = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    if (!s->files) die("Out of memory");
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, stage_thread, s) != 0) die("Can't create staging thread\n");
+
+    if (verbose) display("Staging files in %s (budget %zu bytes)\n", s->dir, budget);
+    return s;
+}
+
+/*
+ * Queue a file to be copied to the staging area
+ *
+ * Files which don't exist are silently ignored, so it is fine to request
+ * all the possible names for a file.
+ */
+void stage_request(stage_t *s, const char *fname, int group)
+{
+    if (!s) return;
+
+    pthread_mutex_lock(&s->lock);
+    if (HashTableSearch(s->files, (char *)fname, strlen(fname))) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    stage_entry_t *e = calloc(1, sizeof(stage_entry_t));
+    if (!e) die("Out of memory");
+    char *tmp = strdup(fname);
+    e->src = strdup(fname);
+    e->dst = smalloc(strlen(s->dir) + strlen(fname) + 16);
+    sprintf(e->dst, "%s/%u_%s", s->dir, s->seq++, basename(tmp));
+    free(tmp);
+    e->group = group;
+    e->state = STAGE_QUEUED;
+    e->in_queue = true;
+
+    HashData hd;
+    hd.p = e;
+    if (!HashTableAdd(s->files, e->src, strlen(e->src), hd, NULL)) die("Out of memory");
+
+    if (s->tail) s->tail->next = e;
+    else         s->head = e;
+    s->tail = e;
+
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Return the name to use to open fname: the staged copy if there is one,
+ * otherwise the original name. The caller must free the result.
+ */
+char *stage_path(stage_t *s, const char *fname)
+{
+    char *path = NULL;
+
+    if (!s) return strdup(fname);
+
+    pthread_mutex_lock(&s->lock);
+    HashItem *hi = HashTableSearch(s->files, (char *)fname, strlen(fname));
+    if (hi) {
+        stage_entry_t *e = (stage_entry_t *)hi->data.p;
+        while (e->state == STAGE_COPYING) pthread_cond_wait(&s->cond, &s->lock);
+        if (e->state == STAGE_QUEUED || e->state == STAGE_WAITING) {
+            e->state = STAGE_REMOTE;
+            pthread_cond_broadcast(&s->cond);
+        }
+        if (e->state == STAGE_READY) path = strdup(e->dst);
+    }
+    if (path) s->nlocal++;
+    else      s->nremote++;
+    pthread_mutex_unlock(&s->lock);
+
+    return path ? path : strdup(fname);
+}
+
+/*
+ * Remove all the files in a group from the staging area
+ */
+void stage_release(stage_t *s, int group)
+{
+    if (!s) return;
+
+    va_t *victims = va_init(64, NULL);
+    HashIter *iter = HashTableIterCreate();
+    HashItem *hi;
+
+    pthread_mutex_lock(&s->lock);
+    while ((hi = HashTableIterNext(s->files, iter)) != NULL) {
+        stage_entry_t *e = (stage_entry_t *)hi->data.p;
+        if (e->group == group) va_push(victims, e);
+    }
+    for (int n = 0; n < victims->end; n++) {
+        stage_entry_t *e = victims->entries[n];
+        HashTableRemove(s->files, e->src, strlen(e->src), 0);
+        if (e->in_queue || e->in_flight) e->evict = true;
+        else                             stage_free_entry(s, e);
+    }
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    HashTableIterDestroy(iter);
+    va_free(victims);
+}
+
+/*
+ * Stop the copier, remove all staged files and the staging directory
+ */
+void stage_free(stage_t *s)
+{
+    if (!s) return;
+
+    pthread_mutex_lock(&s->lock);
+    s->shutdown = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    // anything left on the queue is either evicted or still in the hash
+    while (s->head) {
+        stage_entry_t *e = s->head;
+        s->head = e->next;
+        if (e->evict) stage_free_entry(s, e);
+        else          e->in_queue = false;
+    }
+
+    HashIter *iter = HashTableIterCreate();
+    HashItem *hi;
+    while ((hi = HashTableIterNext(s->files, iter)) != NULL) {
+        stage_free_entry(s, (stage_entry_t *)hi->data.p);
+    }
+    HashTableIterDestroy(iter);
+    HashTableDestroy(s->files, 0);
+
+    if (s->verbose) display("Staging: %zu files staged, %zu opened locally, %zu opened remotely\n",
+                            s->nstaged, s->nlocal, s->nremote);
+
+    if (rmdir(s->dir) < 0) display("Can't remove staging directory %s: %s\n", s->dir, strerror(errno));
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->dir);
+    free(s);
+}
+
+/*
+ * Parse a size with an optional K, M or G suffix, and an optional
+ * trailing B (eg 512, 4G, 4GB, 100MB or 10B)
+ * Returns 0 if the size can't be parsed
+ */
+size_t stage_parse_size(const char *str)
+{
+    char *end;
+    double d = strtod(str, &end);
+    if (end == str || d < 0) return 0;
+    switch (toupper(*end)) {
+        case 'G': d *= 1024;    /* fall-through */
+        case 'M': d *= 1024;    /* fall-through */
+        case 'K': d *= 1024; end++; break;
+    }
+    if (toupper(*end) == 'B') end++;
+    if (*end) return 0;
+    return (size_t)d;
+}
@@ -0,0 +1,47 @@
+/*  stage.h -- local disk staging cache for run folder files
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STAGE_H__
+#define __STAGE_H__
+
+#include <stddef.h>
+
+/*
+ * A staging cache copies files from (slow, remote) storage to a local
+ * directory in a background thread, so that they can be opened locally
+ * when they are needed.
+ *
+ * Files are requested in groups (eg one group per tile) and released a
+ * group at a time. The total size of the staged files is kept within
+ * a fixed budget; files which don't fit are simply read from their
+ * original location.
+ */
+
+typedef struct stage_t stage_t;
+
+stage_t *stage_init(const char *dir, size_t budget, int verbose);
+void stage_request(stage_t *stage, const char *fname, int group);
+char *stage_path(stage_t *stage, const char *fname);
+void stage_release(stage_t *stage, int group);
+void stage_free(stage_t *stage);
+size_t stage_parse_size(const char *str);
+
+#endif
+
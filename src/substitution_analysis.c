@@ -50,10 +50,18 @@
 #include <ctype.h>
 #include <math.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include "parse_bam.h"
 #include "bambi_utils.h"
 #include "bamit.h"
+#include "array.h"
+#include "hash_table.h"
+#include "htslib/kstring.h"
+#include "batch_shared.h"
+#include "qc.h"
 
 #define N_READS 3
 
@@ -65,6 +73,8 @@
 #define NBINS 51
 #define ST_HILO_QUALITY  29.5
 
+#define CONVERGE_INTERVAL 100000    // reads between convergence checks
+
 typedef struct {
     int         read;
     int         cycle;
@@ -83,16 +93,30 @@ typedef struct {
     float       quality;
 } SurvTable;
 
+/*
+ * The survival tables for one read group and/or tile, or for the whole file.
+ * Reads may be of different lengths, so the tables are as long as the
+ * longest read seen.
+ */
+typedef struct {
+    char *name;                 // read group and/or lane_tile, or NULL for the whole file
+    int read_length[N_READS];
+    SurvTable *sts[N_READS];
+} Stratum;
+
 typedef struct {
     char *reportName;
     char *in_bam_file;
-    int read_length[N_READS];
+    bool by_read_group;         // a report for each read group
+    bool by_tile;               // a report for each lane and tile
     int quiet;
     int verbose;
     char compression_level;
     char *input_fmt;
     char *output_fmt;
-
+    double sample_fraction;     // fraction of templates to use
+    uint64_t sample_threshold;  // use templates whose name hashes below this
+    double converge;            // stop when the rates change by less than this, or 0
 } opts_t;
 
 static void free_opts(opts_t *opts)
@@ -100,12 +124,14 @@ static void free_opts(opts_t *opts)
     free(opts->reportName);
     free(opts->in_bam_file);
     free(opts->input_fmt);
+    free(opts->output_fmt);
     free(opts);
 }
 
 
 #define MAXNH       7
 static int* lookup = NULL;
+static pthread_once_t lookup_once = PTHREAD_ONCE_INIT;
 
 static void init_lookup(void) {
     int i;
@@ -126,9 +152,7 @@ static void init_lookup(void) {
 int str2word(char *seq, int NH) {
     int i, word = -1;
 
-    if (!lookup) {
-        init_lookup();
-    }
+    pthread_once(&lookup_once, init_lookup);
 
     if (NH > MAXNH)
         return word;
@@ -143,12 +167,10 @@ int str2word(char *seq, int NH) {
 }
 
 char *word2str(int word, int NH) {
-    static char str[MAXNH+1];
+    static __thread char str[MAXNH+1];
     int i;
 
-    if (!lookup) {
-        init_lookup();
-    }
+    pthread_once(&lookup_once, init_lookup);
 
     for (i = 0; i < NH; i++)
         str[i] = "ACGT"[(word >> (2*(NH-1)-2*i)) & 3];
@@ -208,30 +230,57 @@ static void freeSurvEntry(SurvTable *st)
     }
 }
 
-static void freeSurvTable(opts_t *opts, SurvTable **sts)
+static Stratum *newStratum(const char *name)
 {
+    Stratum *s = smalloc(sizeof(Stratum));
+    s->name = name ? strdup(name) : NULL;
+    for (int read=0; read < N_READS; read++) {
+        s->read_length[read] = 0;
+        s->sts[read] = NULL;
+    }
+    return s;
+}
+
+static void freeStratum(void *ptr)
+{
+    Stratum *s = (Stratum *)ptr;
     int read, cycle;
     for(read=0;read<N_READS;read++)
     {
-        if( NULL == sts[read]) continue;
-        for(cycle=0;cycle<opts->read_length[read];cycle++)
+        if( NULL == s->sts[read]) continue;
+        for(cycle=0;cycle<s->read_length[read];cycle++)
         {
-            SurvTable *st = sts[read] + cycle;
+            SurvTable *st = s->sts[read] + cycle;
             freeSurvEntry(st);
         }
-        free(sts[read]);
+        free(s->sts[read]);
     }
-    free(sts);
+    free(s->name);
+    free(s);
 }
 
-static void completeSurvTable(opts_t *opts, SurvTable **sts)
+/*
+ * Make sure there is a survival table for each cycle of a read.
+ * Each SurvTable, with its arrays, is about 12KB.
+ */
+static void growStratum(Stratum *s, int read, int read_length)
+{
+    if (read_length <= s->read_length[read]) return;
+    s->sts[read] = realloc(s->sts[read], read_length * sizeof(SurvTable));
+    if (!s->sts[read]) die("Out of memory");
+    for (int cycle = s->read_length[read]; cycle < read_length; cycle++)
+        initialiseSurvTable(s->sts[read]+cycle, read, cycle);
+    s->read_length[read] = read_length;
+}
+
+static void completeSurvTable(Stratum *s)
 {
     float ssc = 1.0;
 
     for (int read=0; read < N_READS; read++) {
-        if (NULL == sts[read]) continue;
-        for (int cycle=0; cycle < opts->read_length[read]; cycle++) {
-            SurvTable *st = sts[read] + cycle;
+        if (NULL == s->sts[read]) continue;
+        for (int cycle=0; cycle < s->read_length[read]; cycle++) {
+            SurvTable *st = s->sts[read] + cycle;
             long quality_bases = 0;
             long quality_errors = 0;
 
@@ -252,25 +301,29 @@ static void completeSurvTable(opts_t *opts, SurvTable **sts)
     }
 }
 
-static void writeReport(opts_t *opts, SurvTable **sts)
+/*
+ * Write the report for a stratum to fname, or to stdout if fname is NULL
+ */
+static void writeReport(Stratum *s, char *fname)
 {
     FILE *fp = NULL;
+    SurvTable **sts = s->sts;
     SurvTable **read_sts;
     int read, cycle, i, j;
     char p;
 
     // open report file
-    if (opts->reportName) fp = fopen(opts->reportName, "w");
-    else                  fp = stdout;
+    if (fname) fp = fopen(fname, "w");
+    else       fp = stdout;
 
-    if (!fp) die("ERROR: can't open report file %s: %s\n", opts->reportName, strerror(errno));
+    if (!fp) die("ERROR: can't open report file %s: %s\n", fname, strerror(errno));
 
     /* generate read summary tables by summing over cycles */
 
     read_sts = (SurvTable **)smalloc(N_READS * sizeof(SurvTable *));
 
     for (read=0; read < N_READS; read++) {
-        int read_length = opts->read_length[read];
+        int read_length = s->read_length[read];
         read_sts[read] = NULL;
         if (0 == read_length) continue;
 
@@ -325,7 +378,7 @@ static void writeReport(opts_t *opts, SurvTable **sts)
     {
         if( NULL == sts[read]) continue;
         /* cycle by cycle */
-        for(cycle=0;cycle<opts->read_length[read];cycle++)
+        for(cycle=0;cycle<s->read_length[read];cycle++)
         {
             SurvTable *st = sts[read] + cycle;
             if( 0 == st->total_bases ) continue;
@@ -359,7 +412,7 @@ static void writeReport(opts_t *opts, SurvTable **sts)
     {
         if( NULL == sts[read]) continue;
         /* cycle by cycle */
-        for(cycle=0;cycle<opts->read_length[read];cycle++)
+        for(cycle=0;cycle<s->read_length[read];cycle++)
         {
             SurvTable *st = sts[read] + cycle;
             if( 0 == st->total_bases ) continue;
@@ -547,19 +600,19 @@ static void writeReport(opts_t *opts, SurvTable **sts)
         free(read_sts[read]);
     }
     free(read_sts);
-    if (opts->reportName) fclose(fp);
+    if (fname) fclose(fp);
 }
 
-static int updateSurvTable(opts_t *opts, SurvTable **sts,
-                           int read, int *read_mismatch,
+static int updateSurvTable(Stratum *s, int read, int read_length, int *read_mismatch,
                            char *read_seq, int *read_qual, char *read_ref) {
 
-    int read_length = opts->read_length[read];
     int b;
 
+    growStratum(s, read, read_length);
+
     /* update survival table */
     for (b = 0; b < read_length; b++) {
-        SurvTable *st = sts[read] + b;
+        SurvTable *st = s->sts[read] + b;
         float predictor = -1.0;
         int ibin;
 
@@ -612,29 +665,214 @@ static int updateSurvTable(opts_t *opts, SurvTable **sts,
 }
 
 /*
- * Takes the bam file as input and updates the survival table
- *
- * Assumption: within a single input file, all reads are the same length and
- * we're using unclipped data.
- *
- * Returns: +'ve integer for success
- *          0 for failure
+ * Decide whether to use a record, from a hash of the read name.
+ * Both reads of a pair have the same name, so are sampled together.
+ */
+static bool sampleRead(opts_t *opts, bam1_t *bam)
+{
+    if (opts->sample_fraction >= 1.0) return true;
+
+    // 64 bit FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = bam_get_qname(bam); *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 0x100000001b3ULL;
+    }
+    return h < opts->sample_threshold;
+}
+
+/*
+ * Find the overall error rate and the fraction of errors in each context
+ */
+static double contextShares(Stratum *s, double *shares)
+{
+    long bases = 0, errors = 0, cntxt_total = 0;
+    long count[NUM_CNTXT] = { 0 };
+
+    for (int read=0; read < N_READS; read++) {
+        if (NULL == s->sts[read]) continue;
+        for (int cycle=0; cycle < s->read_length[read]; cycle++) {
+            SurvTable *st = s->sts[read] + cycle;
+            for (int i=0; i < st->nbins; i++) {
+                bases += st->num_bases[i];
+                errors += st->num_errors[i];
+            }
+            for (int c=0; c < NUM_CNTXT; c++) count[c] += st->cntxtH[c] + st->cntxtL[c];
+        }
+    }
+
+    for (int c=0; c < NUM_CNTXT; c++) cntxt_total += count[c];
+    for (int c=0; c < NUM_CNTXT; c++) shares[c] = cntxt_total ? (double)count[c] / cntxt_total : 0;
+    return bases ? (double)errors / bases : 0;
+}
+
+/*
+ * Have the rates stopped changing since the last check?
+ * Compares the error rate (relative change) and the share of errors in
+ * each context (absolute change) with the previous values, then saves
+ * the current ones.
+ */
+static bool hasConverged(opts_t *opts, Stratum *s, double *error_rate, double *shares)
+{
+    double new_shares[NUM_CNTXT];
+    double new_rate = contextShares(s, new_shares);
+    bool converged = *error_rate > 0 && fabs(new_rate - *error_rate) / *error_rate < opts->converge;
+
+    for (int c=0; c < NUM_CNTXT; c++) {
+        if (fabs(new_shares[c] - shares[c]) >= opts->converge) converged = false;
+        shares[c] = new_shares[c];
+    }
+    *error_rate = new_rate;
+    return converged;
+}
+
+/*
+ * Find the stratum for a record, creating it the first time we see it.
+ * Records usually come in runs from the same tile, so check the last
+ * stratum used before looking in the index.
+ */
+static Stratum *findStratum(opts_t *opts, va_t *strata, HashTable *index, Stratum *last,
+                            bam1_t *bam, int lane, int tile, kstring_t *key)
+{
+    key->l = 0;
+    if (opts->by_read_group) {
+        uint8_t *rg = bam_aux_get(bam, "RG");
+        char *id = rg ? bam_aux2Z(rg) : NULL;
+        kputs(id ? id : "none", key);
+    }
+    if (opts->by_tile) ksprintf(key, "%s%d_%d", key->l ? "." : "", lane, tile);
+
+    if (last && strcmp(last->name, key->s) == 0) return last;
+
+    HashItem *hi = HashTableSearch(index, key->s, key->l);
+    if (hi) return strata->entries[hi->data.i];
+
+    HashData hd;
+    hd.i = strata->end;
+    if (!HashTableAdd(index, key->s, key->l, hd, NULL)) die("Out of memory");
+    Stratum *s = newStratum(key->s);
+    va_push(strata, s);
+    return s;
+}
+
+/*
+ * What we need to keep while reading records
+ */
+typedef struct {
+    opts_t *opts;
+    va_t *strata;               // the whole file, then each read group and/or tile
+    HashTable *index;           // stratum name -> index in strata
+    Stratum *last;              // the last stratum used
+    kstring_t key;
+    size_t nreads;
+    size_t nrecords;
+    double error_rate;
+    double shares[NUM_CNTXT];
+    bool converged;
+} LoadState;
+
+static LoadState *initLoadState(opts_t *opts)
+{
+    LoadState *ls = calloc(1, sizeof(LoadState));
+    if (!ls) die("Out of memory");
+    ls->opts = opts;
+    ls->strata = va_init(16, freeStratum);
+    va_push(ls->strata, newStratum(NULL));
+    if (opts->by_read_group || opts->by_tile) ls->index = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    return ls;
+}
+
+/*
+ * Should this record be counted?
  */
-SurvTable **LoadData(opts_t *opts) {
-    SurvTable **sts = NULL;
+static bool useRecord(LoadState *ls, bam1_t *bam)
+{
+    ls->nrecords++;
+
+    if (!sampleRead(ls->opts, bam)) return false;
+
+    if (BAM_FUNMAP & bam->core.flag) return false;
+    if (BAM_FQCFAIL & bam->core.flag) return false;
+    if (BAM_FSECONDARY & bam->core.flag) return false;
+    if (BAM_FSUPPLEMENTARY & bam->core.flag) return false;
+    if (BAM_FPAIRED & bam->core.flag) {
+        if (BAM_FMUNMAP & bam->core.flag) return false;
+        if (0 == (BAM_FPROPER_PAIR & bam->core.flag)) return false;
+    }
+    return true;
+}
+
+/*
+ * Add a record, with the arrays from parse_bam_alignments(), to the survival tables
+ */
+static void addRecord(LoadState *ls, bam1_t *bam, int bam_lane, int bam_tile, int bam_read,
+                      char *read_seq, int *read_qual, char *read_ref, int *read_mismatch)
+{
+    Stratum *all = ls->strata->entries[0];
+    int read_length = bam->core.l_qseq;
 
-    sts = smalloc(N_READS * sizeof(SurvTable *));
-    for(int read=0;read<N_READS;read++) sts[read] = NULL;
+    if (0 != updateSurvTable(all, bam_read, read_length, read_mismatch,
+                             read_seq, read_qual, read_ref)) {
+        fprintf(stderr,"ERROR: updating survival table for tile %i.\n", bam_tile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (ls->index) {
+        ls->last = findStratum(ls->opts, ls->strata, ls->index, ls->last, bam, bam_lane, bam_tile, &ls->key);
+        updateSurvTable(ls->last, bam_read, read_length, read_mismatch,
+                        read_seq, read_qual, read_ref);
+    }
 
-    size_t nreads = 0;
+    ls->nreads++;
 
-    static const int bam_read_buff_size = 1024;
-    char bam_read_seq[bam_read_buff_size];
-    int bam_read_qual[bam_read_buff_size];
-    char bam_read_ref[bam_read_buff_size];
-    int bam_read_mismatch[bam_read_buff_size];
+    if (ls->opts->converge && (ls->nreads % CONVERGE_INTERVAL) == 0) {
+        ls->converged = hasConverged(ls->opts, all, &ls->error_rate, ls->shares);
+    }
+}
 
-    BAMit_t *bam_in = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, NULL);
+/*
+ * Finish the survival tables and return them
+ */
+static va_t *finishLoadState(LoadState *ls)
+{
+    opts_t *opts = ls->opts;
+    va_t *strata = ls->strata;
+
+    if (opts->converge) {
+        if (ls->converged) display("Rates converged after %zu reads (%zu records read)\n", ls->nreads, ls->nrecords);
+        else               display("Rates did not converge: used all %zu reads\n", ls->nreads);
+    } else if (opts->verbose) {
+        display("Used %zu reads from %zu records\n", ls->nreads, ls->nrecords);
+    }
+    if (ls->index && opts->verbose) display("Found %d strata\n", strata->end - 1);
+
+    for (int n=0; n < strata->end; n++) completeSurvTable(strata->entries[n]);
+
+    free(ls->key.s);
+    HashTableDestroy(ls->index, 0);
+    free(ls);
+    return strata;
+}
+
+/*
+ * Takes the bam file as input and updates the survival tables
+ *
+ * Assumption: we're using unclipped data.
+ *
+ * Returns: an array of strata. The first is the whole file, followed by
+ *          one for each read group and/or tile if asked for
+ */
+va_t *LoadData(opts_t *opts) {
+    LoadState *ls = initLoadState(opts);
+
+    // big enough for the longest read so far, plus a terminating null
+    int bam_read_buff_size = 0;
+    char *bam_read_seq = NULL;
+    int *bam_read_qual = NULL;
+    char *bam_read_ref = NULL;
+    int *bam_read_mismatch = NULL;
+
+    BAMit_t *bam_in = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, NULL, BAMIT_ALIGNMENT_FIELDS);
     if (NULL == bam_in) {
         die("ERROR: can't open bam file %s: %s\n", opts->in_bam_file, strerror(errno));
     }
@@ -642,59 +880,39 @@ SurvTable **LoadData(opts_t *opts) {
     bam1_t *bam;
 
     /* loop over reads in the bam file */
-    while (1) {
-        int bam_read = -1, read_length;
+    while (!ls->converged) {
+        int bam_read = -1, bam_lane = -1, bam_tile = -1, read_length;
 
-        bam = parse_bam_readinfo(bam_in, NULL, NULL, NULL, NULL, &bam_read, NULL);
+        bam = parse_bam_readinfo(bam_in, &bam_lane, &bam_tile, NULL, NULL, &bam_read, NULL);
         if (!bam) break;    // exit loop at end of BAM file
 
-        if (BAM_FUNMAP & bam->core.flag) continue;
-        if (BAM_FQCFAIL & bam->core.flag) continue;
-        if (BAM_FSECONDARY & bam->core.flag) continue;
-        if (BAM_FSUPPLEMENTARY & bam->core.flag) continue;
-        if (BAM_FPAIRED & bam->core.flag) {
-            if (BAM_FMUNMAP & bam->core.flag) continue;
-            if (0 == (BAM_FPROPER_PAIR & bam->core.flag)) continue;
-        }
+        if (!useRecord(ls, bam)) continue;
 
         read_length = bam->core.l_qseq;
-        if (0 == opts->read_length[bam_read]) {
-            opts->read_length[bam_read] = read_length;
-        }
-
-        if (opts->read_length[bam_read] != read_length) {
-            fprintf(stderr,
-                    "Error: inconsistent read lengths "
-                    "within bam file for read %d.\n"
-                    "have length %ld, previously it was %d.\n",
-                    bam_read, (long) read_length, opts->read_length[bam_read]);
-            exit(EXIT_FAILURE);
+        if (read_length >= bam_read_buff_size) {
+            bam_read_buff_size = read_length + 1;
+            bam_read_seq = realloc(bam_read_seq, bam_read_buff_size);
+            bam_read_qual = realloc(bam_read_qual, bam_read_buff_size * sizeof(int));
+            bam_read_ref = realloc(bam_read_ref, bam_read_buff_size);
+            bam_read_mismatch = realloc(bam_read_mismatch, bam_read_buff_size * sizeof(int));
+            if (!bam_read_seq || !bam_read_qual || !bam_read_ref || !bam_read_mismatch) die("Out of memory");
         }
 
         parse_bam_alignments(bam_in, bam, bam_read_seq, bam_read_qual, bam_read_ref,
                                      bam_read_mismatch, bam_read_buff_size, NULL);
 
-        if (NULL == sts[bam_read]) {
-            sts[bam_read] = (SurvTable *)smalloc(read_length * sizeof(SurvTable));
-            for(int cycle=0;cycle<read_length;cycle++)
-                initialiseSurvTable(sts[bam_read]+cycle, bam_read, cycle);
-        }
-        
-        if (0 != updateSurvTable(opts, sts,
-                                 bam_read, bam_read_mismatch,
-                                 bam_read_seq, bam_read_qual, bam_read_ref)) {
-            fprintf(stderr,"ERROR: updating survival table for tile %i.\n", 0);
-            exit(EXIT_FAILURE);
-        }
-        
-        nreads++;
+        addRecord(ls, bam, bam_lane, bam_tile, bam_read,
+                  bam_read_seq, bam_read_qual, bam_read_ref, bam_read_mismatch);
     }
-    
-    completeSurvTable(opts, sts);
 
-    bam_destroy1(bam);
+    free(bam_read_seq);
+    free(bam_read_qual);
+    free(bam_read_ref);
+    free(bam_read_mismatch);
+
+    // the last record belongs to the iterator
     BAMit_free(bam_in);
-    return sts;
+    return finishLoadState(ls);
 }
 
 static void usage(FILE *usagefp)
@@ -707,6 +925,20 @@ static void usage(FILE *usagefp)
     fprintf(usagefp, " -v --verbose     display progress messages to stderr\n");
     fprintf(usagefp, " -o               output filename for report [default: stdout]\n");
     fprintf(usagefp, "    --input-fmt   BAM input format [sam|bam|cram] [default: bam]\n");
+    fprintf(usagefp, "    --sample-fraction\n");
+    fprintf(usagefp, "                  Use only this fraction of the templates, chosen by a hash of\n");
+    fprintf(usagefp, "                  the read name so the result is repeatable [default: 1.0]\n");
+    fprintf(usagefp, "    --converge    Stop reading once the error rate and the share of errors in each\n");
+    fprintf(usagefp, "                  context change by less than this between checks, which are made\n");
+    fprintf(usagefp, "                  every %d reads [default: read everything]\n", CONVERGE_INTERVAL);
+    fprintf(usagefp, "    --by-read-group\n");
+    fprintf(usagefp, "                  Also write a report for each read group, to <output>.<RG ID>\n");
+    fprintf(usagefp, "    --by-tile     Also write a report for each tile, to <output>.<lane>_<tile>\n");
+    fprintf(usagefp, "                  With --by-read-group, the reports are <output>.<RG ID>.<lane>_<tile>\n");
+    fprintf(usagefp, "                  Both need -o, and the report for the whole file is still written there.\n");
+    fprintf(usagefp, "                  Neither can be used with --converge. Each report needs about 12KB of\n");
+    fprintf(usagefp, "                  memory for every cycle, so a report for each tile of a flowcell can\n");
+    fprintf(usagefp, "                  need several GB: 2500 tiles of 300 cycles is about 9GB\n");
 }
 
 /*
@@ -725,15 +957,26 @@ opts_t* substitution_analysis_parse_args(int argc, char *argv[])
         {"output-fmt", 1, 0, 0},
         {"input-fmt", 1, 0, 0},
         {"compression-level", 1, 0, 0},
+        {"sample-fraction", 1, 0, 0},
+        {"converge", 1, 0, 0},
+        {"by-read-group", 0, 0, 0},
+        {"by-tile", 0, 0, 0},
         {0, 0, 0, 0}
     };
 
     opts_t *opts = smalloc(sizeof(opts_t));
 
-    for(int n=0; n<N_READS; n++) opts->read_length[n] = 0;
     opts->in_bam_file = NULL;
     opts->reportName = NULL;
     opts->input_fmt = NULL;
+    opts->output_fmt = NULL;
+    opts->quiet = 0;
+    opts->verbose = 0;
+    opts->compression_level = 0;
+    opts->sample_fraction = 1.0;
+    opts->converge = 0;
+    opts->by_read_group = false;
+    opts->by_tile = false;
 
     int opt;
     int option_index = 0;
@@ -747,6 +990,10 @@ opts_t* substitution_analysis_parse_args(int argc, char *argv[])
                           if (strcmp(arg, "output-fmt") == 0)              opts->output_fmt = strdup(optarg);
                      else if (strcmp(arg, "input-fmt") == 0)               opts->input_fmt = strdup(optarg);
                      else if (strcmp(arg, "compression-level") == 0)       opts->compression_level = *optarg;
+                     else if (strcmp(arg, "sample-fraction") == 0)         opts->sample_fraction = atof(optarg);
+                     else if (strcmp(arg, "converge") == 0)                opts->converge = atof(optarg);
+                     else if (strcmp(arg, "by-read-group") == 0)           opts->by_read_group = true;
+                     else if (strcmp(arg, "by-tile") == 0)                 opts->by_tile = true;
                      else {
                          fprintf(stderr,"\nUnknown option: %s\n\n", arg);
                          usage(stderr); free_opts(opts);
@@ -762,20 +1009,99 @@ opts_t* substitution_analysis_parse_args(int argc, char *argv[])
 
     if (optind < argc) opts->in_bam_file = strdup(argv[optind]);
 
+    if (opts->sample_fraction <= 0 || opts->sample_fraction > 1) {
+        fprintf(stderr, "--sample-fraction must be greater than 0 and no more than 1\n");
+        free_opts(opts); return NULL;
+    }
+    if (opts->converge < 0) {
+        fprintf(stderr, "--converge must not be negative\n");
+        free_opts(opts); return NULL;
+    }
+    if ((opts->by_read_group || opts->by_tile) && !opts->reportName) {
+        fprintf(stderr, "--by-read-group and --by-tile need an output file name (-o)\n");
+        free_opts(opts); return NULL;
+    }
+    // convergence is checked for the whole file, so stopping would leave out later read groups and tiles
+    if ((opts->by_read_group || opts->by_tile) && opts->converge) {
+        fprintf(stderr, "--converge can't be used with --by-read-group or --by-tile\n");
+        free_opts(opts); return NULL;
+    }
+    // a fraction of 1 (the default) uses every template, and 2^64 won't fit the threshold
+    if (opts->sample_fraction < 1.0) opts->sample_threshold = (uint64_t)ldexp(opts->sample_fraction, 64);
+
     return opts;
 }
 
-static int substitution_analysis(opts_t *opts)
+/*
+ * The report name for a stratum: the output name, a dot, then the stratum
+ * name with anything which would be awkward in a file name replaced
+ */
+static char *stratumReportName(opts_t *opts, Stratum *s)
+{
+    char *fname = smalloc(strlen(opts->reportName) + strlen(s->name) + 2);
+    char *p = fname + sprintf(fname, "%s.", opts->reportName);
+    for (char *n = s->name; *n; n++) *p++ = (*n == '/' || isspace((unsigned char)*n)) ? '_' : *n;
+    *p = 0;
+    return fname;
+}
+
+static void writeReports(opts_t *opts, va_t *strata)
 {
-    SurvTable **sts = NULL;
+    writeReport(strata->entries[0], opts->reportName);
+    for (int n=1; n < strata->end; n++) {
+        char *fname = stratumReportName(opts, strata->entries[n]);
+        writeReport(strata->entries[n], fname);
+        free(fname);
+    }
+}
 
-    sts = LoadData(opts);
-    writeReport(opts, sts);
-    freeSurvTable(opts, sts);
+static int substitution_analysis(opts_t *opts)
+{
+    va_t *strata = LoadData(opts);
+    writeReports(opts, strata);
+    va_free(strata);
 
     return EXIT_SUCCESS;
 }
 
+/*
+ * Substitution analysis as part of 'bambi qc'
+ */
+static void *qc_sa_init(int argc, char **argv)
+{
+    opts_t *opts = substitution_analysis_parse_args(argc, argv);
+    return opts ? initLoadState(opts) : NULL;
+}
+
+static int qc_sa_records(void *state, qc_batch_t *batch)
+{
+    LoadState *ls = (LoadState *)state;
+
+    for (int n=0; n < batch->nrecs && !ls->converged; n++) {
+        qc_record_t *r = &batch->recs[n];
+        if (!useRecord(ls, r->rec)) continue;
+        if (!r->aligned) die("ERROR: no alignment for read: \"%s\"\n", bam_get_qname(r->rec));
+        addRecord(ls, r->rec, r->lane, r->tile, r->read, r->seq, r->qual, r->ref, r->mismatch);
+    }
+    return 0;
+}
+
+static int qc_sa_finish(void *state)
+{
+    LoadState *ls = (LoadState *)state;
+    opts_t *opts = ls->opts;
+    va_t *strata = finishLoadState(ls);
+    writeReports(opts, strata);
+    va_free(strata);
+    free_opts(opts);
+    return 0;
+}
+
+const qc_analyser_t qc_substitution_analysis = {
+    "substitution_analysis", QC_NEED_INFO | QC_NEED_ALIGNMENT,
+    qc_sa_init, qc_sa_records, qc_sa_finish
+};
+
 /*
  * Called from bambi to create a substitution analysis table
  *
@@ -787,6 +1113,7 @@ int main_substitution_analysis(int argc, char *argv[])
 {
     int ret = 1;
     opts_t *opts = substitution_analysis_parse_args(argc, argv);
+    batch_args_parsed();
     if (opts) ret = substitution_analysis(opts);
     if (opts) free_opts(opts);
     return ret;
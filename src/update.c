@@ -33,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "bamit.h"
 #include "hash_table.h"
+#include "batch_shared.h"
 
 /*
  * structure to hold options
@@ -292,11 +293,11 @@ static int update(opts_t* opts)
     HashTable *RGhash;
 
     // Open input BAM file
-    bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, NULL);
+    bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, NULL, 0);
     if (!bam_in) return 1;
 
     // Open output BAM file
-    bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, 0, NULL);
+    bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, 0, NULL, 0);
     if (!bam_out) return 1;
 
     // copy input to output header
@@ -337,6 +338,8 @@ int main_update(int argc, char *argv[])
     int ret = 1;
 
     opts_t* opts = parse_args(argc, argv);
+
+    batch_args_parsed();
     if (opts) {
         ret = update(opts);
     }
@@ -0,0 +1,246 @@
+/*  whitelist.c -- compact barcode whitelists
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <htslib/hfile.h>
+
+#include "bambi.h"
+#include "whitelist.h"
+
+#define WHITELIST_INDEX_BITS 16     // index on the first eight bases
+
+static const char bases[] = "ACGT";
+
+/*
+ * 2 bit code for a base, or -1 if it isn't one of ACGT
+ */
+static inline int baseCode(char c)
+{
+    switch (c) {
+        case 'A': case 'a': return 0;
+        case 'C': case 'c': return 1;
+        case 'G': case 'g': return 2;
+        case 'T': case 't': return 3;
+    }
+    return -1;
+}
+
+static int compareCodes(const void *a, const void *b)
+{
+    uint64_t c1 = *(const uint64_t *)a, c2 = *(const uint64_t *)b;
+    return c1 < c2 ? -1 : c1 > c2 ? 1 : 0;
+}
+
+/*
+ * Copy seq into buf without separators, returning the length
+ */
+static int stripSeparators(const char *seq, char *buf, int bufsize)
+{
+    int len = 0;
+    for (; *seq && len < bufsize - 1; seq++) {
+        if (!strchr(INDEX_SEPARATOR, *seq)) buf[len++] = *seq;
+    }
+    buf[len] = 0;
+    return len;
+}
+
+static void makeIndex(whitelist_t *wl)
+{
+    int bits = 2 * wl->len < WHITELIST_INDEX_BITS ? 2 * wl->len : WHITELIST_INDEX_BITS;
+    size_t nbuckets = (size_t)1 << bits;
+
+    wl->shift = 2 * wl->len - bits;
+    wl->index = smalloc((nbuckets + 1) * sizeof(uint32_t));
+    int n = 0;
+    for (size_t b = 0; b < nbuckets; b++) {
+        while (n < wl->nbarcodes && (wl->codes[n] >> wl->shift) < b) n++;
+        wl->index[b] = n;
+    }
+    wl->index[nbuckets] = wl->nbarcodes;
+}
+
+whitelist_t *whitelist_load(const char *fname)
+{
+    char buf[8192];
+    char seq[WHITELIST_MAX_LEN + 2];
+    int lineno = 0;
+    size_t max = 0;
+
+    hFILE *fh = hopen(fname, "r");
+    if (!fh) {
+        fprintf(stderr, "ERROR: Can't open whitelist file %s\n", fname);
+        return NULL;
+    }
+
+    whitelist_t *wl = calloc(1, sizeof(whitelist_t));
+    if (!wl) die("Out of memory");
+
+    while (hgets(buf, sizeof(buf), fh) > 0) {
+        lineno++;
+        buf[strcspn(buf, "\t \r\n")] = 0;      // first field only
+        if (!*buf || *buf == '#') continue;
+
+        int len = stripSeparators(buf, seq, sizeof(seq));
+        if (len > WHITELIST_MAX_LEN) {
+            fprintf(stderr, "ERROR: whitelist barcodes can't be longer than %d bases: line %d\n", WHITELIST_MAX_LEN, lineno);
+            goto fail;
+        }
+        if (!wl->len) wl->len = len;
+        if (len != wl->len) {
+            fprintf(stderr, "ERROR: Barcode '%s' is a different length to the previous barcode: line %d\n", buf, lineno);
+            goto fail;
+        }
+
+        uint64_t code = 0;
+        for (int n = 0; n < len; n++) {
+            int b = baseCode(seq[n]);
+            if (b < 0) {
+                fprintf(stderr, "ERROR: Barcode '%s' isn't all ACGT: line %d\n", buf, lineno);
+                goto fail;
+            }
+            code = code << 2 | b;
+        }
+
+        if (wl->nbarcodes == max) {
+            max = max ? max * 2 : 65536;
+            wl->codes = realloc(wl->codes, max * sizeof(uint64_t));
+            if (!wl->codes) die("Out of memory");
+        }
+        wl->codes[wl->nbarcodes++] = code;
+    }
+
+    if (hclose(fh)) die("Can't close whitelist file");
+    fh = NULL;
+
+    if (!wl->nbarcodes) {
+        fprintf(stderr, "ERROR: No barcodes in whitelist file %s\n", fname);
+        goto fail;
+    }
+
+    // sort, and drop any duplicates
+    qsort(wl->codes, wl->nbarcodes, sizeof(uint64_t), compareCodes);
+    int n = 1;
+    for (int i = 1; i < wl->nbarcodes; i++) {
+        if (wl->codes[i] != wl->codes[n-1]) wl->codes[n++] = wl->codes[i];
+    }
+    wl->nbarcodes = n;
+
+    makeIndex(wl);
+    return wl;
+
+ fail:
+    if (fh) hclose_abruptly(fh);
+    whitelist_free(wl);
+    return NULL;
+}
+
+void whitelist_free(whitelist_t *wl)
+{
+    if (!wl) return;
+    free(wl->codes);
+    free(wl->index);
+    free(wl);
+}
+
+int whitelist_find(const whitelist_t *wl, uint64_t code)
+{
+    uint64_t b = code >> wl->shift;
+    int lo = wl->index[b], hi = wl->index[b+1];
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (wl->codes[mid] < code) lo = mid + 1;
+        else                       hi = mid;
+    }
+    return (lo < wl->nbarcodes && wl->codes[lo] == code) ? lo : -1;
+}
+
+void whitelist_seq(const whitelist_t *wl, int n, char *seq)
+{
+    uint64_t code = wl->codes[n];
+    for (int i = wl->len - 1; i >= 0; i--) {
+        seq[i] = bases[code & 3];
+        code >>= 2;
+    }
+    seq[wl->len] = 0;
+}
+
+int whitelist_match(const whitelist_t *wl, const char *seq, int max_mismatches, int max_no_calls, int *nmismatches)
+{
+    char buf[WHITELIST_MAX_LEN + 2];
+    int nocall[WHITELIST_MAX_LEN];
+    int nnocalls = 0;
+    uint64_t code = 0;
+    int found = -1;
+
+    if (max_no_calls > WHITELIST_MAX_NO_CALLS) max_no_calls = WHITELIST_MAX_NO_CALLS;
+    *nmismatches = 0;
+    if (stripSeparators(seq, buf, sizeof(buf)) < wl->len) return -1;
+
+    for (int n = 0; n < wl->len; n++) {
+        int b = baseCode(buf[n]);
+        if (b < 0) {
+            if (nnocalls == max_no_calls) return -1;
+            nocall[nnocalls++] = n;
+            b = 0;
+        }
+        code = code << 2 | b;
+    }
+
+    // every base at the no-calls, then any one other base changed
+    int ncombinations = 1 << (2 * nnocalls);
+    for (int pass = 0; pass <= max_mismatches && pass < 2; pass++) {
+        int nfound = 0;
+        for (int comb = 0; comb < ncombinations; comb++) {
+            uint64_t c = code;
+            for (int i = 0; i < nnocalls; i++) {
+                int shift = 2 * (wl->len - 1 - nocall[i]);
+                c = (c & ~((uint64_t)3 << shift)) | ((uint64_t)((comb >> (2*i)) & 3) << shift);
+            }
+
+            if (pass == 0) {
+                int n = whitelist_find(wl, c);
+                if (n >= 0) { found = n; nfound++; }
+                continue;
+            }
+
+            for (int pos = 0, i = 0; pos < wl->len; pos++) {
+                if (i < nnocalls && nocall[i] == pos) { i++; continue; }
+                int shift = 2 * (wl->len - 1 - pos);
+                uint64_t base = (c >> shift) & 3;
+                for (uint64_t b = 0; b < 4; b++) {
+                    if (b == base) continue;
+                    int n = whitelist_find(wl, (c & ~((uint64_t)3 << shift)) | (b << shift));
+                    if (n >= 0) { found = n; nfound++; }
+                }
+                // a tie is no match
+                if (nfound > 1) return -1;
+            }
+        }
+        if (nfound == 1) {
+            *nmismatches = pass;
+            return found;
+        }
+        if (nfound > 1) return -1;
+    }
+    return -1;
+}
@@ -0,0 +1,64 @@
+/*  whitelist.h -- compact barcode whitelists
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __WHITELIST_H__
+#define __WHITELIST_H__
+
+#include <stdint.h>
+
+/*
+ * A whitelist of up to millions of barcodes, all the same length (at most
+ * 32 bases). Each barcode is packed into two bits a base, and the packed
+ * barcodes are kept sorted, with an index on their first few bases.
+ * A barcode is known by its position in the sorted list.
+ */
+
+#define WHITELIST_MAX_LEN 32
+#define WHITELIST_MAX_NO_CALLS 3        // each no-call is tried as all four bases
+
+typedef struct {
+    int len;                    // barcode length in bases
+    int nbarcodes;
+    uint64_t *codes;            // packed barcodes, sorted
+    int shift;                  // code >> shift is the index bucket
+    uint32_t *index;            // first barcode in each bucket (with one more at the end)
+} whitelist_t;
+
+// Read a whitelist file: one barcode a line, the first field on each line,
+// ignoring blank lines and lines starting with '#'. Returns NULL on error.
+whitelist_t *whitelist_load(const char *fname);
+void whitelist_free(whitelist_t *wl);
+
+// Position of a packed barcode in the whitelist, or -1 if it isn't there
+int whitelist_find(const whitelist_t *wl, uint64_t code);
+
+// Write the sequence of barcode n to seq, which must have room for wl->len + 1 chars
+void whitelist_seq(const whitelist_t *wl, int n, char *seq);
+
+// Find the barcode which seq matches with the fewest mismatches, ignoring any
+// separators in seq and anything after the barcode length. Anything other
+// than ACGT in seq is a no-call, which matches any base; there can be no
+// more than max_no_calls of them (at most WHITELIST_MAX_NO_CALLS).
+// A match must be unique, with no more than max_mismatches (0 or 1).
+// Returns the barcode position, or -1 if there isn't a match, and sets
+// *nmismatches.
+int whitelist_match(const whitelist_t *wl, const char *seq, int max_mismatches, int max_no_calls, int *nmismatches);
+
+#endif
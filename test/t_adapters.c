@@ -140,8 +140,8 @@ void compareTags(bam1_t *gotrec, bam1_t *exprec, char *tag, char tagtype)
 
 void checkFiles(char *gotfile, char *expectfile, int verbose)
 {
-    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL);
-    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL);
+    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL, 0);
+    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL, 0);
 
     bam1_t *got_rec, *exp_rec;
 
@@ -102,15 +102,57 @@ int main(int argc, char**argv)
     icheckEqual("End of records", false, BAMit_hasnext(bit));
     BAMit_free(bit);
 
-    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL);
+    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL, 0);
     rec = BAMit_next(bit);
     checkEqual("First name", "IL16_986:1:9:9:307", bam_get_qname(rec));
     BAMit_free(bit);
 
-    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit_empty.bam"), 'r', NULL, 0, NULL);
+    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL, SAM_QNAME | SAM_FLAG);
+    rec = BAMit_next(bit);
+    checkEqual("Required fields name", "IL16_986:1:9:9:307", bam_get_qname(rec));
+    n=1;
+    while (BAMit_hasnext(bit)) { n++; BAMit_next(bit); }
+    icheckEqual("Required fields records", 6, n);
+    BAMit_free(bit);
+
+    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit_empty.bam"), 'r', NULL, 0, NULL, 0);
     icheckEqual("Empty bam file", false, BAMit_hasnext(bit));
     BAMit_free(bit);
 
+    // aux tag index
+    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL, 0);
+    rec = bam_dup1(BAMit_next(bit));
+    BAMit_free(bit);
+    uint16_t array[3] = { 1, 2, 3 };
+    float pi = 3.14;
+    bam_aux_update_array(rec, "XB", 'S', 3, array);
+    bam_aux_append(rec, "XZ", 'Z', 4, (uint8_t *)"abc");
+    bam_aux_append(rec, "XF", 'f', 4, (uint8_t *)&pi);
+
+    BAMit_aux_t aux = BAMIT_AUX_INIT;
+    int xz = BAMit_aux_add(&aux, "XZ");
+    int xf = BAMit_aux_add(&aux, "XF");
+    int xb = BAMit_aux_add(&aux, "XB");
+    int xx = BAMit_aux_add(&aux, "XX");
+    icheckEqual("aux add same tag", xz, BAMit_aux_add(&aux, "XZ"));
+    icheckEqual("aux index", 0, BAMit_aux_index(&aux, rec));
+    icheckEqual("aux XZ", 1, BAMit_aux_get(&aux, rec, xz) == bam_aux_get(rec, "XZ"));
+    icheckEqual("aux XF", 1, BAMit_aux_get(&aux, rec, xf) == bam_aux_get(rec, "XF"));
+    icheckEqual("aux XB", 1, BAMit_aux_get(&aux, rec, xb) == bam_aux_get(rec, "XB"));
+    icheckEqual("aux XX", 1, BAMit_aux_get(&aux, rec, xx) == NULL);
+
+    BAMit_aux_update(&aux, rec, xz, 'Z', 11, (uint8_t *)"abcdefghij");
+    BAMit_aux_update(&aux, rec, xx, 'Z', 4, (uint8_t *)"xyz");
+    checkEqual("aux updated XZ", "abcdefghij", bam_aux2Z(bam_aux_get(rec, "XZ")));
+    checkEqual("aux new XX", "xyz", bam_aux2Z(BAMit_aux_get(&aux, rec, xx)));
+    icheckEqual("aux moved XF", 1, BAMit_aux_get(&aux, rec, xf) == bam_aux_get(rec, "XF"));
+    icheckEqual("aux XF value", 1, bam_aux2f(BAMit_aux_get(&aux, rec, xf)) == pi);
+    BAMit_aux_update(&aux, rec, xz, 'Z', 2, (uint8_t *)"a");
+    checkEqual("aux shortened XZ", "a", bam_aux2Z(BAMit_aux_get(&aux, rec, xz)));
+    icheckEqual("aux XF after shortening", 1, bam_aux2f(BAMit_aux_get(&aux, rec, xf)) == pi);
+    icheckEqual("aux XB after shortening", 3, bam_auxB_len(BAMit_aux_get(&aux, rec, xb)));
+    bam_destroy1(rec);
+
 
     printf("BAMit tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -0,0 +1,124 @@
+/*  test/t_batch.c -- batch unit tests
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#define xMKNAME(d,f) #d f
+#define MKNAME(d,f) xMKNAME(d,f)
+
+const char * bambi_version(void)
+{
+    return "12.34";
+}
+
+int success = 0;
+int failure = 0;
+
+void checkFiles(char *gotfile, char *expectfile, int verbose)
+{
+    char cmd[1024];
+
+    if (verbose) fprintf(stderr,"\nComparing files: %s with %s\n", gotfile, expectfile);
+    sprintf(cmd,"diff -I ID:bambi %s %s", gotfile, expectfile);
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+}
+
+int main(int argc, char**argv)
+{
+    int verbose = 0;
+
+    int getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v': ++verbose;
+                      break;
+            default: printf("usage: t_batch [-v]\n\n"
+                            " -v verbose output\n"
+                           );
+                     break;
+        }
+    }
+
+    // Cleanup getopt
+    optind = 1;
+
+    // create temp directory
+    char template[] = "/tmp/bambi.XXXXXX";
+    char *TMPDIR = mkdtemp(template);
+    if (TMPDIR == NULL) {
+        fprintf(stderr,"Can't create temp directory\n");
+        exit(1);
+    } else {
+        if (verbose) fprintf(stderr,"Created temporary directory: %s\n", TMPDIR);
+    }
+
+    char manifest[512];
+    char gotfile[512];
+    char cmd[2048];
+    FILE *f;
+
+    // two decodes sharing a barcode file, and two seqchksums
+    if (verbose) fprintf(stderr,"testing batch of decode and seqchksum\n");
+    snprintf(manifest, sizeof(manifest), "%s/manifest", TMPDIR);
+    f = fopen(manifest, "w");
+    if (!f) { fprintf(stderr,"Can't create %s\n", manifest); exit(1); }
+    fprintf(f, "# decode the same file twice\n");
+    for (int n = 0; n < 2; n++) {
+        fprintf(f, "decode -i %s -o %s/decode_%d.sam --output-fmt sam --input-fmt sam "
+                   "--barcode-file %s --metrics-file %s/decode_%d.metrics --barcode-tag-name RT%s\n",
+                MKNAME(DATA_DIR,"/decode_1.sam"), TMPDIR, n,
+                MKNAME(DATA_DIR,"/decode_1.tag"), TMPDIR, n,
+                n ? " -t 2" : "");
+    }
+    fprintf(f, "\n");
+    fprintf(f, "seqchksum -o %s/seqchksum.chksum %s\n", TMPDIR, MKNAME(DATA_DIR,"/seqchksum.bam"));
+    fprintf(f, "seqchksum --hash crc32 -o '%s/seqchksum.crc32' %s\n", TMPDIR, MKNAME(DATA_DIR,"/seqchksum.bam"));
+    fclose(f);
+
+    snprintf(cmd, sizeof(cmd), "src/bambi batch -t 2 -j 3 %s", manifest);
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+
+    for (int n = 0; n < 2; n++) {
+        snprintf(gotfile, sizeof(gotfile), "%s/decode_%d.sam", TMPDIR, n);
+        checkFiles(gotfile, MKNAME(DATA_DIR,"/out/6383_9_nosplit_nochange.sam"), verbose);
+        snprintf(gotfile, sizeof(gotfile), "%s/decode_%d.metrics", TMPDIR, n);
+        checkFiles(gotfile, MKNAME(DATA_DIR,"/out/decode_1.metrics"), verbose);
+    }
+    snprintf(gotfile, sizeof(gotfile), "%s/seqchksum.chksum", TMPDIR);
+    checkFiles(gotfile, MKNAME(DATA_DIR,"/out/seqchksum.chksum"), verbose);
+    snprintf(gotfile, sizeof(gotfile), "%s/seqchksum.crc32", TMPDIR);
+    checkFiles(gotfile, MKNAME(DATA_DIR,"/out/seqchksum.chksum.crc32"), verbose);
+
+    // an unknown command should fail without running anything
+    if (verbose) fprintf(stderr,"testing unknown command\n");
+    f = fopen(manifest, "w");
+    if (!f) { fprintf(stderr,"Can't create %s\n", manifest); exit(1); }
+    fprintf(f, "nosuchcommand -x\n");
+    fclose(f);
+    snprintf(cmd, sizeof(cmd), "src/bambi batch %s 2>/dev/null", manifest);
+    if (system(cmd) == 0) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+
+    printf("batch tests: %s\n", failure ? "FAILED" : "Passed");
+    return failure ? EXIT_FAILURE : EXIT_SUCCESS;
+}
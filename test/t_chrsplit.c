@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <htslib/sam.h>
 
 #include "bambi.h"
@@ -243,6 +244,130 @@ static void testyhuman(char *TMPDIR)
     va_free(expected_exclude);
 }
 
+static int cmp_coord(const void *a, const void *b)
+{
+    const bam1_t *r1 = *(const bam1_t **)a;
+    const bam1_t *r2 = *(const bam1_t **)b;
+    uint32_t t1 = r1->core.tid, t2 = r2->core.tid;    // unplaced reads last
+    if (t1 != t2) return t1 < t2 ? -1 : 1;
+    if (r1->core.pos != r2->core.pos) return r1->core.pos < r2->core.pos ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Make a coordinate sorted and indexed BAM file from a SAM file
+ */
+static void makeIndexedBam(char *in, char *out)
+{
+    samFile *f = hts_open(in, "r");
+    bam_hdr_t *h = sam_hdr_read(f);
+    bam1_t **recs = NULL;
+    int nrecs = 0, max = 0;
+
+    for (;;) {
+        if (nrecs == max) {
+            max = max ? max * 2 : 64;
+            recs = realloc(recs, max * sizeof(bam1_t *));
+            if (!recs) { fprintf(stderr, "Out of memory\n"); exit(1); }
+        }
+        recs[nrecs] = bam_init1();
+        if (sam_read1(f, h, recs[nrecs]) < 0) { bam_destroy1(recs[nrecs]); break; }
+        nrecs++;
+    }
+    hts_close(f);
+    qsort(recs, nrecs, sizeof(bam1_t *), cmp_coord);
+
+    sam_hdr_update_hd(h, "SO", "coordinate");
+    f = hts_open(out, "wb");
+    if (!f || sam_hdr_write(f, h)) { fprintf(stderr, "Can't write %s\n", out); exit(1); }
+    for (int n = 0; n < nrecs; n++) {
+        if (sam_write1(f, h, recs[n]) < 0) { fprintf(stderr, "Can't write %s\n", out); exit(1); }
+        bam_destroy1(recs[n]);
+    }
+    free(recs);
+    hts_close(f);
+    bam_hdr_destroy(h);
+    if (sam_index_build(out, 0) < 0) { fprintf(stderr, "Can't index %s\n", out); exit(1); }
+}
+
+/*
+ * --use-index should select the same pairs as reading the whole file, including
+ * MT_secondary, which has a secondary alignment on chromosome 20 that isn't
+ * named by the mate fields or SA tag of the reads on MT.
+ */
+static void testindexed(char *TMPDIR, bool exclude_unaligned, bool exclude_file)
+{
+    int argc;
+    char** argv;
+    char input[512];
+    char target[512];
+    char exclude[512];
+    va_t *expected_target = va_init(10,NULL);
+    va_t *expected_exclude = va_init(10,NULL);
+
+    va_push(expected_target,"MT_MT");
+    va_push(expected_target,"y_and_y");
+    va_push(exclude_unaligned ? expected_exclude : expected_target,"pair_unmapped");
+    va_push(exclude_unaligned ? expected_exclude : expected_target,"first_unmapped");
+    va_push(exclude_unaligned ? expected_exclude : expected_target,"second_unmapped");
+    va_push(expected_exclude,"first_chimeric");
+    va_push(expected_exclude,"twenty_twenty");
+    va_push(expected_exclude,"unmapped_other");
+    va_push(expected_exclude,"other_unmapped");
+    va_push(expected_exclude,"second_chimeric");
+    va_push(expected_exclude,"MT_secondary");
+
+    sprintf(input,"%s/chrsplit_sorted.bam", TMPDIR);
+    sprintf(target,"%s/chrsplit_target_idx.bam", TMPDIR);
+    sprintf(exclude,"%s/chrsplit_exclude_idx.bam", TMPDIR);
+    makeIndexedBam(MKNAME(DATA_DIR,"/10503_1_secondary.sam"), input);
+
+    argc = 0;
+    argv = (char**)calloc(sizeof(char*), 100);
+    argv[argc++] = strdup("bambi");
+    argv[argc++] = strdup("chrsplit");
+    argv[argc++] = strdup("-i");
+    argv[argc++] = strdup(input);
+    argv[argc++] = strdup("-o");
+    argv[argc++] = strdup(target);
+    argv[argc++] = strdup("--use-index");
+    if (exclude_file) {
+        argv[argc++] = strdup("-e");
+        argv[argc++] = strdup(exclude);
+    }
+    if (exclude_unaligned) argv[argc++] = strdup("-u");
+
+    if (main_chrsplit(argc-1, argv+1)) { fprintf(stderr, "chrsplit --use-index failed\n"); failure++; }
+    checkReadNames(expected_target, target);
+    if (exclude_file) checkReadNames(expected_exclude, exclude);
+    free_args(argv);
+
+    // and the same when reading the (name grouped) file without --use-index
+    if (exclude_file) {
+        argc = 0;
+        argv = (char**)calloc(sizeof(char*), 100);
+        argv[argc++] = strdup("bambi");
+        argv[argc++] = strdup("chrsplit");
+        argv[argc++] = strdup("-i");
+        argv[argc++] = strdup(MKNAME(DATA_DIR,"/10503_1_secondary.sam"));
+        argv[argc++] = strdup("--input-fmt");
+        argv[argc++] = strdup("sam");
+        argv[argc++] = strdup("-o");
+        argv[argc++] = strdup(target);
+        argv[argc++] = strdup("-e");
+        argv[argc++] = strdup(exclude);
+        if (exclude_unaligned) argv[argc++] = strdup("-u");
+
+        if (main_chrsplit(argc-1, argv+1)) { fprintf(stderr, "chrsplit failed\n"); failure++; }
+        checkReadNames(expected_target, target);
+        checkReadNames(expected_exclude, exclude);
+        free_args(argv);
+    }
+
+    va_free(expected_target);
+    va_free(expected_exclude);
+}
+
 int main(int argc, char**argv)
 {
     int verbose = 0;
@@ -275,6 +400,9 @@ int main(int argc, char**argv)
     testxahuman(TMPDIR);
     testxahuman_exclude_unaligned(TMPDIR);
     testyhuman(TMPDIR);
+    testindexed(TMPDIR, false, true);
+    testindexed(TMPDIR, true, true);
+    testindexed(TMPDIR, false, false);
 
     printf("chrsplit tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
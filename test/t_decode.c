@@ -232,6 +232,16 @@ void test_countMismatches(char *a, char *b, int e)
     else { failure++; fprintf(stderr, "countMismatches(%s,%s) returned %d: expected %d\n", a,b,n,e); }
 }
 
+void test_whitelistMatch(whitelist_t *wl, char *seq, int max_mismatches, char *e, int e_nm)
+{
+    char got[WHITELIST_MAX_LEN+1] = "";
+    int nm = -1;
+    int n = whitelist_match(wl, seq, max_mismatches, WHITELIST_MAX_NO_CALLS, &nm);
+    if (n >= 0) whitelist_seq(wl, n, got);
+    if (e ? (n >= 0 && strcmp(got, e) == 0 && nm == e_nm) : n < 0) success++;
+    else { failure++; fprintf(stderr, "whitelist_match(%s,%d) returned '%s' with %d mismatches: expected '%s'\n", seq, max_mismatches, got, nm, e ? e : ""); }
+}
+
 int main(int argc, char**argv)
 {
     // test state
@@ -287,6 +297,31 @@ int main(int argc, char**argv)
     test_countMismatches("xBCiXYZ","NBCNXYz",1);
     test_countMismatches("AGCACGTT","AxCACGTTXXXXXX",1);
 
+    // test whitelist_match()
+    {
+        char wlname[1024];
+        snprintf(wlname, sizeof(wlname), "%s/match.whitelist", TMPDIR);
+        FILE *f = fopen(wlname, "w");
+        if (!f) { fprintf(stderr, "Can't write %s\n", wlname); exit(1); }
+        fputs("# barcodes\nACGTAC\tone\nacgtag\nTTTTTT\n\nACGTAC\nGGG-AAA\n", f);
+        fclose(f);
+        whitelist_t *wl = whitelist_load(wlname);
+        if (wl && wl->nbarcodes == 4 && wl->len == 6) success++;
+        else { failure++; fprintf(stderr, "whitelist_load(%s) failed\n", wlname); }
+        if (wl) {
+            test_whitelistMatch(wl, "ACGTAC", 1, "ACGTAC", 0);
+            test_whitelistMatch(wl, "GGG-AAAT", 1, "GGGAAA", 0);
+            test_whitelistMatch(wl, "TTTATT", 1, "TTTTTT", 1);
+            test_whitelistMatch(wl, "TTTATT", 0, NULL, 0);
+            test_whitelistMatch(wl, "TTNTTT", 0, "TTTTTT", 0);
+            test_whitelistMatch(wl, "ACGTAN", 1, NULL, 0);      // ACGTAC or ACGTAG
+            test_whitelistMatch(wl, "ACGTAT", 1, NULL, 0);      // one mismatch from both
+            test_whitelistMatch(wl, "NNNNTT", 1, NULL, 0);      // too many no-calls
+            test_whitelistMatch(wl, "ACGTA", 1, NULL, 0);       // too short
+        }
+        whitelist_free(wl);
+    }
+
     //
     // Now test the actual decoding
     //
@@ -329,6 +364,29 @@ int main(int argc, char**argv)
         }
     }
 
+    // test 1 again, with separate threads for reading and writing
+    {
+        int argc_1;
+        char** argv_1;
+
+        snprintf(outputfile, max_path_length, "%s/decode_1io.sam", TMPDIR);
+        snprintf(metricsfile, max_path_length, "%s/decode_1io.metrics", TMPDIR);
+        setup_test_1(&argc_1, &argv_1, outputfile, metricsfile, NTHREADS);
+        argv_1 = realloc(argv_1, (argc_1 + 2) * sizeof(char *));
+        argv_1[argc_1++] = strdup("--io-threads");
+        argv_1[argc_1++] = strdup("2");
+        main_decode(argc_1-1, argv_1+1);
+        free_argv(argc_1,argv_1);
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s", outputfile, MKNAME(DATA_DIR,"/out/6383_9_nosplit_nochange.sam"));
+        if (system(cmd)) {
+            fprintf(stderr, "test 1 failed with --io-threads\n");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
     // --convert_low_quality option
     for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
         int argc_2;
@@ -430,6 +488,88 @@ int main(int argc, char**argv)
         }
     }
 
+    // --metrics-only should give the same metrics as test 4, without writing the output
+    for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
+        int argc_4;
+        char** argv_4;
+        snprintf(outputfile, max_path_length,"%s/decode_4mo%s.sam",TMPDIR, threads ? "threads" : "");
+        snprintf(metricsfile, max_path_length, "%s/decode_4mo%s.metrics", TMPDIR, threads ? "threads" : "");
+        setup_test_4(&argc_4, &argv_4, outputfile, metricsfile, threads);
+        argv_4 = realloc(argv_4, (argc_4 + 1) * sizeof(char *));
+        argv_4[argc_4++] = strdup("--metrics-only");
+        main_decode(argc_4-1, argv_4+1);
+        free_argv(argc_4,argv_4);
+
+        if (access(outputfile, F_OK) == 0) {
+            fprintf(stderr, "--metrics-only wrote an output file\n");
+            failure++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s", metricsfile, MKNAME(DATA_DIR,"/out/decode_4.metrics"));
+        if (system(cmd)) {
+            fprintf(stderr, "--metrics-only failed at metrics file diff\n");
+            failure++;
+        } else {
+            success++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s.hops %s", metricsfile, MKNAME(DATA_DIR,"/out/decode_4.metrics.hops"));
+        if (system(cmd)) {
+            fprintf(stderr, "--metrics-only failed at tag hops file diff\n");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
+    // decode two halves of the test 4 input, and merge the partial metrics
+    {
+        char partial[2][max_path_length];
+        char half[max_path_length];
+        for (int n = 0; n < 2; n++) {
+            int argc_4;
+            char** argv_4;
+            snprintf(half, max_path_length, "%s/decode_4_%d.sam", TMPDIR, n);
+            snprintf(cmd, sizeof(cmd), "(grep '^@' %s; grep -v '^@' %s | %s) > %s",
+                     MKNAME(DATA_DIR,"/decode_4.sam"), MKNAME(DATA_DIR,"/decode_4.sam"),
+                     n ? "tail -n +8" : "head -n 7", half);
+            if (system(cmd)) { fprintf(stderr, "Command failed: %s\n", cmd); failure++; }
+            snprintf(outputfile, max_path_length,"%s/decode_4_%d_out.sam",TMPDIR, n);
+            snprintf(metricsfile, max_path_length, "%s/decode_4_%d.metrics", TMPDIR, n);
+            snprintf(partial[n], max_path_length, "%s/decode_4_%d.partial", TMPDIR, n);
+            setup_test_4(&argc_4, &argv_4, outputfile, metricsfile, 0);
+            free(argv_4[3]); argv_4[3] = strdup(half);
+            argv_4 = realloc(argv_4, (argc_4 + 2) * sizeof(char *));
+            argv_4[argc_4++] = strdup("--partial-metrics");
+            argv_4[argc_4++] = strdup(partial[n]);
+            main_decode(argc_4-1, argv_4+1);
+            free_argv(argc_4,argv_4);
+        }
+
+        snprintf(metricsfile, max_path_length, "%s/decode_4merged.metrics", TMPDIR);
+        char *argv_m[] = { "decode", "--merge-metrics", "--metrics-file", metricsfile, partial[0], partial[1], NULL };
+        if (main_decode(6, argv_m)) {
+            fprintf(stderr, "merging partial metrics failed\n");
+            failure++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s", metricsfile, MKNAME(DATA_DIR,"/out/decode_4.metrics"));
+        if (system(cmd)) {
+            fprintf(stderr, "merged metrics file differs\n");
+            failure++;
+        } else {
+            success++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s.hops %s", metricsfile, MKNAME(DATA_DIR,"/out/decode_4.metrics.hops"));
+        if (system(cmd)) {
+            fprintf(stderr, "merged tag hops file differs\n");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
     // --dual-tag option with missing first tag
     for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
         int argc_5;
@@ -491,6 +631,46 @@ int main(int argc, char**argv)
 
     }
 
+    // a whitelist of the test 1 barcodes should give the same counts, with the barcodes in the CB tag
+    for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
+        int argc_1;
+        char** argv_1;
+        char wlname[max_path_length];
+        snprintf(wlname, max_path_length, "%s/decode_1.whitelist", TMPDIR);
+        snprintf(cmd, sizeof(cmd), "tail -n +2 %s | cut -f1 > %s", MKNAME(DATA_DIR,"/decode_1.tag"), wlname);
+        if (system(cmd)) { fprintf(stderr, "Command failed: %s\n", cmd); failure++; }
+        snprintf(outputfile, max_path_length, "%s/decode_wl%s.sam", TMPDIR, threads ? "threads" : "");
+        snprintf(metricsfile, max_path_length, "%s/decode_wl%s.metrics", TMPDIR, threads ? "threads" : "");
+        setup_test_1(&argc_1, &argv_1, outputfile, metricsfile, threads);
+        free(argv_1[10]); argv_1[10] = strdup("--whitelist");
+        free(argv_1[11]); argv_1[11] = strdup(wlname);
+        main_decode(argc_1-1, argv_1+1);
+        free_argv(argc_1,argv_1);
+
+        snprintf(cmd, sizeof(cmd), "grep -A9 ^BARCODE %s | cut -f1,6- > %s.counts;"
+                                   "grep -A9 ^BARCODE %s | cut -f1,6- | diff - %s.counts",
+                                   metricsfile, metricsfile, MKNAME(DATA_DIR,"/out/decode_1.metrics"), metricsfile);
+        if (system(cmd)) {
+            fprintf(stderr, "whitelist test failed at metrics file diff\n");
+            failure++;
+        } else {
+            success++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "test $(grep -c 'CB:Z:ATCACG' %s) -eq $(grep -c 'RG:Z:1#1' %s) &&"
+                                   " test $(grep -c 'CB:Z:CGATGT' %s) -eq $(grep -c 'RG:Z:1#2' %s) &&"
+                                   " ! grep -q -e '^@RG.*#' -e 'RG:Z:1#' %s",
+                                   outputfile, MKNAME(DATA_DIR,"/out/6383_9_nosplit_nochange.sam"),
+                                   outputfile, MKNAME(DATA_DIR,"/out/6383_9_nosplit_nochange.sam"),
+                                   outputfile);
+        if (system(cmd)) {
+            fprintf(stderr, "whitelist test failed at SAM file check\n");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
     free(metricsfile);
     free(outputfile);
     free(chksumfile);
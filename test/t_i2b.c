@@ -24,6 +24,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <fcntl.h>
 
 #include <htslib/kstring.h>
 
@@ -34,6 +36,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MKNAME(d,f) xMKNAME(d,f)
 
 ia_t *parseLaneList(char *arg);
+ia_t *parseTileList(char *arg);
+int parseQualBins(char *arg, uint8_t *map);
 
 int verbose = 0;
 
@@ -675,8 +679,8 @@ void icheckEqual(char *name, int expected, int actual)
 void checkFiles(char *gotfile, char *expectfile, int verbose)
 {
     int f = failure;
-    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL);
-    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL);
+    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL, 0);
+    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL, 0);
     bam1_t *got_rec, *exp_rec;
 
     int c = sam_hdr_count_lines(bgot->h, "RG");
@@ -709,6 +713,108 @@ void checkFiles(char *gotfile, char *expectfile, int verbose)
     return;
 }
 
+/*
+ * Write the header of a spatial filter file for one lane, with no regions
+ * and two reads of 26 and 98 bases
+ */
+static void writeSpatialFilter(char *fname, int lane, size_t ntiles, int *tiles, size_t *counts)
+{
+    char magic[5] = "RGF3", cmdline[1024] = "";
+    int coords[2] = { 1000, 10 }, regions[4] = { 0, 200, 0, 0 }, read_length[3] = { 26, 0, 98 };
+    uint64_t nreads = 0;
+    uint32_t filter_data_size = 0;
+
+    for (int n = 0; n < ntiles; n++) nreads += counts[n];
+    FILE *f = fopen(fname, "wb");
+    if (!f) { fprintf(stderr, "Can't create %s\n", fname); exit(1); }
+    fwrite(magic, sizeof(magic), 1, f);
+    fwrite(cmdline, sizeof(cmdline), 1, f);
+    fwrite(&lane, sizeof(lane), 1, f);
+    fwrite(coords, sizeof(coords), 1, f);
+    fwrite(&ntiles, sizeof(ntiles), 1, f);
+    for (int n = 0; n < ntiles; n++) {
+        fwrite(&tiles[n], sizeof(int), 1, f);
+        fwrite(&counts[n], sizeof(size_t), 1, f);
+    }
+    fwrite(regions, sizeof(regions), 1, f);
+    fwrite(&nreads, sizeof(nreads), 1, f);
+    fwrite(read_length, sizeof(read_length), 1, f);
+    fwrite(&filter_data_size, sizeof(filter_data_size), 1, f);
+    if (fclose(f)) { fprintf(stderr, "Can't write %s\n", fname); exit(1); }
+}
+
+/*
+ * check that the header records the tiles which were skipped
+ */
+void checkSkippedTiles(char *gotfile, int expected)
+{
+    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL, 0);
+    int skipped = 0;
+    for (int n=0; n < sam_hdr_count_lines(bgot->h, "CO"); n++) {
+        kstring_t ks = KS_INITIALIZE;
+        sam_hdr_find_line_pos(bgot->h, "CO", n, &ks);
+        if (strstr(ks_str(&ks), "bambi i2b skipped lane 1 tile")) skipped++;
+        ks_free(&ks);
+    }
+    BAMit_free(bgot);
+    icheckEqual("Skipped tiles", expected, skipped);
+}
+
+/*
+ * check a two tile index written by i2b --tile-index, and read each tile back with it
+ */
+void checkTileIndex(char *outputfile, char *indexfile)
+{
+    int tiles[2] = { 0, 0 };
+    uint64_t counts[2] = { 0, 0 };
+    int lane, tile;
+    int64_t start, end;
+    uint64_t nrec;
+    int ntiles = 0;
+    char line[1024];
+    FILE *f = fopen(indexfile, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open tile index %s\n", indexfile);
+        failure++;
+    } else {
+        while (fgets(line, sizeof(line), f)) {
+            if (*line == '#') continue;
+            if (ntiles < 2 && sscanf(line, "%d %d %"SCNd64" %"SCNd64" %"SCNu64, &lane, &tile, &start, &end, &nrec) == 5) {
+                tiles[ntiles] = tile; counts[ntiles] = nrec;
+            }
+            ntiles++;
+        }
+        fclose(f);
+    }
+    if (ntiles != 2 || tiles[0] != 1101 || tiles[1] != 1102) {
+        fprintf(stderr, "Tile index has %d tiles (%d,%d): expected 1101 and 1102\n", ntiles, tiles[0], tiles[1]);
+        failure++;
+    }
+
+    // each tile on its own, and then both together
+    for (int t = 0; t < 3; t++) {
+        uint64_t expected = t < 2 ? counts[t] : counts[0] + counts[1];
+        uint64_t n = 0;
+        char name[16];
+        BAMit_t *bit = BAMit_open_tiles(outputfile, indexfile, t < 2 ? tiles + t : tiles, t < 2 ? 1 : 2, NULL);
+        while (BAMit_hasnext(bit)) {
+            bam1_t *rec = BAMit_next(bit);
+            snprintf(name, sizeof(name), ":%d:", tiles[t < 2 ? t : (n < counts[0] ? 0 : 1)]);
+            if (!strstr(bam_get_qname(rec), name)) {
+                fprintf(stderr, "Record %s is not from tile%s\n", bam_get_qname(rec), name);
+                failure++;
+                break;
+            }
+            n++;
+        }
+        BAMit_free(bit);
+        if (n != expected) {
+            fprintf(stderr, "Read %"PRIu64" records from tile index: expected %"PRIu64"\n", n, expected);
+            failure++;
+        }
+    }
+}
+
 void compare_metrics(const char *name, const char *expected, const char *result)
 {
     char cmd[1024];
@@ -779,6 +885,38 @@ int main(int argc, char**argv)
     free(s);
     ia_free(lanes);
 
+    // test parseTileList()
+    ia_t *tiles = parseTileList("1101,2_2102");
+    s = tiles ? ia_join(tiles,",") : NULL;
+    if (!s || strcmp(s, "1101,2002102")) {
+        fprintf(stderr,"Tiles are '%s': expected '1101,2002102'\n", s);
+        failure++;
+    }
+    free(s);
+    ia_free(tiles);
+    if ((tiles = parseTileList("1101,x")) != NULL) {
+        fprintf(stderr,"parseTileList() accepted a bad tile\n");
+        failure++;
+        ia_free(tiles);
+    }
+
+    // test parseQualBins()
+    uint8_t qual_map[256];
+    if (parseQualBins("illumina8", qual_map) || qual_map[1] != 1 || qual_map[2] != 6 || qual_map[19] != 15
+        || qual_map[24] != 22 || qual_map[38] != 37 || qual_map[41] != 40) {
+        fprintf(stderr,"parseQualBins(illumina8) failed\n");
+        failure++;
+    }
+    if (parseQualBins("5-10:7,30-:35", qual_map) || qual_map[4] != 4 || qual_map[5] != 7 || qual_map[10] != 7
+        || qual_map[11] != 11 || qual_map[30] != 35 || qual_map[93] != 35) {
+        fprintf(stderr,"parseQualBins(5-10:7,30-:35) failed\n");
+        failure++;
+    }
+    if (parseQualBins("10-5:7", qual_map) == 0 || parseQualBins("x", qual_map) == 0 || parseQualBins("5:", qual_map) == 0) {
+        fprintf(stderr,"parseQualBins() accepted a bad scheme\n");
+        failure++;
+    }
+
     //
     // simple test
     //
@@ -790,6 +928,194 @@ int main(int argc, char**argv)
     checkFiles(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"), verbose);
     free_args(argv_1);
 
+    //
+    // simple test, staging files in a local directory
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Staging test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_1_staged.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--stage-dir");
+    argv_1[argc_1++] = strdup(TMPDIR);
+    argv_1[argc_1++] = strdup("--stage-budget");
+    argv_1[argc_1++] = strdup("10MB");
+    argv_1[argc_1++] = strdup("--verbose");
+    {
+        // the verbose output says how many files were staged and then opened locally
+        char logfile[512], line[1024];
+        size_t nstaged = 0, nlocal = 0;
+        snprintf(logfile, sizeof(logfile), "%s/i2b_1_staged.log", TMPDIR);
+        fflush(stderr);
+        int saved = dup(2);
+        int fd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (saved < 0 || fd < 0) { fprintf(stderr, "Can't create %s\n", logfile); exit(1); }
+        dup2(fd, 2); close(fd);
+        main_i2b(argc_1-1, argv_1+1);
+        fflush(stderr);
+        dup2(saved, 2); close(saved);
+
+        FILE *log = fopen(logfile, "r");
+        while (log && fgets(line, sizeof(line), log)) {
+            sscanf(line, "Staging: %zu files staged, %zu opened locally", &nstaged, &nlocal);
+        }
+        if (log) fclose(log);
+        if (!nstaged || !nlocal) {
+            fprintf(stderr, "Staging test: %zu files staged, %zu opened locally\n", nstaged, nlocal);
+            failure++;
+        }
+    }
+    checkFiles(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"), verbose);
+    free_args(argv_1);
+
+    //
+    // simple test, excluding the other tiles
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Exclude tiles test\n");
+    char *tilelist = calloc(1, filename_len);
+    snprintf(tilelist, filename_len, "%s/exclude_tiles.txt", TMPDIR);
+    FILE *tf = fopen(tilelist, "w");
+    if (!tf) { fprintf(stderr, "Can't create %s\n", tilelist); exit(1); }
+    fprintf(tf, "# bad tiles\n1_1102 2_1101\n2101 # bubble\n");
+    fclose(tf);
+    snprintf(outputfile, filename_len, "%s/i2b_1_exclude.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-limit");
+    argv_1[argc_1++] = strdup("3");
+    argv_1[argc_1++] = strdup("--exclude-tiles");
+    argv_1[argc_1++] = strdup(tilelist);
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"), verbose);
+    checkSkippedTiles(outputfile, 2);
+    free_args(argv_1);
+
+    // a spatial filter for lane 1, where 1102 and 2101 have too few reads
+    if (verbose) fprintf(stderr,"\n===> Exclude tiles from spatial filter test\n");
+    snprintf(tilelist, filename_len, "%s/exclude_tiles.filter", TMPDIR);
+    writeSpatialFilter(tilelist, 1, 3, (int[]){ 1101, 1102, 2101 }, (size_t[]){ 50000, 500, 1999 });
+    snprintf(outputfile, filename_len, "%s/i2b_1_exclude_sf.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-limit");
+    argv_1[argc_1++] = strdup("3");
+    argv_1[argc_1++] = strdup("--exclude-tiles");
+    argv_1[argc_1++] = strdup(tilelist);
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"), verbose);
+    checkSkippedTiles(outputfile, 2);
+    free_args(argv_1);
+
+    // tiles 1101, 1102 and 2101 have PF fractions of 0.514, 0.518 and 0.486
+    if (verbose) fprintf(stderr,"\n===> Minimum tile PF fraction test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_1_min_pf.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-limit");
+    argv_1[argc_1++] = strdup("3");
+    argv_1[argc_1++] = strdup("--exclude-tiles");
+    argv_1[argc_1++] = strdup("1102");
+    argv_1[argc_1++] = strdup("--min-tile-pf-fraction");
+    argv_1[argc_1++] = strdup("0.5");
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"), verbose);
+    checkSkippedTiles(outputfile, 2);
+    free_args(argv_1);
+    free(tilelist);
+
+    //
+    // simple test, reading the run folder from a tar file
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Archive test\n");
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "tar -C %s -cf %s/miseq.tar 160916_miseq_0966_FC", MKNAME(DATA_DIR,""), TMPDIR);
+    if (system(cmd)) {
+        fprintf(stderr, "Command \"%s\" failed\n", cmd);
+        failure++;
+    } else {
+        snprintf(outputfile, filename_len, "%s/i2b_1_archive.bam", TMPDIR);
+        setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+        free(argv_1[3]);
+        argv_1[3] = strdup("160916_miseq_0966_FC/Data/Intensities");
+        argv_1[argc_1++] = strdup("--archive");
+        argv_1[argc_1++] = calloc(1, filename_len);
+        snprintf(argv_1[argc_1-1], filename_len, "%s/miseq.tar", TMPDIR);
+        main_i2b(argc_1-1, argv_1+1);
+        checkFiles(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"), verbose);
+        free_args(argv_1);
+    }
+
+    //
+    // simple test with quality binning
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Quality binning test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_qbins.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--qual-bins");
+    argv_1[argc_1++] = strdup("illumina4");
+    main_i2b(argc_1-1, argv_1+1);
+    free_args(argv_1);
+    {
+        BAMit_t *bexp = BAMit_open(MKNAME(DATA_DIR,"/out/test1.bam"), 'r', NULL, 0, NULL, 0);
+        BAMit_t *bgot = BAMit_open(outputfile, 'r', NULL, 0, NULL, 0);
+        parseQualBins("illumina4", qual_map);
+        if (!strstr(sam_hdr_str(bgot->h), "@CO\tQuality values binned by bambi i2b --qual-bins illumina4")) {
+            fprintf(stderr, "Quality binning not recorded in header\n");
+            failure++;
+        }
+        while (BAMit_hasnext(bexp) && BAMit_hasnext(bgot)) {
+            bam1_t *exp = BAMit_next(bexp);
+            bam1_t *got = BAMit_next(bgot);
+            uint8_t *eq = bam_get_qual(exp), *gq = bam_get_qual(got);
+            int n;
+            for (n = 0; n < exp->core.l_qseq; n++) {
+                if (gq[n] != qual_map[eq[n]]) break;
+            }
+            if (n < exp->core.l_qseq || got->core.l_qseq != exp->core.l_qseq) {
+                fprintf(stderr, "Record %s has wrong binned qualities\n", bam_get_qname(got));
+                failure++;
+                break;
+            }
+        }
+        if (BAMit_hasnext(bexp) || BAMit_hasnext(bgot)) {
+            fprintf(stderr, "Quality binning test has the wrong number of records\n");
+            failure++;
+        }
+        BAMit_free(bexp);
+        BAMit_free(bgot);
+    }
+
+    //
+    // two tiles with a tile index, then read one tile back
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Tile index test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_tiles.bam", TMPDIR);
+    snprintf(metricsfile, filename_len, "%s/i2b_tiles.idx", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    free(argv_1[11]);
+    argv_1[11] = strdup("2");
+    argv_1[argc_1++] = strdup("--tile-index");
+    argv_1[argc_1++] = strdup(metricsfile);
+    main_i2b(argc_1-1, argv_1+1);
+    free_args(argv_1);
+    checkTileIndex(outputfile, metricsfile);
+
+    if (verbose) fprintf(stderr,"\n===> CRAM tile index test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_tiles.cram", TMPDIR);
+    snprintf(metricsfile, filename_len, "%s/i2b_tiles_cram.idx", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    free(argv_1[11]);
+    argv_1[11] = strdup("2");
+    argv_1[argc_1++] = strdup("--tile-index");
+    argv_1[argc_1++] = strdup(metricsfile);
+    argv_1[argc_1++] = strdup("--output-fmt");
+    argv_1[argc_1++] = strdup("cram");
+    if (main_i2b(argc_1-1, argv_1+1)) { fprintf(stderr, "i2b failed writing CRAM\n"); failure++; }
+    free_args(argv_1);
+    checkTileIndex(outputfile, metricsfile);
+    snprintf(metricsfile, filename_len, "%s/i2b_tiles.cram.crai", TMPDIR);
+    if (access(metricsfile, R_OK)) { fprintf(stderr, "No CRAM index %s\n", metricsfile); failure++; }
+
     //
     // miseq missing file test
     //
@@ -0,0 +1,360 @@
+/*  test/t_libbambi.c -- libbambi test cases.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+#include "libbambi.h"
+
+#define xMKNAME(d,f) #d f
+#define MKNAME(d,f) xMKNAME(d,f)
+
+#define BATCH_SIZE 3
+
+int success = 0;
+int failure = 0;
+
+static void checkFiles(char *gotfile, char *expectfile, int verbose)
+{
+    char cmd[1024];
+
+    if (verbose) fprintf(stderr,"\nComparing files: %s with %s\n", gotfile, expectfile);
+    sprintf(cmd,"diff -I ID:bambi %s %s", gotfile, expectfile);
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    else success++;
+}
+
+static int countReads(const bambi_barcode_metrics_t *m, void *arg)
+{
+    if (!m->tag_hop) *(uint64_t *)arg += m->reads;
+    return 0;
+}
+
+/*
+ * Decode decode_1.sam through libbambi, in batches of whole templates
+ */
+static void test_decode(char *TMPDIR, int nthreads, int verbose)
+{
+    char outputfile[512];
+    char metricsfile[512];
+    hts_tpool *pool = NULL;
+    bam1_t **recs = NULL;
+    int nrecs = 0, max_recs = 0, ntagged = 0;
+    uint64_t nreads = 0;
+    bool tagged = false;
+
+    if (verbose) fprintf(stderr,"testing decode with %d threads\n", nthreads);
+    snprintf(outputfile, sizeof(outputfile), "%s/libbambi_decode_%d.sam", TMPDIR, nthreads);
+    snprintf(metricsfile, sizeof(metricsfile), "%s/libbambi_decode_%d.metrics", TMPDIR, nthreads);
+
+    char *argv[] = { "decode",
+                     "--barcode-file", MKNAME(DATA_DIR,"/decode_1.tag"),
+                     "--metrics-file", metricsfile,
+                     "--barcode-tag-name", "RT" };
+    int argc = sizeof(argv) / sizeof(argv[0]);
+
+    if (nthreads) pool = hts_tpool_init(nthreads);
+    bambi_decode_t *ctx = bambi_decode_init(argc, argv, pool);
+    if (!ctx) { fprintf(stderr, "bambi_decode_init() failed\n"); failure++; return; }
+
+    samFile *in = sam_open(MKNAME(DATA_DIR,"/decode_1.sam"), "r");
+    samFile *out = sam_open(outputfile, "w");
+    if (!in || !out) { fprintf(stderr, "Can't open files for decode test\n"); exit(1); }
+    sam_hdr_t *hdr = sam_hdr_read(in);
+    if (bambi_decode_header(ctx, hdr) != 0) { fprintf(stderr, "bambi_decode_header() failed\n"); failure++; }
+    if (sam_hdr_write(out, hdr) < 0) { fprintf(stderr, "Can't write header\n"); exit(1); }
+
+    // read all the records
+    while (1) {
+        if (nrecs == max_recs) {
+            max_recs = max_recs ? max_recs * 2 : 256;
+            recs = realloc(recs, max_recs * sizeof(bam1_t *));
+            if (!recs) { fprintf(stderr, "Out of memory\n"); exit(1); }
+        }
+        recs[nrecs] = bam_init1();
+        if (sam_read1(in, hdr, recs[nrecs]) < 0) { bam_destroy1(recs[nrecs]); break; }
+        // count the templates with a barcode
+        bool new_template = nrecs == 0 || strcmp(bam_get_qname(recs[nrecs]), bam_get_qname(recs[nrecs-1])) != 0;
+        if (new_template) tagged = false;
+        if (!tagged && bam_aux_get(recs[nrecs], "RT")) { tagged = true; ntagged++; }
+        nrecs++;
+    }
+
+    // decode them in batches of whole templates
+    for (int start = 0, end; start < nrecs; start = end) {
+        end = start + BATCH_SIZE;
+        if (end > nrecs) end = nrecs;
+        while (end < nrecs && strcmp(bam_get_qname(recs[end]), bam_get_qname(recs[end-1])) == 0) end++;
+        if (bambi_decode_records(ctx, recs + start, end - start) != 0) {
+            fprintf(stderr, "bambi_decode_records() failed\n"); failure++;
+        }
+    }
+
+    for (int n = 0; n < nrecs; n++) {
+        if (sam_write1(out, hdr, recs[n]) < 0) { fprintf(stderr, "Can't write record\n"); exit(1); }
+        bam_destroy1(recs[n]);
+    }
+    free(recs);
+
+    if (bambi_decode_metrics(ctx, countReads, &nreads) != 0) { fprintf(stderr, "bambi_decode_metrics() failed\n"); failure++; }
+    if (nreads != ntagged) {
+        fprintf(stderr, "decode metrics counted %lu reads, expected %d\n", (unsigned long)nreads, ntagged);
+        failure++;
+    }
+    if (bambi_decode_finish(ctx) != 0) { fprintf(stderr, "bambi_decode_finish() failed\n"); failure++; }
+
+    sam_hdr_destroy(hdr);
+    sam_close(in);
+    sam_close(out);
+    bambi_decode_destroy(ctx);
+    if (pool) hts_tpool_destroy(pool);
+
+    checkFiles(outputfile, MKNAME(DATA_DIR,"/out/6383_9_nosplit_nochange.sam"), verbose);
+    checkFiles(metricsfile, MKNAME(DATA_DIR,"/out/decode_1.metrics"), verbose);
+}
+
+/*
+ * Check that two SAM/BAM/CRAM files have the same records
+ */
+static void checkRecords(char *gotfile, char *expectfile)
+{
+    samFile *got = sam_open(gotfile, "r"), *exp = sam_open(expectfile, "r");
+    if (!got || !exp) { fprintf(stderr, "Can't open %s or %s\n", gotfile, expectfile); failure++; return; }
+    sam_hdr_t *got_hdr = sam_hdr_read(got), *exp_hdr = sam_hdr_read(exp);
+    bam1_t *got_rec = bam_init1(), *exp_rec = bam_init1();
+
+    while (sam_read1(exp, exp_hdr, exp_rec) >= 0) {
+        if (sam_read1(got, got_hdr, got_rec) < 0) { fprintf(stderr, "%s ended too soon\n", gotfile); failure++; break; }
+        if (got_rec->l_data != exp_rec->l_data || memcmp(got_rec->data, exp_rec->data, got_rec->l_data)) {
+            fprintf(stderr, "Record %s in %s differs from %s\n", bam_get_qname(exp_rec), gotfile, expectfile);
+            failure++;
+            break;
+        }
+    }
+    if (sam_read1(got, got_hdr, got_rec) >= 0) { fprintf(stderr, "%s has too many records\n", gotfile); failure++; }
+
+    bam_destroy1(got_rec); bam_destroy1(exp_rec);
+    sam_hdr_destroy(got_hdr); sam_hdr_destroy(exp_hdr);
+    sam_close(got); sam_close(exp);
+}
+
+static int countAdapterReads(const bambi_adapter_metrics_t *m, void *arg)
+{
+    *(int *)arg += m->total_fwd + m->total_rev;
+    return 0;
+}
+
+/*
+ * Find adapters in adapters.bam through libbambi, and compare with 'bambi adapters'
+ */
+static void test_adapters(char *TMPDIR, int nthreads, int verbose)
+{
+    char outputfile[512], metricsfile[512];
+    char expectfile[512], expectmetrics[512];
+    char cmd[2048];
+    hts_tpool *pool = NULL;
+    bam1_t *recs[BATCH_SIZE * 2];
+    int nrecs = 0, nread = 0, ncounted = 0;
+
+    if (verbose) fprintf(stderr,"testing adapters with %d threads\n", nthreads);
+    snprintf(outputfile, sizeof(outputfile), "%s/libbambi_adapters_%d.bam", TMPDIR, nthreads);
+    snprintf(metricsfile, sizeof(metricsfile), "%s/libbambi_adapters_%d.metrics", TMPDIR, nthreads);
+    snprintf(expectfile, sizeof(expectfile), "%s/adapters.bam", TMPDIR);
+    snprintf(expectmetrics, sizeof(expectmetrics), "%s/adapters.metrics", TMPDIR);
+
+    snprintf(cmd, sizeof(cmd), "src/bambi adapters -o %s --metrics-file %s %s", expectfile, expectmetrics, MKNAME(DATA_DIR,"/adapters.bam"));
+    if (system(cmd)) { fprintf(stderr, "Command failed: %s\n", cmd); failure++; return; }
+
+    char *argv[] = { "adapters", "--metrics-file", metricsfile };
+    int argc = sizeof(argv) / sizeof(argv[0]);
+
+    if (nthreads) pool = hts_tpool_init(nthreads);
+    bambi_adapters_t *ctx = bambi_adapters_init(argc, argv, pool);
+    if (!ctx) { fprintf(stderr, "bambi_adapters_init() failed\n"); failure++; return; }
+
+    samFile *in = sam_open(MKNAME(DATA_DIR,"/adapters.bam"), "r");
+    samFile *out = sam_open(outputfile, "wb");
+    if (!in || !out) { fprintf(stderr, "Can't open files for adapters test\n"); exit(1); }
+    sam_hdr_t *hdr = sam_hdr_read(in);
+    if (bambi_adapters_header(ctx, hdr) != 0) { fprintf(stderr, "bambi_adapters_header() failed\n"); failure++; }
+    if (sam_hdr_write(out, hdr) < 0) { fprintf(stderr, "Can't write header\n"); exit(1); }
+
+    for (int n = 0; n < BATCH_SIZE * 2; n++) recs[n] = bam_init1();
+
+    // pass on batches of whole templates (assuming no template has more than BATCH_SIZE records)
+    while (1) {
+        int r = 0;
+        while (nrecs < BATCH_SIZE * 2 && (r = sam_read1(in, hdr, recs[nrecs])) >= 0) nrecs++, nread++;
+        int end = nrecs;
+        if (r >= 0) {
+            end = BATCH_SIZE;
+            while (end < nrecs && strcmp(bam_get_qname(recs[end]), bam_get_qname(recs[end-1])) == 0) end++;
+        }
+        if (end && bambi_adapters_records(ctx, recs, end) != 0) {
+            fprintf(stderr, "bambi_adapters_records() failed\n"); failure++;
+        }
+        for (int n = 0; n < end; n++) {
+            if (sam_write1(out, hdr, recs[n]) < 0) { fprintf(stderr, "Can't write record\n"); exit(1); }
+        }
+        // move the rest down, swapping so that every record is kept
+        for (int n = end; n < nrecs; n++) {
+            bam1_t *t = recs[n - end]; recs[n - end] = recs[n]; recs[n] = t;
+        }
+        nrecs -= end;
+        if (r < 0 && !nrecs) break;
+    }
+
+    if (bambi_adapters_metrics(ctx, countAdapterReads, &ncounted) != 0) { fprintf(stderr, "bambi_adapters_metrics() failed\n"); failure++; }
+    if (ncounted != nread) {
+        fprintf(stderr, "adapters metrics counted %d reads, expected %d\n", ncounted, nread);
+        failure++;
+    }
+    if (bambi_adapters_finish(ctx) != 0) { fprintf(stderr, "bambi_adapters_finish() failed\n"); failure++; }
+
+    for (int n = 0; n < BATCH_SIZE * 2; n++) bam_destroy1(recs[n]);
+    sam_hdr_destroy(hdr);
+    sam_close(in);
+    if (sam_close(out) < 0) { fprintf(stderr, "Can't close %s\n", outputfile); exit(1); }
+    bambi_adapters_destroy(ctx);
+    if (pool) hts_tpool_destroy(pool);
+
+    checkRecords(outputfile, expectfile);
+    checkFiles(metricsfile, expectmetrics, verbose);
+}
+
+typedef struct {
+    samFile *out;
+    sam_hdr_t *hdr;
+    int ncalls;
+    int stop_after;     // return non-zero after this many calls, if set
+} i2b_output_t;
+
+static int i2bHeader(sam_hdr_t *hdr, void *arg)
+{
+    i2b_output_t *o = (i2b_output_t *)arg;
+    o->hdr = sam_hdr_dup(hdr);
+    if (!o->hdr) return -1;
+    return o->out ? sam_hdr_write(o->out, o->hdr) : 0;
+}
+
+static int i2bRecords(bam1_t *recs, int nrecs, void *arg)
+{
+    i2b_output_t *o = (i2b_output_t *)arg;
+    o->ncalls++;
+    for (int n = 0; o->out && n < nrecs; n++) {
+        if (sam_write1(o->out, o->hdr, &recs[n]) < 0) return -1;
+    }
+    return o->stop_after && o->ncalls >= o->stop_after;
+}
+
+/*
+ * Convert the MiSeq test run with libbambi, and compare with the i2b test output
+ */
+static void test_i2b(char *TMPDIR, int nthreads, int verbose)
+{
+    char outputfile[512];
+    hts_tpool *pool = NULL;
+    i2b_output_t o = { NULL, NULL, 0, 0 };
+
+    if (verbose) fprintf(stderr,"testing i2b with %d threads\n", nthreads);
+    snprintf(outputfile, sizeof(outputfile), "%s/libbambi_i2b_%d.bam", TMPDIR, nthreads);
+
+    char *argv[] = { "i2b",
+                     "-i", MKNAME(DATA_DIR,"/160916_miseq_0966_FC/Data/Intensities"),
+                     "--lane", "1",
+                     "--first-tile", "1101",
+                     "--tile-limit", "1",
+                     "--library-name", "Test library",
+                     "--sample-alias", "Test Sample",
+                     "--study-name", "Study testStudy",
+                     "--run-start-date", "2011-03-23T00:00:00+0000" };
+    int argc = sizeof(argv) / sizeof(argv[0]);
+
+    if (nthreads) pool = hts_tpool_init(nthreads);
+    o.out = sam_open(outputfile, "wb");
+    if (!o.out) { fprintf(stderr, "Can't open %s\n", outputfile); exit(1); }
+    if (bambi_i2b_run(argc, argv, pool, i2bHeader, i2bRecords, &o) != 0) {
+        fprintf(stderr, "bambi_i2b_run() failed\n"); failure++;
+    }
+    if (sam_close(o.out) < 0) { fprintf(stderr, "Can't close %s\n", outputfile); exit(1); }
+    sam_hdr_destroy(o.hdr);
+    checkRecords(outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+
+    // a callback returning non-zero stops the conversion, and isn't called again
+    if (verbose) fprintf(stderr,"testing i2b stopping early with %d threads\n", nthreads);
+    i2b_output_t stop = { NULL, NULL, 0, 1 };
+    if (bambi_i2b_run(argc, argv, pool, i2bHeader, i2bRecords, &stop) == 0) {
+        fprintf(stderr, "bambi_i2b_run() didn't stop when asked to\n"); failure++;
+    }
+    if (stop.ncalls != 1) {
+        fprintf(stderr, "bambi_i2b_run() called records_fn %d times after being asked to stop\n", stop.ncalls - 1);
+        failure++;
+    }
+    sam_hdr_destroy(stop.hdr);
+
+    if (pool) hts_tpool_destroy(pool);
+}
+
+int main(int argc, char**argv)
+{
+    int verbose = 0;
+
+    int getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v': ++verbose;
+                      break;
+            default: printf("usage: t_libbambi [-v]\n\n"
+                            " -v verbose output\n"
+                           );
+                     break;
+        }
+    }
+
+    // Cleanup getopt
+    optind = 1;
+
+    // create temp directory
+    char template[] = "/tmp/bambi.XXXXXX";
+    char *TMPDIR = mkdtemp(template);
+    if (TMPDIR == NULL) {
+        fprintf(stderr,"Can't create temp directory\n");
+        exit(1);
+    } else {
+        if (verbose) fprintf(stderr,"Created temporary directory: %s\n", TMPDIR);
+    }
+
+    test_decode(TMPDIR, 0, verbose);
+    test_decode(TMPDIR, 4, verbose);
+    test_adapters(TMPDIR, 0, verbose);
+    test_adapters(TMPDIR, 4, verbose);
+    test_i2b(TMPDIR, 0, verbose);
+    test_i2b(TMPDIR, 4, verbose);
+
+    printf("libbambi tests: %s\n", failure ? "FAILED" : "Passed");
+    return failure ? EXIT_FAILURE : EXIT_SUCCESS;
+}
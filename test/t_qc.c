@@ -0,0 +1,181 @@
+/*  test/t_qc.c -- qc test cases.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+
+#define xMKNAME(d,f) #d f
+#define MKNAME(d,f) xMKNAME(d,f)
+
+int success = 0;
+int failure = 0;
+
+void checkOutputFiles(char *tmpdir, char *gotfile, char *expectfile)
+{
+    char cmd[1024];
+    sprintf(cmd,"diff %s/%s %s", tmpdir, gotfile, expectfile);
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+}
+
+void runCommand(char *cmd)
+{
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+}
+
+/*
+ * Write a BAM file of nrecs unaligned reads, where record 'bad' has an aux
+ * tag of an unknown type, which seqchksum can't read
+ */
+void makeBadAuxBam(char *fname, int nrecs, int bad)
+{
+    char line[256];
+    kstring_t ks = { 0, 0, NULL };
+    samFile *f = sam_open(fname, "wb");
+    sam_hdr_t *h = sam_hdr_parse(strlen("@HD\tVN:1.6\n"), "@HD\tVN:1.6\n");
+    bam1_t *rec = bam_init1();
+    if (!f || !h || sam_hdr_write(f, h)) { fprintf(stderr, "Can't write %s\n", fname); exit(1); }
+
+    for (int n = 0; n < nrecs; n++) {
+        snprintf(line, sizeof(line), "r%d\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\tIIII\tXX:A:x", n);
+        ks.l = 0;
+        kputs(line, &ks);
+        if (sam_parse1(&ks, h, rec) < 0) { fprintf(stderr, "Can't parse %s\n", line); exit(1); }
+        if (n == bad) bam_aux_get(rec, "XX")[0] = 'q';
+        if (sam_write1(f, h, rec) < 0) { fprintf(stderr, "Can't write %s\n", fname); exit(1); }
+    }
+
+    free(ks.s);
+    bam_destroy1(rec);
+    sam_hdr_destroy(h);
+    if (sam_close(f)) { fprintf(stderr, "Can't write %s\n", fname); exit(1); }
+}
+
+/*
+ * The results from one pass must be the same as from each command on its own
+ */
+void checkQC(char *tmpdir, char *name, char *threads)
+{
+    char cmd[2048];
+    char got[512], expect[512];
+
+    snprintf(cmd, sizeof(cmd), "src/bambi qc %s"
+                               " --seqchksum %s/%s.chksum"
+                               " --substitution-analysis %s/%s.sa"
+                               " --spatial-filter %s/%s.filter"
+                               " --adapter-metrics %s/%s.adapters"
+                               " %s",
+                               threads, tmpdir, name, tmpdir, name, tmpdir, name, tmpdir, name,
+                               MKNAME(DATA_DIR,"/sa.bam"));
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; return; }
+
+    snprintf(got, sizeof(got), "%s.sa", name);
+    checkOutputFiles(tmpdir, got, MKNAME(DATA_DIR,"/out/sa.txt"));
+
+    snprintf(got, sizeof(got), "%s.chksum", name);
+    snprintf(expect, sizeof(expect), "%s/expect.chksum", tmpdir);
+    checkOutputFiles(tmpdir, got, expect);
+
+    snprintf(got, sizeof(got), "%s.adapters", name);
+    snprintf(expect, sizeof(expect), "%s/expect.adapters", tmpdir);
+    checkOutputFiles(tmpdir, got, expect);
+
+    // the filter file has the command line in it, so compare what it says
+    snprintf(cmd, sizeof(cmd), "src/bambi spatial_filter -d -F %s/%s.filter 2>&1 | grep -v 'Command Line' > %s/%s.filter.txt",
+                               tmpdir, name, tmpdir, name);
+    runCommand(cmd);
+    snprintf(got, sizeof(got), "%s.filter.txt", name);
+    snprintf(expect, sizeof(expect), "%s/expect.filter.txt", tmpdir);
+    checkOutputFiles(tmpdir, got, expect);
+}
+
+int main(int argc, char**argv)
+{
+    int verbose = 0;
+
+    int getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v': ++verbose;
+                      break;
+            default: printf("usage: t_qc [-v]\n\n"
+                            " -v verbose output\n"
+                           );
+                     break;
+        }
+    }
+
+    // create temp directory
+    char template[] = "/tmp/bambi.XXXXXX";
+    char *TMPDIR = mkdtemp(template);
+    if (TMPDIR == NULL) {
+        fprintf(stderr,"Can't create temp directory\n");
+        exit(1);
+    } else {
+        if (verbose) fprintf(stderr,"Created temporary directory: %s\n", TMPDIR);
+    }
+
+    char cmd[2048];
+
+    // what each command gives on its own
+    snprintf(cmd, sizeof(cmd), "src/bambi seqchksum -o %s/expect.chksum %s", TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    runCommand(cmd);
+    snprintf(cmd, sizeof(cmd), "src/bambi adapters --metrics-file %s/expect.adapters -o /dev/null %s", TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    runCommand(cmd);
+    snprintf(cmd, sizeof(cmd), "src/bambi spatial_filter -c -F %s/expect.filter %s", TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    runCommand(cmd);
+    snprintf(cmd, sizeof(cmd), "src/bambi spatial_filter -d -F %s/expect.filter 2>&1 | grep -v 'Command Line' > %s/expect.filter.txt",
+                               TMPDIR, TMPDIR);
+    runCommand(cmd);
+
+    checkQC(TMPDIR, "qc", "");
+    checkQC(TMPDIR, "qc_t4", "-t 4");
+
+    // just the one analysis
+    snprintf(cmd, sizeof(cmd), "src/bambi qc --substitution-analysis %s/qc_sa.txt %s", TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    runCommand(cmd);
+    checkOutputFiles(TMPDIR, "qc_sa.txt", MKNAME(DATA_DIR,"/out/sa.txt"));
+
+    // an analyser failing must stop qc, with or without threads. The bad record
+    // is in the first batch, so the failure is found while the next one is read.
+    {
+        char bad[512];
+        snprintf(bad, sizeof(bad), "%s/bad_aux.bam", TMPDIR);
+        makeBadAuxBam(bad, 25000, 5);
+        snprintf(cmd, sizeof(cmd), "timeout 60 src/bambi qc --seqchksum %s/bad.chksum %s 2>/dev/null", TMPDIR, bad);
+        if (!system(cmd)) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+        snprintf(cmd, sizeof(cmd), "timeout 60 src/bambi qc -t 4 --seqchksum %s/bad_t4.chksum %s 2>/dev/null", TMPDIR, bad);
+        int r = system(cmd);
+        if (!r) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+        else if (WIFEXITED(r) && WEXITSTATUS(r) == 124) { fprintf(stderr,"Command hung: %s\n",cmd); failure++; }
+    }
+
+    // nothing to do
+    snprintf(cmd, sizeof(cmd), "src/bambi qc %s 2>/dev/null", MKNAME(DATA_DIR,"/sa.bam"));
+    if (!system(cmd)) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+
+    printf("qc tests: %s\n", failure ? "FAILED" : "Passed");
+    return failure ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -304,8 +304,8 @@ void setup_test_12(int* argc, char*** argv, char *outputfile)
 
 void checkFiles(char *gotfile, char *expectfile, int verbose)
 {
-    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL);
-    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL);
+    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL, 0);
+    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL, 0);
    // bam1_t *got_rec, *exp_rec;
 
     int f = failure;
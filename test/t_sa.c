@@ -25,6 +25,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 
 #include "bamit.h"
+#include "array.h"
+#include <htslib/sam.h>
 #include <htslib/kstring.h>
 
 #define xMKNAME(d,f) #d f
@@ -47,6 +49,120 @@ void checkOutputFiles(char *tmpdir, char *gotfile, char *expectfile)
     if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
 }
 
+/*
+ * Write a SAM file with ncopies of each record in sa.bam, each copy of a
+ * template having its own name, to give sampling enough templates to work on
+ */
+void makeCopies(char *fname, int ncopies)
+{
+    samFile *in = sam_open(MKNAME(DATA_DIR,"/sa.bam"), "r");
+    sam_hdr_t *hdr = in ? sam_hdr_read(in) : NULL;
+    FILE *out = fopen(fname, "w");
+    if (!hdr || !out) { fprintf(stderr, "Can't make %s\n", fname); exit(1); }
+
+    va_t *recs = va_init(100, free);
+    kstring_t ks = { 0, 0, NULL };
+    bam1_t *rec = bam_init1();
+    while (sam_read1(in, hdr, rec) >= 0) {
+        if (sam_format1(hdr, rec, &ks) < 0) { fprintf(stderr, "Can't format record\n"); exit(1); }
+        va_push(recs, strdup(ks.s));
+    }
+
+    fputs(sam_hdr_str(hdr), out);
+    for (int c = 0; c < ncopies; c++) {
+        for (int n = 0; n < recs->end; n++) {
+            char *line = recs->entries[n];
+            char *tab = strchr(line, '\t');
+            fprintf(out, "%.*s_%d%s\n", (int)(tab - line), line, c, tab);
+        }
+    }
+
+    fclose(out);
+    free(ks.s);
+    bam_destroy1(rec);
+    va_free(recs);
+    sam_hdr_destroy(hdr);
+    sam_close(in);
+}
+
+/*
+ * Write a SAM file with the records in sa.bam, then a copy of them in read
+ * group B with any soft clips cut off, so B's reads are of mixed lengths.
+ * The read group B records are also written on their own to fnameB.
+ */
+void makeTwoGroups(char *fname, char *fnameB)
+{
+    samFile *in = sam_open(MKNAME(DATA_DIR,"/sa.bam"), "r");
+    sam_hdr_t *hdr = in ? sam_hdr_read(in) : NULL;
+    FILE *out = fopen(fname, "w");
+    FILE *outB = fopen(fnameB, "w");
+    if (!hdr || !out || !outB) { fprintf(stderr, "Can't make %s\n", fname); exit(1); }
+
+    kstring_t ks = { 0, 0, NULL };
+    kstring_t b = { 0, 0, NULL };
+    bam1_t *rec = bam_init1();
+    va_t *recsB = va_init(100, free);
+
+    fprintf(out, "%s@RG\tID:B\tSM:B\n", sam_hdr_str(hdr));
+    fprintf(outB, "%s@RG\tID:B\tSM:B\n", sam_hdr_str(hdr));
+    while (sam_read1(in, hdr, rec) >= 0) {
+        if (sam_format1(hdr, rec, &ks) < 0) { fprintf(stderr, "Can't format record\n"); exit(1); }
+        fprintf(out, "%s\n", ks.s);
+
+        // cut off the soft clips, which leaves the position and MD tag as they are
+        int clip_start = 0, clip_end = 0;
+        uint32_t *cigar = bam_get_cigar(rec);
+        int ncigar = rec->core.n_cigar;
+        if (ncigar > 1 && bam_cigar_op(cigar[0]) == BAM_CSOFT_CLIP) clip_start = bam_cigar_oplen(cigar[0]);
+        if (ncigar > 1 && bam_cigar_op(cigar[ncigar-1]) == BAM_CSOFT_CLIP) clip_end = bam_cigar_oplen(cigar[ncigar-1]);
+        int len = rec->core.l_qseq - clip_start - clip_end;
+
+        b.l = 0;
+        int field = 0;
+        for (char *s = strtok(ks.s, "\t"); s; s = strtok(NULL, "\t"), field++) {
+            if (field) kputc('\t', &b);
+            if (field == 0) { kputc('B', &b); kputs(s, &b); }
+            else if (field == 5 && (clip_start || clip_end)) {
+                for (int c = 0; c < ncigar; c++) {
+                    if (bam_cigar_op(cigar[c]) != BAM_CSOFT_CLIP) ksprintf(&b, "%d%c", bam_cigar_oplen(cigar[c]), bam_cigar_opchr(cigar[c]));
+                }
+            }
+            else if (field == 9 || field == 10) kputsn(s + clip_start, len, &b);
+            else if (strncmp(s, "RG:Z:", 5) == 0) kputs("RG:Z:B", &b);
+            else kputs(s, &b);
+        }
+        va_push(recsB, strdup(b.s));
+    }
+
+    for (int n = 0; n < recsB->end; n++) {
+        fprintf(out, "%s\n", (char *)recsB->entries[n]);
+        fprintf(outB, "%s\n", (char *)recsB->entries[n]);
+    }
+
+    fclose(out);
+    fclose(outB);
+    free(ks.s);
+    free(b.s);
+    va_free(recsB);
+    bam_destroy1(rec);
+    sam_hdr_destroy(hdr);
+    sam_close(in);
+}
+
+/*
+ * Run a command with -v, and return the number of reads it used
+ */
+long usedReads(char *cmd)
+{
+    char buf[1024];
+    long nreads = -1;
+    FILE *f = popen(cmd, "r");
+    if (!f) return -1;
+    while (fgets(buf, sizeof(buf), f)) sscanf(buf, "Used %ld reads", &nreads);
+    if (pclose(f)) return -1;
+    return nreads;
+}
+
 int main(int argc, char**argv)
 {
     int verbose = 0;
@@ -86,6 +202,87 @@ int main(int argc, char**argv)
     if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
     else checkOutputFiles(TMPDIR, "sa.txt", MKNAME(DATA_DIR,"/out/sa.txt"));
 
+    // sampling everything, or converging too late to stop early, must not change the result
+    snprintf(cmd, sizeof(cmd), "%s --sample-fraction 1 --converge 0.001 -o %s/sa_all.txt %s 2>/dev/null", prog, TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    else checkOutputFiles(TMPDIR, "sa_all.txt", MKNAME(DATA_DIR,"/out/sa.txt"));
+
+    // sampling is repeatable
+    snprintf(cmd, sizeof(cmd), "%s --sample-fraction 0.5 -o %s/sa_half1.txt %s", prog, TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    snprintf(cmd, sizeof(cmd), "%s --sample-fraction 0.5 -o %s/sa_half2.txt %s", prog, TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    else {
+        char half[512];
+        snprintf(half, sizeof(half), "%s/sa_half2.txt", TMPDIR);
+        checkOutputFiles(TMPDIR, "sa_half1.txt", half);
+    }
+
+    // a sample fraction of 0.5 uses about half the reads
+    {
+        char copies[512];
+        snprintf(copies, sizeof(copies), "%s/sa_copies.sam", TMPDIR);
+        makeCopies(copies, 100);
+        snprintf(cmd, sizeof(cmd), "%s -v -o %s/sa_copies.txt %s 2>&1", prog, TMPDIR, copies);
+        long all = usedReads(cmd);
+        snprintf(cmd, sizeof(cmd), "%s -v --sample-fraction 0.5 -o %s/sa_copies_half.txt %s 2>&1", prog, TMPDIR, copies);
+        long half = usedReads(cmd);
+        if (all <= 0 || half < all * 0.4 || half > all * 0.6) {
+            fprintf(stderr, "--sample-fraction 0.5 used %ld of %ld reads\n", half, all);
+            failure++;
+        }
+    }
+
+    // one pass with a report per read group: sa.bam has a single read group, so its report is the same
+    snprintf(cmd, sizeof(cmd), "%s --by-read-group -o %s/sa_rg.txt %s", prog, TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    else {
+        checkOutputFiles(TMPDIR, "sa_rg.txt", MKNAME(DATA_DIR,"/out/sa.txt"));
+        checkOutputFiles(TMPDIR, "sa_rg.txt.37688_2#75", MKNAME(DATA_DIR,"/out/sa.txt"));
+    }
+
+    // and per read group and tile
+    snprintf(cmd, sizeof(cmd), "%s --by-read-group --by-tile -o %s/sa_tile.txt %s", prog, TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    else {
+        checkOutputFiles(TMPDIR, "sa_tile.txt", MKNAME(DATA_DIR,"/out/sa.txt"));
+        char tilefile[512];
+        snprintf(tilefile, sizeof(tilefile), "%s/sa_tile.txt.37688_2#75.2_2242", TMPDIR);
+        if (access(tilefile, R_OK)) { fprintf(stderr,"Missing tile report: %s\n", tilefile); failure++; }
+    }
+
+    // two read groups, the second with reads of mixed lengths. Each read group's report
+    // should be the same as the report for a file of just that read group.
+    {
+        char both[512], groupB[512];
+        snprintf(both, sizeof(both), "%s/sa_two_groups.sam", TMPDIR);
+        snprintf(groupB, sizeof(groupB), "%s/sa_group_b.sam", TMPDIR);
+        makeTwoGroups(both, groupB);
+
+        snprintf(cmd, sizeof(cmd), "%s -o %s/sa_two.txt %s", prog, TMPDIR, both);
+        if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        snprintf(cmd, sizeof(cmd), "%s -o %s/sa_b.txt %s", prog, TMPDIR, groupB);
+        if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        snprintf(cmd, sizeof(cmd), "%s --by-read-group -o %s/sa_two_rg.txt %s", prog, TMPDIR, both);
+        if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        else {
+            char expect[512];
+            snprintf(expect, sizeof(expect), "%s/sa_two.txt", TMPDIR);
+            checkOutputFiles(TMPDIR, "sa_two_rg.txt", expect);
+            checkOutputFiles(TMPDIR, "sa_two_rg.txt.37688_2#75", MKNAME(DATA_DIR,"/out/sa.txt"));
+            snprintf(expect, sizeof(expect), "%s/sa_b.txt", TMPDIR);
+            checkOutputFiles(TMPDIR, "sa_two_rg.txt.B", expect);
+        }
+    }
+
+    // --converge would stop before every stratum has been read
+    snprintf(cmd, sizeof(cmd), "%s --converge 0.001 --by-tile -o %s/sa_conv.txt %s 2>/dev/null", prog, TMPDIR, MKNAME(DATA_DIR,"/sa.bam"));
+    if (!system(cmd)) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+
+    // stratifying needs an output file
+    snprintf(cmd, sizeof(cmd), "%s --by-tile %s 2>/dev/null", prog, MKNAME(DATA_DIR,"/sa.bam"));
+    if (!system(cmd)) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+
     printf("substitution_analysis tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -23,6 +23,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
 
 #define xMKNAME(d,f) #d f
 #define MKNAME(d,f) xMKNAME(d,f)
@@ -44,6 +47,99 @@ void checkFiles(char *gotfile, char *expectfile, int verbose)
     if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
 }
 
+/*
+ * Write a BAM file whose records have an aux array holding a chain of bytes
+ * which look like whole unmapped records. If 'converge' is set the array is
+ * the last thing in the record, so the fake chain runs on into the next real
+ * record. The BAM is compressed in small blocks, so that blocks start in the
+ * middle of records, often just before the fake chain.
+ */
+void makeCraftedBam(char *fname, char *tmpdir, int converge)
+{
+    char samfile[512], bamfile[512];
+    snprintf(samfile, sizeof(samfile), "%s/crafted.sam", tmpdir);
+    snprintf(bamfile, sizeof(bamfile), "%s/crafted_big.bam", tmpdir);
+
+    FILE *f = fopen(samfile, "w");
+    if (!f) { fprintf(stderr, "Can't create %s\n", samfile); exit(1); }
+    fprintf(f, "@HD\tVN:1.6\tSO:unsorted\n@RG\tID:1\n");
+    for (int n = 0; n < 40; n++) {
+        fprintf(f, "r%d\t%d\t*\t0\t0\t*\t*\t0\t0\tACGTACGTACGTACGTACGT\tABCDEFGHIJKLMNOPQRST\tRG:Z:1\tXF:B:C",
+                n/2, n%2 ? 141 : 77);
+        for (int r = 0; r < 5; r++) {
+            // block_size, ref, pos, l_read_name, mapq, bin, n_cigar, flag, l_seq, next ref, next pos, tlen, name
+            static const int fake[38] = { 34,0,0,0, 255,255,255,255, 255,255,255,255, 2, 0, 0x48,0x12, 0,0, 4,0,
+                                          0,0,0,0, 255,255,255,255, 255,255,255,255, 0,0,0,0, 'x',0 };
+            for (int b = 0; b < 38; b++) fprintf(f, ",%d", fake[b]);
+        }
+        if (!converge) fprintf(f, "\tXG:Z:end");
+        fprintf(f, "\n");
+    }
+    fclose(f);
+
+    samFile *in = sam_open(samfile, "r");
+    samFile *out = sam_open(bamfile, "wb");
+    if (!in || !out) { fprintf(stderr, "Can't convert %s\n", samfile); exit(1); }
+    sam_hdr_t *hdr = sam_hdr_read(in);
+    bam1_t *rec = bam_init1();
+    if (!hdr || sam_hdr_write(out, hdr) < 0) { fprintf(stderr, "Can't copy header\n"); exit(1); }
+    while (sam_read1(in, hdr, rec) >= 0) {
+        if (sam_write1(out, hdr, rec) < 0) { fprintf(stderr, "Can't write %s\n", bamfile); exit(1); }
+    }
+    bam_destroy1(rec);
+    sam_hdr_destroy(hdr);
+    sam_close(in);
+    if (sam_close(out)) { fprintf(stderr, "Can't close %s\n", bamfile); exit(1); }
+
+    // recompress it in 97 byte blocks
+    BGZF *bin = bgzf_open(bamfile, "r"), *bout = bgzf_open(fname, "w");
+    if (!bin || !bout) { fprintf(stderr, "Can't recompress %s\n", bamfile); exit(1); }
+    char buf[97];
+    ssize_t len;
+    while ((len = bgzf_read(bin, buf, sizeof(buf))) > 0) {
+        if (bgzf_write(bout, buf, len) != len || bgzf_flush(bout)) { fprintf(stderr, "Can't write %s\n", fname); exit(1); }
+    }
+    bgzf_close(bin);
+    if (bgzf_close(bout)) { fprintf(stderr, "Can't close %s\n", fname); exit(1); }
+}
+
+/*
+ * Checksum fname in ranges of 'step' bytes and merge them. Returns the exit
+ * status of the merge, having checked that a merge which succeeds gives the
+ * same checksums as the whole file. If 'strict' is set, every range must work.
+ */
+int checkRanges(char *prog, char *fname, char *tmpdir, int step, int strict, int verbose)
+{
+    char cmd[2048], wholefile[512], mergedfile[512], partial[512];
+    char *partials = NULL;
+    size_t partials_len = 0;
+    struct stat st;
+
+    if (stat(fname, &st)) { fprintf(stderr, "Can't stat %s\n", fname); failure++; return -1; }
+    snprintf(wholefile, sizeof(wholefile), "%s/whole.chksum", tmpdir);
+    snprintf(cmd, sizeof(cmd), "%s -o %s %s", prog, wholefile, fname);
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+
+    for (long from = 0; from < st.st_size; from += step) {
+        snprintf(partial, sizeof(partial), "%s/crafted_%ld.partial", tmpdir, from);
+        if (from + step < st.st_size) snprintf(cmd, sizeof(cmd), "%s --range %ld-%ld -o %s %s", prog, from, from+step, partial, fname);
+        else                          snprintf(cmd, sizeof(cmd), "%s --range %ld- -o %s %s", prog, from, partial, fname);
+        if (system(cmd) && strict) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        partials = realloc(partials, partials_len + strlen(partial) + 2);
+        sprintf(partials + partials_len, " %s", partial);
+        partials_len += strlen(partial) + 1;
+    }
+
+    snprintf(mergedfile, sizeof(mergedfile), "%s/merged.chksum", tmpdir);
+    char *merge = malloc(strlen(prog) + strlen(mergedfile) + partials_len + 32);
+    sprintf(merge, "%s --merge -o %s%s 2>/dev/null", prog, mergedfile, partials);
+    int r = system(merge);
+    if (!r) checkFiles(mergedfile, wholefile, verbose);
+    free(merge);
+    free(partials);
+    return r;
+}
+
 int main(int argc, char**argv)
 {
     int verbose = 0;
@@ -94,6 +190,59 @@ int main(int argc, char**argv)
     if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
     checkFiles(outputfile, MKNAME(DATA_DIR,"/out/seqchksum.chksum.crc32"), verbose);
 
+    // hash types bamseqchksum has but we don't
+    snprintf(cmd, sizeof(cmd), "%s --hash md5 %s > %s/seqchksum.md5 2>&1", prog, MKNAME(DATA_DIR,"/seqchksum.bam"), TMPDIR);
+    if (!system(cmd)) { fprintf(stderr,"--hash md5 should have failed\n"); failure++; }
+
+    // checksum three byte ranges and merge them
+    static const char *merge_hashes[] = { "crc32prod", "crc32" };
+    for (int h = 0; h < 2; h++) {
+        static const char *ranges[] = { "0-1000", "1000-4000", "4000-" };
+        char partials[1024] = "";
+        char expectfile[512];
+        if (verbose) fprintf(stderr,"testing --range and --merge --hash %s\n", merge_hashes[h]);
+        for (int n = 0; n < 3; n++) {
+            snprintf(outputfile, sizeof(outputfile), "%s/seqchksum_%d.partial", TMPDIR, n);
+            snprintf(cmd, sizeof(cmd), "%s --hash %s --range %s -o %s %s", prog, merge_hashes[h], ranges[n], outputfile, MKNAME(DATA_DIR,"/seqchksum.bam"));
+            if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+            strcat(partials, " ");
+            strcat(partials, outputfile);
+        }
+        snprintf(outputfile, sizeof(outputfile), "%s/seqchksum_merged.chksum", TMPDIR);
+        snprintf(cmd, sizeof(cmd), "%s --merge -o %s%s", prog, outputfile, partials);
+        if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        if (h) snprintf(expectfile, sizeof(expectfile), "%s.%s", MKNAME(DATA_DIR,"/out/seqchksum.chksum"), merge_hashes[h]);
+        else   snprintf(expectfile, sizeof(expectfile), "%s", MKNAME(DATA_DIR,"/out/seqchksum.chksum"));
+        checkFiles(outputfile, expectfile, verbose);
+    }
+
+    // records holding bytes which look like records, split across many blocks
+    if (verbose) fprintf(stderr,"testing --range with record-like data\n");
+    char crafted[512];
+    snprintf(crafted, sizeof(crafted), "%s/crafted.bam", TMPDIR);
+    makeCraftedBam(crafted, TMPDIR, 0);
+    if (checkRanges(prog, crafted, TMPDIR, 500, 1, verbose)) {
+        fprintf(stderr, "--merge failed for records with record-like data\n");
+        failure++;
+    }
+
+    // when the fake records run on into real ones, --merge may refuse, but mustn't be wrong
+    if (verbose) fprintf(stderr,"testing --range with record-like data which runs on into real records\n");
+    makeCraftedBam(crafted, TMPDIR, 1);
+    checkRanges(prog, crafted, TMPDIR, 500, 0, verbose);
+
+    // a partial file is missing
+    if (verbose) fprintf(stderr,"testing --merge with a missing range\n");
+    snprintf(cmd, sizeof(cmd), "%s --merge -o %s/missing.chksum %s/crafted_0.partial %s/crafted_1000.partial 2>/dev/null", prog, TMPDIR, TMPDIR, TMPDIR);
+    if (!system(cmd)) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+
+    // --range only works on BAM files, and mustn't leave a partial file behind
+    if (verbose) fprintf(stderr,"testing --range with a SAM file\n");
+    snprintf(outputfile, sizeof(outputfile), "%s/sam_range.partial", TMPDIR);
+    snprintf(cmd, sizeof(cmd), "%s --range 0- -o %s %s 2>/dev/null", prog, outputfile, MKNAME(DATA_DIR,"/10503_1_fix_mate.sam"));
+    if (!system(cmd)) { fprintf(stderr,"Command should have failed: %s\n",cmd); failure++; }
+    if (access(outputfile, F_OK) == 0) { fprintf(stderr,"--range with a SAM file wrote %s\n", outputfile); failure++; }
+
     printf("seqchksum tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }
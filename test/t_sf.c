@@ -42,8 +42,8 @@ int failure = 0;
 
 void checkFiles(char *gotfile, char *expectfile, int verbose)
 {
-    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL);
-    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL);
+    BAMit_t *bgot = BAMit_open(gotfile, 'r', NULL, 0, NULL, 0);
+    BAMit_t *bexp = BAMit_open(expectfile, 'r', NULL, 0, NULL, 0);
     bam1_t *got_rec, *exp_rec;
 
     int c = sam_hdr_count_lines(bgot->h, "RG");
@@ -134,6 +134,42 @@ int main(int argc, char**argv)
     if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
     else checkFiles(outputfile, MKNAME(DATA_DIR,"/out/sf_filtered.bam"), verbose);
 
+    // create filter in two parts, and merge them
+    if (verbose) fprintf(stderr,"Creating filter from partials\n");
+    {
+        char partfile[2][512];
+        char bamfile[2][512];
+        BAMit_t *bin = BAMit_open(MKNAME(DATA_DIR,"/sf.bam"), 'r', NULL, 0, NULL, 0);
+        int nrecs = 0;
+        while (BAMit_next(bin)) nrecs++;
+        BAMit_free(bin);
+
+        // split sf.bam into two halves
+        bin = BAMit_open(MKNAME(DATA_DIR,"/sf.bam"), 'r', NULL, 0, NULL, 0);
+        for (int n=0; n < 2; n++) {
+            snprintf(bamfile[n], sizeof(bamfile[n]), "%s/sf_part%d.bam", TMPDIR, n);
+            snprintf(partfile[n], sizeof(partfile[n]), "%s/sf_part%d.partial", TMPDIR, n);
+            BAMit_t *bout = BAMit_open(bamfile[n], 'w', "bam", 0, NULL, 0);
+            sam_hdr_destroy(bout->h); bout->h = sam_hdr_dup(bin->h);
+            if (sam_hdr_write(bout->f, bout->h)) { fprintf(stderr, "Can't write header\n"); failure++; }
+            for (int r = 0; r < (n ? nrecs : nrecs/2); r++) {
+                bam1_t *rec = BAMit_next(bin);
+                if (!rec) break;
+                if (sam_write1(bout->f, bout->h, rec) < 0) { fprintf(stderr, "Can't write record\n"); failure++; }
+            }
+            BAMit_free(bout);
+
+            snprintf(cmd, sizeof(cmd), "%s -c --partial -F %s %s", prog, partfile[n], bamfile[n]);
+            if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        }
+        BAMit_free(bin);
+
+        snprintf(filterfile, sizeof(filterfile), "%s/sf_merged.filter", TMPDIR);
+        snprintf(cmd, sizeof(cmd), "%s -M -F %s %s %s", prog, filterfile, partfile[0], partfile[1]);
+        if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+        else checkFilterFiles(prog, TMPDIR, filterfile, MKNAME(DATA_DIR,"/out/sf_1.filter"));
+    }
+
     printf("spatial_filter tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,209 @@
+/*  test/t_shm.c -- shared memory ring buffer test cases.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "htslib/hfile.h"
+#include "htslib/sam.h"
+#include "bamit.h"
+#include "shm.h"
+
+#define xMKNAME(d,f) #d f
+#define MKNAME(d,f) xMKNAME(d,f)
+
+#define PATTERN_SIZE (1024*1024)
+
+int verbose = 0;
+
+int success = 0;
+int failure = 0;
+
+void icheckEqual(char *name, int expected, int actual)
+{
+    if (expected != actual) {
+        fprintf(stderr, "%s: Expected: %d \tGot: %d\n", name, expected, actual);
+        failure++;
+    } else {
+        success++;
+    }
+}
+
+static unsigned char pattern(size_t n)
+{
+    return (n * 7 + n / 251) & 0xff;
+}
+
+/*
+ * Write the pattern in odd sized pieces, so that writes cross the end of the ring
+ */
+static int writePattern(char *fname, int delay)
+{
+    unsigned char buf[1000];
+    size_t n = 0;
+
+    if (delay) usleep(delay);
+    hFILE *fp = hopen(fname, "w");
+    if (!fp) return 1;
+    while (n < PATTERN_SIZE) {
+        size_t len = 1 + n % (sizeof(buf) - 1);
+        if (n + len > PATTERN_SIZE) len = PATTERN_SIZE - n;
+        for (size_t i = 0; i < len; i++) buf[i] = pattern(n + i);
+        if (hwrite(fp, buf, len) != len) { hclose_abruptly(fp); return 1; }
+        n += len;
+    }
+    return hclose(fp) ? 1 : 0;
+}
+
+/*
+ * Copy a BAM file into a ring
+ */
+static int writeBAM(char *fname)
+{
+    BAMit_t *bin = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL, 0);
+    BAMit_t *bout = BAMit_open(fname, 'w', NULL, 0, NULL, 0);
+    sam_hdr_destroy(bout->h); bout->h = sam_hdr_dup(bin->h);
+    if (sam_hdr_write(bout->f, bout->h)) return 1;
+    bam1_t *rec;
+    while ((rec = BAMit_next(bin)) != NULL) {
+        if (sam_write1(bout->f, bout->h, rec) < 0) return 1;
+    }
+    BAMit_free(bin);
+    BAMit_free(bout);
+    return 0;
+}
+
+/*
+ * Run a writer in a child process, returning its pid
+ */
+static pid_t startWriter(int (*fn)(char *), char *fname)
+{
+    fflush(stdout); fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) _exit(fn(fname));
+    return pid;
+}
+
+static int writerStatus(pid_t pid)
+{
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+static int writePatternNow(char *fname) { return writePattern(fname, 0); }
+static int writePatternLater(char *fname) { return writePattern(fname, 100000); }
+
+static void testPattern(char *name, char *fname, int (*writer)(char *))
+{
+    unsigned char buf[4096];
+    size_t n = 0;
+    int bad = 0;
+    ssize_t len;
+
+    if (verbose) fprintf(stderr, "%s\n", name);
+    pid_t pid = startWriter(writer, fname);
+    hFILE *fp = hopen(fname, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: can't open %s\n", name, fname);
+        failure++;
+        return;
+    }
+    while ((len = hread(fp, buf, 1 + n % sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < len; i++) if (buf[i] != pattern(n + i)) bad++;
+        n += len;
+    }
+    icheckEqual(name, 0, (int)len);
+    icheckEqual(name, PATTERN_SIZE, n);
+    icheckEqual(name, 0, bad);
+    icheckEqual(name, 0, hclose(fp));
+    icheckEqual(name, 0, writerStatus(pid));
+}
+
+int main(int argc, char**argv)
+{
+    char fname[64];
+
+    int getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v': ++verbose;
+                      break;
+            default: printf("usage: t_shm [-v]\n\n"
+                            " -v verbose output\n"
+                           );
+                     break;
+        }
+    }
+
+    shm_register();
+    snprintf(fname, sizeof(fname), "shm:t_shm.%d", (int)getpid());
+
+    // a small ring, so that the writer has to wait for the reader
+    setenv("BAMBI_SHM_SIZE", "4K", 1);
+
+    icheckEqual("shm_is_shm", 1, shm_is_shm(fname));
+    icheckEqual("shm_is_shm file", 0, shm_is_shm("test.bam"));
+
+    testPattern("Read and write", fname, writePatternNow);
+    testPattern("Reader first", fname, writePatternLater);
+
+    // the writer fails if the reader goes away
+    pid_t pid = startWriter(writePatternNow, fname);
+    hFILE *fp = hopen(fname, "r");
+    icheckEqual("Reader closes early", 1, fp != NULL);
+    if (fp) {
+        char buf[100];
+        hread(fp, buf, sizeof(buf));
+        hclose(fp);
+    }
+    icheckEqual("Reader closes early", 1, writerStatus(pid));
+
+    // BAM records through the ring
+    setenv("BAMBI_SHM_SIZE", "64K", 1);
+    pid = startWriter(writeBAM, fname);
+    BAMit_t *bshm = BAMit_open(fname, 'r', NULL, 0, NULL, 0);
+    BAMit_t *bfile = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL, 0);
+    icheckEqual("BAM header", sam_hdr_nref(bfile->h), sam_hdr_nref(bshm->h));
+    int nrecs = 0, bad = 0;
+    bam1_t *rec;
+    while ((rec = BAMit_next(bfile)) != NULL) {
+        bam1_t *got = BAMit_next(bshm);
+        if (!got || strcmp(bam_get_qname(rec), bam_get_qname(got)) || rec->core.flag != got->core.flag) bad++;
+        nrecs++;
+    }
+    icheckEqual("BAM records", 0, bad);
+    icheckEqual("BAM end", 0, BAMit_hasnext(bshm));
+    icheckEqual("BAM writer", 0, writerStatus(pid));
+    if (verbose) fprintf(stderr, "%d records read through %s\n", nrecs, fname);
+    BAMit_free(bshm);
+    BAMit_free(bfile);
+
+    printf("shm tests: %s\n", failure ? "FAILED" : "Passed");
+    return failure ? EXIT_FAILURE : EXIT_SUCCESS;
+}
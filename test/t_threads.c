@@ -0,0 +1,257 @@
+/*  test/t_threads.c -- check that threaded commands give the same output
+                        whatever the number of threads and size of jobs
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define xMKNAME(d,f) #d f
+#define MKNAME(d,f) xMKNAME(d,f)
+
+#define MAX_ARGS 100
+
+int main_i2b(int argc, char *argv[]);
+int main_decode(int argc, char *argv[]);
+int main_adapters(int argc, char *argv[]);
+
+// job sizes in src/i2b.c, src/decode.c and src/adapters.c, see JOB_SIZE() in bambi.h
+void set_i2b_clusters_per_thread(int n);
+void set_decode_templates_per_job(int n);
+void set_adapters_templates_per_job(int n);
+
+// set when a command used its reserved --io-threads or --bcl-threads pool, see TEST_RECORD() in bambi.h
+extern bool i2b_io_reserved, i2b_bcl_reserved, decode_io_reserved, adapters_io_reserved;
+
+int success = 0;
+int failure = 0;
+
+/*
+ * A command to run, with its arguments but without the thread and output options
+ */
+typedef struct {
+    char *name;
+    int (*func)(int argc, char *argv[]);
+    void (*set_job_size)(int n);
+    int job_sizes[3];           // 0 is the default
+    bool metrics;               // takes --metrics-file
+    char *args[40];
+} threads_test_t;
+
+static void checkFiles(char *gotfile, char *expectfile, int verbose)
+{
+    char cmd[1024];
+
+    if (verbose) fprintf(stderr,"Comparing files: %s with %s\n", gotfile, expectfile);
+    sprintf(cmd,"diff -I ID:bambi %s %s", gotfile, expectfile);
+    if (system(cmd)) { fprintf(stderr,"Command failed: %s\n",cmd); failure++; }
+    else success++;
+}
+
+/*
+ * Run a command with the given number of threads and job size,
+ * writing to <TMPDIR>/<name>_<suffix>.sam (and .metrics)
+ */
+static void runCommand(threads_test_t *t, int nthreads, int job_size, char **extra, char *TMPDIR, char *suffix, int verbose)
+{
+    char *argv[MAX_ARGS];
+    char threads[16];
+    char outputfile[512];
+    char metricsfile[512];
+    int argc = 0;
+
+    snprintf(threads, sizeof(threads), "%d", nthreads);
+    snprintf(outputfile, sizeof(outputfile), "%s/%s_%s.sam", TMPDIR, t->name, suffix);
+    snprintf(metricsfile, sizeof(metricsfile), "%s/%s_%s.metrics", TMPDIR, t->name, suffix);
+
+    argv[argc++] = "bambi";
+    for (int n = 0; t->args[n]; n++) argv[argc++] = t->args[n];
+    argv[argc++] = "-t";
+    argv[argc++] = threads;
+    for (int n = 0; extra && extra[n]; n++) argv[argc++] = extra[n];
+    argv[argc++] = "-o";
+    argv[argc++] = outputfile;
+    argv[argc++] = "--output-fmt";
+    argv[argc++] = "sam";
+    if (t->metrics) {
+        argv[argc++] = "--metrics-file";
+        argv[argc++] = metricsfile;
+    }
+    argv[argc] = NULL;
+
+    if (verbose) fprintf(stderr,"running %s with %d threads, job size %d\n", t->name, nthreads, job_size);
+    t->set_job_size(job_size);
+    if (t->func(argc-1, argv+1)) {
+        fprintf(stderr,"%s failed with %d threads, job size %d\n", t->name, nthreads, job_size);
+        failure++;
+    }
+    t->set_job_size(0);
+}
+
+/*
+ * Run a command single threaded with the default job size, then with
+ * each combination of thread count and job size, and check that the
+ * records and metrics are the same each time.
+ */
+static void testThreads(threads_test_t *t, int *thread_counts, char *TMPDIR, int verbose)
+{
+    char expectfile[512], gotfile[512], suffix[64];
+
+    runCommand(t, 1, t->job_sizes[0], NULL, TMPDIR, "expected", verbose);
+
+    for (int n = 0; thread_counts[n]; n++) {
+        for (int j = 0; j < 3; j++) {
+            if (thread_counts[n] == 1 && j == 0) continue;
+            snprintf(suffix, sizeof(suffix), "t%d_j%d", thread_counts[n], t->job_sizes[j]);
+            runCommand(t, thread_counts[n], t->job_sizes[j], NULL, TMPDIR, suffix, verbose);
+
+            snprintf(expectfile, sizeof(expectfile), "%s/%s_expected.sam", TMPDIR, t->name);
+            snprintf(gotfile, sizeof(gotfile), "%s/%s_%s.sam", TMPDIR, t->name, suffix);
+            checkFiles(gotfile, expectfile, verbose);
+            if (t->metrics) {
+                snprintf(expectfile, sizeof(expectfile), "%s/%s_expected.metrics", TMPDIR, t->name);
+                snprintf(gotfile, sizeof(gotfile), "%s/%s_%s.metrics", TMPDIR, t->name, suffix);
+                checkFiles(gotfile, expectfile, verbose);
+            }
+        }
+    }
+}
+
+/*
+ * Run a command with and without reserved thread pools, checking that the
+ * reserved pools are the ones used, and that the output doesn't change.
+ * testThreads() must have made the expected output.
+ */
+static void testReserved(threads_test_t *t, int nthreads, char **extra, bool *reserved[], char *TMPDIR, int verbose)
+{
+    char expectfile[512], gotfile[512];
+
+    runCommand(t, nthreads, t->job_sizes[1], NULL, TMPDIR, "shared", verbose);
+    for (int n = 0; reserved[n]; n++) {
+        if (*reserved[n]) { fprintf(stderr,"%s used a reserved pool without being asked to\n", t->name); failure++; }
+    }
+
+    runCommand(t, nthreads, t->job_sizes[1], extra, TMPDIR, "reserved", verbose);
+    for (int n = 0; reserved[n]; n++) {
+        if (!*reserved[n]) { fprintf(stderr,"%s didn't use its reserved pool with %s\n", t->name, extra[2*n]); failure++; }
+    }
+
+    snprintf(expectfile, sizeof(expectfile), "%s/%s_expected.sam", TMPDIR, t->name);
+    snprintf(gotfile, sizeof(gotfile), "%s/%s_reserved.sam", TMPDIR, t->name);
+    checkFiles(gotfile, expectfile, verbose);
+}
+
+int main(int argc, char**argv)
+{
+    int verbose = 0;
+
+    int getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v': ++verbose;
+                      break;
+            default: printf("usage: t_threads [-v]\n\n"
+                            " -v verbose output\n"
+                           );
+                     break;
+        }
+    }
+
+    // Cleanup getopt
+    optind = 1;
+
+    // create temp directory
+    char template[] = "/tmp/bambi.XXXXXX";
+    char *TMPDIR = mkdtemp(template);
+    if (TMPDIR == NULL) {
+        fprintf(stderr,"Can't create temp directory\n");
+        exit(1);
+    } else {
+        if (verbose) fprintf(stderr,"Created temporary directory: %s\n", TMPDIR);
+    }
+
+    // 1, 2 and N threads, where N is at least 3 but not silly
+    int nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs < 3) nprocs = 3;
+    if (nprocs > 8) nprocs = 8;
+    int thread_counts[] = { 1, 2, nprocs, 0 };
+
+    char decode_input[512];
+    snprintf(decode_input, sizeof(decode_input), "%s/i2b_hiseq_expected.sam", TMPDIR);
+
+    threads_test_t tests[] = {
+        { "i2b_miseq", main_i2b, set_i2b_clusters_per_thread, { 0, 97, 1000 }, false,
+          { "i2b", "-i", MKNAME(DATA_DIR,"/160916_miseq_0966_FC/Data/Intensities"),
+            "--lane", "1", "--first-tile", "1101", "--tile-limit", "1",
+            "--library-name", "Test library", "--sample-alias", "Test Sample",
+            "--run-start-date", "2011-03-23T00:00:00+0000", NULL } },
+        // barcode reads as tags, which is also the input for the decode test below
+        { "i2b_hiseq", main_i2b, set_i2b_clusters_per_thread, { 0, 97, 1000 }, false,
+          { "i2b", "-i", MKNAME(DATA_DIR,"/160919_hiseq2500_4966_FC/Data/Intensities"),
+            "--lane", "1", "--first-tile", "1101", "--tile-limit", "1",
+            "--library-name", "TestLibrary", "--sample-alias", "TestSample",
+            "--run-start-date", "2011-03-23T00:00:00+0000",
+            "--first-cycle", "1,30", "--final-cycle", "2,32",
+            "--first-index-cycle", "3,6,11", "--final-index-cycle", "5,10,12",
+            "--barcode-tag", "b1,b2,b3", "--quality-tag", "q1,q2,q3", NULL } },
+        { "i2b_hiseq_decode", main_i2b, set_i2b_clusters_per_thread, { 0, 97, 1000 }, true,
+          { "i2b", "-i", MKNAME(DATA_DIR,"/160919_hiseq2500_4966_FC/Data/Intensities"),
+            "--lane", "1", "--first-tile", "1101", "--tile-limit", "1",
+            "--library-name", "TestLibrary", "--sample-alias", "TestSample",
+            "--run-start-date", "2011-03-23T00:00:00+0000",
+            "--first-cycle", "1,30", "--final-cycle", "2,32",
+            "--first-index-cycle", "3,6,11", "--final-index-cycle", "5,10,12",
+            "--barcode-tag", "b1,b2,b3", "--quality-tag", "q1,q2,q3",
+            "--barcode-file", MKNAME(DATA_DIR,"/160919_hiseq2500_4966_FC/barcodes_i2"),
+            "--barcode-tag-name", "b2", NULL } },
+        { "i2b_novaseq", main_i2b, set_i2b_clusters_per_thread, { 0, 97, 1000 }, false,
+          { "i2b", "-i", MKNAME(DATA_DIR,"/novaseq/Data/Intensities"),
+            "--lane", "1", "--no-filter",
+            "--library-name", "TestLibrary", "--sample-alias", "TestSample",
+            "--run-start-date", "2011-03-23T00:00:00+0000", NULL } },
+        { "decode", main_decode, set_decode_templates_per_job, { 0, 1, 13 }, true,
+          { "decode", "-i", decode_input, "--input-fmt", "sam",
+            "--barcode-file", MKNAME(DATA_DIR,"/160919_hiseq2500_4966_FC/barcodes_i2"),
+            "--barcode-tag-name", "b2", "--quality-tag-name", "q2", NULL } },
+        { "adapters", main_adapters, set_adapters_templates_per_job, { 0, 1, 13 }, true,
+          { "adapters", "-i", MKNAME(DATA_DIR,"/adapters.bam"), NULL } },
+    };
+
+    for (int n = 0; n < sizeof(tests) / sizeof(tests[0]); n++) {
+        if (verbose) fprintf(stderr,"testing %s\n", tests[n].name);
+        testThreads(&tests[n], thread_counts, TMPDIR, verbose);
+    }
+
+    // reserved pools, with small jobs so that the pools are busy together
+    char *i2b_extra[] = { "--io-threads", "1", "--bcl-threads", "1", NULL };
+    bool *i2b_reserved[] = { &i2b_io_reserved, &i2b_bcl_reserved, NULL };
+    char *io_extra[] = { "--io-threads", "1", NULL };
+    bool *decode_reserved[] = { &decode_io_reserved, NULL };
+    bool *adapters_reserved[] = { &adapters_io_reserved, NULL };
+    testReserved(&tests[0], 6, i2b_extra, i2b_reserved, TMPDIR, verbose);
+    testReserved(&tests[4], 2, io_extra, decode_reserved, TMPDIR, verbose);
+    testReserved(&tests[5], 2, io_extra, adapters_reserved, TMPDIR, verbose);
+
+    printf("thread tests: %s\n", failure ? "FAILED" : "Passed");
+    return failure ? EXIT_FAILURE : EXIT_SUCCESS;
+}